@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/alloc.h"
+
+#include "bench.h"
+
+#include <pthread.h>
+
+#define N_LIVE 1024
+#define N_THREADS 4
+
+static void
+bench_pair(struct bench *bench, size_t ops, void *ctx)
+{
+    size_t size = *(const size_t *)ctx;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        void *ptr = jmalloc(size);
+
+        // Keep the compiler from eliding the pair
+        BENCH_KEEP(ptr);
+        jfree(ptr);
+    }
+    BENCH_STOP(bench, ops);
+}
+
+static void
+bench_batch(struct bench *bench, size_t ops, void *ctx)
+{
+    static void *ptrs[N_LIVE];
+    size_t size = *(const size_t *)ctx;
+
+    ASSUME(ops == N_LIVE);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        ptrs[i] = jmalloc(size);
+    }
+    for (size_t i = 0; i < ops; ++i) {
+        jfree(ptrs[i]);
+    }
+    BENCH_STOP(bench, ops);
+}
+
+struct thread_ctx {
+    size_t size;
+    size_t ops;
+    // Every thread and the timing thread wait at ready once the threads are
+    // set up, at start before the work, and at done after it, so only the
+    // work is timed
+    pthread_barrier_t ready;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+};
+
+static void *
+thread_pairs(void *arg)
+{
+    struct thread_ctx *thread_ctx = arg;
+    void *ptr;
+
+    // Leave the thread's first-use setup in the allocator out of the timing
+    ptr = jmalloc(thread_ctx->size);
+    BENCH_KEEP(ptr);
+    jfree(ptr);
+
+    pthread_barrier_wait(&thread_ctx->ready);
+    pthread_barrier_wait(&thread_ctx->start);
+
+    for (size_t i = 0; i < thread_ctx->ops; ++i) {
+        ptr = jmalloc(thread_ctx->size);
+
+        BENCH_KEEP(ptr);
+        jfree(ptr);
+    }
+
+    pthread_barrier_wait(&thread_ctx->done);
+
+    return NULL;
+}
+
+// Pairs on several threads at once, where the allocator's locks are contended
+static void
+bench_threads(struct bench *bench, size_t ops, void *ctx)
+{
+    pthread_t threads[N_THREADS];
+    struct thread_ctx thread_ctx;
+
+    thread_ctx.size = *(const size_t *)ctx;
+    thread_ctx.ops = ops / N_THREADS;
+    pthread_barrier_init(&thread_ctx.ready, NULL, N_THREADS + 1);
+    pthread_barrier_init(&thread_ctx.start, NULL, N_THREADS + 1);
+    pthread_barrier_init(&thread_ctx.done, NULL, N_THREADS + 1);
+
+    for (size_t i = 0; i < N_THREADS; ++i) {
+        if (pthread_create(&threads[i], NULL, &thread_pairs, &thread_ctx)
+            != 0) {
+
+            fputs("can't create the bench's threads\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&thread_ctx.ready);
+    BENCH_START(bench);
+    pthread_barrier_wait(&thread_ctx.start);
+    pthread_barrier_wait(&thread_ctx.done);
+    BENCH_STOP(bench, ops);
+
+    for (size_t i = 0; i < N_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&thread_ctx.ready);
+    pthread_barrier_destroy(&thread_ctx.start);
+    pthread_barrier_destroy(&thread_ctx.done);
+}
+
+int
+main(void)
+{
+    static size_t sizes[] = {16, 256, 4096};
+    char name[32];
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+        snprintf(name, sizeof(name), "jmalloc/jfree pair (%zu B)", sizes[i]);
+        BENCH_RUN(name, 1 << 14, &bench_pair, &sizes[i]);
+
+        snprintf(name, sizeof(name), "jmalloc/jfree x%d (%zu B)", N_LIVE,
+                 sizes[i]);
+        BENCH_RUN(name, N_LIVE, &bench_batch, &sizes[i]);
+
+        snprintf(name, sizeof(name), "jmalloc/jfree %d thr (%zu B)",
+                 N_THREADS, sizes[i]);
+        BENCH_RUN(name, 1 << 16, &bench_threads, &sizes[i]);
+    }
+
+#ifdef ALLOC_TCACHE
+    {
+        struct alloc_tcache_stats stats;
+
+        alloc_tcache_stats(&stats);
+        printf("thread cache hit rate: %.3f\n",
+               (double)stats.hits / (double)(stats.hits + stats.misses));
+    }
+#endif
+
+    return 0;
+}
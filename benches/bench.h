@@ -0,0 +1,112 @@
+#ifndef BENCH_H_
+#define BENCH_H_ 1
+
+#include "../src/main.h"
+#include "../src/alloc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Benchmarks are built with ALLOC_STATS (see configure) and POSIX clocks, so
+ * each benchmark file defines _POSIX_C_SOURCE before including anything. */
+
+/* The number of times each benchmark is run. Percentiles are taken over the
+ * ns/op of each run. */
+#define BENCH_RUNS 101
+
+/* Keeps the compiler from optimizing away the computation of v. */
+#define BENCH_KEEP(v) __asm__ __volatile__("" : : "g"(v) : "memory")
+
+struct bench {
+    double ns[BENCH_RUNS];
+    size_t run;
+    uint64_t start;
+    struct alloc_stats start_stats;
+    size_t allocs;
+};
+
+static inline uint64_t
+BENCH_NOW(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline size_t
+BENCH_ALLOCS(const struct alloc_stats *stats)
+{
+    return stats->mallocs + stats->callocs + stats->reallocs;
+}
+
+/* Starts timing the current run. Anything before this in a benchmark is setup,
+ * and isn't measured. */
+static void
+BENCH_START(struct bench *bench)
+{
+    ASSUME(bench != NULL);
+
+    alloc_stats(&bench->start_stats);
+    bench->start = BENCH_NOW();
+}
+
+/* Stops timing the current run, which did ops operations. Anything after this
+ * in a benchmark is teardown, and isn't measured. */
+static void
+BENCH_STOP(struct bench *bench, size_t ops)
+{
+    uint64_t end;
+    struct alloc_stats stats;
+
+    ASSUME(bench != NULL);
+    ASSUME(bench->run < BENCH_RUNS);
+
+    end = BENCH_NOW();
+    alloc_stats(&stats);
+
+    bench->ns[bench->run] = (double)(end - bench->start) / (double)ops;
+    bench->allocs += BENCH_ALLOCS(&stats) - BENCH_ALLOCS(&bench->start_stats);
+}
+
+static int
+BENCH_CMP(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Runs fn BENCH_RUNS times, and prints ns/op percentiles and allocations per
+ * operation. fn(bench, ops, ctx) must do ops operations between BENCH_START
+ * and BENCH_STOP. */
+static void
+BENCH_RUN(const char *name, size_t ops,
+          void (*fn)(struct bench *, size_t, void *), void *ctx)
+{
+    struct bench bench;
+
+    ASSUME(name != NULL);
+    ASSUME(ops > 0);
+    ASSUME(fn != NULL);
+
+    bench.allocs = 0;
+
+    for (bench.run = 0; bench.run < BENCH_RUNS; ++bench.run) {
+        fn(&bench, ops, ctx);
+    }
+
+    qsort(bench.ns, BENCH_RUNS, sizeof(*bench.ns), &BENCH_CMP);
+
+    printf("%-32s min %9.2f  p50 %9.2f  p90 %9.2f  p99 %9.2f ns/op  "
+           "%7.3f allocs/op\n",
+           name, bench.ns[0], bench.ns[BENCH_RUNS / 2],
+           bench.ns[BENCH_RUNS * 9 / 10], bench.ns[BENCH_RUNS * 99 / 100],
+           (double)bench.allocs / (double)(ops * BENCH_RUNS));
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/bitset.h"
+
+#include "../src/alloc.h"
+
+#include "bench.h"
+
+#include <stdint.h>
+
+#define N_BITS ((size_t)1 << 20)
+
+struct bitsets {
+    struct bitset dense;
+    struct bitset sparse;
+};
+
+// The baseline for bitset_count: one popcount per word
+static void
+bench_count_words(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+    const uint64_t *words = bitsets->dense.words;
+    size_t count = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops / BITSET_WORD_BITS; ++i) {
+        count += (size_t)__builtin_popcountll(words[i]);
+    }
+    BENCH_STOP(bench, ops / BITSET_WORD_BITS);
+
+    BENCH_KEEP(count);
+}
+
+static void
+bench_count(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+    size_t count;
+
+    BENCH_START(bench);
+    count = bitset_count(&bitsets->dense);
+    BENCH_STOP(bench, ops / BITSET_WORD_BITS);
+
+    BENCH_KEEP(count);
+}
+
+static void
+bench_and(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+
+    BENCH_START(bench);
+    bitset_and(&bitsets->dense, &bitsets->sparse);
+    BENCH_STOP(bench, ops / BITSET_WORD_BITS);
+
+    bitset_or(&bitsets->dense, &bitsets->sparse);
+}
+
+// The baseline for bitset_next: checking every bit
+static void
+bench_iterate_get(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+    size_t sum = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        if (bitset_get(&bitsets->sparse, i)) {
+            sum += i;
+        }
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+static void
+bench_iterate_next(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+    size_t sum = 0;
+
+    BENCH_START(bench);
+    for (size_t i = bitset_next(&bitsets->sparse, 0); i < ops;
+         i = bitset_next(&bitsets->sparse, i + 1)) {
+
+        sum += i;
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+static void
+bench_rank(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+    size_t sum = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        sum += bitset_rank(&bitsets->dense, i);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+static void
+bench_select(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+    size_t sum = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        sum += bitset_select(&bitsets->dense, i);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+// A rank after every change, which only has the count of the changed block to
+// bring up to date
+static void
+bench_set_rank(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bitsets *bitsets = ctx;
+    size_t sum = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        bitset_set(&bitsets->sparse, i);
+        sum += bitset_rank(&bitsets->sparse, i);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+int
+main(void)
+{
+    struct bitsets bitsets;
+    uint32_t x = 1;
+
+    bitset_init(&bitsets.dense);
+    bitset_init(&bitsets.sparse);
+
+    for (size_t i = 0; i < N_BITS; ++i) {
+        x = x * 1103515245 + 12345;
+        bitset_push(&bitsets.dense, (x >> 16) & 1);
+        bitset_push(&bitsets.sparse, (x >> 16) % 1000 == 0);
+    }
+
+    BENCH_RUN("popcount per word", N_BITS, &bench_count_words, &bitsets);
+    BENCH_RUN("bitset_count (per word)", N_BITS, &bench_count, &bitsets);
+    BENCH_RUN("bitset_and (per word)", N_BITS, &bench_and, &bitsets);
+    BENCH_RUN("bitset_get every bit (1/1000 set)", N_BITS,
+              &bench_iterate_get, &bitsets);
+    BENCH_RUN("bitset_next (1/1000 set, per bit)", N_BITS,
+              &bench_iterate_next, &bitsets);
+    BENCH_RUN("bitset_rank every bit", N_BITS, &bench_rank, &bitsets);
+    BENCH_RUN("bitset_select every bit set", N_BITS / 2, &bench_select,
+              &bitsets);
+    BENCH_RUN("bitset_set then bitset_rank", N_BITS, &bench_set_rank,
+              &bitsets);
+
+    bitset_free(&bitsets.dense);
+    bitset_free(&bitsets.sparse);
+
+    return 0;
+}
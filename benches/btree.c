@@ -0,0 +1,183 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/btree.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "bench.h"
+
+#include <stdint.h>
+
+#define N_KEYS ((size_t)1 << 17)
+#define N_INSERTS ((size_t)1 << 13)
+
+static char items[N_KEYS];
+
+// The ith key in a pseudorandom order
+static inline char *
+nth(size_t i, size_t n)
+{
+    return items + (i * 7919) % n;
+}
+
+// Returns the index of the first pointer in the sorted ptrvec that's at least
+// ptr
+static size_t
+lower_bound(const struct ptrvec *ptrvec, const void *ptr)
+{
+    size_t lo = 0, hi = ptrvec->length, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if ((uintptr_t)ptrvec->ptr[mid] < (uintptr_t)ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void
+bench_ptrvec_search(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    size_t found = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        found += lower_bound(ptrvec, nth(i, N_KEYS));
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(found);
+}
+
+static void
+bench_btree_get(struct bench *bench, size_t ops, void *ctx)
+{
+    struct btree *btree = ctx;
+    size_t found = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        found += btree_get(btree, (uintptr_t)nth(i, N_KEYS)) != NULL;
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(found);
+}
+
+// Each op iterates over 64 keys from a random starting point
+static void
+bench_btree_range(struct bench *bench, size_t ops, void *ctx)
+{
+    struct btree *btree = ctx;
+    struct btree_iter iter;
+    uintptr_t key, sum = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        btree_seek(btree, (uintptr_t)nth(i, N_KEYS - 64), &iter);
+
+        for (size_t j = 0; j < 64 && btree_iter_next(&iter, &key, NULL);
+             ++j) {
+
+            sum += key;
+        }
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+// Keeping a ptrvec sorted by inserting each pointer where it goes
+static void
+bench_ptrvec_insert(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec ptrvec;
+    char *ptr;
+
+    UNUSED(ctx);
+
+    ptrvec_init(&ptrvec);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        ptr = nth(i, ops);
+        ptrvec_insert(&ptrvec, ptr, lower_bound(&ptrvec, ptr));
+    }
+    BENCH_STOP(bench, ops);
+
+    ptrvec_free(&ptrvec);
+}
+
+static void
+bench_btree_put(struct bench *bench, size_t ops, void *ctx)
+{
+    struct btree btree;
+    char *ptr;
+
+    UNUSED(ctx);
+
+    btree_init(&btree);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        ptr = nth(i, ops);
+        btree_put(&btree, (uintptr_t)ptr, ptr);
+    }
+    BENCH_STOP(bench, ops);
+
+    btree_free(&btree);
+}
+
+static void
+bench_btree_load(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    struct btree btree;
+
+    btree_init(&btree);
+
+    BENCH_START(bench);
+    btree_load(&btree, ptrvec, NULL);
+    BENCH_STOP(bench, ops);
+
+    btree_free(&btree);
+}
+
+int
+main(void)
+{
+    struct ptrvec ptrvec;
+    struct btree btree;
+
+    ptrvec_init(&ptrvec);
+    for (size_t i = 0; i < N_KEYS; ++i) {
+        ptrvec_push(&ptrvec, items + i);
+    }
+
+    btree_init(&btree);
+    btree_load(&btree, &ptrvec, NULL);
+
+    BENCH_RUN("sorted ptrvec search (128K ptrs)", 1 << 16,
+              &bench_ptrvec_search, &ptrvec);
+    BENCH_RUN("btree_get (128K ptrs)", 1 << 16, &bench_btree_get, &btree);
+    BENCH_RUN("btree_seek + 64 keys (128K ptrs)", 1 << 12,
+              &bench_btree_range, &btree);
+    BENCH_RUN("sorted ptrvec insert (8K ptrs)", N_INSERTS,
+              &bench_ptrvec_insert, NULL);
+    BENCH_RUN("btree_put (8K ptrs)", N_INSERTS, &bench_btree_put, NULL);
+    BENCH_RUN("btree_load (128K ptrs, per ptr)", N_KEYS, &bench_btree_load,
+              &ptrvec);
+
+    btree_free(&btree);
+    ptrvec_free(&ptrvec);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/bytebuf.h"
+
+#include "../src/alloc.h"
+#include "../src/vec.h"
+
+#include "bench.h"
+
+#include <string.h>
+
+// Each op appends 32 bytes, for 32 MB in all
+#define N_APPENDS ((size_t)1 << 20)
+#define LINE "0123456789abcdef0123456789abcde\n"
+
+static void
+bench_append(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bytebuf bytebuf;
+
+    UNUSED(ctx);
+
+    bytebuf_init(&bytebuf);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        bytebuf_append(&bytebuf, LINE, 32);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(bytebuf.iov);
+    bytebuf_free(&bytebuf);
+}
+
+// The pattern bytebuf replaces: one char * grown with vec_reserve_min
+static void
+bench_vec(struct bench *bench, size_t ops, void *ctx)
+{
+    char *buf = NULL;
+    size_t length = 0, cap = 0;
+
+    UNUSED(ctx);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        if (cap - length < 32) {
+            vec_reserve_min(&buf, &cap, 1, 32);
+        }
+        memcpy(buf + length, LINE, 32);
+        length += 32;
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(buf);
+    jfree(buf);
+}
+
+static void
+bench_printf(struct bench *bench, size_t ops, void *ctx)
+{
+    struct bytebuf bytebuf;
+
+    UNUSED(ctx);
+
+    bytebuf_init(&bytebuf);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        bytebuf_printf(&bytebuf, "%zu: %s", i, "abcdefghijklmnop\n");
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(bytebuf.iov);
+    bytebuf_free(&bytebuf);
+}
+
+int
+main(void)
+{
+    BENCH_RUN("bytebuf_append (32 B)", N_APPENDS, &bench_append, NULL);
+    BENCH_RUN("vec_reserve_min + memcpy (32 B)", N_APPENDS, &bench_vec, NULL);
+    BENCH_RUN("bytebuf_printf", N_APPENDS, &bench_printf, NULL);
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/hashmap.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "bench.h"
+
+#define N_MAX 4096
+#define N_OPS ((size_t)1 << 16)
+
+static char items[N_MAX];
+
+// The number of keys in the containers being looked up in
+static size_t n_keys;
+
+static void
+bench_ptrvec_find(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    size_t found = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        found += ptrvec_find(ptrvec, items + (i * 7919) % n_keys);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(found);
+}
+
+static void
+bench_hashmap_get(struct bench *bench, size_t ops, void *ctx)
+{
+    struct hashmap *hashmap = ctx;
+    const char *key;
+    size_t found = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        key = items + (i * 7919) % n_keys;
+        found += hashmap_get(hashmap, &key) != NULL;
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(found);
+}
+
+static void
+bench_hashmap_miss(struct bench *bench, size_t ops, void *ctx)
+{
+    struct hashmap *hashmap = ctx;
+    size_t key, found = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        key = i;
+        found += hashmap_get(hashmap, &key) != NULL;
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(found);
+}
+
+// Each op puts a key and removes the one put N_MAX ops before
+static void
+bench_hashmap_churn(struct bench *bench, size_t ops, void *ctx)
+{
+    struct hashmap hashmap;
+    size_t key;
+
+    UNUSED(ctx);
+
+    hashmap_init(&hashmap, sizeof(key), sizeof(key), NULL, NULL);
+    for (key = 0; key < N_MAX; ++key) {
+        hashmap_put(&hashmap, &key, &key);
+    }
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        key = N_MAX + i;
+        hashmap_put(&hashmap, &key, &key);
+        key = i;
+        hashmap_remove(&hashmap, &key);
+    }
+    BENCH_STOP(bench, ops);
+
+    hashmap_free(&hashmap);
+}
+
+int
+main(void)
+{
+    static const size_t sizes[] = {16, 256, N_MAX};
+    struct ptrvec ptrvec;
+    struct hashmap hashmap;
+    char name[64];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+        n_keys = sizes[s];
+
+        ptrvec_init(&ptrvec);
+        hashmap_init(&hashmap, sizeof(char *), 0, NULL, NULL);
+        for (size_t i = 0; i < n_keys; ++i) {
+            const char *key = items + i;
+
+            ptrvec_push(&ptrvec, key);
+            hashmap_put(&hashmap, &key, NULL);
+        }
+
+        snprintf(name, sizeof(name), "ptrvec_find (%zu ptrs)", n_keys);
+        BENCH_RUN(name, N_OPS, &bench_ptrvec_find, &ptrvec);
+        snprintf(name, sizeof(name), "hashmap_get (%zu ptrs)", n_keys);
+        BENCH_RUN(name, N_OPS, &bench_hashmap_get, &hashmap);
+        snprintf(name, sizeof(name), "hashmap_get miss (%zu ptrs)", n_keys);
+        BENCH_RUN(name, N_OPS, &bench_hashmap_miss, &hashmap);
+
+        ptrvec_free(&ptrvec);
+        hashmap_free(&hashmap);
+    }
+
+    BENCH_RUN("hashmap_put + hashmap_remove", N_OPS, &bench_hashmap_churn,
+              NULL);
+
+    return 0;
+}
@@ -0,0 +1,371 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/ptrvec.h"
+
+#include "../src/alloc.h"
+
+#include "bench.h"
+
+#include <string.h>
+
+#define N_PTRS 4096
+// Large enough to be backed by huge pages (see VEC_HUGE_THRESHOLD)
+#define N_LARGE ((size_t)1 << 24)
+// Enough objects that they don't nearly fit in the cache
+#define N_OBJECTS ((size_t)1 << 20)
+#define OBJECT_SIZE 64
+
+static char items[N_PTRS];
+
+static void
+bench_push(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec ptrvec;
+
+    UNUSED(ctx);
+
+    ptrvec_init(&ptrvec);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        ptrvec_push(&ptrvec, items + i % N_PTRS);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(ptrvec.ptr);
+    ptrvec_free(&ptrvec);
+}
+
+static void
+bench_insert_front(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec ptrvec;
+
+    UNUSED(ctx);
+
+    ptrvec_init(&ptrvec);
+    ptrvec_reserve(&ptrvec, ops);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        ptrvec_insert(&ptrvec, items + i % N_PTRS, 0);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(ptrvec.ptr);
+    ptrvec_free(&ptrvec);
+}
+
+static void
+bench_find(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    size_t found;
+
+    found = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        // Stride through the vector so each find scans a different distance
+        found += ptrvec_find(ptrvec, items + (i * 7919) % N_PTRS);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(found);
+}
+
+static void
+bench_remove_front(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *template = ctx, ptrvec;
+
+    ptrvec_init(&ptrvec);
+    ptrvec_push_v(&ptrvec, template);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        ptrvec_remove(&ptrvec, 0);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(ptrvec.ptr);
+    ptrvec_free(&ptrvec);
+}
+
+static void
+bench_remove_fast(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *template = ctx, ptrvec;
+
+    ptrvec_init(&ptrvec);
+    ptrvec_push_v(&ptrvec, template);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        ptrvec_remove_fast(&ptrvec, 0);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(ptrvec.ptr);
+    ptrvec_free(&ptrvec);
+}
+
+// A find that never matches, so it scans the whole vector
+static void
+bench_scan(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    size_t found;
+
+    found = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        found += ptrvec_find(ptrvec, NULL);
+    }
+    BENCH_STOP(bench, ops * ptrvec->length);
+
+    BENCH_KEEP(found);
+}
+
+// Dependent random reads, which miss the TLB on almost every access with small
+// pages, and wait for each page walk
+static void
+bench_gather(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    uint32_t state = 1;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        state = (state * 1664525 + 1013904223)
+            ^ (uint32_t)(uintptr_t)ptrvec->ptr[state % ptrvec->length];
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(state);
+}
+
+// Fills ptrvec with N_LARGE pointers by pushing, which grows it through the
+// vec helpers, and copies them into plain, which has no huge page hint
+static void
+fill_large(struct ptrvec *ptrvec, struct ptrvec *plain)
+{
+    ptrvec_init(ptrvec);
+    for (size_t i = 0; i < N_LARGE; ++i) {
+        ptrvec_push(ptrvec, items + i % N_PTRS + 1);
+    }
+
+    ptrvec_init(plain);
+    plain->ptr = jmalloc(N_LARGE * sizeof(*plain->ptr));
+    memcpy(plain->ptr, ptrvec->ptr, N_LARGE * sizeof(*plain->ptr));
+    plain->length = plain->capacity = N_LARGE;
+}
+
+// Shuffles the pointers in ptrvec
+static void
+scramble(struct ptrvec *ptrvec)
+{
+    uint32_t state = 1;
+
+    for (size_t i = ptrvec->length - 1; i > 0; --i) {
+        size_t j;
+        void *tmp;
+
+        state = state * 1664525 + 1013904223;
+        j = (size_t)(state >> 16) % (i + 1);
+
+        tmp = ptrvec->ptr[i];
+        ptrvec->ptr[i] = ptrvec->ptr[j];
+        ptrvec->ptr[j] = tmp;
+    }
+}
+
+// Fills ptrvec with N_PTRS new blocks in a scrambled order, as a vector built
+// up over time would be
+static void
+fill_scrambled(struct ptrvec *ptrvec)
+{
+    ptrvec_init(ptrvec);
+    ptrvec_push_new(ptrvec, N_PTRS, 32);
+    scramble(ptrvec);
+}
+
+// Fills ptrvec with N_OBJECTS new objects in a scrambled order, so visiting
+// them in order misses the cache on almost every object
+static void
+fill_objects(struct ptrvec *ptrvec)
+{
+    ptrvec_init(ptrvec);
+    ptrvec_push_new(ptrvec, N_OBJECTS, OBJECT_SIZE);
+
+    for (size_t i = 0; i < N_OBJECTS; ++i) {
+        memset(ptrvec->ptr[i], (int)i, OBJECT_SIZE);
+    }
+
+    scramble(ptrvec);
+}
+
+// Some work on each word of an object, enough that the out of order window
+// can't reach the next objects on its own
+static inline uint64_t
+hash_object(const void *ptr)
+{
+    const uint64_t *words = ptr;
+    uint64_t h = 0;
+
+    for (size_t i = 0; i < OBJECT_SIZE / sizeof(*words); ++i) {
+        h = (h ^ words[i]) * UINT64_C(0x9E3779B97F4A7C15);
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+static void
+sum_object(void *ptr, void *ctx)
+{
+    *(uint64_t *)ctx += hash_object(ptr);
+}
+
+static void
+sum_objects(void **ptrs, size_t n, void *ctx)
+{
+    for (size_t i = 0; i < n; ++i) {
+        *(uint64_t *)ctx += hash_object(ptrs[i]);
+    }
+}
+
+static void
+bench_visit(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    uint64_t sum = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ptrvec->length; ++i) {
+        sum += hash_object(ptrvec->ptr[i]);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+static void
+bench_visit_prefetch(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    uint64_t sum = 0;
+
+    BENCH_START(bench);
+    ptrvec_for_each_prefetch(ptrvec, PTRVEC_PREFETCH_DISTANCE, &sum_object,
+                             &sum);
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+static void
+bench_visit_tuned(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    uint64_t sum = 0;
+
+    BENCH_START(bench);
+    ptrvec_for_each_prefetch(ptrvec, 0, &sum_object, &sum);
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+static void
+bench_visit_batch(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    uint64_t sum = 0;
+
+    BENCH_START(bench);
+    ptrvec_for_each_batch_prefetch(ptrvec, 0, &sum_objects, &sum);
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+}
+
+static void
+bench_free_loop(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec ptrvec;
+
+    UNUSED(ctx);
+    ASSUME(ops == N_PTRS);
+
+    fill_scrambled(&ptrvec);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        jfree(ptrvec.ptr[i]);
+    }
+    BENCH_STOP(bench, ops);
+
+    ptrvec_free(&ptrvec);
+}
+
+static void
+bench_delete(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec ptrvec;
+
+    UNUSED(ctx);
+    ASSUME(ops == N_PTRS);
+
+    fill_scrambled(&ptrvec);
+
+    BENCH_START(bench);
+    ptrvec_delete(&ptrvec);
+    BENCH_STOP(bench, ops);
+}
+
+int
+main(void)
+{
+    struct ptrvec ptrvec, large, plain;
+
+    ptrvec_init(&ptrvec);
+    for (size_t i = 0; i < N_PTRS; ++i) {
+        ptrvec_push(&ptrvec, items + i);
+    }
+
+    BENCH_RUN("ptrvec_push", 1 << 16, &bench_push, NULL);
+    BENCH_RUN("ptrvec_insert (front)", N_PTRS, &bench_insert_front, NULL);
+    BENCH_RUN("ptrvec_find (4096 ptrs)", 1 << 10, &bench_find, &ptrvec);
+    BENCH_RUN("ptrvec_remove (front)", N_PTRS, &bench_remove_front, &ptrvec);
+    BENCH_RUN("ptrvec_remove_fast", N_PTRS, &bench_remove_fast, &ptrvec);
+    BENCH_RUN("jfree each (4096 x 32 B)", N_PTRS, &bench_free_loop, NULL);
+    BENCH_RUN("ptrvec_delete (4096 x 32 B)", N_PTRS, &bench_delete, NULL);
+
+    // ns/op is per pointer scanned, or per random read
+    fill_large(&large, &plain);
+    BENCH_RUN("scan 128 MB (huge pages)", 1, &bench_scan, &large);
+    BENCH_RUN("scan 128 MB (no hint)", 1, &bench_scan, &plain);
+    BENCH_RUN("gather 128 MB (huge pages)", 1 << 14, &bench_gather, &large);
+    BENCH_RUN("gather 128 MB (no hint)", 1 << 14, &bench_gather, &plain);
+    ptrvec_free(&large);
+    ptrvec_free(&plain);
+
+    // ns/op is per object visited
+    fill_objects(&large);
+    BENCH_RUN("visit 1M x 64 B (plain loop)", N_OBJECTS, &bench_visit,
+              &large);
+    BENCH_RUN("visit 1M x 64 B (prefetch 16)", N_OBJECTS,
+              &bench_visit_prefetch, &large);
+    BENCH_RUN("visit 1M x 64 B (prefetch tuned)", N_OBJECTS,
+              &bench_visit_tuned, &large);
+    BENCH_RUN("visit 1M x 64 B (batch prefetch)", N_OBJECTS,
+              &bench_visit_batch, &large);
+    ptrvec_delete(&large);
+
+    ptrvec_free(&ptrvec);
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/ring.h"
+
+#include "../src/alloc.h"
+
+#include "bench.h"
+
+#include <string.h>
+
+// Each op produces and consumes one message. The ring isn't a multiple of the
+// message size, so messages keep wrapping around at different offsets.
+#define MESSAGE 1500
+#define CAPACITY ((size_t)1 << 16)
+
+static void
+bench_messages(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ring ring;
+    unsigned flags = *(unsigned *)ctx;
+    char *p;
+    size_t n, sum = 0;
+
+    ring_init(&ring, CAPACITY, flags);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        p = ring_write_ptr(&ring, &n);
+        memset(p, (int)i, MESSAGE);
+        ring_produce(&ring, MESSAGE);
+
+        p = ring_read_ptr(&ring, &n);
+        sum += (unsigned char)p[MESSAGE - 1];
+        ring_consume(&ring, n);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(sum);
+    ring_free(&ring);
+}
+
+int
+main(void)
+{
+    unsigned mapped = 0, copy = RING_COPY;
+
+    BENCH_RUN("ring message (1500 B, double mapped)", 1 << 14,
+              &bench_messages, &mapped);
+    BENCH_RUN("ring message (1500 B, RING_COPY)", 1 << 14, &bench_messages,
+              &copy);
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/serial.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "bench.h"
+
+#include <string.h>
+#include <unistd.h>
+
+// 4 MB of ints, or of blocks for the ptrvec benchmarks
+#define N_INTS ((size_t)1 << 20)
+#define BLOCK 4096
+#define N_BLOCKS ((size_t)1 << 10)
+
+static int fd;
+
+static void
+bench_save(struct bench *bench, size_t ops, void *ctx)
+{
+    const int *array = ctx;
+
+    ftruncate(fd, 0);
+    lseek(fd, 0, SEEK_SET);
+
+    BENCH_START(bench);
+    serial_save(fd, array, ops, sizeof(*array), SERIAL_CHECKSUM);
+    BENCH_STOP(bench, ops);
+}
+
+static void
+bench_load(struct bench *bench, size_t ops, void *ctx)
+{
+    int *array = NULL;
+    size_t n = 0;
+
+    UNUSED(ctx);
+
+    lseek(fd, 0, SEEK_SET);
+
+    BENCH_START(bench);
+    serial_load(fd, &array, &n, sizeof(*array));
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(array);
+    jfree(array);
+}
+
+static void
+bench_save_ptrvec(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+
+    ftruncate(fd, 0);
+    lseek(fd, 0, SEEK_SET);
+
+    BENCH_START(bench);
+    serial_save_ptrvec(fd, ptrvec, BLOCK, 0);
+    BENCH_STOP(bench, ops);
+}
+
+// The same blocks copied into one buffer and written in one go, for comparison
+// with the gathered writes
+static void
+bench_save_copy(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec *ptrvec = ctx;
+    char *buf = jmalloc(ops * BLOCK);
+
+    ftruncate(fd, 0);
+    lseek(fd, 0, SEEK_SET);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        memcpy(buf + i * BLOCK, ptrvec->ptr[i], BLOCK);
+    }
+    serial_save(fd, buf, ops, BLOCK, 0);
+    BENCH_STOP(bench, ops);
+
+    jfree(buf);
+}
+
+static void
+bench_load_ptrvec(struct bench *bench, size_t ops, void *ctx)
+{
+    struct ptrvec ptrvec;
+
+    UNUSED(ctx);
+
+    ptrvec_init(&ptrvec);
+    lseek(fd, 0, SEEK_SET);
+
+    BENCH_START(bench);
+    serial_load_ptrvec(fd, &ptrvec, BLOCK);
+    BENCH_STOP(bench, ops);
+
+    ptrvec_delete(&ptrvec);
+}
+
+int
+main(void)
+{
+    char path[] = "/tmp/serial-bench-XXXXXX";
+    int *array = jmalloc(N_INTS * sizeof(*array));
+    struct ptrvec ptrvec;
+
+    fd = mkstemp(path);
+    unlink(path);
+
+    for (size_t i = 0; i < N_INTS; ++i) {
+        array[i] = (int)i;
+    }
+    ptrvec_init(&ptrvec);
+    ptrvec_push_new(&ptrvec, N_BLOCKS, BLOCK);
+    for (size_t i = 0; i < N_BLOCKS; ++i) {
+        memset(ptrvec.ptr[i], (int)i, BLOCK);
+    }
+
+    // ns/op is per element
+    BENCH_RUN("serial_save (4 MB of ints, checksum)", N_INTS, &bench_save,
+              array);
+    BENCH_RUN("serial_load (4 MB of ints, checksum)", N_INTS, &bench_load,
+              NULL);
+    BENCH_RUN("serial_save_ptrvec (1024 x 4 KB)", N_BLOCKS,
+              &bench_save_ptrvec, &ptrvec);
+    BENCH_RUN("copy then serial_save (1024 x 4 KB)", N_BLOCKS,
+              &bench_save_copy, &ptrvec);
+    BENCH_RUN("serial_load_ptrvec (1024 x 4 KB)", N_BLOCKS,
+              &bench_load_ptrvec, NULL);
+
+    ptrvec_delete(&ptrvec);
+    jfree(array);
+    close(fd);
+
+    return 0;
+}
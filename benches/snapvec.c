@@ -0,0 +1,355 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/snapvec.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "bench.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+// Each op is one read of a short list, like a configuration lookup
+#define N_PTRS 16
+
+// The readers in the concurrent benches
+#define N_READERS 4
+
+struct shared {
+    struct snapvec snapvec;
+    struct ptrvec ptrvec;
+    pthread_mutex_t mutex;
+    pthread_rwlock_t rwlock;
+};
+
+static inline uintptr_t
+sum(void *const *ptr, size_t n)
+{
+    uintptr_t sum = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        sum += (uintptr_t)ptr[i];
+    }
+
+    return sum;
+}
+
+static void
+bench_mutex(struct bench *bench, size_t ops, void *ctx)
+{
+    struct shared *shared = ctx;
+    uintptr_t total = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        pthread_mutex_lock(&shared->mutex);
+        total += sum(shared->ptrvec.ptr, shared->ptrvec.length);
+        pthread_mutex_unlock(&shared->mutex);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(total);
+}
+
+static void
+bench_rwlock(struct bench *bench, size_t ops, void *ctx)
+{
+    struct shared *shared = ctx;
+    uintptr_t total = 0;
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        pthread_rwlock_rdlock(&shared->rwlock);
+        total += sum(shared->ptrvec.ptr, shared->ptrvec.length);
+        pthread_rwlock_unlock(&shared->rwlock);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(total);
+}
+
+static void
+bench_snapvec(struct bench *bench, size_t ops, void *ctx)
+{
+    struct shared *shared = ctx;
+    struct snapvec_reader reader;
+    const struct snapvec_snap *snap;
+    uintptr_t total = 0;
+
+    snapvec_reader_add(&shared->snapvec, &reader);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        snap = snapvec_read_begin(&reader);
+        total += sum(snap->ptr, snap->length);
+        snapvec_read_end(&reader);
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(total);
+    snapvec_reader_remove(&reader);
+}
+
+// Each op publishes a new version, with one reader registered
+static void
+bench_publish(struct bench *bench, size_t ops, void *ctx)
+{
+    struct shared *shared = ctx;
+    struct snapvec_reader reader;
+
+    snapvec_reader_add(&shared->snapvec, &reader);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        snapvec_publish(&shared->snapvec, &shared->ptrvec);
+    }
+    BENCH_STOP(bench, ops);
+
+    snapvec_reader_remove(&reader);
+}
+
+enum guard {
+    GUARD_MUTEX,
+    GUARD_RWLOCK,
+    GUARD_SNAPVEC
+};
+
+struct concurrent {
+    struct shared *shared;
+    enum guard guard;
+    size_t ops;
+    int done;
+    // The readers, the writer if there is one, and the timing thread wait at
+    // ready once they're set up and at start before the work. The readers and
+    // the timing thread wait at finish after it, and then the writer stops.
+    pthread_barrier_t ready;
+    pthread_barrier_t start;
+    pthread_barrier_t finish;
+};
+
+static void *
+concurrent_reader(void *arg)
+{
+    struct concurrent *run = arg;
+    struct shared *shared = run->shared;
+    struct snapvec_reader reader;
+    const struct snapvec_snap *snap;
+    uintptr_t total = 0;
+
+    if (run->guard == GUARD_SNAPVEC) {
+        snapvec_reader_add(&shared->snapvec, &reader);
+    }
+
+    pthread_barrier_wait(&run->ready);
+    pthread_barrier_wait(&run->start);
+
+    for (size_t i = 0; i < run->ops; ++i) {
+        switch (run->guard) {
+        case GUARD_MUTEX:
+            pthread_mutex_lock(&shared->mutex);
+            total += sum(shared->ptrvec.ptr, shared->ptrvec.length);
+            pthread_mutex_unlock(&shared->mutex);
+            break;
+        case GUARD_RWLOCK:
+            pthread_rwlock_rdlock(&shared->rwlock);
+            total += sum(shared->ptrvec.ptr, shared->ptrvec.length);
+            pthread_rwlock_unlock(&shared->rwlock);
+            break;
+        case GUARD_SNAPVEC:
+            snap = snapvec_read_begin(&reader);
+            total += sum(snap->ptr, snap->length);
+            snapvec_read_end(&reader);
+            break;
+        default:
+            ASSUME_UNREACHABLE();
+        }
+    }
+
+    pthread_barrier_wait(&run->finish);
+
+    BENCH_KEEP(total);
+    if (run->guard == GUARD_SNAPVEC) {
+        snapvec_reader_remove(&reader);
+    }
+
+    return NULL;
+}
+
+// Swaps the first two pointers, so each version differs from the last
+static void
+swap_first(void **ptr)
+{
+    void *first = ptr[0];
+
+    ptr[0] = ptr[1];
+    ptr[1] = first;
+}
+
+static int
+update(struct ptrvec *ptrvec, void *ctx)
+{
+    UNUSED(ctx);
+
+    swap_first(ptrvec->ptr);
+
+    return 0;
+}
+
+// Changes the list over and over until the readers are done, yielding after
+// each change so that the readers get to run between them on a busy machine
+static void *
+concurrent_writer(void *arg)
+{
+    struct concurrent *run = arg;
+    struct shared *shared = run->shared;
+
+    pthread_barrier_wait(&run->ready);
+    pthread_barrier_wait(&run->start);
+
+    while (!__atomic_load_n(&run->done, __ATOMIC_ACQUIRE)) {
+        switch (run->guard) {
+        case GUARD_MUTEX:
+            pthread_mutex_lock(&shared->mutex);
+            swap_first(shared->ptrvec.ptr);
+            pthread_mutex_unlock(&shared->mutex);
+            break;
+        case GUARD_RWLOCK:
+            pthread_rwlock_wrlock(&shared->rwlock);
+            swap_first(shared->ptrvec.ptr);
+            pthread_rwlock_unlock(&shared->rwlock);
+            break;
+        case GUARD_SNAPVEC:
+            snapvec_update(&shared->snapvec, &update, NULL);
+            break;
+        default:
+            ASSUME_UNREACHABLE();
+        }
+
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+// Reads on N_READERS threads at once, and changes the list on another thread
+// too if writer is set. ns/op is the wall time over all the reads.
+static void
+bench_concurrent(struct bench *bench, size_t ops, void *ctx, enum guard guard,
+                 int writer)
+{
+    pthread_t threads[N_READERS + 1];
+    size_t n_threads = writer ? N_READERS + 1 : N_READERS;
+    struct concurrent run;
+
+    run.shared = ctx;
+    run.guard = guard;
+    run.ops = ops / N_READERS;
+    run.done = 0;
+    pthread_barrier_init(&run.ready, NULL, (unsigned)n_threads + 1);
+    pthread_barrier_init(&run.start, NULL, (unsigned)n_threads + 1);
+    pthread_barrier_init(&run.finish, NULL, N_READERS + 1);
+
+    for (size_t i = 0; i < n_threads; ++i) {
+        if (pthread_create(&threads[i], NULL,
+                           i < N_READERS ? &concurrent_reader
+                           : &concurrent_writer, &run) != 0) {
+
+            fputs("can't create the bench's threads\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&run.ready);
+    BENCH_START(bench);
+    pthread_barrier_wait(&run.start);
+    pthread_barrier_wait(&run.finish);
+    BENCH_STOP(bench, ops);
+
+    __atomic_store_n(&run.done, 1, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < n_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&run.ready);
+    pthread_barrier_destroy(&run.start);
+    pthread_barrier_destroy(&run.finish);
+}
+
+static void
+bench_readers_mutex(struct bench *bench, size_t ops, void *ctx)
+{
+    bench_concurrent(bench, ops, ctx, GUARD_MUTEX, 0);
+}
+
+static void
+bench_readers_rwlock(struct bench *bench, size_t ops, void *ctx)
+{
+    bench_concurrent(bench, ops, ctx, GUARD_RWLOCK, 0);
+}
+
+static void
+bench_readers_snapvec(struct bench *bench, size_t ops, void *ctx)
+{
+    bench_concurrent(bench, ops, ctx, GUARD_SNAPVEC, 0);
+}
+
+static void
+bench_writer_mutex(struct bench *bench, size_t ops, void *ctx)
+{
+    bench_concurrent(bench, ops, ctx, GUARD_MUTEX, 1);
+}
+
+static void
+bench_writer_rwlock(struct bench *bench, size_t ops, void *ctx)
+{
+    bench_concurrent(bench, ops, ctx, GUARD_RWLOCK, 1);
+}
+
+static void
+bench_writer_snapvec(struct bench *bench, size_t ops, void *ctx)
+{
+    bench_concurrent(bench, ops, ctx, GUARD_SNAPVEC, 1);
+}
+
+int
+main(void)
+{
+    static char items[N_PTRS];
+    struct shared shared;
+
+    ptrvec_init(&shared.ptrvec);
+    for (size_t i = 0; i < N_PTRS; ++i) {
+        ptrvec_push(&shared.ptrvec, items + i);
+    }
+    snapvec_init(&shared.snapvec);
+    snapvec_publish(&shared.snapvec, &shared.ptrvec);
+    pthread_mutex_init(&shared.mutex, NULL);
+    pthread_rwlock_init(&shared.rwlock, NULL);
+
+    BENCH_RUN("read 16 ptrs under pthread_mutex", 1 << 16, &bench_mutex,
+              &shared);
+    BENCH_RUN("read 16 ptrs under pthread_rwlock", 1 << 16, &bench_rwlock,
+              &shared);
+    BENCH_RUN("read 16 ptrs from snapvec", 1 << 16, &bench_snapvec, &shared);
+    BENCH_RUN("snapvec_publish (16 ptrs)", 1 << 12, &bench_publish, &shared);
+
+    BENCH_RUN("4 readers, pthread_mutex", 1 << 18, &bench_readers_mutex,
+              &shared);
+    BENCH_RUN("4 readers, pthread_rwlock", 1 << 18, &bench_readers_rwlock,
+              &shared);
+    BENCH_RUN("4 readers, snapvec", 1 << 18, &bench_readers_snapvec, &shared);
+    BENCH_RUN("4 readers + writer, mutex", 1 << 18, &bench_writer_mutex,
+              &shared);
+    BENCH_RUN("4 readers + writer, rwlock", 1 << 18, &bench_writer_rwlock,
+              &shared);
+    BENCH_RUN("4 readers + writer, snapvec", 1 << 18, &bench_writer_snapvec,
+              &shared);
+
+    pthread_rwlock_destroy(&shared.rwlock);
+    pthread_mutex_destroy(&shared.mutex);
+    snapvec_free(&shared.snapvec);
+    ptrvec_free(&shared.ptrvec);
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/vec.h"
+
+#include "../src/alloc.h"
+
+#include "bench.h"
+
+#define CHUNK 64
+
+static void
+bench_reserve_one(struct bench *bench, size_t ops, void *ctx)
+{
+    int *array = NULL;
+
+    UNUSED(ctx);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        vec_reserve_one(&array, i, sizeof(*array));
+        array[i] = (int)i;
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(array);
+    jfree(array);
+}
+
+static void
+bench_reserve_one_min(struct bench *bench, size_t ops, void *ctx)
+{
+    int *array = NULL;
+    size_t cap = 0;
+
+    UNUSED(ctx);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        if (i == cap) {
+            vec_reserve_one_min(&array, &cap, sizeof(*array));
+        }
+        array[i] = (int)i;
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(array);
+    jfree(array);
+}
+
+static void
+bench_reserve_min(struct bench *bench, size_t ops, void *ctx)
+{
+    int *array = NULL;
+    size_t length = 0, cap = 0;
+
+    UNUSED(ctx);
+
+    BENCH_START(bench);
+    for (size_t i = 0; i < ops; ++i) {
+        if (cap - length < CHUNK) {
+            vec_reserve_min(&array, &cap, sizeof(*array), CHUNK);
+        }
+        for (size_t j = 0; j < CHUNK; ++j) {
+            array[length++] = (int)j;
+        }
+    }
+    BENCH_STOP(bench, ops);
+
+    BENCH_KEEP(array);
+    jfree(array);
+}
+
+int
+main(void)
+{
+    BENCH_RUN("vec_reserve_one", 1 << 12, &bench_reserve_one, NULL);
+    BENCH_RUN("vec_reserve_one_min", 1 << 16, &bench_reserve_one_min, NULL);
+    BENCH_RUN("vec_reserve_min (64 per op)", 1 << 10, &bench_reserve_min,
+              NULL);
+
+    return 0;
+}
@@ -1,218 +1,2264 @@
+#define _POSIX_C_SOURCE 200809L
+// For madvise and its Linux-only advice
+#define _DEFAULT_SOURCE
+
 #include "main.h"
 #include "alloc.h"
 
+#include "alloc_trace.h"
+#include "trace.h"
+
+#include <errno.h>
 #include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef JEMALLOC
+#include <jemalloc/jemalloc.h>
+#endif
 
 #define INIT_ALLOC_MIN_BUF_SIZE 32
 
+static void *
+system_malloc(void *ctx, size_t n)
+{
+    UNUSED(ctx);
+
+    return malloc(n);
+}
+
+static void *
+system_calloc(void *ctx, size_t n, size_t size)
+{
+    UNUSED(ctx);
+
+    return calloc(n, size);
+}
+
+static void *
+system_realloc(void *ctx, void *ptr, size_t n)
+{
+    UNUSED(ctx);
+
+    return realloc(ptr, n);
+}
+
+static void
+system_free(void *ctx, void *ptr)
+{
+    UNUSED(ctx);
+
+    free(ptr);
+}
+
+static size_t
+system_usable_size(void *ctx, void *ptr)
+{
+    UNUSED(ctx);
+
+    return malloc_usable_size(ptr);
+}
+
+const struct allocator alloc_system = {
+    &system_malloc, &system_calloc, &system_realloc, &system_free,
+    &system_usable_size, NULL
+};
+
 #ifdef JEMALLOC
 
-#define MALLOC(n) jemalloc(n)
-#define CALLOC(n,s) jecalloc((n), (s))
-#define REALLOC(p,n) jerealloc((p), (n))
-#define FREE(p) jefree((void *)(p))
+static void *
+je_malloc_(void *ctx, size_t n)
+{
+    UNUSED(ctx);
+
+    return jemalloc(n);
+}
+
+static void *
+je_calloc_(void *ctx, size_t n, size_t size)
+{
+    UNUSED(ctx);
+
+    return jecalloc(n, size);
+}
+
+static void *
+je_realloc_(void *ctx, void *ptr, size_t n)
+{
+    UNUSED(ctx);
+
+    return jerealloc(ptr, n);
+}
+
+static void
+je_free_(void *ctx, void *ptr)
+{
+    UNUSED(ctx);
+
+    jefree(ptr);
+}
+
+static size_t
+je_usable_size_(void *ctx, void *ptr)
+{
+    UNUSED(ctx);
+
+    return jemalloc_usable_size(ptr);
+}
+
+const struct allocator alloc_jemalloc = {
+    &je_malloc_, &je_calloc_, &je_realloc_, &je_free_, &je_usable_size_, NULL
+};
+
+const struct allocator *alloc_allocator = &alloc_jemalloc;
 
 #else
 
-#define MALLOC(n) malloc(n)
-#define CALLOC(n,s) calloc((n), (s))
-#define REALLOC(p,n) realloc((p), (n))
-#define FREE(p) free((void *)(p))
+const struct allocator *alloc_allocator = &alloc_system;
 
 #endif
 
-#ifndef NDEBUG
+void
+alloc_set_allocator(const struct allocator *allocator)
+{
+    ASSUME(allocator != NULL);
 
-static size_t alloc_min_buf_size = INIT_ALLOC_MIN_BUF_SIZE;
+    alloc_allocator = allocator;
+}
 
-void
-alloc_size(size_t size)
+const struct allocator *
+alloc_find_allocator(const char *name)
 {
-    ASSUME(alloc_min_buf_size >= INIT_ALLOC_MIN_BUF_SIZE);
+    ASSUME(name != NULL);
 
-    if (size <= alloc_min_buf_size) {
-        return;
+    if (strcmp(name, "system") == 0) {
+        return &alloc_system;
     }
 
-    // Round up to the next power of 2
-    --size;
-    for (size_t i = 1; i < sizeof(size) * CHAR_BIT; i *= 2) {
-        size |= size >> i;
+#ifdef JEMALLOC
+    if (strcmp(name, "jemalloc") == 0) {
+        return &alloc_jemalloc;
     }
-    alloc_min_buf_size = size + 1;
+#endif
 
-    ASSERT(alloc_min_buf_size != 0, "alloc_min_buf_size should not be 0");
-    ASSERT((alloc_min_buf_size & (alloc_min_buf_size - 1)) == 0,
-           "alloc_min_buf_size should be a power of 2");
+    return NULL;
 }
 
-struct mem_info {
-    size_t bytes;
-    int line;
-    const char *file;
-    const char *pre_buf;
-    const char *post_buf;
-};
+int
+alloc_advise(void *ptr, size_t bytes, enum alloc_advice advice)
+{
+    static size_t page_size = 0;
+    uintptr_t begin, end, align;
+    int flag;
+
+    ASSUME(ptr != NULL || bytes == 0);
+
+    if (UNLIKELY(page_size == 0)) {
+        long size = sysconf(_SC_PAGESIZE);
+
+        page_size = size > 0 ? (size_t)size : 4096;
+    }
+
+    switch (advice) {
+    case ALLOC_ADVICE_HUGE:
+#ifdef MADV_HUGEPAGE
+        flag = MADV_HUGEPAGE;
+        align = ALLOC_HUGE_PAGE;
+        break;
+#else
+        return 0;
+#endif
+    case ALLOC_ADVICE_RELEASE:
+        flag = MADV_DONTNEED;
+        align = page_size;
+        break;
+    default:
+        ASSUME_UNREACHABLE();
+        return -1;
+    }
+
+    begin = ((uintptr_t)ptr + align - 1) & ~(align - 1);
+    end = ((uintptr_t)ptr + bytes) & ~(align - 1);
+    if (begin >= end) {
+        return 0;
+    }
+
+    if (ERR(madvise((void *)begin, end - begin, flag) != 0)) {
+        // Kernels without transparent huge pages reject the advice
+        return advice == ALLOC_ADVICE_HUGE && errno == EINVAL ? 0 : -1;
+    }
+
+    return 0;
+}
+
+// Everything below allocates through the current allocator, except for the
+// bookkeeping of the debug and trace modes, which always uses the system
+// malloc so that it isn't affected by alloc_set_allocator
+
+#define MALLOC(n) alloc_allocator->malloc(alloc_allocator->ctx, (n))
+#define CALLOC(n,s) alloc_allocator->calloc(alloc_allocator->ctx, (n), (s))
+#define REALLOC(p,n) alloc_allocator->realloc(alloc_allocator->ctx, (p), (n))
+#define FREE(p) alloc_allocator->free(alloc_allocator->ctx, (p))
+
+#ifdef ALLOC_STATS
+
+// Each thread counts into its own cache line, so counting takes no locked
+// instruction and no line is shared between threads
+struct thread_stats {
+    struct thread_stats *next;
+    struct alloc_stats stats;
+} __attribute__((aligned(64)));
+
+// Guards thread_stats_list. stats_exited holds the counts of the threads that
+// have exited, and anything counted without a thread's own stats, and is only
+// ever changed atomically.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *thread_stats_list = NULL;
+static struct alloc_stats stats_exited;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_stats *thread_stats = NULL;
+// Set once the thread's stats have been folded into stats_exited on its way
+// out, after which it counts straight into stats_exited
+static __thread int stats_thread_done = 0;
+
+#define ADD_STAT(to,from,field) \
+    __atomic_fetch_add(&(to)->field, \
+                       __atomic_load_n(&(from)->field, __ATOMIC_RELAXED), \
+                       __ATOMIC_RELAXED)
 
-// The line might not always be exactly right, but it should be close enough to
-// identify where the error occured
 static void
-mem_fail(size_t bytes, int line, const char *file)
+add_stats(struct alloc_stats *to, const struct alloc_stats *from)
 {
-    ASSUME(line >= 0);
-    ASSUME(file != NULL);
+    ADD_STAT(to, from, mallocs);
+    ADD_STAT(to, from, callocs);
+    ADD_STAT(to, from, reallocs);
+    ADD_STAT(to, from, frees);
+    ADD_STAT(to, from, maps);
+    ADD_STAT(to, from, unmaps);
+    ADD_STAT(to, from, bytes);
+}
 
-    fprintf(stderr, "Memory failure!\n\tLine: %i\n\tFile: %s\n\tBytes: %zu\n",
-            line, file, bytes);
+static void
+stats_thread_exit(void *arg)
+{
+    struct thread_stats *ts = arg;
+
+    pthread_mutex_lock(&stats_lock);
+
+    add_stats(&stats_exited, &ts->stats);
+
+    for (struct thread_stats **p = &thread_stats_list; *p != NULL;
+         p = &(*p)->next) {
+
+        if (*p == ts) {
+            *p = ts->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+
+    free(ts);
+    thread_stats = NULL;
+    stats_thread_done = 1;
 }
 
-static int alloc_freed = 0;
+static void
+stats_key_init(void)
+{
+    pthread_key_create(&stats_key, &stats_thread_exit);
+}
+
+// Returns the calling thread's stats, or NULL if it can't have them
+static struct alloc_stats *
+new_thread_stats(void)
+{
+    struct thread_stats *ts;
+    void *mem;
 
-// TODO - Optimize the pointer info storage. Maybe adapt ptrvec to a vector of
-// struct ptr_info? Or maybe use a tree to get O(log(n)) insertion, removal,
-// and deletion?
+    if (stats_thread_done) {
+        return NULL;
+    }
 
-struct ptr_info {
-    const void *ptr;
-    size_t bytes;
+    // Like the trace buffers, the stats come from the system malloc
+    if (ERR(posix_memalign(&mem, sizeof(*ts), sizeof(*ts)) != 0)) {
+        return NULL;
+    }
+    ts = mem;
+    memset(ts, 0, sizeof(*ts));
+
+    pthread_once(&stats_key_once, &stats_key_init);
+    pthread_setspecific(stats_key, ts);
+
+    pthread_mutex_lock(&stats_lock);
+    ts->next = thread_stats_list;
+    thread_stats_list = ts;
+    pthread_mutex_unlock(&stats_lock);
+
+    thread_stats = ts;
+
+    return &ts->stats;
+}
+
+static inline struct alloc_stats *
+get_thread_stats(void)
+{
+    return LIKELY(thread_stats != NULL) ? &thread_stats->stats
+        : new_thread_stats();
+}
+
+// Only the owning thread changes its stats, so a plain add will do, stored
+// atomically for alloc_stats to read
+#define STAT_ADD(x,n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+#define STAT(field,n) STAT_BATCH(field, 1, (n))
+
+#define STAT_BATCH(field,count,n) do { \
+    struct alloc_stats *stats_ = get_thread_stats(); \
+    \
+    if (LIKELY(stats_ != NULL)) { \
+        STAT_ADD(stats_->field, (count)); \
+        STAT_ADD(stats_->bytes, (n)); \
+    } else { \
+        __atomic_fetch_add(&stats_exited.field, (count), __ATOMIC_RELAXED); \
+        __atomic_fetch_add(&stats_exited.bytes, (n), __ATOMIC_RELAXED); \
+    } \
+} while (0)
+
+void
+alloc_stats(struct alloc_stats *out)
+{
+    ASSUME(out != NULL);
+
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&stats_lock);
+
+    add_stats(out, &stats_exited);
+    for (struct thread_stats *ts = thread_stats_list; ts != NULL;
+         ts = ts->next) {
+
+        add_stats(out, &ts->stats);
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void
+alloc_stats_map(size_t bytes)
+{
+    STAT(maps, bytes);
+}
+
+void
+alloc_stats_unmap(void)
+{
+    STAT(unmaps, 0);
+}
+
+#else
+
+#define STAT(field,n) ((void)0)
+#define STAT_BATCH(field,count,n) ((void)0)
+
+#endif
+
+#ifdef ALLOC_TRACE
+
+#define TRACE_BUF_EVENTS 512
+
+struct trace_buf {
+    struct trace_buf *next;
+    size_t n;
+    struct alloc_trace_event events[TRACE_BUF_EVENTS];
 };
 
-static struct ptr_info *ptr_infos = NULL;
-static size_t n_ptr_infos = 0;
-static size_t cap_ptr_infos = 0;
+// Guards trace_file and trace_bufs
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file = NULL;
+static struct trace_buf *trace_bufs = NULL;
+
+static int trace_on = 0;
+static uint64_t trace_seq = 0;
+
+// No sequence number, for an event reserved while tracing was off
+#define TRACE_NO_SEQ UINT64_MAX
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_buf *trace_buf = NULL;
+// Set once the thread's buffer has been freed on its way out, so that any
+// later events, e.g. from other TLS destructors, are written straight out
+static __thread int trace_thread_done = 0;
+
+static void
+flush_trace_buf(struct trace_buf *buf)
+{
+    ASSUME(buf != NULL);
+
+    if (trace_file != NULL && buf->n > 0) {
+        fwrite(buf->events, sizeof(*buf->events), buf->n, trace_file);
+    }
+
+    buf->n = 0;
+}
+
+static void
+trace_thread_exit(void *arg)
+{
+    struct trace_buf *buf = arg;
+
+    pthread_mutex_lock(&trace_lock);
+
+    flush_trace_buf(buf);
+
+    for (struct trace_buf **p = &trace_bufs; *p != NULL; p = &(*p)->next) {
+        if (*p == buf) {
+            *p = buf->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    free(buf);
+
+    trace_buf = NULL;
+    trace_thread_done = 1;
+}
+
+static void
+trace_key_init(void)
+{
+    pthread_key_create(&trace_key, &trace_thread_exit);
+}
+
+static struct trace_buf *
+new_trace_buf(void)
+{
+    struct trace_buf *buf;
+
+    // Use the system malloc, so the buffer doesn't show up in the trace
+    buf = malloc(sizeof(*buf));
+    if (ERR(buf == NULL)) {
+        return NULL;
+    }
+
+    buf->n = 0;
+
+    pthread_once(&trace_key_once, &trace_key_init);
+    pthread_setspecific(trace_key, buf);
+
+    pthread_mutex_lock(&trace_lock);
+    buf->next = trace_bufs;
+    trace_bufs = buf;
+    pthread_mutex_unlock(&trace_lock);
+
+    return buf;
+}
+
+// Returns the next sequence number, or TRACE_NO_SEQ if tracing is off
+static uint64_t
+trace_seq_next(void)
+{
+    if (LIKELY(!__atomic_load_n(&trace_on, __ATOMIC_RELAXED))) {
+        return TRACE_NO_SEQ;
+    }
+
+    return __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+}
+
+// Records an event with a sequence number from trace_seq_next, which can be
+// taken before the event happens to keep it in order with other threads
+static void
+trace_event_seq(enum alloc_trace_op op, uint64_t seq, const void *ptr,
+                const void *old_ptr, size_t size)
+{
+    struct trace_buf *buf;
+    struct alloc_trace_event *event, direct;
+
+    if (LIKELY(seq == TRACE_NO_SEQ)) {
+        return;
+    }
+
+    buf = trace_buf;
+    if (UNLIKELY(buf == NULL) && !trace_thread_done) {
+        buf = trace_buf = new_trace_buf();
+        if (ERR(buf == NULL)) {
+            return;
+        }
+    }
+
+    event = LIKELY(buf != NULL) ? &buf->events[buf->n++] : &direct;
+
+    event->seq_op = seq | (uint64_t)op << 56;
+    event->ptr = (uint64_t)(uintptr_t)ptr;
+    event->old_ptr = (uint64_t)(uintptr_t)old_ptr;
+    event->size = size;
+
+    if (UNLIKELY(buf == NULL)) {
+        // The thread's buffer is gone, so write the event on its own
+        pthread_mutex_lock(&trace_lock);
+        if (trace_file != NULL) {
+            fwrite(event, sizeof(*event), 1, trace_file);
+        }
+        pthread_mutex_unlock(&trace_lock);
+    } else if (buf->n == TRACE_BUF_EVENTS) {
+        pthread_mutex_lock(&trace_lock);
+        flush_trace_buf(buf);
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+static void
+trace_event(enum alloc_trace_op op, const void *ptr, const void *old_ptr,
+            size_t size)
+{
+    trace_event_seq(op, trace_seq_next(), ptr, old_ptr, size);
+}
+
+int
+alloc_trace_start(const char *path)
+{
+    struct alloc_trace_header header;
+
+    ASSUME(path != NULL);
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (ERR(trace_file != NULL)) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    trace_file = fopen(path, "wb");
+    if (ERR(trace_file == NULL)) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    memcpy(header.magic, ALLOC_TRACE_MAGIC, sizeof(header.magic));
+    header.version = ALLOC_TRACE_VERSION;
+    header.event_size = sizeof(struct alloc_trace_event);
+
+    if (ERR(fwrite(&header, sizeof(header), 1, trace_file) != 1)) {
+        fclose(trace_file);
+        trace_file = NULL;
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    // Drop anything buffered by an earlier trace
+    for (struct trace_buf *buf = trace_bufs; buf != NULL; buf = buf->next) {
+        buf->n = 0;
+    }
+
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return 0;
+}
+
+int
+alloc_trace_stop(void)
+{
+    int err;
+
+    pthread_mutex_lock(&trace_lock);
+
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+
+    if (ERR(trace_file == NULL)) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    for (struct trace_buf *buf = trace_bufs; buf != NULL; buf = buf->next) {
+        flush_trace_buf(buf);
+    }
+
+    err = ferror(trace_file);
+    if (ERR(fclose(trace_file) != 0)) {
+        err = -1;
+    }
+    trace_file = NULL;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return err != 0 ? -1 : 0;
+}
+
+#define TRACE_ALLOC(op,p,old,n) trace_event(ALLOC_TRACE_##op, (p), (old), (n))
+#define TRACE_SEQ() trace_seq_next()
+#define TRACE_ALLOC_SEQ(op,seq,p,old,n) \
+    trace_event_seq(ALLOC_TRACE_##op, (seq), (p), (old), (n))
+
+#else
+
+#define TRACE_ALLOC(op,p,old,n) ((void)0)
+#define TRACE_SEQ() ((uint64_t)0)
+#define TRACE_ALLOC_SEQ(op,seq,p,old,n) ((void)(seq))
+
+#endif
+
+#if defined(NDEBUG) && defined(ALLOC_TCACHE)
+
+// The size classes go up by 16 bytes to 128, and then by a quarter of the
+// previous power of 2. Blocks are allocated at exactly their class's size, and
+// a freed block is put in the largest class that fits in its usable size, so
+// blocks that didn't come from the cache can be cached too.
+
+#define TCACHE_CLASSES 28
+#define TCACHE_BIN_MAX 64
+#define TCACHE_BIN_BYTES 32768
+#define TCACHE_DEPOT_MAX 64
+
+static const size_t tcache_sizes[TCACHE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096
+};
+
+// A free block is linked to the next block of its list, and the first block of
+// a batch in the depot is also linked to the next batch
+struct tcache_block {
+    struct tcache_block *next;
+    struct tcache_block *next_batch;
+};
+
+struct tcache_bin {
+    struct tcache_block *head;
+    size_t n;
+};
+
+struct tcache {
+    struct tcache *next;
+    struct tcache_bin bins[TCACHE_CLASSES];
+    struct alloc_tcache_stats stats;
+};
+
+struct tcache_depot {
+    pthread_mutex_t lock;
+    struct tcache_block *batches;
+    size_t n;
+};
+
+static struct tcache_depot tcache_depots[TCACHE_CLASSES];
+
+// Guards tcaches and tcache_exited
+static pthread_mutex_t tcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tcache *tcaches = NULL;
+static struct alloc_tcache_stats tcache_exited;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread struct tcache *tcache = NULL;
+// Set once the thread's cache has been flushed at exit, after which any frees
+// from other destructors go straight to the allocator
+static __thread int tcache_exiting = 0;
+
+#define TCACHE_STAT(tc,field) \
+    __atomic_store_n(&(tc)->stats.field, (tc)->stats.field + 1, \
+                     __ATOMIC_RELAXED)
+
+#define USABLE_SIZE(p) \
+    alloc_allocator->usable_size(alloc_allocator->ctx, (p))
+
+// Returns the smallest class that holds n bytes, for 0 < n <= ALLOC_TCACHE_MAX
+static size_t
+tcache_class(size_t n)
+{
+    unsigned shift;
+
+    if (n <= 128) {
+        return n == 0 ? 0 : (n - 1) / 16;
+    }
+
+    // 4 classes per power of 2, starting at class 8 for (128, 256]
+    shift = (unsigned)(sizeof(long) * CHAR_BIT) - 3
+        - (unsigned)__builtin_clzl((unsigned long)(n - 1));
+    return 8 + (shift - 5) * 4 + ((n - 1) >> shift) - 4;
+}
+
+static inline size_t
+tcache_bin_max(size_t class)
+{
+    size_t max = TCACHE_BIN_BYTES / tcache_sizes[class];
+
+    return max < TCACHE_BIN_MAX ? max : TCACHE_BIN_MAX;
+}
+
+// Blocks move between threads and the depot in batches of half a full bin
+static inline size_t
+tcache_batch(size_t class)
+{
+    return tcache_bin_max(class) / 2;
+}
+
+static void
+tcache_release(struct tcache_block *block)
+{
+    while (block != NULL) {
+        struct tcache_block *next = block->next;
+
+        FREE(block);
+        block = next;
+    }
+}
+
+// Moves a batch off the front of the bin to the depot
+static void
+tcache_flush_batch(struct tcache *tc, size_t class)
+{
+    struct tcache_bin *bin = &tc->bins[class];
+    struct tcache_depot *depot = &tcache_depots[class];
+    struct tcache_block *batch, *tail;
+    size_t n = tcache_batch(class);
+
+    ASSUME(bin->n >= n);
+
+    batch = tail = bin->head;
+    for (size_t i = 1; i < n; ++i) {
+        tail = tail->next;
+    }
+    bin->head = tail->next;
+    bin->n -= n;
+    tail->next = NULL;
+
+    TCACHE_STAT(tc, flushes);
+
+    pthread_mutex_lock(&depot->lock);
+    if (depot->n < TCACHE_DEPOT_MAX) {
+        batch->next_batch = depot->batches;
+        depot->batches = batch;
+        __atomic_store_n(&depot->n, depot->n + 1, __ATOMIC_RELAXED);
+        batch = NULL;
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    // The depot is full, so the allocator gets the batch back
+    tcache_release(batch);
+}
+
+// Refills an empty bin with a batch from the depot, returning whether there
+// was one
+static int
+tcache_refill(struct tcache *tc, size_t class)
+{
+    struct tcache_depot *depot = &tcache_depots[class];
+    struct tcache_block *batch;
+
+    if (__atomic_load_n(&depot->n, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&depot->lock);
+    batch = depot->batches;
+    if (batch != NULL) {
+        depot->batches = batch->next_batch;
+        __atomic_store_n(&depot->n, depot->n - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    if (batch == NULL) {
+        return 0;
+    }
+
+    tc->bins[class].head = batch;
+    tc->bins[class].n = tcache_batch(class);
+    TCACHE_STAT(tc, refills);
+
+    return 1;
+}
+
+// Moves whole batches of every bin to the depot, and frees what's left over
+static void
+tcache_flush_all(struct tcache *tc)
+{
+    for (size_t class = 0; class < TCACHE_CLASSES; ++class) {
+        struct tcache_bin *bin = &tc->bins[class];
+
+        while (bin->n >= tcache_batch(class)) {
+            tcache_flush_batch(tc, class);
+        }
+
+        tcache_release(bin->head);
+        bin->head = NULL;
+        bin->n = 0;
+    }
+}
+
+static void
+tcache_thread_exit(void *arg)
+{
+    struct tcache *tc = arg;
+
+    tcache_flush_all(tc);
+
+    pthread_mutex_lock(&tcache_lock);
+
+    tcache_exited.hits += tc->stats.hits;
+    tcache_exited.misses += tc->stats.misses;
+    tcache_exited.refills += tc->stats.refills;
+    tcache_exited.flushes += tc->stats.flushes;
+
+    for (struct tcache **p = &tcaches; *p != NULL; p = &(*p)->next) {
+        if (*p == tc) {
+            *p = tc->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&tcache_lock);
+
+    free(tc);
+    tcache = NULL;
+    tcache_exiting = 1;
+}
+
+static void
+tcache_init(void)
+{
+    pthread_key_create(&tcache_key, &tcache_thread_exit);
+
+    for (size_t class = 0; class < TCACHE_CLASSES; ++class) {
+        pthread_mutex_init(&tcache_depots[class].lock, NULL);
+    }
+}
+
+// Returns the calling thread's cache, or NULL if it can't have one
+static struct tcache *
+new_tcache(void)
+{
+    struct tcache *tc;
+
+    if (tcache_exiting) {
+        return NULL;
+    }
+
+    // Like the trace buffers, the cache itself comes from the system malloc
+    tc = calloc(1, sizeof(*tc));
+    if (ERR(tc == NULL)) {
+        return NULL;
+    }
+
+    pthread_once(&tcache_once, &tcache_init);
+    pthread_setspecific(tcache_key, tc);
+
+    pthread_mutex_lock(&tcache_lock);
+    tc->next = tcaches;
+    tcaches = tc;
+    pthread_mutex_unlock(&tcache_lock);
+
+    return tcache = tc;
+}
+
+static void *
+tcache_malloc(size_t n)
+{
+    struct tcache *tc = tcache;
+    struct tcache_bin *bin;
+    struct tcache_block *block;
+    size_t class;
+
+    if (n > ALLOC_TCACHE_MAX) {
+        return MALLOC(n);
+    }
+
+    if (UNLIKELY(tc == NULL)) {
+        tc = new_tcache();
+        if (tc == NULL) {
+            return MALLOC(n);
+        }
+    }
+
+    class = tcache_class(n);
+    bin = &tc->bins[class];
+
+    if (UNLIKELY(bin->head == NULL) && !tcache_refill(tc, class)) {
+        TCACHE_STAT(tc, misses);
+        return MALLOC(tcache_sizes[class]);
+    }
+
+    block = bin->head;
+    bin->head = block->next;
+    --bin->n;
+    TCACHE_STAT(tc, hits);
+
+    return block;
+}
+
+static void *
+tcache_calloc(size_t n, size_t size)
+{
+    void *ptr;
+
+    if (ERR(size != 0 && n > SIZE_MAX / size)) {
+        return NULL;
+    }
+
+    if (n * size > ALLOC_TCACHE_MAX) {
+        return CALLOC(n, size);
+    }
+
+    ptr = tcache_malloc(n * size);
+    if (LIKELY(ptr != NULL)) {
+        memset(ptr, 0, n * size);
+    }
+
+    return ptr;
+}
+
+// Returns the largest class that fits in a block of usable bytes, or
+// TCACHE_CLASSES if the block shouldn't be cached
+static size_t
+tcache_free_class(size_t usable)
+{
+    // Anything much bigger than the largest class would waste memory there
+    if (usable < tcache_sizes[0]
+        || usable >= ALLOC_TCACHE_MAX + ALLOC_TCACHE_MAX / 4) {
+        return TCACHE_CLASSES;
+    }
+
+    return usable >= ALLOC_TCACHE_MAX ? TCACHE_CLASSES - 1
+        : tcache_class(usable + 1) - 1;
+}
+
+static void
+tcache_free(void *ptr)
+{
+    struct tcache *tc = tcache;
+    struct tcache_bin *bin;
+    struct tcache_block *block = ptr;
+    size_t class;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    class = tcache_free_class(USABLE_SIZE(ptr));
+    if (class == TCACHE_CLASSES) {
+        FREE(ptr);
+        return;
+    }
+
+    if (UNLIKELY(tc == NULL)) {
+        tc = new_tcache();
+        if (tc == NULL) {
+            FREE(ptr);
+            return;
+        }
+    }
+
+    bin = &tc->bins[class];
+
+    block->next = bin->head;
+    bin->head = block;
+
+    if (UNLIKELY(++bin->n > tcache_bin_max(class))) {
+        tcache_flush_batch(tc, class);
+    }
+}
+
+// Hardened frees go through the quarantine one block at a time
+#ifndef ALLOC_HARDEN
+
+// Same as calling tcache_free on each of the count pointers, but the thread's
+// cache is only looked up once, and bins that overflow are only flushed once
+// every block is in its bin
+static void
+tcache_free_batch(void **ptrs, size_t count)
+{
+    struct tcache *tc = tcache;
+    struct tcache_bin *bin;
+    struct tcache_block *block;
+    // One bit per class, for the bins that are over their limit
+    uint32_t full = 0;
+    size_t class;
+
+    for (size_t i = 0; i < count; ++i) {
+        block = ptrs[i];
+        if (block == NULL) {
+            continue;
+        }
+
+        class = tcache_free_class(USABLE_SIZE(block));
+        if (class == TCACHE_CLASSES) {
+            FREE(block);
+            continue;
+        }
+
+        if (UNLIKELY(tc == NULL)) {
+            tc = new_tcache();
+            if (tc == NULL) {
+                FREE(block);
+                continue;
+            }
+        }
+
+        bin = &tc->bins[class];
+
+        block->next = bin->head;
+        bin->head = block;
+
+        if (++bin->n > tcache_bin_max(class)) {
+            full |= (uint32_t)1 << class;
+        }
+    }
+
+    for (class = 0; full != 0; ++class, full >>= 1) {
+        if ((full & 1) == 0) {
+            continue;
+        }
+
+        while (tc->bins[class].n > tcache_bin_max(class)) {
+            tcache_flush_batch(tc, class);
+        }
+    }
+}
+
+#endif
+
+static void *
+tcache_realloc(void *ptr, size_t n)
+{
+    void *new_ptr;
+    size_t usable;
+
+    if (ptr == NULL) {
+        return tcache_malloc(n);
+    }
+
+    usable = USABLE_SIZE(ptr);
+
+    // Keep the block if it fits without wasting more than half of it
+    if (n <= usable && n >= usable / 2) {
+        return ptr;
+    }
+
+    if (n > ALLOC_TCACHE_MAX && usable > ALLOC_TCACHE_MAX) {
+        return REALLOC(ptr, n);
+    }
+
+    new_ptr = tcache_malloc(n);
+    if (ERR(new_ptr == NULL)) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, n < usable ? n : usable);
+    tcache_free(ptr);
+
+    return new_ptr;
+}
+
+void
+alloc_tcache_stats(struct alloc_tcache_stats *out)
+{
+    ASSUME(out != NULL);
+
+    pthread_mutex_lock(&tcache_lock);
+
+    *out = tcache_exited;
+
+    for (struct tcache *tc = tcaches; tc != NULL; tc = tc->next) {
+        out->hits += __atomic_load_n(&tc->stats.hits, __ATOMIC_RELAXED);
+        out->misses += __atomic_load_n(&tc->stats.misses, __ATOMIC_RELAXED);
+        out->refills += __atomic_load_n(&tc->stats.refills, __ATOMIC_RELAXED);
+        out->flushes += __atomic_load_n(&tc->stats.flushes, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&tcache_lock);
+}
+
+void
+alloc_tcache_flush(void)
+{
+    if (tcache != NULL) {
+        tcache_flush_all(tcache);
+    }
+}
+
+void
+alloc_tcache_trim(void)
+{
+    pthread_once(&tcache_once, &tcache_init);
+
+    for (size_t class = 0; class < TCACHE_CLASSES; ++class) {
+        struct tcache_depot *depot = &tcache_depots[class];
+        struct tcache_block *batch;
+
+        pthread_mutex_lock(&depot->lock);
+        batch = depot->batches;
+        depot->batches = NULL;
+        __atomic_store_n(&depot->n, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&depot->lock);
+
+        while (batch != NULL) {
+            struct tcache_block *next = batch->next_batch;
+
+            tcache_release(batch);
+            batch = next;
+        }
+    }
+}
+
+#define CACHED_MALLOC(n) tcache_malloc((n))
+#define CACHED_CALLOC(n,s) tcache_calloc((n), (s))
+#define CACHED_REALLOC(p,n) tcache_realloc((p), (n))
+#define CACHED_FREE(p) tcache_free((p))
+#define CACHED_FREE_BATCH(p,c) tcache_free_batch((p), (c))
+
+#else
+
+#define CACHED_MALLOC(n) MALLOC(n)
+#define CACHED_CALLOC(n,s) CALLOC((n), (s))
+#define CACHED_REALLOC(p,n) REALLOC((p), (n))
+#define CACHED_FREE(p) FREE(p)
+#define CACHED_FREE_BATCH(p,c) do { \
+    for (size_t i_ = 0; i_ < (c); ++i_) { \
+        FREE((p)[i_]); \
+    } \
+} while (0)
+
+#endif
+
+#if defined(NDEBUG) && defined(ALLOC_HARDEN)
+
+// Each block is laid out as a struct harden_header, the caller's bytes, and an
+// 8 byte footer. Both the header and footer hold a cookie derived from a
+// per-process secret, which is checked whenever the block is freed or
+// reallocated. Overflows off the end of a block hit the footer of that block,
+// and underflows hit its header.
+
+struct harden_header {
+    size_t bytes;
+    uint64_t cookie;
+};
+
+#define HARDEN_OVERHEAD (sizeof(struct harden_header) + sizeof(uint64_t))
+
+// XORed into the header cookie while a block is in quarantine
+#define HARDEN_FREED UINT64_C(0xF4EEF4EEF4EEF4EE)
+
+static uint64_t harden_secret;
+
+__attribute__((constructor)) static void
+harden_init(void)
+{
+    const void *random;
+    uint64_t secret = 0;
+
+    // The kernel gives every process 16 random bytes; fall back on ASLR if
+    // they're missing for some reason
+    random = (const void *)getauxval(AT_RANDOM);
+    if (random != NULL) {
+        memcpy(&secret, random, sizeof(secret));
+    }
+
+    harden_secret = secret ^ (uint64_t)(uintptr_t)&harden_secret;
+}
+
+static inline uint64_t
+harden_cookie(const struct harden_header *header)
+{
+    return harden_secret ^ (uint64_t)(uintptr_t)header;
+}
+
+static inline void
+harden_seal(struct harden_header *header, size_t bytes)
+{
+    uint64_t footer;
+
+    header->bytes = bytes;
+    header->cookie = harden_cookie(header);
+
+    footer = header->cookie ^ bytes;
+    memcpy((char *)(header + 1) + bytes, &footer, sizeof(footer));
+}
+
+__attribute__((noreturn)) static void
+harden_fail(const struct harden_header *header, const char *problem)
+{
+    fprintf(stderr, "Heap corruption detected!\n\tPointer: %p\n"
+            "\tProblem: %s\nAborting now.\n",
+            (const void *)(header + 1), problem);
+
+    abort();
+}
+
+static void
+harden_check(const struct harden_header *header)
+{
+    uint64_t footer;
+
+    if (ERR(header->cookie != harden_cookie(header))) {
+        harden_fail(header, header->cookie == (harden_cookie(header)
+                                               ^ HARDEN_FREED)
+                    ? "double free" : "header overwritten");
+    }
+
+    memcpy(&footer, (const char *)(header + 1) + header->bytes,
+           sizeof(footer));
+    if (ERR(footer != (header->cookie ^ header->bytes))) {
+        harden_fail(header, "footer overwritten");
+    }
+}
+
+static size_t quarantine_len = ALLOC_QUARANTINE;
+
+static __thread struct harden_header *quarantine[ALLOC_QUARANTINE_MAX];
+static __thread size_t quarantine_next = 0;
+static __thread int quarantine_registered = 0;
+
+static pthread_key_t quarantine_key;
+static pthread_once_t quarantine_key_once = PTHREAD_ONCE_INIT;
+
+static void
+quarantine_release(struct harden_header *header)
+{
+    // A write to the header after the block was freed is caught here
+    if (ERR(header->cookie != (harden_cookie(header) ^ HARDEN_FREED))) {
+        harden_fail(header, "written after free");
+    }
+
+    CACHED_FREE(header);
+}
+
+static void
+quarantine_thread_exit(void *arg)
+{
+    UNUSED(arg);
+
+    for (size_t i = 0; i < ALLOC_QUARANTINE_MAX; ++i) {
+        if (quarantine[i] != NULL) {
+            quarantine_release(quarantine[i]);
+            quarantine[i] = NULL;
+        }
+    }
+}
+
+static void
+quarantine_key_init(void)
+{
+    pthread_key_create(&quarantine_key, &quarantine_thread_exit);
+}
+
+void
+alloc_quarantine(size_t n)
+{
+    __atomic_store_n(&quarantine_len,
+                     n < ALLOC_QUARANTINE_MAX ? n : ALLOC_QUARANTINE_MAX,
+                     __ATOMIC_RELAXED);
+}
+
+static void *
+harden_alloc(size_t n, int clear)
+{
+    struct harden_header *header;
+
+    if (ERR(n > SIZE_MAX - HARDEN_OVERHEAD)) {
+        return NULL;
+    }
+
+    header = clear ? CACHED_CALLOC(1, n + HARDEN_OVERHEAD)
+        : CACHED_MALLOC(n + HARDEN_OVERHEAD);
+    if (ERR(header == NULL)) {
+        return NULL;
+    }
+
+    harden_seal(header, n);
+
+    return header + 1;
+}
+
+static void *
+harden_realloc(void *ptr, size_t n)
+{
+    struct harden_header *header;
+
+    if (ptr == NULL) {
+        return harden_alloc(n, 0);
+    }
+
+    if (ERR(n > SIZE_MAX - HARDEN_OVERHEAD)) {
+        return NULL;
+    }
+
+    header = (struct harden_header *)ptr - 1;
+    harden_check(header);
+
+    header = CACHED_REALLOC(header, n + HARDEN_OVERHEAD);
+    if (ERR(header == NULL)) {
+        return NULL;
+    }
+
+    harden_seal(header, n);
+
+    return header + 1;
+}
+
+static void
+harden_free(void *ptr)
+{
+    struct harden_header *header, *evicted;
+    size_t len;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    header = (struct harden_header *)ptr - 1;
+    harden_check(header);
+
+    header->cookie ^= HARDEN_FREED;
+
+    len = __atomic_load_n(&quarantine_len, __ATOMIC_RELAXED);
+    if (len == 0) {
+        CACHED_FREE(header);
+        return;
+    }
+
+    if (UNLIKELY(!quarantine_registered)) {
+        pthread_once(&quarantine_key_once, &quarantine_key_init);
+        pthread_setspecific(quarantine_key, &quarantine_registered);
+        quarantine_registered = 1;
+    }
+
+    if (quarantine_next >= len) {
+        quarantine_next = 0;
+    }
+
+    evicted = quarantine[quarantine_next];
+    quarantine[quarantine_next++] = header;
+
+    if (evicted != NULL) {
+        quarantine_release(evicted);
+    }
+}
+
+#define WRAPPED_MALLOC(n) harden_alloc((n), 0)
+#define WRAPPED_CALLOC(n,s) (ERR((s) != 0 && (n) > SIZE_MAX / (s)) ? NULL \
+                             : harden_alloc((n) * (s), 1))
+#define WRAPPED_REALLOC(p,n) harden_realloc((p), (n))
+#define WRAPPED_FREE(p) harden_free((p))
+#define WRAPPED_FREE_BATCH(p,c) do { \
+    for (size_t i_ = 0; i_ < (c); ++i_) { \
+        harden_free((p)[i_]); \
+    } \
+} while (0)
+
+#else
+
+#define WRAPPED_MALLOC(n) CACHED_MALLOC(n)
+#define WRAPPED_CALLOC(n,s) CACHED_CALLOC((n), (s))
+#define WRAPPED_REALLOC(p,n) CACHED_REALLOC((p), (n))
+#define WRAPPED_FREE(p) CACHED_FREE(p)
+#define WRAPPED_FREE_BATCH(p,c) CACHED_FREE_BATCH((p), (c))
+
+#endif
+
+#ifdef ALLOC_WRAPPED
+
+void *
+malloc_s(size_t n)
+{
+    void *ptr;
+
+    STAT(mallocs, n);
+
+    ptr = WRAPPED_MALLOC(n);
+    if (LIKELY(ptr != NULL)) {
+        TRACE_ALLOC(MALLOC, ptr, NULL, n);
+    }
+
+    return ptr;
+}
+
+void *
+calloc_s(size_t n, size_t size)
+{
+    void *ptr;
+
+    STAT(callocs, n * size);
+
+    ptr = WRAPPED_CALLOC(n, size);
+    if (LIKELY(ptr != NULL)) {
+        TRACE_ALLOC(CALLOC, ptr, NULL, n * size);
+    }
+
+    return ptr;
+}
+
+void *
+realloc_s(void *ptr, size_t n)
+{
+    void *new_ptr;
+    uint64_t seq;
+
+    STAT(reallocs, n);
+
+    // Take the sequence number before ptr is freed, as free_s does, so that
+    // no other thread can be given ptr with an earlier one
+    seq = TRACE_SEQ();
+
+    new_ptr = WRAPPED_REALLOC(ptr, n);
+    if (LIKELY(new_ptr != NULL)) {
+        TRACE_ALLOC_SEQ(REALLOC, seq, new_ptr, ptr, n);
+    }
+
+    return new_ptr;
+}
+
+void
+free_s(void *ptr)
+{
+    if (ptr != NULL) {
+        STAT(frees, 0);
+        // Trace before freeing, so that no other thread can be given the same
+        // pointer with an earlier sequence number
+        TRACE_ALLOC(FREE, ptr, NULL, 0);
+    }
+
+    WRAPPED_FREE(ptr);
+}
+
+#endif
+
+#ifdef NDEBUG
+
+int
+malloc_batch_s(size_t count, size_t size, void **ptrs)
+{
+    ASSUME(ptrs != NULL || count == 0);
+
+    // Counted as one call per block, but with one update for the batch
+    STAT_BATCH(mallocs, count, count * size);
+
+    for (size_t i = 0; i < count; ++i) {
+        ptrs[i] = WRAPPED_MALLOC(size);
+        if (ERR(ptrs[i] == NULL)) {
+            free_batch_s(ptrs, i);
+            return -1;
+        }
+
+        TRACE_ALLOC(MALLOC, ptrs[i], NULL, size);
+    }
+
+    return 0;
+}
+
+void
+free_batch_s(void **ptrs, size_t count)
+{
+    size_t freed = 0;
+
+    ASSUME(ptrs != NULL || count == 0);
+
+    // Everything is traced before anything is freed, like free_s does
+    for (size_t i = 0; i < count; ++i) {
+        if (ptrs[i] != NULL) {
+            TRACE_ALLOC(FREE, ptrs[i], NULL, 0);
+            ++freed;
+        }
+    }
+
+    STAT_BATCH(frees, freed, 0);
+    UNUSED(freed);
+
+    // These aren't sorted like in debug builds: sorting costs far more per
+    // pointer than the allocator saves on frees in address order. Only the
+    // thread cache has per-call work to save, by filling its bins in one pass.
+    WRAPPED_FREE_BATCH(ptrs, count);
+}
+
+#endif
+
+#ifndef NDEBUG
+
+static size_t alloc_min_buf_size = INIT_ALLOC_MIN_BUF_SIZE;
+
+void
+alloc_size(size_t size)
+{
+    ASSUME(alloc_min_buf_size >= INIT_ALLOC_MIN_BUF_SIZE);
+
+    if (size <= alloc_min_buf_size) {
+        return;
+    }
+
+    // Round up to the next power of 2
+    --size;
+    for (size_t i = 1; i < sizeof(size) * CHAR_BIT; i *= 2) {
+        size |= size >> i;
+    }
+    alloc_min_buf_size = size + 1;
+
+    ASSERT(alloc_min_buf_size != 0, "alloc_min_buf_size should not be 0");
+    ASSERT((alloc_min_buf_size & (alloc_min_buf_size - 1)) == 0,
+           "alloc_min_buf_size should be a power of 2");
+}
+
+struct mem_info {
+    size_t bytes;
+    int line;
+    const char *file;
+    char *pre_buf;
+    char *post_buf;
+};
+
+// The line might not always be exactly right, but it should be close enough to
+// identify where the error occured
+static void
+mem_fail(size_t bytes, int line, const char *file)
+{
+    ASSUME(line >= 0);
+    ASSUME(file != NULL);
+
+    fprintf(stderr, "Memory failure!\n\tLine: %i\n\tFile: %s\n\tBytes: %zu\n",
+            line, file, bytes);
+}
+
+static int alloc_freed = 0;
+
+// The registry is kept sorted by address, so that the block holding a pointer
+// can be found with a binary search. Most blocks are newer than the last one
+// and go at the end, so inserting is usually O(1), and removing is a memmove.
+
+// Each block is stamped with the number of allocations made before it, so that
+// a snapshot only has to remember that number to tell newer blocks from older
+// ones
+struct ptr_info {
+    void *ptr;
+    size_t bytes;
+    uint64_t generation;
+};
+
+// Guards ptr_infos, the generation, and the live bytes, so that memory can be
+// allocated and freed from any thread
+static pthread_mutex_t ptr_infos_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ptr_info *ptr_infos = NULL;
+static size_t n_ptr_infos = 0;
+static size_t cap_ptr_infos = 0;
+static uint64_t generation = 0;
+static size_t live_bytes = 0;
+
+// Counts the blocks removed from the registry, so that a cached lookup can
+// tell that its block might be gone
+static uint64_t removals = 0;
+
+// Returns the index of the first block that starts after ptr, so the block
+// that could hold ptr is the one before it. ptr_infos_lock must be held.
+static inline size_t
+search_ptr_infos(uintptr_t ptr)
+{
+    size_t lo = 0, hi = n_ptr_infos;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if ((uintptr_t)ptr_infos[mid].ptr <= ptr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Returns the index of the block holding ptr, or n_ptr_infos if there isn't
+// one. ptr_infos_lock must be held.
+static inline size_t
+lookup_ptr_info(const void *ptr)
+{
+    size_t i = search_ptr_infos((uintptr_t)ptr);
+
+    if (i == 0 || (uintptr_t)ptr - (uintptr_t)ptr_infos[i - 1].ptr
+                  >= ptr_infos[i - 1].bytes) {
+        return n_ptr_infos;
+    }
+
+    return i - 1;
+}
+
+// Shrinks the registry once it's less than half full. ptr_infos_lock must be
+// held.
+static inline int
+shrink_ptr_infos(void)
+{
+    struct ptr_info *tmp;
+
+    if (cap_ptr_infos <= 2 * (n_ptr_infos + 1)) {
+        return 0;
+    }
+
+    // Keep at least one entry, since realloc(ptr, 0) may free ptr
+    tmp = realloc(ptr_infos, (n_ptr_infos + 1) * sizeof(*ptr_infos));
+    if (ERR(tmp == NULL)) {
+        mem_fail((n_ptr_infos + 1) * sizeof(*ptr_infos), __LINE__, __FILE__);
+        return -1;
+    }
+    ptr_infos = tmp;
+
+    cap_ptr_infos = n_ptr_infos + 1;
+
+    return 0;
+}
+
+static inline int
+add_ptr_info(void *ptr, size_t bytes)
+{
+    struct ptr_info *tmp;
+    size_t i;
+
+    ASSUME(ptr != NULL);
+    ASSUME(bytes > 0);
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    if (n_ptr_infos == cap_ptr_infos) {
+        size_t cap;
+
+        cap = cap_ptr_infos == 0 ? 1 : cap_ptr_infos * 2;
+
+        tmp = realloc(ptr_infos, cap * sizeof(*ptr_infos));
+        if (ERR(tmp == NULL)) {
+            cap = cap_ptr_infos + 1;
+
+            tmp = realloc(ptr_infos, cap * sizeof(*ptr_infos));
+            if (ERR(tmp == NULL)) {
+                pthread_mutex_unlock(&ptr_infos_lock);
+                mem_fail(cap * sizeof(*ptr_infos), __LINE__, __FILE__);
+                return -1;
+            }
+        }
+        ptr_infos = tmp;
+
+        cap_ptr_infos = cap;
+    }
+
+    i = n_ptr_infos;
+    if (i != 0 && (uintptr_t)ptr_infos[i - 1].ptr > (uintptr_t)ptr) {
+        i = search_ptr_infos((uintptr_t)ptr);
+        memmove(ptr_infos + i + 1, ptr_infos + i,
+                (n_ptr_infos - i) * sizeof(*ptr_infos));
+    }
+
+    ptr_infos[i].ptr = ptr;
+    ptr_infos[i].bytes = bytes;
+    ptr_infos[i].generation = generation++;
+    ++n_ptr_infos;
+
+    // The block's struct mem_info is filled in before it's added
+    live_bytes += ((const struct mem_info *)ptr)->bytes;
+
+    pthread_mutex_unlock(&ptr_infos_lock);
+
+    return 0;
+}
+
+// Orders blocks by address, for add_ptr_infos
+static int
+compare_ptr_infos(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)((const struct ptr_info *)a)->ptr;
+    uintptr_t y = (uintptr_t)((const struct ptr_info *)b)->ptr;
+
+    return (x > y) - (x < y);
+}
+
+// Adds the n blocks in infos to the registry, taking the lock only once.
+// infos is sorted by address, and merged into the registry from the back.
+static int
+add_ptr_infos(struct ptr_info *infos, size_t n)
+{
+    struct ptr_info *tmp;
+    size_t i, j, k;
+
+    ASSUME(infos != NULL);
+
+    qsort(infos, n, sizeof(*infos), &compare_ptr_infos);
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    if (n > cap_ptr_infos - n_ptr_infos) {
+        size_t cap = cap_ptr_infos * 2;
+
+        if (cap < n_ptr_infos + n) {
+            cap = n_ptr_infos + n;
+        }
+
+        tmp = realloc(ptr_infos, cap * sizeof(*ptr_infos));
+        if (ERR(tmp == NULL)) {
+            pthread_mutex_unlock(&ptr_infos_lock);
+            mem_fail(cap * sizeof(*ptr_infos), __LINE__, __FILE__);
+            return -1;
+        }
+        ptr_infos = tmp;
+
+        cap_ptr_infos = cap;
+    }
+
+    for (j = 0; j < n; ++j) {
+        infos[j].generation = generation++;
+        live_bytes += ((const struct mem_info *)infos[j].ptr)->bytes;
+    }
+
+    i = n_ptr_infos;
+    k = n_ptr_infos + n;
+    while (j > 0) {
+        if (i > 0 && (uintptr_t)ptr_infos[i - 1].ptr
+                     > (uintptr_t)infos[j - 1].ptr) {
+            ptr_infos[--k] = ptr_infos[--i];
+        } else {
+            ptr_infos[--k] = infos[--j];
+        }
+    }
+    n_ptr_infos += n;
+
+    pthread_mutex_unlock(&ptr_infos_lock);
+
+    return 0;
+}
+
+static inline void *
+find_ptr_info(const void *ptr)
+{
+    void *found;
+    size_t i;
+
+    ASSUME(ptr != NULL);
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    i = lookup_ptr_info(ptr);
+    found = i == n_ptr_infos ? NULL : ptr_infos[i].ptr;
+
+    pthread_mutex_unlock(&ptr_infos_lock);
+
+    // NULL if the pointer wasn't found
+    return found;
+}
+
+static inline int
+remove_ptr_info(const void *ptr)
+{
+    size_t i;
+    int err;
+
+    ASSUME(ptr != NULL);
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    i = lookup_ptr_info(ptr);
+    if (ERR(i == n_ptr_infos || ptr_infos[i].ptr != ptr)) {
+        pthread_mutex_unlock(&ptr_infos_lock);
+
+        ASSUME_UNREACHABLE();
+
+        return -1;
+    }
+
+    live_bytes -= ((const struct mem_info *)ptr)->bytes;
+    __atomic_store_n(&removals, removals + 1, __ATOMIC_RELEASE);
+
+    memmove(ptr_infos + i, ptr_infos + i + 1,
+            (n_ptr_infos - i - 1) * sizeof(*ptr_infos));
+    --n_ptr_infos;
+
+    err = shrink_ptr_infos();
+
+    pthread_mutex_unlock(&ptr_infos_lock);
+
+    return err;
+}
+
+// Orders pointers by address, for take_ptr_infos
+static int
+compare_ptrs(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Removes the blocks holding each of the n sorted pointers from the registry in
+// one merge pass, and stores the start of each block in owners. A pointer that
+// isn't in any block, or is in the same block as an earlier pointer, is left
+// NULL.
+static void
+take_ptr_infos(const void *const *ptrs, size_t n, char **owners)
+{
+    size_t kept = 0, j = 0;
+
+    ASSUME(ptrs != NULL);
+    ASSUME(owners != NULL);
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    for (size_t i = 0; i < n_ptr_infos; ++i) {
+        uintptr_t begin = (uintptr_t)ptr_infos[i].ptr;
+
+        // Pointers before this block are in no block, or in the same block as
+        // the pointer before them
+        while (j < n && (uintptr_t)ptrs[j] < begin) {
+            ++j;
+        }
+
+        if (j < n && (uintptr_t)ptrs[j] - begin < ptr_infos[i].bytes) {
+            owners[j++] = ptr_infos[i].ptr;
+            live_bytes -= ((const struct mem_info *)ptr_infos[i].ptr)->bytes;
+            continue;
+        }
+
+        ptr_infos[kept++] = ptr_infos[i];
+    }
+
+    if (kept != n_ptr_infos) {
+        __atomic_store_n(&removals, removals + n_ptr_infos - kept,
+                         __ATOMIC_RELEASE);
+        n_ptr_infos = kept;
+        shrink_ptr_infos();
+    }
+
+    pthread_mutex_unlock(&ptr_infos_lock);
+}
+
+static inline void
+free_bufs(const struct mem_info *mem_info)
+{
+    ASSUME(mem_info != NULL);
+
+    free(mem_info->pre_buf);
+    free(mem_info->post_buf);
+}
+
+static void
+alloc_exit(void)
+{
+    if (!alloc_freed) {
+        alloc_freed = 1;
+        alloc_free();
+    }
+}
+
+int
+alloc_init(void)
+{
+    return atexit(&alloc_exit);
+}
+
+int
+alloc_free(void)
+{
+    alloc_freed = 1;
+
+    // The background check can't be left scanning blocks as they're freed
+    alloc_check_stop();
+
+    for (size_t i = 0; i < n_ptr_infos; ++i) {
+        const struct mem_info *mem_info =
+            (const struct mem_info *)ptr_infos[i].ptr;
+
+        fprintf(stderr, "Memory not freed!\n\tLine: %i\n\tFile: %s\n"
+                "\tBytes: %zu\n\tPointer: %p\n",
+                mem_info->line, mem_info->file, mem_info->bytes,
+                (const void *)mem_info);
+
+        free_bufs(mem_info);
+        FREE(ptr_infos[i].ptr);
+    }
+
+    free(ptr_infos);
+
+    return n_ptr_infos != 0;
+}
+
+void
+alloc_snapshot(struct alloc_snapshot *snapshot)
+{
+    ASSUME(snapshot != NULL);
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    snapshot->generation = generation;
+    snapshot->blocks = n_ptr_infos;
+    snapshot->bytes = live_bytes;
+
+    pthread_mutex_unlock(&ptr_infos_lock);
+}
+
+struct diff_site {
+    const char *file;
+    int line;
+    size_t blocks;
+    size_t bytes;
+};
+
+static int
+compare_site_places(const void *a, const void *b)
+{
+    const struct diff_site *x = a, *y = b;
+    int cmp;
+
+    cmp = x->file == y->file ? 0 : strcmp(x->file, y->file);
+
+    return cmp != 0 ? cmp : (x->line > y->line) - (x->line < y->line);
+}
+
+static int
+compare_site_bytes(const void *a, const void *b)
+{
+    const struct diff_site *x = a, *y = b;
+
+    // Most bytes first
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+int
+alloc_diff(const struct alloc_snapshot *a, const struct alloc_snapshot *b,
+           FILE *stream)
+{
+    struct diff_site *sites;
+    size_t n_sites, n_blocks, n_bytes;
+    uint64_t end;
+
+    ASSUME(a != NULL);
+    ASSUME(stream != NULL);
+    ASSUME(b == NULL || a->generation <= b->generation);
+
+    end = b == NULL ? UINT64_MAX : b->generation;
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    n_blocks = 0;
+    for (size_t i = 0; i < n_ptr_infos; ++i) {
+        n_blocks += ptr_infos[i].generation >= a->generation
+            && ptr_infos[i].generation < end;
+    }
+
+    sites = NULL;
+    if (n_blocks != 0) {
+        sites = malloc(n_blocks * sizeof(*sites));
+        if (ERR(sites == NULL)) {
+            pthread_mutex_unlock(&ptr_infos_lock);
+            mem_fail(n_blocks * sizeof(*sites), __LINE__, __FILE__);
+            return -1;
+        }
+    }
+
+    // Copy out what's needed, so the lock is only held for one pass
+    n_sites = 0;
+    n_bytes = 0;
+    for (size_t i = 0; i < n_ptr_infos; ++i) {
+        const struct mem_info *mem_info;
+
+        if (ptr_infos[i].generation < a->generation
+            || ptr_infos[i].generation >= end) {
+            continue;
+        }
+
+        mem_info = (const struct mem_info *)ptr_infos[i].ptr;
+        sites[n_sites].file = mem_info->file;
+        sites[n_sites].line = mem_info->line;
+        sites[n_sites].blocks = 1;
+        sites[n_sites].bytes = mem_info->bytes;
+        n_bytes += mem_info->bytes;
+        ++n_sites;
+    }
+
+    pthread_mutex_unlock(&ptr_infos_lock);
+
+    ASSUME(n_sites == n_blocks);
+
+    // Merge the blocks from each place, then put the biggest places first
+    if (n_sites != 0) {
+        size_t n = 0;
+
+        qsort(sites, n_sites, sizeof(*sites), &compare_site_places);
+
+        for (size_t i = 1; i < n_sites; ++i) {
+            if (compare_site_places(&sites[n], &sites[i]) == 0) {
+                sites[n].blocks += sites[i].blocks;
+                sites[n].bytes += sites[i].bytes;
+            } else {
+                sites[++n] = sites[i];
+            }
+        }
+        n_sites = n + 1;
+
+        qsort(sites, n_sites, sizeof(*sites), &compare_site_bytes);
+    }
+
+    fprintf(stream, "Memory allocated since snapshot!\n\tBlocks: %zu\n"
+            "\tBytes: %zu\n",
+            n_blocks, n_bytes);
+    for (size_t i = 0; i < n_sites; ++i) {
+        fprintf(stream, "\t%s:%i: %zu blocks, %zu bytes\n",
+                sites[i].file, sites[i].line, sites[i].blocks, sites[i].bytes);
+    }
+
+    free(sites);
+
+    return ferror(stream) != 0 ? -1 : 0;
+}
+
+// Reports the block and returns nonzero if either of its canaries has been
+// overwritten. ptr_infos_lock must be held, so the block can't be freed.
+static int
+check_canaries(const struct mem_info *mem_info)
+{
+    const char *p, *problem;
+    size_t pre_len;
+
+    ASSUME(mem_info != NULL);
+
+    p = (const char *)(mem_info + 1);
+    pre_len = strlen(mem_info->pre_buf);
+
+    if (ERR(memcmp(p, mem_info->pre_buf, pre_len) != 0)) {
+        problem = "Bytes before the block overwritten";
+    } else if (ERR(memcmp(p + pre_len + mem_info->bytes, mem_info->post_buf,
+                          strlen(mem_info->post_buf)) != 0)) {
+        problem = "Bytes after the block overwritten";
+    } else {
+        return 0;
+    }
+
+    fprintf(stderr, "Memory corruption found by scan!\n"
+            "\tLine allocated: %i\n\tFile allocated: %s\n"
+            "\tBytes: %zu\n\tPointer: %p\n\tProblem: %s\n",
+            mem_info->line, mem_info->file, mem_info->bytes,
+            (const void *)(p + pre_len), problem);
+
+    return -1;
+}
+
+size_t
+alloc_check_all(void)
+{
+    size_t corrupted = 0;
+
+    pthread_mutex_lock(&ptr_infos_lock);
+
+    for (size_t i = 0; i < n_ptr_infos; ++i) {
+        corrupted += check_canaries(ptr_infos[i].ptr) != 0;
+    }
+
+    pthread_mutex_unlock(&ptr_infos_lock);
 
-static inline int
-add_ptr_info(const void *ptr, size_t bytes)
+    return corrupted;
+}
+
+// The bytes of the block that the thread last found with alloc_check_range,
+// which are valid while no block has been removed since
+static __thread uintptr_t range_begin = UINTPTR_MAX;
+static __thread uintptr_t range_end = 0;
+static __thread uint64_t range_removals = 0;
+
+int
+alloc_check_range(const void *ptr, size_t len)
 {
-    struct ptr_info *tmp;
+    uintptr_t p = (uintptr_t)ptr;
+    const struct mem_info *mem_info;
+    size_t i;
 
-    ASSUME(ptr != NULL);
-    ASSUME(bytes > 0);
+    if (LIKELY(p >= range_begin && p <= range_end && len <= range_end - p
+               && __atomic_load_n(&removals, __ATOMIC_ACQUIRE)
+                  == range_removals)) {
+        return 0;
+    }
 
-    if (n_ptr_infos == cap_ptr_infos) {
-        size_t cap;
+    pthread_mutex_lock(&ptr_infos_lock);
 
-        cap = cap_ptr_infos == 0 ? 1 : cap_ptr_infos * 2;
+    i = lookup_ptr_info(ptr);
+    if (ERR(i == n_ptr_infos)) {
+        pthread_mutex_unlock(&ptr_infos_lock);
 
-        tmp = REALLOC(ptr_infos, cap * sizeof(*ptr_infos));
-        if (ERR(tmp == NULL)) {
-            cap = cap_ptr_infos + 1;
+        fprintf(stderr, "Range outside of any block!\n\tPointer: %p\n"
+                "\tLength: %zu\n",
+                ptr, len);
 
-            tmp = REALLOC(ptr_infos, cap * sizeof(*ptr_infos));
-            if (ERR(tmp == NULL)) {
-                mem_fail(cap * sizeof(*ptr_infos), __LINE__, __FILE__);
-                return -1;
-            }
-        }
-        ptr_infos = tmp;
+        return -1;
+    }
 
-        cap_ptr_infos = cap;
+    mem_info = ptr_infos[i].ptr;
+    range_begin = (uintptr_t)(mem_info + 1) + strlen(mem_info->pre_buf);
+    range_end = range_begin + mem_info->bytes;
+    range_removals = removals;
+
+    if (LIKELY(p >= range_begin && p <= range_end && len <= range_end - p)) {
+        pthread_mutex_unlock(&ptr_infos_lock);
+        return 0;
     }
 
-    ptr_infos[n_ptr_infos].ptr = ptr;
-    ptr_infos[n_ptr_infos].bytes = bytes;
-    ++n_ptr_infos;
+    // The range hits the block's canaries or header. Report it before
+    // unlocking, while the block can't be freed.
+    fprintf(stderr, "Range outside of block!\n"
+            "\tLine allocated: %i\n\tFile allocated: %s\n"
+            "\tBytes: %zu\n\tPointer: %p\n\tOffset: %td\n\tLength: %zu\n",
+            mem_info->line, mem_info->file, mem_info->bytes,
+            (const void *)range_begin, (ptrdiff_t)(p - range_begin), len);
 
-    return 0;
+    pthread_mutex_unlock(&ptr_infos_lock);
+
+    return -1;
 }
 
-static inline const void *
-find_ptr_info(const void *ptr)
+// Where the next alloc_check_step starts, guarded by ptr_infos_lock
+static size_t check_cursor = 0;
+
+size_t
+alloc_check_step(size_t n)
 {
-    ASSUME(ptr != NULL);
+    size_t corrupted = 0;
 
-    for (size_t i = 0; i < n_ptr_infos; ++i) {
-        for (const char *p = ptr_infos[i].ptr, *p_end = p + ptr_infos[i].bytes;
-             p != p_end; ++p) {
+    pthread_mutex_lock(&ptr_infos_lock);
 
-            if (p == ptr) {
-                return ptr_infos[i].ptr;
-            }
+    if (n > n_ptr_infos) {
+        n = n_ptr_infos;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (check_cursor >= n_ptr_infos) {
+            check_cursor = 0;
         }
+
+        corrupted += check_canaries(ptr_infos[check_cursor++].ptr) != 0;
     }
 
-    // Pointer not found
-    return NULL;
+    pthread_mutex_unlock(&ptr_infos_lock);
+
+    return corrupted;
 }
 
-static inline int
-remove_ptr_info(const void *ptr)
+// Guards everything about the background check thread
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t check_thread;
+static int check_running = 0;
+static int check_stopping = 0;
+static size_t check_n = 0;
+static unsigned check_interval = 0;
+static size_t check_found = 0;
+
+static void *
+check_thread_main(void *arg)
 {
-    ASSUME(ptr != NULL);
+    UNUSED(arg);
 
-    for (size_t i = 0; i < n_ptr_infos; ++i) {
-        if (ptr != ptr_infos[i].ptr) {
-            continue;
-        }
+    pthread_mutex_lock(&check_lock);
 
-        // The order doesn't really matter, so just replace this with the
-        // last ptr_info and remove the last
-        ptr_infos[i] = ptr_infos[--n_ptr_infos];
+    // Always check once, even if stopped straight away
+    for (;;) {
+        struct timespec deadline;
+        size_t found;
 
-        if (cap_ptr_infos > 2 * (n_ptr_infos + 1)) {
-            struct ptr_info *tmp;
+        pthread_mutex_unlock(&check_lock);
+        found = alloc_check_step(check_n);
+        pthread_mutex_lock(&check_lock);
 
-            tmp = REALLOC(ptr_infos, n_ptr_infos * sizeof(*ptr_infos));
-            if (ERR(tmp == NULL)) {
-                mem_fail(n_ptr_infos * sizeof(*ptr_infos), __LINE__, __FILE__);
-                return -1;
-            }
-            ptr_infos = tmp;
+        check_found += found;
+        if (found != 0 || check_stopping) {
+            break;
+        }
 
-            cap_ptr_infos = n_ptr_infos;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += check_interval / 1000;
+        deadline.tv_nsec += (long)(check_interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
         }
 
-        return 0;
+        while (!check_stopping
+               && pthread_cond_timedwait(&check_cond, &check_lock, &deadline)
+                  != ETIMEDOUT) {
+        }
+
+        if (check_stopping) {
+            break;
+        }
     }
 
-    ASSUME_UNREACHABLE();
+    pthread_mutex_unlock(&check_lock);
 
-    return -1;
+    return NULL;
 }
 
-static void
-alloc_exit(void)
+int
+alloc_check_start(size_t n, unsigned interval_ms)
 {
-    if (!alloc_freed) {
-        alloc_freed = 1;
-        alloc_free();
+    ASSUME(n > 0);
+
+    pthread_mutex_lock(&check_lock);
+
+    if (ERR(check_running)) {
+        pthread_mutex_unlock(&check_lock);
+        return -1;
     }
-}
 
-int
-alloc_init(void)
-{
-    return atexit(&alloc_exit);
+    check_n = n;
+    check_interval = interval_ms;
+    check_found = 0;
+    check_stopping = 0;
+
+    if (ERR(pthread_create(&check_thread, NULL, &check_thread_main, NULL)
+            != 0)) {
+        pthread_mutex_unlock(&check_lock);
+        return -1;
+    }
+    check_running = 1;
+
+    pthread_mutex_unlock(&check_lock);
+
+    return 0;
 }
 
-int
-alloc_free(void)
+size_t
+alloc_check_stop(void)
 {
-    alloc_freed = 1;
-
-    for (size_t i = 0; i < n_ptr_infos; ++i) {
-        const struct mem_info *mem_info =
-            (const struct mem_info *)ptr_infos[i].ptr;
+    size_t found;
 
-        fprintf(stderr, "Memory not freed!\n\tLine: %i\n\tFile: %s\n"
-                "\tBytes: %zu\n\tPointer: %p\n",
-                mem_info->line, mem_info->file, mem_info->bytes,
-                (const void *)mem_info);
+    pthread_mutex_lock(&check_lock);
 
-        FREE(ptr_infos[i].ptr);
+    if (!check_running) {
+        found = check_found;
+        pthread_mutex_unlock(&check_lock);
+        return found;
     }
 
-    FREE(ptr_infos);
+    check_stopping = 1;
+    pthread_cond_signal(&check_cond);
 
-    return n_ptr_infos != 0;
+    pthread_mutex_unlock(&check_lock);
+
+    pthread_join(check_thread, NULL);
+
+    pthread_mutex_lock(&check_lock);
+    check_running = 0;
+    found = check_found;
+    pthread_mutex_unlock(&check_lock);
+
+    return found;
 }
 
-static inline const char *
+static inline char *
 get_buf(size_t len)
 {
     char *str;
@@ -243,20 +2289,22 @@ get_buf(size_t len)
     return str;
 }
 
+// Allocates a block for n bytes and fills in its struct mem_info and canaries,
+// but doesn't add it to the registry. Stores the block and its size in info,
+// and returns the caller's pointer into it.
 static void *
-alloc_d(size_t n, int clear, int line, const char *file)
+new_block(size_t n, int clear, int line, const char *file,
+          struct ptr_info *info)
 {
     char *ptr, *tmp;
     uintptr_t align;
     size_t size, buf_size, remainder;
     struct mem_info *mem_info;
 
+    ASSUME(n > 0);
     ASSUME(line >= 0);
     ASSUME(file != NULL);
-
-    if (n == 0) {
-        return NULL;
-    }
+    ASSUME(info != NULL);
 
     ptr = clear ? CALLOC(n, 1) : MALLOC(n);
     if (ERR(ptr == NULL)) {
@@ -294,11 +2342,6 @@ alloc_d(size_t n, int clear, int line, const char *file)
         memset(ptr + n, 0, size - n);
     }
 
-    if (add_ptr_info(ptr, size) != 0) {
-        FREE(ptr);
-        return NULL;
-    }
-
     mem_info = (struct mem_info *)ptr;
     mem_info->bytes = n;
     mem_info->line = line;
@@ -306,25 +2349,76 @@ alloc_d(size_t n, int clear, int line, const char *file)
     mem_info->pre_buf = get_buf(buf_size);
     mem_info->post_buf = get_buf(buf_size);
 
-    ptr += sizeof(struct mem_info);
-    memcpy(ptr, mem_info->pre_buf, buf_size);
-    memcpy(ptr + buf_size + n, mem_info->post_buf, buf_size);
+    memcpy(ptr + sizeof(struct mem_info), mem_info->pre_buf, buf_size);
+    memcpy(ptr + sizeof(struct mem_info) + buf_size + n, mem_info->post_buf,
+           buf_size);
+
+    info->ptr = ptr;
+    info->bytes = size;
+
+    return ptr + sizeof(struct mem_info) + buf_size;
+}
+
+// Frees a block made by new_block that isn't in the registry
+static void
+free_block(const struct ptr_info *info)
+{
+    free_bufs(info->ptr);
+    FREE(info->ptr);
+}
+
+static void *
+alloc_d(size_t n, int clear, int line, const char *file)
+{
+    void *ptr;
+    struct ptr_info info;
+    TRACE_SCOPE("alloc_d");
+
+    ASSUME(line >= 0);
+    ASSUME(file != NULL);
+
+    if (n == 0) {
+        return NULL;
+    }
+
+    ptr = new_block(n, clear, line, file, &info);
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    // Only add the block once it's filled in, since alloc_diff may read it
+    // from another thread as soon as it's in the registry
+    if (add_ptr_info(info.ptr, info.bytes) != 0) {
+        free_block(&info);
+        return NULL;
+    }
 
-    return ptr + buf_size;
+    return ptr;
 }
 
 void *
 malloc_d(size_t n, int line, const char *file)
 {
+    void *ptr;
+
     ASSUME(line >= 0);
     ASSUME(file != NULL);
 
-    return alloc_d(n, 0, line, file);
+    STAT(mallocs, n);
+
+    ptr = alloc_d(n, 0, line, file);
+    if (LIKELY(ptr != NULL)) {
+        TRACE_ALLOC(MALLOC, ptr, NULL, n);
+    }
+
+    return ptr;
 }
 
 void *
 calloc_d(size_t n, size_t size, int line, const char *file)
 {
+    void *ptr;
+
     ASSUME(line >= 0);
     ASSUME(file != NULL);
 
@@ -333,21 +2427,36 @@ calloc_d(size_t n, size_t size, int line, const char *file)
     ASSERT(n <= n * size, "overflow has occcured");
     ASSERT(size <= n * size, "overflow has occured");
 
-    return alloc_d(n * size, 1, line, file);
+    STAT(callocs, n * size);
+
+    ptr = alloc_d(n * size, 1, line, file);
+    if (LIKELY(ptr != NULL)) {
+        TRACE_ALLOC(CALLOC, ptr, NULL, n * size);
+    }
+
+    return ptr;
 }
 
 void *
 realloc_d(void *ptr, size_t n, int line, const char *file)
 {
-    const char *old_ptr;
+    char *old_ptr;
     char *new_ptr;
     const struct mem_info *mem_info;
 
     ASSUME(line >= 0);
     ASSUME(file != NULL);
 
+    STAT(reallocs, n);
+
+    // Call alloc_d directly rather than malloc_d so this is only counted once
     if (ptr == NULL) {
-        return malloc_d(n, line, file);
+        new_ptr = alloc_d(n, 0, line, file);
+        if (LIKELY(new_ptr != NULL)) {
+            TRACE_ALLOC(REALLOC, new_ptr, NULL, n);
+        }
+
+        return new_ptr;
     }
 
     if (ERR(n == 0)) {
@@ -384,44 +2493,35 @@ realloc_d(void *ptr, size_t n, int line, const char *file)
         return NULL;
     }
 
-    new_ptr = malloc_d(n, line, file);
+    new_ptr = alloc_d(n, 0, line, file);
     if (ERR(new_ptr == NULL)) {
-        // mem_fail called in malloc_d
+        // mem_fail called in alloc_d
         return NULL;
     }
 
     memcpy(new_ptr, ptr, mem_info->bytes < n ? mem_info->bytes : n);
 
+    TRACE_ALLOC(REALLOC, new_ptr, ptr, n);
+
     remove_ptr_info(old_ptr);
+    free_bufs(mem_info);
     FREE(old_ptr);
 
     return new_ptr;
 }
 
+// Checks that ptr is the start of the block at ptr_info, and that the block's
+// canaries are intact, returning nonzero if not
 static int
-do_free_d(void *ptr, int line, const char *file)
+check_block(const void *ptr, const char *ptr_info, int line, const char *file)
 {
     int err;
-    const char *ptr_info;
     const char *p;
     const struct mem_info *mem_info;
     size_t pre_len, post_len;
 
-    ASSUME(line >= 0);
-    ASSUME(file != NULL);
-
-    if (ptr == NULL) {
-        return 0;
-    }
-
-    ptr_info = find_ptr_info(ptr);
-    if (ERR(ptr_info == NULL)) {
-        fprintf(stderr, "Freeing unallocated pointer!\n\tLine: %i\n"
-                "\tFile: %s\n\tPointer: %p\n",
-                line, file, ptr);
-
-        return -1;
-    }
+    ASSUME(ptr != NULL);
+    ASSUME(ptr_info != NULL);
 
     mem_info = (const struct mem_info *)ptr_info;
     p = ptr_info + sizeof(struct mem_info);
@@ -475,7 +2575,38 @@ do_free_d(void *ptr, int line, const char *file)
         }
     }
 
+    return err;
+}
+
+static int
+do_free_d(void *ptr, int line, const char *file)
+{
+    int err;
+    char *ptr_info;
+
+    ASSUME(line >= 0);
+    ASSUME(file != NULL);
+
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    STAT(frees, 0);
+    TRACE_ALLOC(FREE, ptr, NULL, 0);
+
+    ptr_info = find_ptr_info(ptr);
+    if (ERR(ptr_info == NULL)) {
+        fprintf(stderr, "Freeing unallocated pointer!\n\tLine: %i\n"
+                "\tFile: %s\n\tPointer: %p\n",
+                line, file, ptr);
+
+        return -1;
+    }
+
+    err = check_block(ptr, ptr_info, line, file);
+
     remove_ptr_info(ptr_info);
+    free_bufs((const struct mem_info *)ptr_info);
     FREE(ptr_info);
 
     return err;
@@ -487,6 +2618,116 @@ free_d(void *ptr, int line, const char *file)
     do_free_d(ptr, line, file);
 }
 
+int
+malloc_batch_d(size_t count, size_t size, void **ptrs, int line,
+               const char *file)
+{
+    struct ptr_info *infos;
+    size_t made;
+
+    ASSUME(ptrs != NULL || count == 0);
+    ASSUME(line >= 0);
+    ASSUME(file != NULL);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    STAT_BATCH(mallocs, count, count * size);
+
+    // Like jmalloc(0), which gives NULL
+    if (size == 0) {
+        return -1;
+    }
+
+    infos = calloc(count, sizeof(*infos));
+    if (ERR(infos == NULL)) {
+        mem_fail(count * sizeof(*infos), __LINE__, __FILE__);
+        return -1;
+    }
+
+    // Make every block first, so that they can all be added to the registry
+    // under one lock
+    for (made = 0; made < count; ++made) {
+        ptrs[made] = new_block(size, 0, line, file, &infos[made]);
+        if (ERR(ptrs[made] == NULL)) {
+            break;
+        }
+    }
+
+    if (made < count || add_ptr_infos(infos, made) != 0) {
+        for (size_t i = 0; i < made; ++i) {
+            free_block(&infos[i]);
+        }
+
+        free(infos);
+        return -1;
+    }
+
+    free(infos);
+
+    for (size_t i = 0; i < count; ++i) {
+        TRACE_ALLOC(MALLOC, ptrs[i], NULL, size);
+    }
+
+    return 0;
+}
+
+void
+free_batch_d(void **ptrs, size_t count, int line, const char *file)
+{
+    char **owners;
+    size_t first;
+
+    ASSUME(ptrs != NULL || count == 0);
+    ASSUME(line >= 0);
+    ASSUME(file != NULL);
+
+    // Sorting puts any NULLs first, and lets take_ptr_infos binary search
+    qsort(ptrs, count, sizeof(*ptrs), &compare_ptrs);
+
+    for (first = 0; first < count && ptrs[first] == NULL; ++first) {
+    }
+    ptrs += first;
+    count -= first;
+
+    if (count == 0) {
+        return;
+    }
+
+    owners = calloc(count, sizeof(*owners));
+    if (ERR(owners == NULL)) {
+        mem_fail(count * sizeof(*owners), __LINE__, __FILE__);
+
+        for (size_t i = 0; i < count; ++i) {
+            free_d(ptrs[i], line, file);
+        }
+
+        return;
+    }
+
+    take_ptr_infos((const void *const *)ptrs, count, owners);
+
+    for (size_t i = 0; i < count; ++i) {
+        STAT(frees, 0);
+        TRACE_ALLOC(FREE, ptrs[i], NULL, 0);
+
+        if (ERR(owners[i] == NULL)) {
+            fprintf(stderr, "Freeing unallocated pointer!\n\tLine: %i\n"
+                    "\tFile: %s\n\tPointer: %p\n",
+                    line, file, ptrs[i]);
+
+            continue;
+        }
+
+        check_block(ptrs[i], owners[i], line, file);
+        free_bufs((const struct mem_info *)owners[i]);
+        FREE(owners[i]);
+    }
+
+    free(owners);
+}
+
 #endif
 
 #ifdef XMALLOC
@@ -503,6 +2744,8 @@ xmalloc(size_t n)
 
     ASSUME(n > 0);
 
+    STAT(mallocs, n);
+
     ptr = MALLOC(n);
     if (ERR(ptr == NULL)) {
         fputs(XMALLOC_ERR_MSG, stderr);
@@ -520,6 +2763,8 @@ xcalloc(size_t n, size_t size)
     ASSUME(n > 0);
     ASSUME(size > 0);
 
+    STAT(callocs, n * size);
+
     ptr = CALLOC(n, size);
     if (ERR(ptr == NULL)) {
         fputs(XCALLOC_ERR_MSG, stderr);
@@ -537,6 +2782,8 @@ xrealloc(void *ptr, size_t n)
 {
     ASSUME(n > 0);
 
+    STAT(reallocs, n);
+
     ptr = REALLOC(ptr, n);
     if (ERR(ptr == NULL)) {
         fputs(XREALLOC_ERR_MSG, stderr);
@@ -3,40 +3,276 @@
 
 #include "main.h"
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+/* A set of allocation functions, each of which is passed ctx as its first
+ * argument. They behave like the standard functions of the same name;
+ * usable_size returns the number of bytes usable at ptr, which may be more
+ * than were requested. */
+struct allocator {
+    void *(*malloc)(void *ctx, size_t n);
+    void *(*calloc)(void *ctx, size_t n, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t n);
+    void (*free)(void *ctx, void *ptr);
+    size_t (*usable_size)(void *ctx, void *ptr);
+    void *ctx;
+};
+
+/* The system malloc. */
+extern const struct allocator alloc_system;
+
 #ifdef JEMALLOC
-#include <jemalloc/jemalloc.h>
+
+/* jemalloc, built with the je prefix. */
+extern const struct allocator alloc_jemalloc;
+
 #endif
 
+/* The allocator that the j*alloc macros allocate through. It defaults to
+ * alloc_jemalloc when built with JEMALLOC, and alloc_system otherwise. */
+extern const struct allocator *alloc_allocator;
+
+/* Makes the j*alloc macros allocate through allocator. This must be called
+ * before anything is allocated, since memory must be freed by the allocator
+ * that allocated it. */
+void
+alloc_set_allocator(const struct allocator *allocator);
+
+/* Returns the built in allocator called name ("system", or "jemalloc" when
+ * built with JEMALLOC), or NULL if there isn't one. This allows the allocator
+ * to be chosen at startup, e.g. from the environment. */
+const struct allocator *
+alloc_find_allocator(const char *name);
+
+/* The size of a transparent huge page on the platforms this is built for. */
+#define ALLOC_HUGE_PAGE ((size_t)2 << 20)
+
+/* Advice about how a buffer will be used, for alloc_advise. */
+enum alloc_advice {
+    /* The buffer is large and will be scanned, so it should be backed by huge
+     * pages to save TLB misses. */
+    ALLOC_ADVICE_HUGE,
+    /* The buffer's contents aren't needed, so its memory can be given back to
+     * the system. It reads as zeros when touched again. */
+    ALLOC_ADVICE_RELEASE
+};
+
+/* Passes advice about [ptr, ptr + bytes), which must be inside one allocated
+ * block, on to the kernel. Only whole pages are advised (whole huge pages for
+ * ALLOC_ADVICE_HUGE), so the ends of the range may be left alone. Returns 0
+ * on success, nonzero on failure. Advice the system doesn't support is
+ * ignored. */
+int
+alloc_advise(void *ptr, size_t bytes, enum alloc_advice advice);
+
 #ifndef NDEBUG
 
 #define XMALLOC
 
 #endif
 
+#ifdef ALLOC_STATS
+
+/* Counts of the calls made through the j*alloc macros, and the total bytes
+ * requested by them. Frees of NULL aren't counted. maps and unmaps count the
+ * memory that modules map for themselves rather than allocate (see
+ * alloc_stats_map), and those mappings' bytes are counted in bytes too. */
+struct alloc_stats {
+    size_t mallocs;
+    size_t callocs;
+    size_t reallocs;
+    size_t frees;
+    size_t maps;
+    size_t unmaps;
+    size_t bytes;
+};
+
+/* Stores the current counts in *stats. The counts only ever increase, so the
+ * difference of two calls measures the code run between them. */
+void
+alloc_stats(struct alloc_stats *stats);
+
+/* Counts a mapping of bytes made outside the j*alloc macros, or the unmapping
+ * of one. */
+void
+alloc_stats_map(size_t bytes);
+
+void
+alloc_stats_unmap(void);
+
+#else
+
+static inline void
+alloc_stats_map(size_t bytes)
+{
+    UNUSED(bytes);
+}
+
+static inline void
+alloc_stats_unmap(void)
+{
+}
+
+#endif
+
+#ifdef ALLOC_TRACE
+
+/* Starts writing every allocation made through the j*alloc macros to the file
+ * at path, in the format described in alloc_trace.h. Each thread buffers its
+ * own events, so tracing doesn't take a lock per allocation. Returns 0 on
+ * success, nonzero on failure. */
+int
+alloc_trace_start(const char *path);
+
+/* Flushes every thread's buffered events and stops tracing. Other threads
+ * should not be allocating while this is called. Returns 0 on success, nonzero
+ * on failure. */
+int
+alloc_trace_stop(void);
+
+#endif
+
+#if defined(NDEBUG) && defined(ALLOC_HARDEN)
+
+/* The default number of freed blocks each thread holds back from the allocator
+ * in ALLOC_HARDEN builds, and the most it can be set to. */
+#ifndef ALLOC_QUARANTINE
+#define ALLOC_QUARANTINE 8
+#endif
+#define ALLOC_QUARANTINE_MAX 64
+
+/* Sets the number of freed blocks each thread holds back from the allocator,
+ * at most ALLOC_QUARANTINE_MAX. A quarantined block can't be handed out again
+ * right away, so a use after free is more likely to be caught by its cookie
+ * than to corrupt a new allocation. 0 turns the quarantine off, which takes
+ * about half of ALLOC_HARDEN's cost off a malloc/free pair. This should be
+ * called at startup. */
+void
+alloc_quarantine(size_t n);
+
+#endif
+
+#if defined(NDEBUG) && defined(ALLOC_TCACHE)
+
+/* In ALLOC_TCACHE builds, blocks of up to ALLOC_TCACHE_MAX bytes are freed to
+ * a list kept by each thread, and allocated from it again without touching the
+ * allocator. Each list holds at most 64 blocks or 32 KB. When one fills up,
+ * half of it is moved to a shared depot, from which any thread can take it
+ * back in one go. */
+#define ALLOC_TCACHE_MAX 4096
+
+/* Counts of the cacheable allocations served from a thread's list (hits) and
+ * from the allocator (misses), and of the batches moved from the depot to a
+ * thread (refills) and back (flushes). */
+struct alloc_tcache_stats {
+    size_t hits;
+    size_t misses;
+    size_t refills;
+    size_t flushes;
+};
+
+/* Stores the counts summed over every thread, including ones that have
+ * exited, in *stats. */
+void
+alloc_tcache_stats(struct alloc_tcache_stats *stats);
+
+/* Moves the blocks cached by the calling thread to the depot. This is done
+ * automatically when a thread exits, but a thread that goes idle for a while
+ * can call it to give its blocks to the other threads. */
+void
+alloc_tcache_flush(void);
+
+/* Frees every block in the depot back to the allocator. */
+void
+alloc_tcache_trim(void);
+
+#endif
+
+#if defined(NDEBUG) && (defined(ALLOC_STATS) || defined(ALLOC_TRACE) \
+                        || defined(ALLOC_HARDEN) || defined(ALLOC_TCACHE))
+
+/* The j*alloc macros go through the wrapper functions in alloc.c. */
+#define ALLOC_WRAPPED
+
+#endif
+
+/* jmalloc_batch(count, size, ptrs) allocates count blocks of size bytes each
+ * with jmalloc, and stores them in ptrs. Returns 0 on success; on failure,
+ * nothing is left allocated and nonzero is returned. In debug builds the whole
+ * batch is added to the registry under one lock.
+ *
+ * jfree_batch(ptrs, count) frees count blocks with jfree, skipping NULLs. In
+ * debug builds the pointers are sorted by address, which leaves ptrs
+ * reordered, so that the whole batch is looked up and removed from the
+ * registry in one pass. With ALLOC_TCACHE, the blocks are put in the thread's
+ * cache in one pass, and full bins are flushed once at the end. Otherwise,
+ * only the stats are updated once per batch, and each block still costs a
+ * free. */
+
 #ifdef NDEBUG
 
 #define alloc_size(s) ((void)0)
-#define alloc_init() (0)
-#define alloc_free() (0)
 
-#ifdef JEMALLOC
+static inline int
+alloc_check_range(const void *ptr, size_t len)
+{
+    UNUSED(ptr);
+    UNUSED(len);
+
+    return 0;
+}
+
+static inline int
+alloc_init(void)
+{
+    return 0;
+}
+
+static inline int
+alloc_free(void)
+{
+    return 0;
+}
+
+#ifdef ALLOC_WRAPPED
+
+void *
+malloc_s(size_t n);
+
+void *
+calloc_s(size_t n, size_t size);
+
+void *
+realloc_s(void *ptr, size_t n);
+
+void
+free_s(void *ptr);
 
-#define jmalloc(n) jemalloc((n))
-#define jcalloc(n,s) jecalloc((n), (s))
-#define jrealloc(p,s) jerealloc((p), (s))
-#define jfree(p) jefree((void *)(p))
+#define jmalloc(n) malloc_s((n))
+#define jcalloc(n,s) calloc_s((n), (s))
+#define jrealloc(p,s) realloc_s((p), (s))
+#define jfree(p) free_s((void *)(p))
 
 #else
 
-#define jmalloc(n) malloc((n))
-#define jcalloc(n,s) calloc((n), (s))
-#define jrealloc(p,s) realloc((p), (s))
-#define jfree(p) free((void *)(p))
+#define jmalloc(n) alloc_allocator->malloc(alloc_allocator->ctx, (n))
+#define jcalloc(n,s) alloc_allocator->calloc(alloc_allocator->ctx, (n), (s))
+#define jrealloc(p,s) alloc_allocator->realloc(alloc_allocator->ctx, (p), (s))
+#define jfree(p) alloc_allocator->free(alloc_allocator->ctx, (void *)(p))
 
 #endif
 
+int
+malloc_batch_s(size_t count, size_t size, void **ptrs);
+
+void
+free_batch_s(void **ptrs, size_t count);
+
+#define jmalloc_batch(c,s,p) malloc_batch_s((c), (s), (p))
+#define jfree_batch(p,c) free_batch_s((p), (c))
+
 #else
 
 /* Increases the buffer to be at least size bytes. */
@@ -49,6 +285,63 @@ alloc_init(void);
 int
 alloc_free(void);
 
+/* A point in the life of the heap, for finding what was allocated between two
+ * points. generation counts every allocation made before the snapshot, and
+ * blocks and bytes are the number of live blocks and the bytes requested for
+ * them. */
+struct alloc_snapshot {
+    uint64_t generation;
+    size_t blocks;
+    size_t bytes;
+};
+
+/* Stores the current state of the heap in *snapshot. This only copies a few
+ * counters, so it can be called often on a busy heap. */
+void
+alloc_snapshot(struct alloc_snapshot *snapshot);
+
+/* Writes the blocks that were allocated between snapshots a and b and are
+ * still live to stream, grouped by the file and line that allocated them,
+ * with the most bytes first. b may be NULL to include everything allocated
+ * since a. Returns 0 on success, nonzero on failure. */
+int
+alloc_diff(const struct alloc_snapshot *a, const struct alloc_snapshot *b,
+           FILE *stream);
+
+/* Returns 0 if [ptr, ptr + len) lies inside a single live block allocated
+ * with the j*alloc macros. Otherwise, reports the range (and the block it
+ * overruns, if any) to stderr and returns nonzero. The block found last by
+ * each thread is remembered, so checking ranges in the same block again is
+ * nearly free, and other blocks take a binary search. In release builds this
+ * always returns 0. */
+int
+alloc_check_range(const void *ptr, size_t len);
+
+/* Checks the canaries before and after every live block, and reports each
+ * corrupted block and where it was allocated to stderr. Returns the number of
+ * corrupted blocks. */
+size_t
+alloc_check_all(void);
+
+/* Checks the canaries of the next n live blocks, carrying on from where the
+ * last call stopped and wrapping around at the end. Only n blocks are checked
+ * while the registry is locked, so this can be called on every tick of an
+ * event loop. Blocks allocated or freed between calls may be checked twice or
+ * skipped in one pass. Returns the number of corrupted blocks found. */
+size_t
+alloc_check_step(size_t n);
+
+/* Starts a thread that calls alloc_check_step(n) every interval_ms
+ * milliseconds, until it finds a corrupted block or alloc_check_stop is
+ * called. Returns 0 on success, nonzero on failure. */
+int
+alloc_check_start(size_t n, unsigned interval_ms);
+
+/* Stops the thread started by alloc_check_start, and returns the number of
+ * corrupted blocks it found. */
+size_t
+alloc_check_stop(void);
+
 void *
 malloc_d(size_t n, int line, const char *file);
 
@@ -66,6 +359,16 @@ free_d(void *ptr, int line, const char *file);
 #define jrealloc(p,s) realloc_d((p), (s), __LINE__, __FILE__)
 #define jfree(p) free_d((void *)(p), __LINE__, __FILE__)
 
+int
+malloc_batch_d(size_t count, size_t size, void **ptrs, int line,
+               const char *file);
+
+void
+free_batch_d(void **ptrs, size_t count, int line, const char *file);
+
+#define jmalloc_batch(c,s,p) malloc_batch_d((c), (s), (p), __LINE__, __FILE__)
+#define jfree_batch(p,c) free_batch_d((p), (c), __LINE__, __FILE__)
+
 #endif
 
 #ifdef XMALLOC
@@ -113,4 +416,18 @@ xfree_d(void *ptr, int line, const char *file);
 
 #endif
 
+/* These are the same as the j*alloc macros, but allocate through allocator
+ * instead, unless it's NULL. They let a single container use its own allocator,
+ * e.g. an arena or a pool. Memory allocated through a custom allocator isn't
+ * tracked in debug mode. */
+
+#define jmalloc_a(a,n) ((a) == NULL ? jmalloc((n)) \
+                        : (a)->malloc((a)->ctx, (n)))
+#define jcalloc_a(a,n,s) ((a) == NULL ? jcalloc((n), (s)) \
+                          : (a)->calloc((a)->ctx, (n), (s)))
+#define jrealloc_a(a,p,s) ((a) == NULL ? jrealloc((p), (s)) \
+                           : (a)->realloc((a)->ctx, (p), (s)))
+#define jfree_a(a,p) ((a) == NULL ? jfree((p)) \
+                      : (a)->free((a)->ctx, (void *)(p)))
+
 #endif
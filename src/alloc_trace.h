@@ -0,0 +1,45 @@
+#ifndef ALLOC_TRACE_H_
+#define ALLOC_TRACE_H_ 1
+
+#include "main.h"
+
+#include <stdint.h>
+
+/* The format of the allocation traces written when alloc.c is built with
+ * ALLOC_TRACE. A trace is a struct alloc_trace_header followed by any number
+ * of struct alloc_trace_event, all in host byte order. Events are written in
+ * per-thread batches, so they are only in order within a thread; sort them by
+ * ALLOC_TRACE_SEQ to get the order they happened in. */
+
+#define ALLOC_TRACE_MAGIC "JALLOCTR"
+#define ALLOC_TRACE_VERSION 1
+
+enum alloc_trace_op {
+    ALLOC_TRACE_MALLOC = 1,
+    ALLOC_TRACE_CALLOC = 2,
+    ALLOC_TRACE_REALLOC = 3,
+    ALLOC_TRACE_FREE = 4
+};
+
+struct alloc_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t event_size;
+};
+
+/* ptr is the pointer returned, or the pointer freed. old_ptr is the pointer
+ * passed to realloc, and is 0 for every other op. size is the number of bytes
+ * requested, and is 0 for frees. */
+struct alloc_trace_event {
+    uint64_t seq_op;
+    uint64_t ptr;
+    uint64_t old_ptr;
+    uint64_t size;
+};
+
+/* The op is stored in the top byte of seq_op, and a global sequence number in
+ * the rest. */
+#define ALLOC_TRACE_OP(e) ((enum alloc_trace_op)((e)->seq_op >> 56))
+#define ALLOC_TRACE_SEQ(e) ((e)->seq_op & (((uint64_t)1 << 56) - 1))
+
+#endif
@@ -0,0 +1,461 @@
+#include "main.h"
+#include "bitset.h"
+
+#include "alloc.h"
+#include "vec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WORD(index) ((index) / BITSET_WORD_BITS)
+#define BIT(index) ((uint64_t)1 << (index) % BITSET_WORD_BITS)
+
+// The number of words holding length bits, without overflowing near SIZE_MAX
+static inline size_t
+words_for(size_t length)
+{
+    return WORD(length) + (length % BITSET_WORD_BITS != 0);
+}
+
+// Returns the number of bits set in the n words at words
+static size_t
+count_words(const uint64_t *words, size_t n)
+{
+    size_t count = 0, i = 0;
+
+#ifdef __SSE2__
+    {
+        const __m128i m1 = _mm_set1_epi8(0x55);
+        const __m128i m2 = _mm_set1_epi8(0x33);
+        const __m128i m4 = _mm_set1_epi8(0x0F);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i v, sum = zero;
+        uint64_t lanes[2];
+
+        // Counts the bits of each byte in parallel, then adds up the bytes of
+        // each half with psadbw
+        for (; n - i >= 2; i += 2) {
+            v = _mm_loadu_si128((const __m128i *)(const void *)(words + i));
+            v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+            v = _mm_add_epi8(_mm_and_si128(v, m2),
+                             _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+            v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+        }
+
+        _mm_storeu_si128((__m128i *)(void *)lanes, sum);
+        count = (size_t)(lanes[0] + lanes[1]);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        count += (size_t)__builtin_popcountll(words[i]);
+    }
+
+    return count;
+}
+
+// Puts the block counts after the one holding word out of date, since word
+// has changed
+static inline void
+invalidate_ranks(struct bitset *bitset, size_t word)
+{
+    size_t valid = word / BITSET_RANK_WORDS + 1;
+
+    if (bitset->ranks_valid > valid) {
+        bitset->ranks_valid = valid;
+    }
+}
+
+// Brings the block counts up to date up to and including ranks[block]. Returns
+// 0 on success, nonzero if they can't be allocated.
+static int
+update_ranks(struct bitset *bitset, size_t block)
+{
+    if (block < bitset->ranks_valid) {
+        return 0;
+    }
+
+    if (block >= bitset->ranks_capacity
+        && ERR(vec_reserve_min(&bitset->ranks, &bitset->ranks_capacity,
+                               sizeof(*bitset->ranks),
+                               block + 1 - bitset->ranks_capacity) != 0)) {
+
+        return -1;
+    }
+
+    if (bitset->ranks_valid == 0) {
+        bitset->ranks[0] = 0;
+        bitset->ranks_valid = 1;
+    }
+
+    for (size_t i = bitset->ranks_valid; i <= block; ++i) {
+        bitset->ranks[i] = bitset->ranks[i - 1]
+            + count_words(bitset->words + (i - 1) * BITSET_RANK_WORDS,
+                          BITSET_RANK_WORDS);
+    }
+
+    bitset->ranks_valid = block + 1;
+
+    return 0;
+}
+
+int
+bitset_init(struct bitset *bitset)
+{
+    ASSUME(bitset != NULL);
+
+    bitset->words = NULL;
+    bitset->length = 0;
+    bitset->capacity = 0;
+    bitset->ranks = NULL;
+    bitset->ranks_valid = 0;
+    bitset->ranks_capacity = 0;
+
+    return 0;
+}
+
+int
+bitset_get(struct bitset *bitset, size_t index)
+{
+    ASSUME(bitset != NULL);
+    ASSUME(index < bitset->length);
+
+    return (bitset->words[WORD(index)] & BIT(index)) != 0;
+}
+
+void
+bitset_set(struct bitset *bitset, size_t index)
+{
+    ASSUME(bitset != NULL);
+    ASSUME(index < bitset->length);
+
+    bitset->words[WORD(index)] |= BIT(index);
+    invalidate_ranks(bitset, WORD(index));
+}
+
+void
+bitset_reset(struct bitset *bitset, size_t index)
+{
+    ASSUME(bitset != NULL);
+    ASSUME(index < bitset->length);
+
+    bitset->words[WORD(index)] &= ~BIT(index);
+    invalidate_ranks(bitset, WORD(index));
+}
+
+void
+bitset_fill(struct bitset *bitset, int bit)
+{
+    size_t n;
+
+    ASSUME(bitset != NULL);
+    ASSUME(bit == 0 || bit == 1);
+
+    n = words_for(bitset->length);
+    if (n == 0) {
+        return;
+    }
+
+    memset(bitset->words, bit ? 0xFF : 0, n * sizeof(*bitset->words));
+    bitset->ranks_valid = 0;
+
+    if (bit && bitset->length % BITSET_WORD_BITS != 0) {
+        bitset->words[n - 1] = BIT(bitset->length) - 1;
+    }
+}
+
+int
+bitset_push(struct bitset *bitset, int bit)
+{
+    ASSUME(bitset != NULL);
+    ASSUME(bit == 0 || bit == 1);
+
+    if (bitset->length % BITSET_WORD_BITS == 0) {
+        if (WORD(bitset->length) == bitset->capacity
+            && ERR(vec_reserve_one_min(&bitset->words, &bitset->capacity,
+                                       sizeof(*bitset->words)) != 0)) {
+
+            return -1;
+        }
+
+        bitset->words[WORD(bitset->length)] = 0;
+    }
+
+    bitset->words[WORD(bitset->length)] |= (uint64_t)bit
+        << bitset->length % BITSET_WORD_BITS;
+    invalidate_ranks(bitset, WORD(bitset->length));
+
+    ++bitset->length;
+
+    return 0;
+}
+
+int
+bitset_resize(struct bitset *bitset, size_t length)
+{
+    size_t n, old;
+
+    ASSUME(bitset != NULL);
+
+    n = words_for(length);
+    old = words_for(bitset->length);
+
+    if (length > bitset->length) {
+        if (ERR(bitset_reserve(bitset, length) != 0)) {
+            return -1;
+        }
+
+        // The bits past the old length in its last word are already 0, but
+        // the words after it may have been cut off by an earlier resize
+        memset(bitset->words + old, 0, (n - old) * sizeof(*bitset->words));
+        invalidate_ranks(bitset, old);
+    } else if (length % BITSET_WORD_BITS != 0) {
+        bitset->words[n - 1] &= BIT(length) - 1;
+        invalidate_ranks(bitset, n - 1);
+    }
+
+    bitset->length = length;
+
+    return 0;
+}
+
+// Defines a set operation computing the words of bitset from their values a
+// and b in bitset and other, 128 bits at a time with vop where SSE2 is
+// available, and 64 at a time with op otherwise. Each op takes 0 and 0 to 0,
+// so the bits past the end stay 0.
+#ifdef __SSE2__
+#define SET_OP(name, vop, op) \
+void \
+name(struct bitset *bitset, const struct bitset *other) \
+{ \
+    size_t n, i = 0; \
+\
+    ASSUME(bitset != NULL); \
+    ASSUME(other != NULL); \
+    ASSUME(bitset->length == other->length); \
+\
+    n = words_for(bitset->length); \
+\
+    for (; n - i >= 2; i += 2) { \
+        __m128i a = _mm_loadu_si128((const __m128i *)(const void *) \
+                                    (bitset->words + i)); \
+        __m128i b = _mm_loadu_si128((const __m128i *)(const void *) \
+                                    (other->words + i)); \
+\
+        _mm_storeu_si128((__m128i *)(void *)(bitset->words + i), vop); \
+    } \
+\
+    for (; i < n; ++i) { \
+        uint64_t a = bitset->words[i], b = other->words[i]; \
+\
+        bitset->words[i] = op; \
+    } \
+\
+    bitset->ranks_valid = 0; \
+}
+#else
+#define SET_OP(name, vop, op) \
+void \
+name(struct bitset *bitset, const struct bitset *other) \
+{ \
+    size_t n; \
+\
+    ASSUME(bitset != NULL); \
+    ASSUME(other != NULL); \
+    ASSUME(bitset->length == other->length); \
+\
+    n = words_for(bitset->length); \
+\
+    for (size_t i = 0; i < n; ++i) { \
+        uint64_t a = bitset->words[i], b = other->words[i]; \
+\
+        bitset->words[i] = op; \
+    } \
+\
+    bitset->ranks_valid = 0; \
+}
+#endif
+
+SET_OP(bitset_and, _mm_and_si128(a, b), a & b)
+SET_OP(bitset_or, _mm_or_si128(a, b), a | b)
+SET_OP(bitset_xor, _mm_xor_si128(a, b), a ^ b)
+SET_OP(bitset_andnot, _mm_andnot_si128(b, a), a & ~b)
+
+size_t
+bitset_count(struct bitset *bitset)
+{
+    ASSUME(bitset != NULL);
+
+    return count_words(bitset->words, words_for(bitset->length));
+}
+
+size_t
+bitset_next(struct bitset *bitset, size_t index)
+{
+    size_t n, i;
+    uint64_t word;
+
+    ASSUME(bitset != NULL);
+    ASSUME(index <= bitset->length);
+
+    if (index == bitset->length) {
+        return bitset->length;
+    }
+
+    n = words_for(bitset->length);
+    i = WORD(index);
+
+    word = bitset->words[i] & ~(BIT(index) - 1);
+    if (word != 0) {
+        return i * BITSET_WORD_BITS + (size_t)__builtin_ctzll(word);
+    }
+
+    ++i;
+
+#ifdef __SSE2__
+    // Skips runs of 0 words 4 at a time, for sparse bitsets
+    for (; n - i >= 4; i += 4) {
+        __m128i v = _mm_or_si128(
+            _mm_loadu_si128((const __m128i *)(const void *)
+                            (bitset->words + i)),
+            _mm_loadu_si128((const __m128i *)(const void *)
+                            (bitset->words + i + 2)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))
+            != 0xFFFF) {
+
+            break;
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        if (bitset->words[i] != 0) {
+            return i * BITSET_WORD_BITS
+                + (size_t)__builtin_ctzll(bitset->words[i]);
+        }
+    }
+
+    return bitset->length;
+}
+
+size_t
+bitset_rank(struct bitset *bitset, size_t index)
+{
+    size_t count, block;
+
+    ASSUME(bitset != NULL);
+    ASSUME(index <= bitset->length);
+
+    block = WORD(index) / BITSET_RANK_WORDS;
+
+    if (LIKELY(update_ranks(bitset, block) == 0)) {
+        count = bitset->ranks[block]
+            + count_words(bitset->words + block * BITSET_RANK_WORDS,
+                          WORD(index) - block * BITSET_RANK_WORDS);
+    } else {
+        count = count_words(bitset->words, WORD(index));
+    }
+
+    if (index % BITSET_WORD_BITS != 0) {
+        count += (size_t)__builtin_popcountll(bitset->words[WORD(index)]
+                                              & (BIT(index) - 1));
+    }
+
+    return count;
+}
+
+size_t
+bitset_select(struct bitset *bitset, size_t n)
+{
+    size_t words, i = 0, count, low, high, mid;
+    uint64_t word;
+
+    ASSUME(bitset != NULL);
+
+    words = words_for(bitset->length);
+
+    // Finds the last block with at most n bits set before it
+    if (LIKELY(update_ranks(bitset, words / BITSET_RANK_WORDS) == 0)) {
+        low = 0;
+        high = words / BITSET_RANK_WORDS;
+
+        while (low < high) {
+            mid = high - (high - low) / 2;
+
+            if (bitset->ranks[mid] <= n) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+
+        i = low * BITSET_RANK_WORDS;
+        n -= bitset->ranks[low];
+    }
+
+    // Skips whole blocks of words first, then single words, then bits
+    for (; words - i >= BITSET_RANK_WORDS; i += BITSET_RANK_WORDS) {
+        count = count_words(bitset->words + i, BITSET_RANK_WORDS);
+        if (count > n) {
+            break;
+        }
+
+        n -= count;
+    }
+
+    for (; i < words; ++i) {
+        count = (size_t)__builtin_popcountll(bitset->words[i]);
+        if (count > n) {
+            break;
+        }
+
+        n -= count;
+    }
+
+    if (i == words) {
+        return bitset->length;
+    }
+
+    for (word = bitset->words[i]; n > 0; --n) {
+        word &= word - 1;
+    }
+
+    return i * BITSET_WORD_BITS + (size_t)__builtin_ctzll(word);
+}
+
+int
+bitset_reserve(struct bitset *bitset, size_t size)
+{
+    size_t n;
+
+    ASSUME(bitset != NULL);
+
+    n = words_for(size);
+    if (n <= bitset->capacity) {
+        return 0;
+    }
+
+    if (ERR(vec_reserve_min(&bitset->words, &bitset->capacity,
+                            sizeof(*bitset->words), n - bitset->capacity)
+            != 0)) {
+
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+bitset_free(struct bitset *bitset)
+{
+    ASSUME(bitset != NULL);
+
+    jfree(bitset->words);
+    jfree(bitset->ranks);
+}
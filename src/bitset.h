@@ -0,0 +1,121 @@
+#ifndef BITSET_H_
+#define BITSET_H_ 1
+
+#include "main.h"
+
+#include <stdint.h>
+
+/* A growable array of length bits, stored 64 to a word. It's meant to sit next
+ * to a ptrvec or a vec with one bit per element, e.g. for liveness or flags.
+ * capacity is in words. The bits in the last word past length are always 0.
+ *
+ * ranks[i] is the number of bits set in the first i blocks of
+ * BITSET_RANK_WORDS words, for bitset_rank and bitset_select. Only the first
+ * ranks_valid of them are up to date, and the rest are counted again when
+ * they're needed. Anything that changes words directly must set ranks_valid
+ * to 0. */
+struct bitset {
+    uint64_t *words;
+    size_t length;
+    size_t capacity;
+    size_t *ranks;
+    size_t ranks_valid;
+    size_t ranks_capacity;
+};
+
+/* The number of bits in each word. */
+#define BITSET_WORD_BITS 64
+
+/* The number of words counted together in bitset->ranks, i.e. 512 bits. */
+#define BITSET_RANK_WORDS 8
+
+/* All of the following functions take a struct bitset * as their first
+ * argument. This pointer is always assumed not to be NULL.
+ *
+ * Any functions that take an index assume the index is valid. The set
+ * operations assume both bitsets have the same length. The set operations and
+ * counts work 128 bits at a time where SSE2 is available. */
+
+/* Initializes the bitset, empty. Returns 0 on success, nonzero on failure. */
+int
+bitset_init(struct bitset *bitset);
+
+/* Returns the bit at index, 0 or 1. */
+int
+bitset_get(struct bitset *bitset, size_t index);
+
+/* Sets the bit at index to 1. */
+void
+bitset_set(struct bitset *bitset, size_t index);
+
+/* Sets the bit at index to 0. */
+void
+bitset_reset(struct bitset *bitset, size_t index);
+
+/* Sets every bit to bit, which is 0 or 1. */
+void
+bitset_fill(struct bitset *bitset, int bit);
+
+/* Appends bit, which is 0 or 1, to the end of bitset. Returns 0 on success,
+ * nonzero on failure. */
+int
+bitset_push(struct bitset *bitset, int bit);
+
+/* Sets the length of bitset to length, with any new bits 0. Returns 0 on
+ * success, nonzero on failure. */
+int
+bitset_resize(struct bitset *bitset, size_t length);
+
+/* Sets bitset to bitset & other. */
+void
+bitset_and(struct bitset *bitset, const struct bitset *other);
+
+/* Sets bitset to bitset | other. */
+void
+bitset_or(struct bitset *bitset, const struct bitset *other);
+
+/* Sets bitset to bitset ^ other. */
+void
+bitset_xor(struct bitset *bitset, const struct bitset *other);
+
+/* Sets bitset to bitset & ~other, i.e. clears every bit set in other. */
+void
+bitset_andnot(struct bitset *bitset, const struct bitset *other);
+
+/* Returns the number of bits set. */
+size_t
+bitset_count(struct bitset *bitset);
+
+/* Returns the index of the first bit set at or after index, or bitset->length
+ * if there isn't one. index may be bitset->length. To visit every bit set:
+ *
+ *     for (size_t i = bitset_next(bitset, 0); i < bitset->length;
+ *          i = bitset_next(bitset, i + 1)) */
+size_t
+bitset_next(struct bitset *bitset, size_t index);
+
+/* Returns the number of bits set before index, which may be bitset->length.
+ * This takes constant time once the block counts up to index are up to date,
+ * and a change to the bitset only puts the counts after it out of date. */
+size_t
+bitset_rank(struct bitset *bitset, size_t index);
+
+/* Returns the index of the bit set with rank n, i.e. the (n + 1)th bit set, or
+ * bitset->length if there are n or fewer bits set. This brings every block
+ * count up to date, then searches them in time logarithmic in the length.
+ *
+ * If the block counts can't be allocated, bitset_rank and bitset_select count
+ * every word before the answer instead. */
+size_t
+bitset_select(struct bitset *bitset, size_t n);
+
+/* Reserves enough memory for at least size bits. Returns 0 on success, nonzero
+ * on failure. */
+int
+bitset_reserve(struct bitset *bitset, size_t size);
+
+/* Frees the memory used by bitset. */
+void
+bitset_free(struct bitset *bitset);
+
+#endif
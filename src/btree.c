@@ -0,0 +1,665 @@
+#include "main.h"
+#include "btree.h"
+
+#include "alloc.h"
+#include "ptrvec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+// Every node but the root holds at least this many keys
+#define MIN_KEYS (BTREE_KEYS / 2)
+
+// The next leaf after a leaf
+#define NEXT(node) ((node)->ptrs[BTREE_KEYS])
+
+// Adds a slab of BTREE_SLAB nodes to the free list
+static int
+add_slab(struct btree *btree)
+{
+    char *slab, *nodes;
+    struct btree_node *node;
+
+    slab = jmalloc(BTREE_SLAB * sizeof(*node) + CACHE_LINE - 1);
+    if (ERR(slab == NULL)) {
+        return -1;
+    }
+
+    if (ERR(ptrvec_push(&btree->slabs, slab) != 0)) {
+        jfree(slab);
+        return -1;
+    }
+
+    nodes = slab + (CACHE_LINE - (uintptr_t)slab % CACHE_LINE) % CACHE_LINE;
+
+    for (size_t i = 0; i < BTREE_SLAB; ++i) {
+        node = (struct btree_node *)(void *)(nodes + i * sizeof(*node));
+        node->ptrs[0] = btree->free;
+        btree->free = node;
+    }
+
+    btree->n_free += BTREE_SLAB;
+
+    return 0;
+}
+
+// Makes sure there are at least n nodes in the free list, so that an operation
+// that needs up to n new nodes can't fail halfway through
+static int
+reserve_nodes(struct btree *btree, size_t n)
+{
+    while (btree->n_free < n) {
+        if (ERR(add_slab(btree) != 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Takes a node from the free list, which mustn't be empty
+static struct btree_node *
+new_node(struct btree *btree, int leaf)
+{
+    struct btree_node *node = btree->free;
+
+    ASSUME(node != NULL);
+
+    btree->free = node->ptrs[0];
+    --btree->n_free;
+
+    node->length = 0;
+    node->leaf = (uint32_t)leaf;
+    NEXT(node) = NULL;
+
+    return node;
+}
+
+static void
+free_node(struct btree *btree, struct btree_node *node)
+{
+    node->ptrs[0] = btree->free;
+    btree->free = node;
+    ++btree->n_free;
+}
+
+// Returns the index of the first key in node that's at least key
+static inline size_t
+lower_bound(const struct btree_node *node, uintptr_t key)
+{
+    size_t i = 0;
+
+    while (i < node->length && node->keys[i] < key) {
+        ++i;
+    }
+
+    return i;
+}
+
+// Returns the index of the child of an internal node whose keys include key
+static inline size_t
+child_index(const struct btree_node *node, uintptr_t key)
+{
+    size_t i = 0;
+
+    while (i < node->length && node->keys[i] <= key) {
+        ++i;
+    }
+
+    return i;
+}
+
+// Inserts key and ptr into node at index, which has room for them. In an
+// internal node, ptr is the child after key.
+static void
+node_insert(struct btree_node *node, size_t index, uintptr_t key,
+            void *ptr)
+{
+    size_t p = node->leaf ? index : index + 1;
+
+    memmove(node->keys + index + 1, node->keys + index,
+            (node->length - index) * sizeof(*node->keys));
+    memmove(node->ptrs + p + 1, node->ptrs + p,
+            (node->length + !node->leaf - p) * sizeof(*node->ptrs));
+
+    node->keys[index] = key;
+    node->ptrs[p] = ptr;
+    ++node->length;
+}
+
+// Removes the key at index and the pointer after it in an internal node, or
+// its value in a leaf
+static void
+node_remove(struct btree_node *node, size_t index)
+{
+    size_t p = node->leaf ? index : index + 1;
+
+    memmove(node->keys + index, node->keys + index + 1,
+            (node->length - index - 1) * sizeof(*node->keys));
+    memmove(node->ptrs + p, node->ptrs + p + 1,
+            (node->length + !node->leaf - p - 1) * sizeof(*node->ptrs));
+
+    --node->length;
+}
+
+// Inserts key and ptr into the full node at index, splitting it in two. Sets
+// *up to the key to insert into the parent, before the new node, which is
+// returned.
+static struct btree_node *
+split(struct btree *btree, struct btree_node *node, size_t index,
+      uintptr_t key, void *ptr, uintptr_t *up)
+{
+    struct btree_node *right = new_node(btree, node->leaf != 0);
+    size_t mid = (BTREE_KEYS + 1) / 2;
+
+    if (node->leaf) {
+        // Each half gets mid keys after the insertion
+        size_t at = index < mid ? mid - 1 : mid;
+
+        right->length = (uint32_t)(BTREE_KEYS - at);
+        memcpy(right->keys, node->keys + at,
+               right->length * sizeof(*node->keys));
+        memcpy(right->ptrs, node->ptrs + at,
+               right->length * sizeof(*node->ptrs));
+        node->length = (uint32_t)at;
+
+        if (index < mid) {
+            node_insert(node, index, key, ptr);
+        } else {
+            node_insert(right, index - at, key, ptr);
+        }
+
+        NEXT(right) = NEXT(node);
+        NEXT(node) = right;
+        *up = right->keys[0];
+    } else {
+        uintptr_t keys[BTREE_KEYS + 1];
+        void *ptrs[BTREE_KEYS + 2];
+
+        // Simplest to lay out all the keys and children in order first
+        memcpy(keys, node->keys, index * sizeof(*keys));
+        keys[index] = key;
+        memcpy(keys + index + 1, node->keys + index,
+               (BTREE_KEYS - index) * sizeof(*keys));
+
+        memcpy(ptrs, node->ptrs, (index + 1) * sizeof(*ptrs));
+        ptrs[index + 1] = ptr;
+        memcpy(ptrs + index + 2, node->ptrs + index + 1,
+               (BTREE_KEYS - index) * sizeof(*ptrs));
+
+        node->length = (uint32_t)mid;
+        memcpy(node->keys, keys, mid * sizeof(*keys));
+        memcpy(node->ptrs, ptrs, (mid + 1) * sizeof(*ptrs));
+
+        *up = keys[mid];
+
+        right->length = (uint32_t)(BTREE_KEYS - mid);
+        memcpy(right->keys, keys + mid + 1, right->length * sizeof(*keys));
+        memcpy(right->ptrs, ptrs + mid + 1,
+               (right->length + 1) * sizeof(*ptrs));
+    }
+
+    return right;
+}
+
+// Puts key and value in the subtree at node. Returns the new node if node was
+// split, with *up set to the key before it, or NULL otherwise. The free list
+// must have a node for each level.
+static struct btree_node *
+put(struct btree *btree, struct btree_node *node, uintptr_t key,
+    void *value, uintptr_t *up)
+{
+    struct btree_node *right;
+    size_t i;
+
+    if (node->leaf) {
+        i = lower_bound(node, key);
+
+        if (i < node->length && node->keys[i] == key) {
+            node->ptrs[i] = value;
+            return NULL;
+        }
+
+        ++btree->length;
+
+        if (node->length < BTREE_KEYS) {
+            node_insert(node, i, key, value);
+            return NULL;
+        }
+
+        return split(btree, node, i, key, value, up);
+    }
+
+    i = child_index(node, key);
+
+    right = put(btree, node->ptrs[i], key, value, up);
+    if (right == NULL) {
+        return NULL;
+    }
+
+    if (node->length < BTREE_KEYS) {
+        node_insert(node, i, *up, right);
+        return NULL;
+    }
+
+    return split(btree, node, i, *up, right, up);
+}
+
+// Fixes the child at index of the internal node parent, which has one key too
+// few, by borrowing a key from a sibling or merging it with one
+static void
+rebalance(struct btree *btree, struct btree_node *parent, size_t index)
+{
+    struct btree_node *child = parent->ptrs[index];
+    struct btree_node *left, *right;
+
+    left = index > 0 ? parent->ptrs[index - 1] : NULL;
+    right = index < parent->length ? parent->ptrs[index + 1] : NULL;
+
+    if (left != NULL && left->length > MIN_KEYS) {
+        if (child->leaf) {
+            node_insert(child, 0, left->keys[left->length - 1],
+                        left->ptrs[left->length - 1]);
+            parent->keys[index - 1] = child->keys[0];
+        } else {
+            // The separator comes down, and left's last key goes up
+            memmove(child->keys + 1, child->keys,
+                    child->length * sizeof(*child->keys));
+            memmove(child->ptrs + 1, child->ptrs,
+                    (child->length + 1) * sizeof(*child->ptrs));
+            child->keys[0] = parent->keys[index - 1];
+            child->ptrs[0] = left->ptrs[left->length];
+            ++child->length;
+            parent->keys[index - 1] = left->keys[left->length - 1];
+        }
+        --left->length;
+
+        return;
+    }
+
+    if (right != NULL && right->length > MIN_KEYS) {
+        if (child->leaf) {
+            child->keys[child->length] = right->keys[0];
+            child->ptrs[child->length] = right->ptrs[0];
+            ++child->length;
+            node_remove(right, 0);
+            parent->keys[index] = right->keys[0];
+        } else {
+            child->keys[child->length] = parent->keys[index];
+            child->ptrs[child->length + 1] = right->ptrs[0];
+            ++child->length;
+            parent->keys[index] = right->keys[0];
+
+            memmove(right->keys, right->keys + 1,
+                    (right->length - 1) * sizeof(*right->keys));
+            memmove(right->ptrs, right->ptrs + 1,
+                    right->length * sizeof(*right->ptrs));
+            --right->length;
+        }
+
+        return;
+    }
+
+    // Neither sibling can spare a key, so merge with one of them
+    if (left == NULL) {
+        left = child;
+        ++index;
+    } else {
+        right = child;
+    }
+
+    if (left->leaf) {
+        memcpy(left->keys + left->length, right->keys,
+               right->length * sizeof(*left->keys));
+        memcpy(left->ptrs + left->length, right->ptrs,
+               right->length * sizeof(*left->ptrs));
+        left->length += right->length;
+        NEXT(left) = NEXT(right);
+    } else {
+        left->keys[left->length] = parent->keys[index - 1];
+        memcpy(left->keys + left->length + 1, right->keys,
+               right->length * sizeof(*left->keys));
+        memcpy(left->ptrs + left->length + 1, right->ptrs,
+               (right->length + 1) * sizeof(*left->ptrs));
+        left->length += right->length + 1;
+    }
+
+    free_node(btree, right);
+    node_remove(parent, index - 1);
+}
+
+// Removes key from the subtree at node. Returns 0 on success, nonzero if key
+// isn't there.
+static int
+remove_key(struct btree *btree, struct btree_node *node, uintptr_t key)
+{
+    struct btree_node *child;
+    size_t i;
+
+    if (node->leaf) {
+        i = lower_bound(node, key);
+
+        if (i == node->length || node->keys[i] != key) {
+            return -1;
+        }
+
+        node_remove(node, i);
+        --btree->length;
+
+        return 0;
+    }
+
+    i = child_index(node, key);
+    child = node->ptrs[i];
+
+    if (remove_key(btree, child, key) != 0) {
+        return -1;
+    }
+
+    if (child->length < MIN_KEYS) {
+        rebalance(btree, node, i);
+    }
+
+    return 0;
+}
+
+int
+btree_init(struct btree *btree)
+{
+    ASSUME(btree != NULL);
+
+    btree->root = NULL;
+    btree->length = 0;
+    btree->height = 0;
+    btree->free = NULL;
+    btree->n_free = 0;
+
+    return ptrvec_init(&btree->slabs);
+}
+
+void **
+btree_get(struct btree *btree, uintptr_t key)
+{
+    struct btree_node *node;
+    size_t i;
+
+    ASSUME(btree != NULL);
+
+    node = btree->root;
+    if (node == NULL) {
+        return NULL;
+    }
+
+    while (!node->leaf) {
+        node = node->ptrs[child_index(node, key)];
+    }
+
+    i = lower_bound(node, key);
+    if (i == node->length || node->keys[i] != key) {
+        return NULL;
+    }
+
+    return node->ptrs + i;
+}
+
+int
+btree_put(struct btree *btree, uintptr_t key, void *value)
+{
+    struct btree_node *right, *root;
+    uintptr_t up;
+
+    ASSUME(btree != NULL);
+
+    // A split can reach the root, which then needs a new root too
+    if (ERR(reserve_nodes(btree, btree->height + 1) != 0)) {
+        return -1;
+    }
+
+    if (btree->root == NULL) {
+        btree->root = new_node(btree, 1);
+        btree->height = 1;
+    }
+
+    right = put(btree, btree->root, key, value, &up);
+    if (right != NULL) {
+        root = new_node(btree, 0);
+        root->length = 1;
+        root->keys[0] = up;
+        root->ptrs[0] = btree->root;
+        root->ptrs[1] = right;
+
+        btree->root = root;
+        ++btree->height;
+    }
+
+    return 0;
+}
+
+int
+btree_remove(struct btree *btree, uintptr_t key)
+{
+    struct btree_node *root;
+
+    ASSUME(btree != NULL);
+
+    root = btree->root;
+    if (root == NULL || remove_key(btree, root, key) != 0) {
+        return -1;
+    }
+
+    // The root may be left with a single child, or no keys at all
+    if (root->length == 0) {
+        btree->root = root->leaf ? NULL : root->ptrs[0];
+        --btree->height;
+        free_node(btree, root);
+    }
+
+    return 0;
+}
+
+void
+btree_seek(struct btree *btree, uintptr_t key, struct btree_iter *iter)
+{
+    struct btree_node *node;
+
+    ASSUME(btree != NULL);
+    ASSUME(iter != NULL);
+
+    node = btree->root;
+    if (node == NULL) {
+        iter->node = NULL;
+        iter->index = 0;
+        return;
+    }
+
+    while (!node->leaf) {
+        node = node->ptrs[child_index(node, key)];
+    }
+
+    iter->node = node;
+    iter->index = lower_bound(node, key);
+}
+
+int
+btree_iter_next(struct btree_iter *iter, uintptr_t *key, void **value)
+{
+    ASSUME(iter != NULL);
+
+    while (iter->node != NULL && iter->index == iter->node->length) {
+        iter->node = NEXT(iter->node);
+        iter->index = 0;
+    }
+
+    if (iter->node == NULL) {
+        return 0;
+    }
+
+    if (key != NULL) {
+        *key = iter->node->keys[iter->index];
+    }
+    if (value != NULL) {
+        *value = iter->node->ptrs[iter->index];
+    }
+
+    ++iter->index;
+
+    return 1;
+}
+
+// The number of nodes needed for a level above one of n nodes, or n keys for
+// the leaves, with up to per keys or children in each
+static inline size_t
+level_nodes(size_t n, size_t per)
+{
+    return n / per + (n % per != 0);
+}
+
+int
+btree_load(struct btree *btree, struct ptrvec *ptrvec,
+           uintptr_t (*key)(const void *))
+{
+    struct btree_node **nodes, *node;
+    uintptr_t *mins;
+    size_t n, total, count, next, begin, end;
+
+    ASSUME(btree != NULL);
+    ASSUME(ptrvec != NULL);
+    ASSUME(btree->length == 0);
+
+    n = ptrvec->length;
+    if (n == 0) {
+        return 0;
+    }
+
+    for (size_t i = 1; i < n; ++i) {
+        uintptr_t a = key == NULL ? (uintptr_t)ptrvec->ptr[i - 1]
+                                  : key(ptrvec->ptr[i - 1]);
+        uintptr_t b = key == NULL ? (uintptr_t)ptrvec->ptr[i]
+                                  : key(ptrvec->ptr[i]);
+
+        if (ERR(a >= b)) {
+            return -1;
+        }
+    }
+
+    count = level_nodes(n, BTREE_KEYS);
+    total = count;
+    for (next = count; next > 1; total += next) {
+        next = level_nodes(next, BTREE_KEYS + 1);
+    }
+
+    // The nodes and their smallest keys of the level being built, which are
+    // overwritten in place by the level above
+    nodes = jmalloc(count * (sizeof(*nodes) + sizeof(*mins)));
+    if (ERR(nodes == NULL)) {
+        return -1;
+    }
+    mins = (uintptr_t *)(void *)(nodes + count);
+
+    if (ERR(reserve_nodes(btree, total) != 0)) {
+        jfree(nodes);
+        return -1;
+    }
+
+    // Spreading the keys evenly keeps every leaf at least half full
+    for (size_t i = 0; i < count; ++i) {
+        begin = n * i / count;
+        end = n * (i + 1) / count;
+
+        node = new_node(btree, 1);
+        node->length = (uint32_t)(end - begin);
+
+        for (size_t j = begin; j < end; ++j) {
+            node->keys[j - begin] = key == NULL ? (uintptr_t)ptrvec->ptr[j]
+                                                : key(ptrvec->ptr[j]);
+            node->ptrs[j - begin] = ptrvec->ptr[j];
+        }
+
+        if (i > 0) {
+            NEXT(nodes[i - 1]) = node;
+        }
+
+        nodes[i] = node;
+        mins[i] = node->keys[0];
+    }
+
+    btree->height = 1;
+
+    for (; count > 1; count = next) {
+        next = level_nodes(count, BTREE_KEYS + 1);
+
+        for (size_t i = 0; i < next; ++i) {
+            begin = count * i / next;
+            end = count * (i + 1) / next;
+
+            node = new_node(btree, 0);
+            node->length = (uint32_t)(end - begin - 1);
+
+            for (size_t j = begin; j < end; ++j) {
+                if (j > begin) {
+                    node->keys[j - begin - 1] = mins[j];
+                }
+                node->ptrs[j - begin] = nodes[j];
+            }
+
+            nodes[i] = node;
+            mins[i] = mins[begin];
+        }
+
+        ++btree->height;
+    }
+
+    btree->root = nodes[0];
+    btree->length = n;
+
+    jfree(nodes);
+
+    return 0;
+}
+
+// Returns every node in the subtree at node to the free list
+static void
+free_subtree(struct btree *btree, struct btree_node *node)
+{
+    if (!node->leaf) {
+        for (size_t i = 0; i <= node->length; ++i) {
+            free_subtree(btree, node->ptrs[i]);
+        }
+    }
+
+    free_node(btree, node);
+}
+
+void
+btree_clear(struct btree *btree)
+{
+    ASSUME(btree != NULL);
+
+    if (btree->root != NULL) {
+        free_subtree(btree, btree->root);
+    }
+
+    btree->root = NULL;
+    btree->length = 0;
+    btree->height = 0;
+}
+
+void
+btree_free(struct btree *btree)
+{
+    ASSUME(btree != NULL);
+
+    for (size_t i = 0; i < btree->slabs.length; ++i) {
+        jfree(btree->slabs.ptr[i]);
+    }
+
+    ptrvec_free(&btree->slabs);
+
+    btree->root = NULL;
+    btree->length = 0;
+    btree->height = 0;
+    btree->free = NULL;
+    btree->n_free = 0;
+}
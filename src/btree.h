@@ -0,0 +1,110 @@
+#ifndef BTREE_H_
+#define BTREE_H_ 1
+
+#include "main.h"
+#include "ptrvec.h"
+
+#include <stdint.h>
+
+/* The size of each node in bytes, a whole number of cache lines. Bigger nodes
+ * mean a shallower tree but more keys scanned in each node. */
+#define BTREE_NODE_SIZE 256
+
+/* The most keys a node holds, so that a node is BTREE_NODE_SIZE bytes. Every
+ * node but the root holds at least half this many. */
+#define BTREE_KEYS ((BTREE_NODE_SIZE - 2 * sizeof(uint32_t) - sizeof(void *)) \
+                    / (sizeof(uintptr_t) + sizeof(void *)))
+
+/* The number of nodes allocated at once for a btree's node pool. */
+#define BTREE_SLAB 64
+
+/* Both leaves and internal nodes. In a leaf, ptrs[i] is the value for keys[i],
+ * and ptrs[BTREE_KEYS] is the next leaf. In an internal node, ptrs[i] is the
+ * child with the keys less than keys[i] and at least keys[i - 1]. */
+struct btree_node {
+    uint32_t length;
+    uint32_t leaf;
+    uintptr_t keys[BTREE_KEYS];
+    void *ptrs[BTREE_KEYS + 1];
+};
+
+/* An ordered map from integer or pointer keys, compared as uintptr_t, to
+ * pointers, as a B+-tree. All the values are in the leaves, which are linked
+ * in order, so iterating over a range walks along the leaves without going
+ * back up the tree.
+ *
+ * Nodes are allocated BTREE_SLAB at a time, aligned to cache lines, and are
+ * kept in the btree's own free list when they're freed rather than going back
+ * to the allocator. slabs holds every slab, and is only freed by btree_free. */
+struct btree {
+    struct btree_node *root;
+    size_t length;
+    size_t height;
+    struct btree_node *free;
+    size_t n_free;
+    struct ptrvec slabs;
+};
+
+/* A position in a btree, for iterating over it in order. It's invalidated by
+ * any insertion or removal. */
+struct btree_iter {
+    struct btree_node *node;
+    size_t index;
+};
+
+/* All of the following functions take a struct btree * as their first
+ * argument. This pointer is always assumed not to be NULL.
+ *
+ * Note: the values contained in a btree are not managed by the btree. */
+
+/* Initializes the btree, empty. Returns 0 on success, nonzero on failure. */
+int
+btree_init(struct btree *btree);
+
+/* Returns a pointer to the value for key, or NULL if key isn't in the btree.
+ * The pointer is invalidated by any insertion or removal. */
+void **
+btree_get(struct btree *btree, uintptr_t key);
+
+/* Sets the value for key to value, adding key if it isn't already in the
+ * btree. Returns 0 on success, nonzero on failure. */
+int
+btree_put(struct btree *btree, uintptr_t key, void *value);
+
+/* Removes key and its value. Returns 0 on success, nonzero if key isn't in the
+ * btree. */
+int
+btree_remove(struct btree *btree, uintptr_t key);
+
+/* Sets *iter to the first key that's at least key. To visit every key in
+ * [begin, end):
+ *
+ *     btree_seek(btree, begin, &iter);
+ *     while (btree_iter_next(&iter, &key, &value) && key < end) */
+void
+btree_seek(struct btree *btree, uintptr_t key, struct btree_iter *iter);
+
+/* Stores the key and value at iter in *key and *value, and moves iter to the
+ * next key. Returns 1 if there was a key at iter, or 0 at the end of the
+ * btree. key and value may be NULL. */
+int
+btree_iter_next(struct btree_iter *iter, uintptr_t *key, void **value);
+
+/* Fills the btree, which must be empty, with the pointers in ptrvec as values,
+ * keyed by key(ptr), or by their addresses if key is NULL. ptrvec must be
+ * sorted by key, without duplicates. The tree is built bottom up with full
+ * leaves, which is much faster than inserting the pointers one by one. Returns
+ * 0 on success, nonzero on failure, including if ptrvec isn't sorted. */
+int
+btree_load(struct btree *btree, struct ptrvec *ptrvec,
+           uintptr_t (*key)(const void *));
+
+/* Removes every key, keeping the nodes in the pool. */
+void
+btree_clear(struct btree *btree);
+
+/* Frees the memory used by the btree. */
+void
+btree_free(struct btree *btree);
+
+#endif
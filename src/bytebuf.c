@@ -0,0 +1,323 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "main.h"
+#include "bytebuf.h"
+
+#include "alloc.h"
+#include "vec.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// The most iovecs passed to each writev, which is IOV_MAX on Linux and the
+// BSDs
+#define WRITE_IOVS 1024
+
+// The bytes a first bytebuf_vprintf attempt has room for
+#define PRINTF_MIN 64
+
+static inline struct iovec *
+last(struct bytebuf *bytebuf)
+{
+    return bytebuf->iov + bytebuf->length - 1;
+}
+
+static inline size_t
+spare(struct bytebuf *bytebuf)
+{
+    return bytebuf->tail == NULL
+        ? 0 : bytebuf->tail_capacity - last(bytebuf)->iov_len;
+}
+
+// The iovecs are only ever read through, by writev and bytebuf_copy, so base
+// may be data the caller passed as const
+static int
+push_iov(struct bytebuf *bytebuf, const void *base, size_t len)
+{
+    if (bytebuf->length == bytebuf->capacity
+        && ERR(vec_reserve_one_min(&bytebuf->iov, &bytebuf->capacity,
+                                   sizeof(*bytebuf->iov)) != 0)) {
+
+        return -1;
+    }
+
+    bytebuf->iov[bytebuf->length].iov_base = (void *)(uintptr_t)base;
+    bytebuf->iov[bytebuf->length].iov_len = len;
+    ++bytebuf->length;
+
+    return 0;
+}
+
+// Starts a new tail with room for at least n bytes. Chunks start small, and
+// once one has reached BYTEBUF_CHUNK_SIZE, the ones after it are that big.
+static int
+new_chunk(struct bytebuf *bytebuf, size_t n)
+{
+    size_t cap;
+    char *chunk;
+
+    cap = bytebuf->tail_capacity >= BYTEBUF_CHUNK_SIZE
+        ? BYTEBUF_CHUNK_SIZE : BYTEBUF_MIN_CHUNK;
+    cap = n > cap ? n : cap;
+
+    if (bytebuf->nowned == bytebuf->owned_capacity
+        && ERR(vec_reserve_one_min(&bytebuf->owned, &bytebuf->owned_capacity,
+                                   sizeof(*bytebuf->owned)) != 0)) {
+
+        return -1;
+    }
+
+    chunk = jmalloc(cap);
+    if (ERR(chunk == NULL)) {
+        return -1;
+    }
+
+    if (ERR(push_iov(bytebuf, chunk, 0) != 0)) {
+        jfree(chunk);
+        return -1;
+    }
+
+    bytebuf->owned[bytebuf->nowned++] = chunk;
+    bytebuf->tail = chunk;
+    bytebuf->tail_capacity = cap;
+
+    return 0;
+}
+
+void *
+bytebuf_reserve(struct bytebuf *bytebuf, size_t n)
+{
+    size_t extra;
+
+    ASSUME(bytebuf != NULL);
+
+    if (bytebuf->tail != NULL && spare(bytebuf) >= n) {
+        // Nothing to do
+    } else if (bytebuf->tail != NULL
+               && bytebuf->tail_capacity < BYTEBUF_CHUNK_SIZE) {
+
+        // A small tail grows in place like any vec
+        extra = n - spare(bytebuf);
+        if (ERR(vec_reserve_min(&bytebuf->tail, &bytebuf->tail_capacity, 1,
+                                extra) != 0)) {
+            return NULL;
+        }
+        last(bytebuf)->iov_base = bytebuf->tail;
+        bytebuf->owned[bytebuf->nowned - 1] = bytebuf->tail;
+    } else if (ERR(new_chunk(bytebuf, n) != 0)) {
+        return NULL;
+    }
+
+    return bytebuf->tail + last(bytebuf)->iov_len;
+}
+
+void
+bytebuf_commit(struct bytebuf *bytebuf, size_t n)
+{
+    ASSUME(bytebuf != NULL);
+    ASSUME(n <= spare(bytebuf));
+
+    if (n == 0) {
+        return;
+    }
+
+    last(bytebuf)->iov_len += n;
+    bytebuf->size += n;
+}
+
+int
+bytebuf_init(struct bytebuf *bytebuf)
+{
+    ASSUME(bytebuf != NULL);
+
+    bytebuf->iov = NULL;
+    bytebuf->length = 0;
+    bytebuf->capacity = 0;
+    bytebuf->size = 0;
+    bytebuf->tail = NULL;
+    bytebuf->tail_capacity = 0;
+    bytebuf->owned = NULL;
+    bytebuf->nowned = 0;
+    bytebuf->owned_capacity = 0;
+
+    return 0;
+}
+
+int
+bytebuf_append(struct bytebuf *bytebuf, const void *data, size_t n)
+{
+    void *dst;
+
+    ASSUME(bytebuf != NULL);
+    ASSUME(data != NULL || n == 0);
+
+    dst = bytebuf_reserve(bytebuf, n);
+    if (ERR(dst == NULL)) {
+        return -1;
+    }
+
+    memcpy(dst, data, n);
+    bytebuf_commit(bytebuf, n);
+
+    return 0;
+}
+
+int
+bytebuf_append_ref(struct bytebuf *bytebuf, const void *data, size_t n)
+{
+    ASSUME(bytebuf != NULL);
+    ASSUME(data != NULL || n == 0);
+
+    if (n < BYTEBUF_REF_MIN) {
+        return bytebuf_append(bytebuf, data, n);
+    }
+
+    if (ERR(push_iov(bytebuf, data, n) != 0)) {
+        return -1;
+    }
+
+    // The tail is no longer last, so appends after this need a new chunk
+    bytebuf->tail = NULL;
+    bytebuf->size += n;
+
+    return 0;
+}
+
+int
+bytebuf_printf(struct bytebuf *bytebuf, const char *fmt, ...)
+{
+    va_list ap;
+    int err;
+
+    va_start(ap, fmt);
+    err = bytebuf_vprintf(bytebuf, fmt, ap);
+    va_end(ap);
+
+    return err;
+}
+
+int
+bytebuf_vprintf(struct bytebuf *bytebuf, const char *fmt, va_list ap)
+{
+    va_list copy;
+    size_t avail;
+    char *dst;
+    int n;
+
+    ASSUME(bytebuf != NULL);
+    ASSUME(fmt != NULL);
+
+    dst = bytebuf_reserve(bytebuf, PRINTF_MIN);
+    if (ERR(dst == NULL)) {
+        return -1;
+    }
+    avail = spare(bytebuf);
+
+    // Format straight into the spare space, and only if it doesn't fit, make
+    // room and format again
+    va_copy(copy, ap);
+    n = vsnprintf(dst, avail, fmt, copy);
+    va_end(copy);
+
+    if (ERR(n < 0)) {
+        return -1;
+    }
+
+    if ((size_t)n >= avail) {
+        dst = bytebuf_reserve(bytebuf, (size_t)n + 1);
+        if (ERR(dst == NULL)) {
+            return -1;
+        }
+
+        vsnprintf(dst, (size_t)n + 1, fmt, ap);
+    }
+
+    bytebuf_commit(bytebuf, (size_t)n);
+
+    return 0;
+}
+
+void
+bytebuf_copy(struct bytebuf *bytebuf, void *dst)
+{
+    char *p = dst;
+
+    ASSUME(bytebuf != NULL);
+    ASSUME(dst != NULL || bytebuf->size == 0);
+
+    for (size_t i = 0; i < bytebuf->length; ++i) {
+        memcpy(p, bytebuf->iov[i].iov_base, bytebuf->iov[i].iov_len);
+        p += bytebuf->iov[i].iov_len;
+    }
+}
+
+int
+bytebuf_write(struct bytebuf *bytebuf, int fd)
+{
+    struct iovec *iov;
+    size_t n, left;
+    ssize_t done;
+
+    ASSUME(bytebuf != NULL);
+
+    iov = bytebuf->iov;
+    n = bytebuf->length;
+
+    while (n > 0) {
+        done = writev(fd, iov, (int)(n < WRITE_IOVS ? n : WRITE_IOVS));
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ERR(done < 0)) {
+            // Keep what's left, and append to a new chunk after it
+            memmove(bytebuf->iov, iov, n * sizeof(*iov));
+            bytebuf->length = n;
+            bytebuf->tail = NULL;
+
+            return -1;
+        }
+
+        left = (size_t)done;
+        bytebuf->size -= left;
+
+        for (; n > 0 && left >= iov->iov_len; ++iov, --n) {
+            left -= iov->iov_len;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    bytebuf_clear(bytebuf);
+
+    return 0;
+}
+
+void
+bytebuf_clear(struct bytebuf *bytebuf)
+{
+    ASSUME(bytebuf != NULL);
+
+    jfree_batch(bytebuf->owned, bytebuf->nowned);
+
+    bytebuf->nowned = 0;
+    bytebuf->length = 0;
+    bytebuf->size = 0;
+    bytebuf->tail = NULL;
+    bytebuf->tail_capacity = 0;
+}
+
+void
+bytebuf_free(struct bytebuf *bytebuf)
+{
+    ASSUME(bytebuf != NULL);
+
+    bytebuf_clear(bytebuf);
+
+    jfree(bytebuf->iov);
+    jfree(bytebuf->owned);
+}
@@ -0,0 +1,98 @@
+#ifndef BYTEBUF_H_
+#define BYTEBUF_H_ 1
+
+#include "main.h"
+
+#include <stdarg.h>
+#include <sys/uio.h>
+
+/* A growable buffer of bytes, e.g. for building output, kept as a chain of
+ * chunks that can be written out with writev without ever being concatenated.
+ *
+ * Bytes are appended to the last chunk the buffer allocated, the tail. The
+ * tail grows in place with the vec helpers until it reaches
+ * BYTEBUF_CHUNK_SIZE, and then a new chunk is started, so a large buffer is
+ * never copied as it grows. Memory owned by the caller can also be added to
+ * the chain without copying it (see bytebuf_append_ref).
+ *
+ * iov holds the chain, and size is the total number of bytes in it. */
+struct bytebuf {
+    struct iovec *iov;
+    size_t length;
+    size_t capacity;
+    size_t size;
+    char *tail;
+    size_t tail_capacity;
+    void **owned;
+    size_t nowned;
+    size_t owned_capacity;
+};
+
+/* The size past which the tail stops growing in place. */
+#define BYTEBUF_CHUNK_SIZE ((size_t)64 << 10)
+
+/* The size of the first chunk, unless more is needed at once. */
+#define BYTEBUF_MIN_CHUNK ((size_t)256)
+
+/* bytebuf_append_ref copies anything smaller than this instead, since a copy
+ * is cheaper than another iovec. */
+#define BYTEBUF_REF_MIN ((size_t)512)
+
+/* All of the following functions take a struct bytebuf * as their first
+ * argument. This pointer is always assumed not to be NULL. */
+
+/* Initializes the bytebuf. Returns 0 on success, nonzero on failure. */
+int
+bytebuf_init(struct bytebuf *bytebuf);
+
+/* Appends a copy of the n bytes at data. Returns 0 on success, nonzero on
+ * failure. */
+int
+bytebuf_append(struct bytebuf *bytebuf, const void *data, size_t n);
+
+/* Appends the n bytes at data without copying them, so they must stay valid
+ * and unchanged until bytebuf is written, cleared or freed. Returns 0 on
+ * success, nonzero on failure. */
+int
+bytebuf_append_ref(struct bytebuf *bytebuf, const void *data, size_t n);
+
+/* Appends the output of printf, without the terminating NUL. Returns 0 on
+ * success, nonzero on failure. */
+__attribute__((format(printf, 2, 3))) int
+bytebuf_printf(struct bytebuf *bytebuf, const char *fmt, ...);
+
+/* Same as bytebuf_printf, but with a va_list. */
+__attribute__((format(printf, 2, 0))) int
+bytebuf_vprintf(struct bytebuf *bytebuf, const char *fmt, va_list ap);
+
+/* Returns a pointer to at least n bytes of contiguous spare space at the end
+ * of bytebuf, for a producer to write into directly before calling
+ * bytebuf_commit. Any call other than bytebuf_commit may move or replace the
+ * space. Returns NULL on failure. */
+void *
+bytebuf_reserve(struct bytebuf *bytebuf, size_t n);
+
+/* Appends the first n bytes of the space returned by the last call to
+ * bytebuf_reserve, which must have asked for at least n bytes. */
+void
+bytebuf_commit(struct bytebuf *bytebuf, size_t n);
+
+/* Copies the contents of bytebuf to the bytebuf->size bytes at dst. */
+void
+bytebuf_copy(struct bytebuf *bytebuf, void *dst);
+
+/* Writes the contents of bytebuf to fd with writev, and clears it. Returns 0
+ * on success; on failure, bytebuf is left holding the bytes that weren't
+ * written, and nonzero is returned. */
+int
+bytebuf_write(struct bytebuf *bytebuf, int fd);
+
+/* Empties bytebuf, freeing its chunks but keeping its chain for reuse. */
+void
+bytebuf_clear(struct bytebuf *bytebuf);
+
+/* Frees the memory used by bytebuf. */
+void
+bytebuf_free(struct bytebuf *bytebuf);
+
+#endif
@@ -0,0 +1,385 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "main.h"
+#include "filevec.h"
+
+#include "alloc.h"
+#include "vec.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The vec helpers grow the elements through this allocator, whose realloc
+// grows the file and maps it again. The header is mapped along with the
+// elements, just before them.
+
+static inline char *
+map_start(void *ptr)
+{
+    return (char *)ptr - FILEVEC_HEADER_SIZE;
+}
+
+static inline struct filevec_header *
+header(const struct filevec *filevec)
+{
+    return (struct filevec_header *)map_start(filevec->ptr);
+}
+
+static void *
+file_realloc(void *ctx, void *ptr, size_t n)
+{
+    struct filevec *filevec = ctx;
+    size_t bytes, old_bytes;
+    char *map;
+
+    ASSUME(ptr == filevec->ptr);
+
+    if (ERR(n > SIZE_MAX - FILEVEC_HEADER_SIZE)) {
+        return NULL;
+    }
+
+    bytes = FILEVEC_HEADER_SIZE + n;
+    old_bytes = FILEVEC_HEADER_SIZE + filevec->capacity * filevec->size;
+
+    // Touching a mapped page past the end of the file is a SIGBUS, so a
+    // growing file is extended before it's mapped, and a shrinking one is only
+    // cut once the new mapping is in place. Either way, a failure leaves the
+    // vector as it was.
+    if (bytes > old_bytes
+        && ERR(ftruncate(filevec->fd, (off_t)bytes) != 0)) {
+        return NULL;
+    }
+
+    map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, filevec->fd,
+               0);
+    if (ERR(map == MAP_FAILED)) {
+        if (bytes > old_bytes) {
+            ftruncate(filevec->fd, (off_t)old_bytes);
+        }
+        return NULL;
+    }
+
+    if (bytes < old_bytes
+        && ERR(ftruncate(filevec->fd, (off_t)bytes) != 0)) {
+        munmap(map, bytes);
+        return NULL;
+    }
+
+    munmap(map_start(ptr), old_bytes);
+
+    return map + FILEVEC_HEADER_SIZE;
+}
+
+static void *
+file_malloc(void *ctx, size_t n)
+{
+    UNUSED(ctx);
+    UNUSED(n);
+
+    // The elements are always mapped, so they're only ever reallocated
+    ASSUME_UNREACHABLE();
+
+    return NULL;
+}
+
+static void *
+file_calloc(void *ctx, size_t n, size_t size)
+{
+    UNUSED(ctx);
+    UNUSED(n);
+    UNUSED(size);
+
+    ASSUME_UNREACHABLE();
+
+    return NULL;
+}
+
+static void
+file_free(void *ctx, void *ptr)
+{
+    UNUSED(ctx);
+    UNUSED(ptr);
+}
+
+static size_t
+file_usable_size(void *ctx, void *ptr)
+{
+    const struct filevec *filevec = ctx;
+
+    UNUSED(ptr);
+
+    return filevec->capacity * filevec->size;
+}
+
+// Returns whether the FILEVEC_HEADER_SIZE bytes at ptr are all zero
+static int
+all_zero(const char *ptr)
+{
+    for (size_t i = 0; i < FILEVEC_HEADER_SIZE; ++i) {
+        if (ptr[i] != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// The allocator's ctx points back at the filevec, which may have been copied
+// since it was opened
+static inline const struct allocator *
+allocator(struct filevec *filevec)
+{
+    filevec->allocator.ctx = filevec;
+
+    return &filevec->allocator;
+}
+
+// A 64 bit FNV-1a over 8 bytes at a time, then the bytes left over
+static uint64_t
+checksum(const void *data, size_t bytes)
+{
+    const unsigned char *p = data;
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    uint64_t word;
+
+    for (; bytes >= sizeof(word); bytes -= sizeof(word), p += sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        hash = (hash ^ word) * UINT64_C(0x100000001B3);
+    }
+
+    for (; bytes > 0; --bytes, ++p) {
+        hash = (hash ^ *p) * UINT64_C(0x100000001B3);
+    }
+
+    return hash;
+}
+
+int
+filevec_open(struct filevec *filevec, const char *path, size_t size)
+{
+    struct stat st;
+    struct filevec_header *head;
+    size_t map_bytes;
+    char *map;
+    int fresh;
+
+    ASSUME(filevec != NULL);
+    ASSUME(path != NULL);
+    ASSUME(size > 0);
+
+    filevec->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ERR(filevec->fd < 0)) {
+        return -1;
+    }
+
+    if (ERR(fstat(filevec->fd, &st) != 0)) {
+        goto fail;
+    }
+
+    fresh = st.st_size == 0;
+    if (fresh) {
+        if (ERR(ftruncate(filevec->fd, FILEVEC_HEADER_SIZE) != 0)) {
+            goto fail;
+        }
+        st.st_size = FILEVEC_HEADER_SIZE;
+    }
+
+    if (ERR(st.st_size < FILEVEC_HEADER_SIZE)
+        || ERR((uintmax_t)st.st_size > SIZE_MAX)) {
+        goto fail;
+    }
+
+    // Only whole elements are mapped, so the mapping is always the header
+    // plus capacity elements
+    filevec->size = size;
+    filevec->capacity = ((size_t)st.st_size - FILEVEC_HEADER_SIZE) / size;
+    map_bytes = FILEVEC_HEADER_SIZE + filevec->capacity * size;
+
+    map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+               filevec->fd, 0);
+    if (ERR(map == MAP_FAILED)) {
+        goto fail;
+    }
+
+    head = (struct filevec_header *)map;
+
+    // Only a file this created is given a header, or one left with nothing
+    // but a zeroed header by a crash before the header was written. Any other
+    // file has to have the magic.
+    if (fresh || (st.st_size == FILEVEC_HEADER_SIZE && all_zero(map))) {
+        memcpy(head->magic, FILEVEC_MAGIC, sizeof(head->magic));
+        head->version = FILEVEC_VERSION;
+        head->size = size;
+        head->length = 0;
+        head->checksum = checksum(NULL, 0);
+    }
+
+    filevec->ptr = map + FILEVEC_HEADER_SIZE;
+    filevec->length = (size_t)head->length;
+
+    if (ERR(memcmp(head->magic, FILEVEC_MAGIC, sizeof(head->magic)) != 0)
+        || ERR(head->version != FILEVEC_VERSION)
+        || ERR(head->size != size)
+        || ERR(head->length > filevec->capacity)) {
+
+        munmap(map, map_bytes);
+        goto fail;
+    }
+
+    filevec->allocator.malloc = &file_malloc;
+    filevec->allocator.calloc = &file_calloc;
+    filevec->allocator.realloc = &file_realloc;
+    filevec->allocator.free = &file_free;
+    filevec->allocator.usable_size = &file_usable_size;
+    filevec->allocator.ctx = filevec;
+
+    return 0;
+
+fail:
+    close(filevec->fd);
+    filevec->fd = -1;
+
+    return -1;
+}
+
+int
+filevec_push(struct filevec *filevec, const void *elem)
+{
+    ASSUME(filevec != NULL);
+    ASSUME(elem != NULL);
+
+    if (filevec->capacity == filevec->length
+        && ERR(vec_reserve_one_min_a(allocator(filevec), &filevec->ptr,
+                                     &filevec->capacity, filevec->size)
+               != 0)) {
+
+        return -1;
+    }
+
+    memcpy((char *)filevec->ptr + filevec->length * filevec->size, elem,
+           filevec->size);
+    ++filevec->length;
+
+    return 0;
+}
+
+int
+filevec_resize(struct filevec *filevec, size_t length)
+{
+    ASSUME(filevec != NULL);
+
+    if (ERR(filevec_reserve(filevec, length) != 0)) {
+        return -1;
+    }
+
+    if (length > filevec->length) {
+        memset((char *)filevec->ptr + filevec->length * filevec->size, 0,
+               (length - filevec->length) * filevec->size);
+    }
+
+    filevec->length = length;
+
+    return 0;
+}
+
+int
+filevec_reserve(struct filevec *filevec, size_t size)
+{
+    ASSUME(filevec != NULL);
+
+    if (size <= filevec->capacity) {
+        return 0;
+    }
+
+    if (ERR(vec_reserve_min_a(allocator(filevec), &filevec->ptr,
+                              &filevec->capacity, filevec->size,
+                              size - filevec->capacity) != 0)) {
+
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+filevec_shrink(struct filevec *filevec)
+{
+    void *tmp;
+
+    ASSUME(filevec != NULL);
+
+    if (filevec->capacity == filevec->length) {
+        return 0;
+    }
+
+    // Not vec_shrink, which might only release the pages of a big tail
+    tmp = file_realloc(filevec, filevec->ptr,
+                       filevec->length * filevec->size);
+    if (ERR(tmp == NULL)) {
+        return -1;
+    }
+    filevec->ptr = tmp;
+
+    filevec->capacity = filevec->length;
+
+    return 0;
+}
+
+int
+filevec_sync(struct filevec *filevec)
+{
+    struct filevec_header *head;
+
+    ASSUME(filevec != NULL);
+
+    head = header(filevec);
+    head->length = filevec->length;
+    head->checksum = checksum(filevec->ptr, filevec->length * filevec->size);
+
+    if (ERR(msync(head, FILEVEC_HEADER_SIZE + filevec->capacity * filevec->size,
+                  MS_SYNC) != 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+filevec_verify(struct filevec *filevec)
+{
+    const struct filevec_header *head;
+
+    ASSUME(filevec != NULL);
+
+    head = header(filevec);
+
+    return head->length != filevec->length
+        || head->checksum != checksum(filevec->ptr,
+                                      filevec->length * filevec->size);
+}
+
+int
+filevec_close(struct filevec *filevec)
+{
+    int err;
+
+    ASSUME(filevec != NULL);
+
+    err = filevec_sync(filevec);
+
+    munmap(map_start(filevec->ptr),
+           FILEVEC_HEADER_SIZE + filevec->capacity * filevec->size);
+
+    if (ERR(close(filevec->fd) != 0)) {
+        err = -1;
+    }
+
+    filevec->ptr = NULL;
+    filevec->fd = -1;
+
+    return err;
+}
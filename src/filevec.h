@@ -0,0 +1,99 @@
+#ifndef FILEVEC_H_
+#define FILEVEC_H_ 1
+
+#include "main.h"
+#include "alloc.h"
+
+#include <stdint.h>
+
+/* A vector of fixed size elements that lives in a file, which is mapped into
+ * memory. Opening an existing file gives a vector that can be used straight
+ * away, without reading or copying its elements, so the elements must not
+ * contain pointers. The vector grows like the vec helpers, by growing the file
+ * and mapping it again, so ptr may move whenever the vector grows. */
+struct filevec {
+    void *ptr;
+    size_t length;
+    size_t capacity;
+    size_t size;
+    int fd;
+    struct allocator allocator;
+};
+
+#define FILEVEC_MAGIC "JFILEVEC"
+#define FILEVEC_VERSION 1
+
+/* The file starts with this header, padded to FILEVEC_HEADER_SIZE bytes, and
+ * the elements follow it. All the fields are in the host's byte order.
+ * length and checksum are only written by filevec_sync and filevec_close;
+ * checksum covers the length * size bytes of elements. */
+struct filevec_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t length;
+    uint64_t checksum;
+};
+
+#define FILEVEC_HEADER_SIZE 64
+
+/* All of the following functions take a struct filevec * as their first
+ * argument. This pointer is always assumed not to be NULL.
+ *
+ * Any functions that take an index assume the index is valid. */
+
+/* Opens the file at path as a vector of elements of size bytes, creating it
+ * if it doesn't exist or is empty. An existing file must have been written
+ * with the same element size. The checksum isn't checked (see
+ * filevec_verify). Returns 0 on success, nonzero on failure. */
+int
+filevec_open(struct filevec *filevec, const char *path, size_t size);
+
+/* Returns a pointer to the element at index. */
+static inline void *
+filevec_at(struct filevec *filevec, size_t index)
+{
+    ASSUME(filevec != NULL);
+    ASSUME(index < filevec->length);
+
+    return (char *)filevec->ptr + index * filevec->size;
+}
+
+/* Appends a copy of the element at elem. Returns 0 on success, nonzero on
+ * failure. */
+int
+filevec_push(struct filevec *filevec, const void *elem);
+
+/* Sets the length of filevec to length, and zeroes any new elements. Returns 0
+ * on success, nonzero on failure. */
+int
+filevec_resize(struct filevec *filevec, size_t length);
+
+/* Reserves enough space in the file for at least size elements. Returns 0 on
+ * success, nonzero on failure. */
+int
+filevec_reserve(struct filevec *filevec, size_t size);
+
+/* Truncates the file to hold exactly filevec->length elements. Returns 0 on
+ * success, nonzero on failure. */
+int
+filevec_shrink(struct filevec *filevec);
+
+/* Writes the length and checksum to the header, and flushes the file to disk.
+ * Returns 0 on success, nonzero on failure. */
+int
+filevec_sync(struct filevec *filevec);
+
+/* Returns 0 if the checksum in the header matches the elements, and nonzero
+ * if not, e.g. if the process writing the file didn't sync it before
+ * exiting. */
+int
+filevec_verify(struct filevec *filevec);
+
+/* Syncs filevec, and unmaps and closes the file. Returns 0 on success,
+ * nonzero on failure; the file is closed either way. */
+int
+filevec_close(struct filevec *filevec);
+
+#endif
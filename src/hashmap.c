@@ -0,0 +1,423 @@
+#include "main.h"
+#include "hashmap.h"
+
+#include "alloc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The hashmap grows before more than 3/4 of its slots are in use. Linear
+// probing's clusters, which lookups and removals have to scan, grow quickly
+// past that.
+#define LOAD_NUM 3
+#define LOAD_DEN 4
+
+// A key's home slot comes from the high bits of its hash, and its control byte
+// from the low 7
+#define H1(h) ((size_t)((h) >> 7))
+#define H2(h) ((unsigned char)((h) & 0x7F))
+
+uint64_t
+hashmap_hash_bytes(const void *key, size_t size)
+{
+    const unsigned char *p = key;
+    uint64_t h = UINT64_C(0x9E3779B97F4A7C15) ^ size;
+    uint64_t word;
+
+    for (; size >= sizeof(word); size -= sizeof(word), p += sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        h = (h ^ word) * UINT64_C(0xFF51AFD7ED558CCD);
+        h ^= h >> 32;
+    }
+
+    if (size > 0) {
+        word = 0;
+        memcpy(&word, p, size);
+        h = (h ^ word) * UINT64_C(0xFF51AFD7ED558CCD);
+    }
+
+    // MurmurHash3's finalizer, so every bit of the key affects H1 and H2
+    h ^= h >> 33;
+    h *= UINT64_C(0xFF51AFD7ED558CCD);
+    h ^= h >> 33;
+    h *= UINT64_C(0xC4CEB9FE1A85EC53);
+    h ^= h >> 33;
+
+    return h;
+}
+
+// Returns a mask with bit i set for each of the HASHMAP_GROUP control bytes
+// from ctrl that equals b
+static inline unsigned
+match(const unsigned char *ctrl, unsigned char b)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group,
+                                                      _mm_set1_epi8((char)b)));
+#else
+    unsigned mask = 0;
+
+    for (unsigned i = 0; i < HASHMAP_GROUP; ++i) {
+        mask |= (unsigned)(ctrl[i] == b) << i;
+    }
+
+    return mask;
+#endif
+}
+
+static inline uint64_t
+hash_key(const struct hashmap *hashmap, const void *key)
+{
+    return hashmap->hash == NULL
+        ? hashmap_hash_bytes(key, hashmap->key_size)
+        : hashmap->hash(key, hashmap->key_size);
+}
+
+static inline int
+equal_keys(const struct hashmap *hashmap, const void *a, const void *b)
+{
+    return hashmap->equal == NULL
+        ? memcmp(a, b, hashmap->key_size) == 0
+        : hashmap->equal(a, b, hashmap->key_size);
+}
+
+static inline char *
+slot(const struct hashmap *hashmap, size_t index)
+{
+    return hashmap->slots + index * hashmap->stride;
+}
+
+// The first HASHMAP_GROUP - 1 control bytes are repeated after the last one,
+// so a group starting near the end can be loaded in one go
+static inline void
+set_ctrl(struct hashmap *hashmap, size_t index, unsigned char b)
+{
+    hashmap->ctrl[index] = b;
+
+    if (index < HASHMAP_GROUP - 1) {
+        hashmap->ctrl[hashmap->capacity + index] = b;
+    }
+}
+
+// Returns the slot holding key, or hashmap->capacity if there isn't one. The
+// table always has empty slots, so this always ends.
+static size_t
+find(const struct hashmap *hashmap, const void *key, uint64_t h)
+{
+    size_t mask = hashmap->capacity - 1;
+    size_t pos, index;
+    unsigned bits;
+
+    if (hashmap->capacity == 0) {
+        return hashmap->capacity;
+    }
+
+    for (pos = H1(h) & mask;; pos = (pos + HASHMAP_GROUP) & mask) {
+        bits = match(hashmap->ctrl + pos, H2(h));
+
+        for (; bits != 0; bits &= bits - 1) {
+            index = (pos + (size_t)__builtin_ctz(bits)) & mask;
+
+            if (equal_keys(hashmap, key, slot(hashmap, index))) {
+                return index;
+            }
+        }
+
+        // Keys are never stored past an empty slot from their home
+        if (match(hashmap->ctrl + pos, HASHMAP_EMPTY) != 0) {
+            return hashmap->capacity;
+        }
+    }
+}
+
+static size_t
+find_empty(const struct hashmap *hashmap, uint64_t h)
+{
+    size_t mask = hashmap->capacity - 1;
+    size_t pos;
+    unsigned bits;
+
+    for (pos = H1(h) & mask;; pos = (pos + HASHMAP_GROUP) & mask) {
+        bits = match(hashmap->ctrl + pos, HASHMAP_EMPTY);
+
+        if (bits != 0) {
+            return (pos + (size_t)__builtin_ctz(bits)) & mask;
+        }
+    }
+}
+
+// Moves every key into new arrays of capacity slots
+static int
+rehash(struct hashmap *hashmap, size_t capacity)
+{
+    unsigned char *ctrl, *old_ctrl;
+    char *slots, *old_slots;
+    size_t old_capacity, index;
+    uint64_t h;
+
+    if (ERR(capacity > SIZE_MAX / hashmap->stride)) {
+        return -1;
+    }
+
+    ctrl = jmalloc(capacity + HASHMAP_GROUP);
+    if (ERR(ctrl == NULL)) {
+        return -1;
+    }
+
+    slots = jmalloc(capacity * hashmap->stride);
+    if (ERR(slots == NULL)) {
+        jfree(ctrl);
+        return -1;
+    }
+
+    memset(ctrl, HASHMAP_EMPTY, capacity + HASHMAP_GROUP);
+
+    old_ctrl = hashmap->ctrl;
+    old_slots = hashmap->slots;
+    old_capacity = hashmap->capacity;
+
+    hashmap->ctrl = ctrl;
+    hashmap->slots = slots;
+    hashmap->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_ctrl[i] == HASHMAP_EMPTY) {
+            continue;
+        }
+
+        h = hash_key(hashmap, old_slots + i * hashmap->stride);
+        index = find_empty(hashmap, h);
+
+        set_ctrl(hashmap, index, H2(h));
+        memcpy(slot(hashmap, index), old_slots + i * hashmap->stride,
+               hashmap->stride);
+    }
+
+    jfree(old_ctrl);
+    jfree(old_slots);
+
+    return 0;
+}
+
+// The largest power of 2 dividing size, up to 8
+static size_t
+align_of(size_t size)
+{
+    size_t align = 1;
+
+    while (align < 8 && size % (align * 2) == 0) {
+        align *= 2;
+    }
+
+    return align;
+}
+
+int
+hashmap_init(struct hashmap *hashmap, size_t key_size, size_t value_size,
+             uint64_t (*hash)(const void *, size_t),
+             int (*equal)(const void *, const void *, size_t))
+{
+    size_t key_align, value_align, align;
+
+    ASSUME(hashmap != NULL);
+    ASSUME(key_size > 0);
+
+    key_align = align_of(key_size);
+    value_align = value_size == 0 ? 1 : align_of(value_size);
+    align = key_align > value_align ? key_align : value_align;
+
+    hashmap->ctrl = NULL;
+    hashmap->slots = NULL;
+    hashmap->length = 0;
+    hashmap->capacity = 0;
+    hashmap->key_size = key_size;
+    hashmap->value_size = value_size;
+    hashmap->value_offset = (key_size + value_align - 1) & ~(value_align - 1);
+    hashmap->stride = (hashmap->value_offset + value_size + align - 1)
+        & ~(align - 1);
+    hashmap->hash = hash;
+    hashmap->equal = equal;
+
+    return 0;
+}
+
+void *
+hashmap_get(struct hashmap *hashmap, const void *key)
+{
+    size_t index;
+
+    ASSUME(hashmap != NULL);
+    ASSUME(key != NULL);
+
+    index = find(hashmap, key, hash_key(hashmap, key));
+    if (index == hashmap->capacity) {
+        return NULL;
+    }
+
+    return slot(hashmap, index) + hashmap->value_offset;
+}
+
+int
+hashmap_put(struct hashmap *hashmap, const void *key, const void *value)
+{
+    size_t index;
+    uint64_t h;
+
+    ASSUME(hashmap != NULL);
+    ASSUME(key != NULL);
+
+    h = hash_key(hashmap, key);
+    index = find(hashmap, key, h);
+
+    if (index == hashmap->capacity) {
+        if (ERR(hashmap_reserve(hashmap, hashmap->length + 1) != 0)) {
+            return -1;
+        }
+
+        index = find_empty(hashmap, h);
+        set_ctrl(hashmap, index, H2(h));
+        memcpy(slot(hashmap, index), key, hashmap->key_size);
+        ++hashmap->length;
+    }
+
+    if (value != NULL) {
+        memcpy(slot(hashmap, index) + hashmap->value_offset, value,
+               hashmap->value_size);
+    }
+
+    return 0;
+}
+
+int
+hashmap_remove(struct hashmap *hashmap, const void *key)
+{
+    size_t mask, index, next, home;
+
+    ASSUME(hashmap != NULL);
+    ASSUME(key != NULL);
+
+    index = find(hashmap, key, hash_key(hashmap, key));
+    if (index == hashmap->capacity) {
+        return -1;
+    }
+
+    mask = hashmap->capacity - 1;
+
+    // Shift back each key after the hole that would still be reachable from
+    // its home slot, moving the hole along, until the end of the cluster
+    for (next = (index + 1) & mask; hashmap->ctrl[next] != HASHMAP_EMPTY;
+         next = (next + 1) & mask) {
+
+        home = H1(hash_key(hashmap, slot(hashmap, next))) & mask;
+
+        if (((next - home) & mask) >= ((next - index) & mask)) {
+            set_ctrl(hashmap, index, hashmap->ctrl[next]);
+            memcpy(slot(hashmap, index), slot(hashmap, next),
+                   hashmap->stride);
+            index = next;
+        }
+    }
+
+    set_ctrl(hashmap, index, HASHMAP_EMPTY);
+    --hashmap->length;
+
+    return 0;
+}
+
+int
+hashmap_reserve(struct hashmap *hashmap, size_t size)
+{
+    size_t capacity;
+
+    ASSUME(hashmap != NULL);
+
+    if (ERR(size > SIZE_MAX / LOAD_DEN)) {
+        return -1;
+    }
+
+    if (size * LOAD_DEN < hashmap->capacity * LOAD_NUM) {
+        return 0;
+    }
+
+    // Strictly below the maximum load, so there's always an empty slot
+    for (capacity = HASHMAP_GROUP; size * LOAD_DEN >= capacity * LOAD_NUM;
+         capacity *= 2) {
+    }
+
+    return rehash(hashmap, capacity);
+}
+
+size_t
+hashmap_next(struct hashmap *hashmap, size_t index)
+{
+    unsigned bits;
+
+    ASSUME(hashmap != NULL);
+
+    for (; index < hashmap->capacity; index += HASHMAP_GROUP) {
+        bits = ~match(hashmap->ctrl + index, HASHMAP_EMPTY)
+            & ((1u << HASHMAP_GROUP) - 1);
+
+        if (bits != 0) {
+            index += (size_t)__builtin_ctz(bits);
+
+            // Past the end, this is one of the repeated control bytes
+            return index < hashmap->capacity ? index : hashmap->capacity;
+        }
+    }
+
+    return hashmap->capacity;
+}
+
+void *
+hashmap_key_at(struct hashmap *hashmap, size_t index)
+{
+    ASSUME(hashmap != NULL);
+    ASSUME(index < hashmap->capacity);
+    ASSUME(hashmap->ctrl[index] != HASHMAP_EMPTY);
+
+    return slot(hashmap, index);
+}
+
+void *
+hashmap_value_at(struct hashmap *hashmap, size_t index)
+{
+    ASSUME(hashmap != NULL);
+    ASSUME(index < hashmap->capacity);
+    ASSUME(hashmap->ctrl[index] != HASHMAP_EMPTY);
+
+    return slot(hashmap, index) + hashmap->value_offset;
+}
+
+void
+hashmap_clear(struct hashmap *hashmap)
+{
+    ASSUME(hashmap != NULL);
+
+    if (hashmap->capacity > 0) {
+        memset(hashmap->ctrl, HASHMAP_EMPTY,
+               hashmap->capacity + HASHMAP_GROUP);
+    }
+
+    hashmap->length = 0;
+}
+
+void
+hashmap_free(struct hashmap *hashmap)
+{
+    ASSUME(hashmap != NULL);
+
+    jfree(hashmap->ctrl);
+    jfree(hashmap->slots);
+
+    hashmap->ctrl = NULL;
+    hashmap->slots = NULL;
+    hashmap->length = 0;
+    hashmap->capacity = 0;
+}
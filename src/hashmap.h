@@ -0,0 +1,106 @@
+#ifndef HASHMAP_H_
+#define HASHMAP_H_ 1
+
+#include "main.h"
+
+#include <stdint.h>
+
+/* A hash map from keys of key_size bytes to values of value_size bytes, with
+ * open addressing.
+ *
+ * Each slot has a control byte in ctrl: HASHMAP_EMPTY, or 7 bits of its key's
+ * hash. A lookup compares the control bytes of 16 slots at once (with SSE2
+ * where it's available), and only compares keys whose 7 bits match, so it
+ * rarely touches a key that isn't the one it's looking for. Slots are probed
+ * linearly from a key's home slot, which lets removal shift the keys after it
+ * back instead of leaving a tombstone, so lookups never slow down as keys
+ * come and go.
+ *
+ * hash and equal may be NULL, for hashmap_hash_bytes and memcmp. The keys and
+ * values are stored together in slots, stride bytes apart, with each value at
+ * value_offset in its slot. */
+struct hashmap {
+    unsigned char *ctrl;
+    char *slots;
+    size_t length;
+    size_t capacity;
+    size_t key_size;
+    size_t value_size;
+    size_t value_offset;
+    size_t stride;
+    uint64_t (*hash)(const void *key, size_t size);
+    int (*equal)(const void *a, const void *b, size_t size);
+};
+
+/* The control byte of an empty slot. */
+#define HASHMAP_EMPTY 0x80
+
+/* The number of control bytes compared at once. The capacity is always 0 or a
+ * power of 2 that's at least this. */
+#define HASHMAP_GROUP 16
+
+/* All of the following functions take a struct hashmap * as their first
+ * argument. This pointer is always assumed not to be NULL.
+ *
+ * Pointers to keys and values are invalidated by any insertion or removal. */
+
+/* The default hash function, which mixes all the bits of the size bytes at
+ * key. */
+uint64_t
+hashmap_hash_bytes(const void *key, size_t size);
+
+/* Initializes the hashmap. hash returns the hash of a key, and equal returns
+ * nonzero if two keys are equal; either may be NULL for the default. Returns 0
+ * on success, nonzero on failure. */
+int
+hashmap_init(struct hashmap *hashmap, size_t key_size, size_t value_size,
+             uint64_t (*hash)(const void *, size_t),
+             int (*equal)(const void *, const void *, size_t));
+
+/* Returns a pointer to the value for key, or NULL if key isn't in the
+ * hashmap. */
+void *
+hashmap_get(struct hashmap *hashmap, const void *key);
+
+/* Sets the value for key to a copy of the value_size bytes at value, or leaves
+ * it uninitialized if value is NULL, adding key if it isn't already in the
+ * hashmap. Returns 0 on success, nonzero on failure. */
+int
+hashmap_put(struct hashmap *hashmap, const void *key, const void *value);
+
+/* Removes key and its value. Returns 0 on success, nonzero if key isn't in
+ * the hashmap. */
+int
+hashmap_remove(struct hashmap *hashmap, const void *key);
+
+/* Reserves enough space for at least size keys without rehashing. Returns 0 on
+ * success, nonzero on failure. */
+int
+hashmap_reserve(struct hashmap *hashmap, size_t size);
+
+/* Returns the index of the first slot in use at or after index, or
+ * hashmap->capacity if there isn't one. To visit every key:
+ *
+ *     for (size_t i = hashmap_next(hashmap, 0); i < hashmap->capacity;
+ *          i = hashmap_next(hashmap, i + 1)) */
+size_t
+hashmap_next(struct hashmap *hashmap, size_t index);
+
+/* Returns a pointer to the key in the slot at index, which must be in use. */
+void *
+hashmap_key_at(struct hashmap *hashmap, size_t index);
+
+/* Returns a pointer to the value in the slot at index, which must be in
+ * use. */
+void *
+hashmap_value_at(struct hashmap *hashmap, size_t index);
+
+/* Removes every key, keeping the memory. */
+void
+hashmap_clear(struct hashmap *hashmap);
+
+/* Frees the memory used by the hashmap. */
+void
+hashmap_free(struct hashmap *hashmap);
+
+#endif
@@ -0,0 +1,209 @@
+#include "main.h"
+#include "heap.h"
+
+#include "ptrvec.h"
+
+#define PARENT(heap, i) (((i) - 1) >> (heap)->shift)
+#define FIRST_CHILD(heap, i) (((i) << (heap)->shift) + 1)
+
+static inline void
+place(struct heap *heap, size_t index, void *ptr)
+{
+    heap->ptrvec.ptr[index] = ptr;
+
+    if (heap->set_index != NULL) {
+        heap->set_index(ptr, index);
+    }
+}
+
+// Both sifts move a hole through the heap instead of swapping, so each level
+// costs one store rather than two
+
+static size_t
+sift_up(struct heap *heap, size_t index)
+{
+    void *ptr;
+
+    ASSUME(heap != NULL);
+    ASSUME(index < heap->ptrvec.length);
+
+    ptr = heap->ptrvec.ptr[index];
+
+    while (index > 0) {
+        size_t parent = PARENT(heap, index);
+
+        if (heap->cmp(ptr, heap->ptrvec.ptr[parent]) >= 0) {
+            break;
+        }
+
+        place(heap, index, heap->ptrvec.ptr[parent]);
+        index = parent;
+    }
+
+    place(heap, index, ptr);
+
+    return index;
+}
+
+static void
+sift_down(struct heap *heap, size_t index)
+{
+    void *ptr;
+    size_t length, arity;
+
+    ASSUME(heap != NULL);
+    ASSUME(index < heap->ptrvec.length);
+
+    ptr = heap->ptrvec.ptr[index];
+    length = heap->ptrvec.length;
+    arity = (size_t)1 << heap->shift;
+
+    for (;;) {
+        size_t child, best, end;
+
+        child = FIRST_CHILD(heap, index);
+        if (child >= length || child < index) {
+            break;
+        }
+
+        end = length - child < arity ? length : child + arity;
+        best = child;
+
+        for (++child; child < end; ++child) {
+            if (heap->cmp(heap->ptrvec.ptr[child],
+                          heap->ptrvec.ptr[best]) < 0) {
+                best = child;
+            }
+        }
+
+        if (heap->cmp(heap->ptrvec.ptr[best], ptr) >= 0) {
+            break;
+        }
+
+        place(heap, index, heap->ptrvec.ptr[best]);
+        index = best;
+    }
+
+    place(heap, index, ptr);
+}
+
+int
+heap_init(struct heap *heap, int (*cmp)(const void *, const void *),
+          void (*set_index)(void *, size_t), size_t arity)
+{
+    ASSUME(heap != NULL);
+    ASSUME(cmp != NULL);
+    ASSERT(arity >= 2 && (arity & (arity - 1)) == 0,
+           "arity must be a power of 2 of at least 2");
+
+    heap->cmp = cmp;
+    heap->set_index = set_index;
+
+    heap->shift = 0;
+    while (((size_t)1 << heap->shift) < arity) {
+        ++heap->shift;
+    }
+
+    return ptrvec_init(&heap->ptrvec);
+}
+
+int
+heap_push(struct heap *heap, const void *ptr)
+{
+    ASSUME(heap != NULL);
+
+    if (ERR(ptrvec_push(&heap->ptrvec, ptr) != 0)) {
+        return -1;
+    }
+
+    sift_up(heap, heap->ptrvec.length - 1);
+
+    return 0;
+}
+
+void *
+heap_pop(struct heap *heap)
+{
+    ASSUME(heap != NULL);
+    ASSUME(heap->ptrvec.length > 0);
+
+    return heap_remove(heap, 0);
+}
+
+void *
+heap_peek(struct heap *heap)
+{
+    ASSUME(heap != NULL);
+    ASSUME(heap->ptrvec.length > 0);
+
+    return heap->ptrvec.ptr[0];
+}
+
+void
+heap_heapify(struct heap *heap)
+{
+    size_t i;
+
+    ASSUME(heap != NULL);
+
+    if (heap->ptrvec.length < 2) {
+        if (heap->ptrvec.length == 1 && heap->set_index != NULL) {
+            heap->set_index(heap->ptrvec.ptr[0], 0);
+        }
+
+        return;
+    }
+
+    // sift_down places every internal node, but leaves that never move would
+    // otherwise not be told their index
+    if (heap->set_index != NULL) {
+        for (i = PARENT(heap, heap->ptrvec.length - 1) + 1;
+             i < heap->ptrvec.length; ++i) {
+
+            heap->set_index(heap->ptrvec.ptr[i], i);
+        }
+    }
+
+    i = PARENT(heap, heap->ptrvec.length - 1) + 1;
+    while (i-- > 0) {
+        sift_down(heap, i);
+    }
+}
+
+void
+heap_update(struct heap *heap, size_t index)
+{
+    ASSUME(heap != NULL);
+    ASSUME(index < heap->ptrvec.length);
+
+    if (sift_up(heap, index) == index) {
+        sift_down(heap, index);
+    }
+}
+
+void *
+heap_remove(struct heap *heap, size_t index)
+{
+    void *ptr, *last;
+
+    ASSUME(heap != NULL);
+    ASSUME(index < heap->ptrvec.length);
+
+    ptr = heap->ptrvec.ptr[index];
+    last = ptrvec_pop(&heap->ptrvec);
+
+    if (index < heap->ptrvec.length) {
+        heap->ptrvec.ptr[index] = last;
+        heap_update(heap, index);
+    }
+
+    return ptr;
+}
+
+void
+heap_free(struct heap *heap)
+{
+    ASSUME(heap != NULL);
+
+    ptrvec_free(&heap->ptrvec);
+}
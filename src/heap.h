@@ -0,0 +1,67 @@
+#ifndef HEAP_H_
+#define HEAP_H_ 1
+
+#include "main.h"
+#include "ptrvec.h"
+
+/* A priority queue of pointers, stored as an implicit d-ary heap in a ptrvec.
+ * The pointer that compares lowest with cmp is at the top of the heap. */
+struct heap {
+    struct ptrvec ptrvec;
+    int (*cmp)(const void *, const void *);
+    void (*set_index)(void *, size_t);
+    unsigned shift;
+};
+
+/* All of the following functions take a struct heap * as their first
+ * argument. This pointer is always assumed not to be NULL.
+ *
+ * Any functions that take an index assume the index is valid.
+ *
+ * Note: the pointers contained in a heap are not managed by the heap. */
+
+/* Initializes the heap. cmp(a, b) returns a negative number if a should come
+ * out of the heap before b, a positive number if after, and 0 if either order
+ * is fine. If set_index isn't NULL, set_index(ptr, index) is called whenever
+ * ptr moves to a new index in heap->ptrvec, so that pointers can remember
+ * their position for heap_update and heap_remove. arity is the number of
+ * children of each node, and must be a power of 2 of at least 2; 4 is usually
+ * faster than 2 for large heaps, since siblings share a cache line. Returns 0
+ * on success, nonzero on failure. */
+int
+heap_init(struct heap *heap, int (*cmp)(const void *, const void *),
+          void (*set_index)(void *, size_t), size_t arity);
+
+/* Adds ptr to the heap. Returns 0 on success, nonzero on failure. */
+int
+heap_push(struct heap *heap, const void *ptr);
+
+/* Removes the top pointer from the heap and returns it. Assumes the heap is not
+ * empty. */
+void *
+heap_pop(struct heap *heap);
+
+/* Returns the top pointer of the heap. Assumes the heap is not empty. */
+void *
+heap_peek(struct heap *heap);
+
+/* Restores the heap order of every pointer in heap->ptrvec in O(n). This is
+ * faster than pushing the pointers one by one when many pointers have been
+ * added to heap->ptrvec directly, e.g. with ptrvec_push_v. */
+void
+heap_heapify(struct heap *heap);
+
+/* Restores the heap order after the priority of the pointer at index has
+ * changed, in either direction. */
+void
+heap_update(struct heap *heap, size_t index);
+
+/* Removes the pointer at index from the heap and returns it. */
+void *
+heap_remove(struct heap *heap, size_t index);
+
+/* Frees the memory used by the heap. */
+void
+heap_free(struct heap *heap);
+
+#endif
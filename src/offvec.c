@@ -0,0 +1,233 @@
+#include "main.h"
+#include "offvec.h"
+
+#include "alloc.h"
+#include "vec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static inline uint32_t
+encode(const struct offvec *offvec, const void *ptr)
+{
+    if (ptr == NULL) {
+        return OFFVEC_NULL;
+    }
+
+    ASSERT((const char *)ptr >= offvec->base
+           && (size_t)((const char *)ptr - offvec->base) < OFFVEC_NULL,
+           "pointer is outside of the offvec's region");
+
+    return (uint32_t)((const char *)ptr - offvec->base);
+}
+
+static inline void *
+decode(const struct offvec *offvec, uint32_t off)
+{
+    if (off == OFFVEC_NULL) {
+        return NULL;
+    }
+
+    return offvec->base + off;
+}
+
+int
+offvec_init(struct offvec *offvec, void *base)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(base != NULL);
+
+    offvec->base = base;
+    offvec->off = NULL;
+    offvec->length = 0;
+    offvec->capacity = 0;
+
+    return 0;
+}
+
+void *
+offvec_get(struct offvec *offvec, size_t index)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(index < offvec->length);
+
+    return decode(offvec, offvec->off[index]);
+}
+
+void
+offvec_set(struct offvec *offvec, size_t index, const void *ptr)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(index < offvec->length);
+
+    offvec->off[index] = encode(offvec, ptr);
+}
+
+int
+offvec_push(struct offvec *offvec, const void *ptr)
+{
+    ASSUME(offvec != NULL);
+
+    if (offvec->capacity == offvec->length
+        && ERR(vec_reserve_one_min(&offvec->off, &offvec->capacity,
+                                   sizeof(*offvec->off)) != 0)) {
+
+        return -1;
+    }
+
+    offvec->off[offvec->length++] = encode(offvec, ptr);
+
+    return 0;
+}
+
+void *
+offvec_pop(struct offvec *offvec)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(offvec->length > 0);
+
+    return decode(offvec, offvec->off[--offvec->length]);
+}
+
+void *
+offvec_peek(struct offvec *offvec)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(offvec->length > 0);
+
+    return decode(offvec, offvec->off[offvec->length - 1]);
+}
+
+int
+offvec_insert(struct offvec *offvec, const void *ptr, size_t index)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(index <= offvec->length);
+
+    if (offvec->length == offvec->capacity
+        && ERR(vec_reserve_one_min(&offvec->off, &offvec->capacity,
+                                   sizeof(*offvec->off)) != 0)) {
+
+        return -1;
+    }
+
+    memmove(offvec->off + index + 1, offvec->off + index,
+            (offvec->length - index) * sizeof(*offvec->off));
+
+    offvec->off[index] = encode(offvec, ptr);
+
+    ++offvec->length;
+
+    return 0;
+}
+
+void
+offvec_remove(struct offvec *offvec, size_t index)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(index < offvec->length);
+
+    memmove(offvec->off + index, offvec->off + index + 1,
+            (offvec->length - index - 1) * sizeof(*offvec->off));
+
+    --offvec->length;
+}
+
+void
+offvec_remove_fast(struct offvec *offvec, size_t index)
+{
+    ASSUME(offvec != NULL);
+    ASSUME(index < offvec->length);
+
+    offvec->off[index] = offvec->off[--offvec->length];
+}
+
+int
+offvec_contains(struct offvec *offvec, const void *ptr)
+{
+    ASSUME(offvec != NULL);
+
+    return offvec_find(offvec, ptr) != offvec->length;
+}
+
+size_t
+offvec_find(struct offvec *offvec, const void *ptr)
+{
+    uint32_t off;
+    size_t i;
+
+    ASSUME(offvec != NULL);
+
+    // A pointer outside the region can't be in offvec
+    if (ptr != NULL && ((const char *)ptr < offvec->base
+                        || (size_t)((const char *)ptr - offvec->base)
+                           >= OFFVEC_NULL)) {
+
+        return offvec->length;
+    }
+
+    off = encode(offvec, ptr);
+    i = 0;
+
+#ifdef __SSE2__
+    {
+        __m128i needle = _mm_set1_epi32((int)off);
+
+        for (; offvec->length - i >= 8; i += 8) {
+            __m128i a, b;
+            int mask;
+
+            a = _mm_loadu_si128((const __m128i *)(const void *)
+                                (offvec->off + i));
+            b = _mm_loadu_si128((const __m128i *)(const void *)
+                                (offvec->off + i + 4));
+            mask = _mm_movemask_epi8(_mm_cmpeq_epi32(a, needle))
+                | _mm_movemask_epi8(_mm_cmpeq_epi32(b, needle)) << 16;
+
+            if (mask != 0) {
+                // Each matching offset sets 4 bits of the mask
+                return i + (size_t)__builtin_ctz((unsigned)mask) / 4;
+            }
+        }
+    }
+#endif
+
+    for (; i < offvec->length; ++i) {
+        if (offvec->off[i] == off) {
+            return i;
+        }
+    }
+
+    return offvec->length;
+}
+
+int
+offvec_reserve(struct offvec *offvec, size_t size)
+{
+    ASSUME(offvec != NULL);
+
+    if (size <= offvec->capacity) {
+        return 0;
+    }
+
+    if (ERR(vec_reserve_min(&offvec->off, &offvec->capacity,
+                            sizeof(*offvec->off), size - offvec->length)
+            != 0)) {
+
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+offvec_free(struct offvec *offvec)
+{
+    ASSUME(offvec != NULL);
+
+    jfree(offvec->off);
+}
@@ -0,0 +1,89 @@
+#ifndef OFFVEC_H_
+#define OFFVEC_H_ 1
+
+#include "main.h"
+
+#include <stdint.h>
+
+/* A vector of pointers into a single region of less than 4 GB starting at
+ * base, stored as 32 bit offsets from base. This takes half the memory of a
+ * ptrvec on 64 bit hosts. NULL can be stored as well. */
+struct offvec {
+    char *base;
+    uint32_t *off;
+    size_t length;
+    size_t capacity;
+};
+
+/* The offset used to store NULL. */
+#define OFFVEC_NULL UINT32_MAX
+
+/* All of the following functions take a struct offvec * as their first
+ * argument. This pointer is always assumed not to be NULL.
+ *
+ * Any functions that take an index assume the index is valid. Any functions
+ * that take a pointer assume it is either NULL or points into the region
+ * starting at base, less than OFFVEC_NULL bytes after base.
+ *
+ * Note: the pointers contained in an offvec are not managed by the offvec. */
+
+/* Initializes the offvec with base as the start of the region. Returns 0 on
+ * success, nonzero on failure. */
+int
+offvec_init(struct offvec *offvec, void *base);
+
+/* Returns the pointer at index. */
+void *
+offvec_get(struct offvec *offvec, size_t index);
+
+/* Sets the pointer at index to ptr. */
+void
+offvec_set(struct offvec *offvec, size_t index, const void *ptr);
+
+/* Appends ptr to the end of offvec. Returns 0 on success, nonzero on failure. */
+int
+offvec_push(struct offvec *offvec, const void *ptr);
+
+/* Removes the last pointer from offvec and returns it. Assumes offvec is not
+ * empty. */
+void *
+offvec_pop(struct offvec *offvec);
+
+/* Returns the last pointer in offvec. Assumes offvec is not empty. */
+void *
+offvec_peek(struct offvec *offvec);
+
+/* Inserts ptr into offvec at index, shifting all pointers at and after index
+ * by one. Returns 0 on success, nonzero on failure. */
+int
+offvec_insert(struct offvec *offvec, const void *ptr, size_t index);
+
+/* Removes the pointer at index from offvec, shifting each pointer after index
+ * by one. */
+void
+offvec_remove(struct offvec *offvec, size_t index);
+
+/* Same as offvec_remove, but faster. However, this doesn't preserve the
+ * ordering of the pointers. */
+void
+offvec_remove_fast(struct offvec *offvec, size_t index);
+
+/* Returns 1 if offvec contains ptr, otherwise returns 0. */
+int
+offvec_contains(struct offvec *offvec, const void *ptr);
+
+/* Returns the index where ptr is. If ptr is not in offvec, returns
+ * offvec->length. Compares 8 offsets at a time where SSE2 is available. */
+size_t
+offvec_find(struct offvec *offvec, const void *ptr);
+
+/* Reserves enough memory for at least size pointers. Returns 0 on success,
+ * nonzero on failure. */
+int
+offvec_reserve(struct offvec *offvec, size_t size);
+
+/* Frees the memory used by offvec. */
+void
+offvec_free(struct offvec *offvec);
+
+#endif
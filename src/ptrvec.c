@@ -1,19 +1,60 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "main.h"
 #include "ptrvec.h"
 
 #include "alloc.h"
 #include "vec.h"
 
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The number of pointers each candidate prefetch distance is timed over
+#define PREFETCH_TUNE_RUN 2048
+
+// The number of times each candidate is timed, of which the fastest counts
+#define PREFETCH_TUNE_REPS 4
+
+// The distances tried when tuning
+static const size_t prefetch_candidates[] = {2, 4, 8, 16, 32, 64};
+
+#define N_PREFETCH_CANDIDATES \
+    (sizeof(prefetch_candidates) / sizeof(*prefetch_candidates))
+
+// Each timed run, including one per rep without prefetching, gets its own
+// window of pointers
+#define PREFETCH_TUNE_WINDOWS (PREFETCH_TUNE_REPS * (N_PREFETCH_CANDIDATES + 1))
+
+// The shortest ptrvec tuned on, so that the timed runs are a small part of
+// the work
+#define PREFETCH_TUNE_MIN (4 * PREFETCH_TUNE_WINDOWS * PREFETCH_TUNE_RUN)
+
+// The tuned distance when no candidate beat not prefetching at all
+#define PREFETCH_NONE SIZE_MAX
+
+// The distance chosen by tuning, shared by every thread, or 0 until it's
+// chosen. Only the thread that sets prefetch_tuning tunes, once.
+static size_t prefetch_distance = 0;
+static int prefetch_tuning = 0;
 
 int
 ptrvec_init(struct ptrvec *ptrvec)
+{
+    return ptrvec_init_a(ptrvec, NULL);
+}
+
+int
+ptrvec_init_a(struct ptrvec *ptrvec, const struct allocator *allocator)
 {
     ASSUME(ptrvec != NULL);
 
     ptrvec->ptr = NULL;
     ptrvec->length = 0;
     ptrvec->capacity = 0;
+    ptrvec->allocator = allocator;
 
     return 0;
 }
@@ -36,13 +77,15 @@ ptrvec_push(struct ptrvec *ptrvec, const void *ptr)
     ASSUME(ptrvec != NULL);
 
     if (ptrvec->capacity == ptrvec->length
-        && ERR(vec_reserve_one_min(&ptrvec->ptr, &ptrvec->capacity,
-                                   sizeof(*ptrvec->ptr)) != 0)) {
+        && ERR(vec_reserve_one_min_a(ptrvec->allocator, &ptrvec->ptr,
+                                     &ptrvec->capacity, sizeof(*ptrvec->ptr))
+               != 0)) {
 
         return -1;
     }
 
-    ptrvec->ptr[ptrvec->length++] = (void *)ptr;
+    // The pointers are never written through, so const ones are kept as is
+    ptrvec->ptr[ptrvec->length++] = (void *)(uintptr_t)ptr;
 
     return 0;
 }
@@ -88,16 +131,17 @@ ptrvec_insert(struct ptrvec *ptrvec, const void *ptr, size_t index)
     ASSUME(index <= ptrvec->length);
 
     if (ptrvec->length == ptrvec->capacity
-        && ERR(vec_reserve_one_min(&ptrvec->ptr, &ptrvec->capacity,
-                                   sizeof(*ptrvec->ptr)) != 0)) {
+        && ERR(vec_reserve_one_min_a(ptrvec->allocator, &ptrvec->ptr,
+                                     &ptrvec->capacity, sizeof(*ptrvec->ptr))
+               != 0)) {
 
         return -1;
     }
 
     memmove(ptrvec->ptr + index + 1, ptrvec->ptr + index,
-            (ptrvec->length - index - 1) * sizeof(*ptrvec->ptr));
+            (ptrvec->length - index) * sizeof(*ptrvec->ptr));
 
-    ptrvec->ptr[index] = (void *)ptr;
+    ptrvec->ptr[index] = (void *)(uintptr_t)ptr;
 
     ++ptrvec->length;
 
@@ -172,6 +216,124 @@ ptrvec_remove_fast_r(struct ptrvec *ptrvec, size_t begin, size_t end)
     ptrvec->length -= (end - begin);
 }
 
+size_t
+ptrvec_remove_if(struct ptrvec *ptrvec, int (*pred)(void *, void *),
+                 void *ctx)
+{
+    size_t kept;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(pred != NULL);
+
+    kept = 0;
+
+    for (size_t i = 0; i < ptrvec->length; ++i) {
+        if (!pred(ptrvec->ptr[i], ctx)) {
+            ptrvec->ptr[kept++] = ptrvec->ptr[i];
+        }
+    }
+
+    kept = ptrvec->length - kept;
+    ptrvec->length -= kept;
+
+    return kept;
+}
+
+size_t
+ptrvec_remove_if_fast(struct ptrvec *ptrvec, int (*pred)(void *, void *),
+                      void *ctx)
+{
+    size_t i, end;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(pred != NULL);
+
+    i = 0;
+    end = ptrvec->length;
+
+    // Everything in [end, length) has already been removed, so each pointer
+    // is tested exactly once
+    while (i < end) {
+        if (pred(ptrvec->ptr[i], ctx)) {
+            ptrvec->ptr[i] = ptrvec->ptr[--end];
+        } else {
+            ++i;
+        }
+    }
+
+    i = ptrvec->length - end;
+    ptrvec->length = end;
+
+    return i;
+}
+
+void
+ptrvec_remove_indices(struct ptrvec *ptrvec, const size_t *indices, size_t n)
+{
+    size_t kept;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(IMPLIES(n > 0, indices != NULL));
+
+    if (n == 0) {
+        return;
+    }
+
+    kept = indices[0];
+
+    // Shift each run of kept pointers between two removed indices down in one
+    // memmove
+    for (size_t i = 0; i < n; ++i) {
+        size_t begin, end;
+
+        ASSUME(indices[i] < ptrvec->length);
+        ASSUME(IMPLIES(i > 0, indices[i - 1] < indices[i]));
+
+        begin = indices[i] + 1;
+        end = i + 1 < n ? indices[i + 1] : ptrvec->length;
+
+        memmove(ptrvec->ptr + kept, ptrvec->ptr + begin,
+                (end - begin) * sizeof(*ptrvec->ptr));
+        kept += end - begin;
+    }
+
+    ptrvec->length = kept;
+}
+
+void
+ptrvec_remove_indices_fast(struct ptrvec *ptrvec, const size_t *indices,
+                           size_t n)
+{
+    size_t end, last;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(IMPLIES(n > 0, indices != NULL));
+
+    end = ptrvec->length;
+    last = n;
+
+    // Fill the holes from the front, taking pointers from the back. Indices at
+    // the back are removed by just dropping them, which is why last walks
+    // backwards through indices.
+    for (size_t i = 0; i < last; ++i) {
+        ASSUME(indices[i] < ptrvec->length);
+        ASSUME(IMPLIES(i > 0, indices[i - 1] < indices[i]));
+
+        while (last > i && indices[last - 1] == end - 1) {
+            --last;
+            --end;
+        }
+
+        if (i == last) {
+            break;
+        }
+
+        ptrvec->ptr[indices[i]] = ptrvec->ptr[--end];
+    }
+
+    ptrvec->length -= n;
+}
+
 int
 ptrvec_contains(struct ptrvec *ptrvec, const void *ptr)
 {
@@ -237,9 +399,9 @@ ptrvec_reserve(struct ptrvec *ptrvec, size_t size)
         return 0;
     }
 
-    if (ERR(vec_reserve_min(&ptrvec->ptr, &ptrvec->capacity,
-                            sizeof(*ptrvec->ptr), size - ptrvec->length)
-            != 0)) {
+    if (ERR(vec_reserve_min_a(ptrvec->allocator, &ptrvec->ptr,
+                              &ptrvec->capacity, sizeof(*ptrvec->ptr),
+                              size - ptrvec->length) != 0)) {
 
         return -1;
     }
@@ -263,7 +425,7 @@ ptrvec_free(struct ptrvec *ptrvec)
 {
     ASSUME(ptrvec != NULL);
 
-    jfree(ptrvec->ptr);
+    jfree_a(ptrvec->allocator, ptrvec->ptr);
 }
 
 void
@@ -271,9 +433,452 @@ ptrvec_delete(struct ptrvec *ptrvec)
 {
     ASSUME(ptrvec != NULL);
 
-    for (size_t i = 0; i < ptrvec->length; ++i) {
-        jfree(ptrvec->ptr[i]);
+    jfree_batch(ptrvec->ptr, ptrvec->length);
+
+    ptrvec_free(ptrvec);
+}
+
+int
+ptrvec_push_new(struct ptrvec *ptrvec, size_t count, size_t size)
+{
+    ASSUME(ptrvec != NULL);
+
+    if (ERR(ptrvec_reserve(ptrvec, ptrvec->length + count) != 0)) {
+        return -1;
+    }
+
+    if (ERR(jmalloc_batch(count, size, ptrvec->ptr + ptrvec->length) != 0)) {
+        return -1;
+    }
+
+    ptrvec->length += count;
+
+    return 0;
+}
+
+// Calls fn on the n pointers at ptr, prefetching distance pointers ahead
+static void
+for_each_prefetch(void **ptr, size_t n, size_t distance,
+                  void (*fn)(void *, void *), void *ctx)
+{
+    size_t i = 0, end;
+
+    end = n > distance ? n - distance : 0;
+
+    for (; i < end; ++i) {
+        __builtin_prefetch(ptr[i + distance]);
+        fn(ptr[i], ctx);
+    }
+
+    for (; i < n; ++i) {
+        fn(ptr[i], ctx);
+    }
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Keeps the pointee reads in probe from being optimized away
+static volatile unsigned char probe_sink;
+
+// Reads the first byte of each non-NULL pointee of the n pointers at ptr,
+// prefetching distance pointers ahead, or not at all if distance is 0, and
+// returns the time it took
+static uint64_t
+probe(void **ptr, size_t n, size_t distance)
+{
+    uint64_t start;
+    unsigned char sum = 0;
+
+    start = now_ns();
+
+    for (size_t i = 0; i < n; ++i) {
+        if (distance != 0 && i + distance < n) {
+            __builtin_prefetch(ptr[i + distance]);
+        }
+        if (ptr[i] != NULL) {
+            sum = (unsigned char)(sum + *(const unsigned char *)ptr[i]);
+        }
+    }
+
+    probe_sink = sum;
+
+    return now_ns() - start;
+}
+
+// Returns the candidate distance that reads the pointees at ptr fastest, or
+// PREFETCH_NONE if none is faster than not prefetching. Every timed run reads
+// a window of pointees no earlier run has touched, since prefetching can only
+// help with misses; the order of the runs is rotated with each rep, so no
+// candidate always lands on the same part of ptr, and the fastest of each
+// candidate's runs is kept to leave out interruptions.
+static size_t
+tune_distance(void **ptr)
+{
+    uint64_t best[N_PREFETCH_CANDIDATES + 1], elapsed, fastest;
+    size_t window = 0, slot, distance;
+
+    for (size_t i = 0; i <= N_PREFETCH_CANDIDATES; ++i) {
+        best[i] = UINT64_MAX;
+    }
+
+    // Slot 0 is without prefetching, and slot i + 1 is candidate i
+    for (size_t rep = 0; rep < PREFETCH_TUNE_REPS; ++rep) {
+        for (size_t i = 0; i <= N_PREFETCH_CANDIDATES; ++i) {
+            slot = (rep + i) % (N_PREFETCH_CANDIDATES + 1);
+
+            elapsed = probe(ptr + window * PREFETCH_TUNE_RUN, PREFETCH_TUNE_RUN,
+                            slot == 0 ? 0 : prefetch_candidates[slot - 1]);
+            ++window;
+
+            best[slot] = elapsed < best[slot] ? elapsed : best[slot];
+        }
+    }
+
+    distance = PREFETCH_NONE;
+    fastest = best[0];
+    for (size_t i = 0; i < N_PREFETCH_CANDIDATES; ++i) {
+        if (best[i + 1] < fastest) {
+            fastest = best[i + 1];
+            distance = prefetch_candidates[i];
+        }
+    }
+
+    return distance;
+}
+
+// Returns the tuned distance, or the default until it's tuned
+static inline size_t
+tuned_distance(void)
+{
+    size_t distance = __atomic_load_n(&prefetch_distance, __ATOMIC_ACQUIRE);
+
+    return distance != 0 ? distance : PTRVEC_PREFETCH_DISTANCE;
+}
+
+void
+ptrvec_for_each_prefetch(struct ptrvec *ptrvec, size_t distance,
+                         void (*fn)(void *, void *), void *ctx)
+{
+    ASSUME(ptrvec != NULL);
+    ASSUME(fn != NULL);
+
+    if (distance == 0) {
+        distance = tuned_distance();
+
+        if (ptrvec->length >= PREFETCH_TUNE_MIN
+            && __atomic_load_n(&prefetch_distance, __ATOMIC_RELAXED) == 0
+            && !__atomic_exchange_n(&prefetch_tuning, 1, __ATOMIC_ACQ_REL)) {
+
+            distance = tune_distance(ptrvec->ptr);
+            __atomic_store_n(&prefetch_distance, distance, __ATOMIC_RELEASE);
+        }
+    }
+
+    // PREFETCH_NONE is past the end of any ptrvec, so nothing is prefetched
+    for_each_prefetch(ptrvec->ptr, ptrvec->length, distance, fn, ctx);
+}
+
+void
+ptrvec_for_each_batch_prefetch(struct ptrvec *ptrvec, size_t batch,
+                               void (*fn)(void **, size_t, void *), void *ctx)
+{
+    size_t n, end;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(fn != NULL);
+
+    if (batch == 0) {
+        batch = tuned_distance();
+        batch = batch != PREFETCH_NONE ? batch : PTRVEC_PREFETCH_DISTANCE;
+    }
+
+    end = batch < ptrvec->length ? batch : ptrvec->length;
+    for (size_t i = 0; i < end; ++i) {
+        __builtin_prefetch(ptrvec->ptr[i]);
+    }
+
+    for (size_t i = 0; i < ptrvec->length; i += n) {
+        n = ptrvec->length - i < batch ? ptrvec->length - i : batch;
+
+        end = ptrvec->length - i - n < batch ? ptrvec->length : i + n + batch;
+        for (size_t j = i + n; j < end; ++j) {
+            __builtin_prefetch(ptrvec->ptr[j]);
+        }
+
+        fn(ptrvec->ptr + i, n, ctx);
     }
+}
+
+struct par_chunk {
+    void **ptr;
+    size_t length;
+    void (*for_each)(void *, void *);
+    void *(*transform)(void *, void *);
+    void *ctx;
+};
+
+static void
+run_chunk(const struct par_chunk *chunk)
+{
+    ASSUME(chunk != NULL);
+
+    if (chunk->transform != NULL) {
+        for (size_t i = 0; i < chunk->length; ++i) {
+            chunk->ptr[i] = chunk->transform(chunk->ptr[i], chunk->ctx);
+        }
+    } else {
+        for (size_t i = 0; i < chunk->length; ++i) {
+            chunk->for_each(chunk->ptr[i], chunk->ctx);
+        }
+    }
+}
 
-    jfree(ptrvec->ptr);
+static void *
+par_worker(void *arg)
+{
+    run_chunk(arg);
+
+    return NULL;
+}
+
+static size_t
+par_threads(size_t length, size_t nthreads)
+{
+    size_t max;
+
+    if (nthreads == 0) {
+        long cpus;
+
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    max = length / PTRVEC_PAR_MIN_CHUNK;
+    if (max == 0) {
+        max = 1;
+    }
+
+    return nthreads < max ? nthreads : max;
+}
+
+static int
+par_run(struct ptrvec *ptrvec, const struct par_chunk *job, size_t nthreads)
+{
+    struct par_chunk *chunks;
+    pthread_t *threads;
+    int *started;
+    size_t per, extra, offset;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(job != NULL);
+
+    nthreads = par_threads(ptrvec->length, nthreads);
+
+    if (nthreads == 1) {
+        struct par_chunk chunk = *job;
+
+        chunk.ptr = ptrvec->ptr;
+        chunk.length = ptrvec->length;
+        run_chunk(&chunk);
+
+        return 0;
+    }
+
+    chunks = jmalloc(nthreads * sizeof(*chunks));
+    threads = jmalloc(nthreads * sizeof(*threads));
+    started = jcalloc(nthreads, sizeof(*started));
+    if (ERR(chunks == NULL) || ERR(threads == NULL) || ERR(started == NULL)) {
+        jfree(chunks);
+        jfree(threads);
+        jfree(started);
+        return -1;
+    }
+
+    per = ptrvec->length / nthreads;
+    extra = ptrvec->length % nthreads;
+    offset = 0;
+
+    for (size_t i = 0; i < nthreads; ++i) {
+        chunks[i] = *job;
+        chunks[i].ptr = ptrvec->ptr + offset;
+        chunks[i].length = per + (i < extra);
+        offset += chunks[i].length;
+    }
+
+    ASSERT(offset == ptrvec->length, "chunks should cover the whole ptrvec");
+
+    for (size_t i = 1; i < nthreads; ++i) {
+        started[i] = pthread_create(&threads[i], NULL, &par_worker,
+                                    &chunks[i]) == 0;
+    }
+
+    run_chunk(&chunks[0]);
+
+    for (size_t i = 1; i < nthreads; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            run_chunk(&chunks[i]);
+        }
+    }
+
+    jfree(chunks);
+    jfree(threads);
+    jfree(started);
+
+    return 0;
+}
+
+int
+ptrvec_for_each_par(struct ptrvec *ptrvec, void (*fn)(void *, void *),
+                    void *ctx, size_t nthreads)
+{
+    struct par_chunk job;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(fn != NULL);
+
+    job.ptr = NULL;
+    job.length = 0;
+    job.for_each = fn;
+    job.transform = NULL;
+    job.ctx = ctx;
+
+    return par_run(ptrvec, &job, nthreads);
+}
+
+int
+ptrvec_transform_par(struct ptrvec *ptrvec, void *(*fn)(void *, void *),
+                     void *ctx, size_t nthreads)
+{
+    struct par_chunk job;
+
+    ASSUME(ptrvec != NULL);
+    ASSUME(fn != NULL);
+
+    job.ptr = NULL;
+    job.length = 0;
+    job.for_each = NULL;
+    job.transform = fn;
+    job.ctx = ctx;
+
+    return par_run(ptrvec, &job, nthreads);
+}
+
+static void
+free_one(void *ptr, void *ctx)
+{
+    UNUSED(ctx);
+
+    jfree(ptr);
+}
+
+int
+ptrvec_delete_par(struct ptrvec *ptrvec, size_t nthreads)
+{
+    ASSUME(ptrvec != NULL);
+
+    if (ERR(ptrvec_for_each_par(ptrvec, &free_one, NULL, nthreads) != 0)) {
+        return -1;
+    }
+
+    ptrvec_free(ptrvec);
+
+    return 0;
+}
+
+struct async_delete {
+    struct ptrvec ptrvec;
+    size_t nthreads;
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_done = PTHREAD_COND_INITIALIZER;
+static size_t async_pending = 0;
+
+static void *
+async_worker(void *arg)
+{
+    struct async_delete *job = arg;
+
+    // If the parallel delete can't get its bookkeeping memory, fall back to
+    // freeing everything on this thread
+    if (ERR(ptrvec_delete_par(&job->ptrvec, job->nthreads) != 0)) {
+        ptrvec_delete(&job->ptrvec);
+    }
+    jfree(job);
+
+    pthread_mutex_lock(&async_lock);
+    if (--async_pending == 0) {
+        pthread_cond_broadcast(&async_done);
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    return NULL;
+}
+
+int
+ptrvec_delete_async(struct ptrvec *ptrvec, size_t nthreads)
+{
+    struct async_delete *job;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err;
+
+    ASSUME(ptrvec != NULL);
+
+    job = jmalloc(sizeof(*job));
+    if (ERR(job == NULL)) {
+        return -1;
+    }
+
+    job->ptrvec = *ptrvec;
+    job->nthreads = nthreads;
+
+    if (ERR(pthread_attr_init(&attr) != 0)) {
+        jfree(job);
+        return -1;
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&async_lock);
+    ++async_pending;
+    pthread_mutex_unlock(&async_lock);
+
+    err = pthread_create(&thread, &attr, &async_worker, job);
+    pthread_attr_destroy(&attr);
+
+    if (ERR(err != 0)) {
+        pthread_mutex_lock(&async_lock);
+        --async_pending;
+        pthread_mutex_unlock(&async_lock);
+
+        jfree(job);
+
+        if (ERR(ptrvec_delete_par(ptrvec, nthreads) != 0)) {
+            return -1;
+        }
+    }
+
+    ptrvec_init_a(ptrvec, ptrvec->allocator);
+
+    return 0;
+}
+
+void
+ptrvec_delete_wait(void)
+{
+    pthread_mutex_lock(&async_lock);
+    while (async_pending != 0) {
+        pthread_cond_wait(&async_done, &async_lock);
+    }
+    pthread_mutex_unlock(&async_lock);
 }
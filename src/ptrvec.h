@@ -3,11 +3,15 @@
 
 #include "main.h"
 
-/* A vector of pointers. */
+struct allocator;
+
+/* A vector of pointers. If allocator isn't NULL, the vector's memory is
+ * allocated through it rather than the j*alloc macros. */
 struct ptrvec {
     void **ptr;
     size_t length;
     size_t capacity;
+    const struct allocator *allocator;
 };
 
 /* All of the following functions take a struct ptrvec * as their first
@@ -22,6 +26,11 @@ struct ptrvec {
 int
 ptrvec_init(struct ptrvec *ptrvec);
 
+/* Initializes the ptrvec to allocate its memory through allocator, e.g. an
+ * arena or a pool. Returns 0 on success, nonzero on failure. */
+int
+ptrvec_init_a(struct ptrvec *ptrvec, const struct allocator *allocator);
+
 /* Sets all the pointers to NULL. */
 void
 ptrvec_zero(struct ptrvec *ptrvec);
@@ -75,6 +84,34 @@ ptrvec_remove_fast(struct ptrvec *ptrvec, size_t index);
 void
 ptrvec_remove_fast_r(struct ptrvec *ptrvec, size_t begin, size_t end);
 
+/* Removes every pointer ptr for which pred(ptr, ctx) is nonzero, preserving
+ * the order of the remaining pointers. This is done in a single pass, so it's
+ * O(n) no matter how many pointers are removed. Returns the number of pointers
+ * removed. */
+size_t
+ptrvec_remove_if(struct ptrvec *ptrvec, int (*pred)(void *, void *),
+                 void *ctx);
+
+/* Same as ptrvec_remove_if, but faster when few pointers are removed, since
+ * each hole is filled from the end of ptrvec. However, this doesn't preserve
+ * the ordering of the pointers. */
+size_t
+ptrvec_remove_if_fast(struct ptrvec *ptrvec, int (*pred)(void *, void *),
+                      void *ctx);
+
+/* Removes the pointers at each of the n indices in indices, preserving the
+ * order of the remaining pointers. Assumes indices is sorted in increasing
+ * order and has no duplicates. */
+void
+ptrvec_remove_indices(struct ptrvec *ptrvec, const size_t *indices, size_t n);
+
+/* Same as ptrvec_remove_indices, but faster, since each hole is filled from
+ * the end of ptrvec. However, this doesn't preserve the ordering of the
+ * pointers. */
+void
+ptrvec_remove_indices_fast(struct ptrvec *ptrvec, const size_t *indices,
+                           size_t n);
+
 /* Returns 1 if ptrvec contains ptr, otherwise returns 0. */
 int
 ptrvec_contains(struct ptrvec *ptrvec, const void *ptr);
@@ -104,8 +141,82 @@ void
 ptrvec_free(struct ptrvec *ptrvec);
 
 /* Frees the memory used by each pointer in ptrvec and the memory used by
- * ptrvec. Only use this if all the pointers point to heap memory. */
+ * ptrvec. Only use this if all the pointers point to memory allocated with the
+ * j*alloc macros. The pointers are freed in one batch with jfree_batch. */
 void
 ptrvec_delete(struct ptrvec *ptrvec);
 
+/* Allocates count blocks of size bytes each in one batch with jmalloc_batch,
+ * and appends them to ptrvec. Returns 0 on success; on failure, nothing is
+ * allocated or appended and nonzero is returned. */
+int
+ptrvec_push_new(struct ptrvec *ptrvec, size_t count, size_t size);
+
+/* The prefetch distance used when none is given, until one has been tuned. */
+#define PTRVEC_PREFETCH_DISTANCE 16
+
+/* Calls fn(ptr, ctx) on each pointer in ptrvec in order, prefetching the
+ * memory each pointer points to distance pointers ahead of fn. This hides the
+ * cache misses of reading scattered pointees in fn. If distance is 0, the
+ * tuned distance is used. It's tuned once, by the first such call on a large
+ * ptrvec, which times reading the first byte of the pointees with each
+ * candidate distance, and without prefetching, each over its own stretch of
+ * the first 60,000 or so pointers. If no distance beats not prefetching,
+ * nothing is prefetched from then on; until tuning, PTRVEC_PREFETCH_DISTANCE
+ * is used. Every non-NULL pointer must point to readable memory for tuning.
+ * fn is called exactly once for each pointer either way. */
+void
+ptrvec_for_each_prefetch(struct ptrvec *ptrvec, size_t distance,
+                         void (*fn)(void *, void *), void *ctx);
+
+/* Calls fn(ptrs, n, ctx) on each run of n consecutive pointers in ptrvec, in
+ * order, with n being batch for all but the last run. The pointees of the next
+ * run are prefetched before fn is called on a run, so fn can work through a
+ * run with its pointees already on the way. If batch is 0, the distance tuned
+ * by ptrvec_for_each_prefetch is used, or PTRVEC_PREFETCH_DISTANCE if it
+ * found prefetching doesn't pay. */
+void
+ptrvec_for_each_batch_prefetch(struct ptrvec *ptrvec, size_t batch,
+                               void (*fn)(void **, size_t, void *), void *ctx);
+
+/* The following functions split ptrvec into contiguous chunks and process each
+ * chunk on its own thread, with the calling thread taking the first chunk.
+ * nthreads is the maximum number of threads to use, including the calling
+ * thread; 0 means one per online CPU. Vectors too small to be worth splitting
+ * are processed on the calling thread only. If a worker thread can't be
+ * created, its chunk is processed on the calling thread instead. */
+
+/* The fewest pointers given to each thread. Vectors shorter than twice this
+ * are processed on the calling thread only. */
+#define PTRVEC_PAR_MIN_CHUNK 4096
+
+/* Calls fn(ptr, ctx) on each pointer in ptrvec. fn may be called concurrently
+ * from several threads. Returns 0 on success, nonzero on failure. */
+int
+ptrvec_for_each_par(struct ptrvec *ptrvec, void (*fn)(void *, void *),
+                    void *ctx, size_t nthreads);
+
+/* Replaces each pointer ptr in ptrvec with fn(ptr, ctx). fn may be called
+ * concurrently from several threads. Returns 0 on success, nonzero on
+ * failure. */
+int
+ptrvec_transform_par(struct ptrvec *ptrvec, void *(*fn)(void *, void *),
+                     void *ctx, size_t nthreads);
+
+/* Same as ptrvec_delete, but frees the pointers in parallel. Returns 0 on
+ * success, nonzero on failure. */
+int
+ptrvec_delete_par(struct ptrvec *ptrvec, size_t nthreads);
+
+/* Same as ptrvec_delete_par, but hands the work to a background thread and
+ * returns immediately. ptrvec is left empty and may be reused. If the
+ * background thread can't be created, the pointers are freed before returning.
+ * Returns 0 on success, nonzero on failure. */
+int
+ptrvec_delete_async(struct ptrvec *ptrvec, size_t nthreads);
+
+/* Blocks until every deletion started by ptrvec_delete_async has finished. */
+void
+ptrvec_delete_wait(void);
+
 #endif
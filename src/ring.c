@@ -0,0 +1,212 @@
+// For memfd_create
+#define _GNU_SOURCE
+
+#include "main.h"
+#include "ring.h"
+
+#include "alloc.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Each side only ever writes its own counter, and reads the other's. With
+// RING_SPSC, a counter is published with a release store once the bytes it
+// covers are written or read, and read with an acquire load.
+
+static inline size_t
+load(const size_t *p, unsigned flags)
+{
+    return flags & RING_SPSC ? __atomic_load_n(p, __ATOMIC_ACQUIRE) : *p;
+}
+
+static inline void
+store(size_t *p, size_t x, unsigned flags)
+{
+    if (flags & RING_SPSC) {
+        __atomic_store_n(p, x, __ATOMIC_RELEASE);
+    } else {
+        *p = x;
+    }
+}
+
+static size_t
+round_capacity(size_t capacity)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t cap = page > 0 ? (size_t)page : 4096;
+
+    while (cap < capacity) {
+        cap *= 2;
+    }
+
+    return cap;
+}
+
+// Maps cap bytes of a memfd twice, back to back, or returns NULL if that
+// isn't possible here
+static char *
+map_twice(size_t cap)
+{
+#ifdef MFD_CLOEXEC
+    char *addr;
+    int fd;
+
+    fd = memfd_create("ring", MFD_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (ERR(ftruncate(fd, (off_t)cap) != 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    // Reserve both halves first, so nothing else can be mapped between them
+    addr = mmap(NULL, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ERR(addr == MAP_FAILED)) {
+        close(fd);
+        return NULL;
+    }
+
+    if (ERR(mmap(addr, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, 0) == MAP_FAILED)
+        || ERR(mmap(addr + cap, cap, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+
+        munmap(addr, 2 * cap);
+        close(fd);
+        return NULL;
+    }
+
+    // The mappings keep the memory alive
+    close(fd);
+
+    return addr;
+#else
+    UNUSED(cap);
+
+    return NULL;
+#endif
+}
+
+int
+ring_init(struct ring *ring, size_t capacity, unsigned flags)
+{
+    ASSUME(ring != NULL);
+    ASSUME((flags & ~(RING_SPSC | RING_COPY)) == 0);
+
+    ring->capacity = round_capacity(capacity);
+    ring->flags = flags;
+    ring->head = 0;
+    ring->tail = 0;
+
+    if (ERR(ring->capacity > SIZE_MAX / 2)) {
+        return -1;
+    }
+
+    if (!(flags & RING_COPY)) {
+        ring->buf = map_twice(ring->capacity);
+        if (ring->buf != NULL) {
+            alloc_stats_map(ring->capacity);
+            return 0;
+        }
+
+        ring->flags |= RING_COPY;
+    }
+
+    ring->buf = jmalloc(2 * ring->capacity);
+    if (ERR(ring->buf == NULL)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+size_t
+ring_length(struct ring *ring)
+{
+    ASSUME(ring != NULL);
+
+    return load(&ring->head, ring->flags) - load(&ring->tail, ring->flags);
+}
+
+void *
+ring_write_ptr(struct ring *ring, size_t *n)
+{
+    size_t head;
+
+    ASSUME(ring != NULL);
+    ASSUME(n != NULL);
+
+    head = ring->head;
+    *n = ring->capacity - (head - load(&ring->tail, ring->flags));
+
+    return ring->buf + (head & (ring->capacity - 1));
+}
+
+void
+ring_produce(struct ring *ring, size_t n)
+{
+    size_t head, end;
+
+    ASSUME(ring != NULL);
+    ASSUME(n <= ring->capacity - (ring->head - load(&ring->tail,
+                                                    ring->flags)));
+
+    head = ring->head;
+    end = (head & (ring->capacity - 1)) + n;
+
+    // Without the second mapping, bytes written past the end belong at the
+    // start
+    if (ring->flags & RING_COPY && end > ring->capacity) {
+        memcpy(ring->buf, ring->buf + ring->capacity, end - ring->capacity);
+    }
+
+    store(&ring->head, head + n, ring->flags);
+}
+
+void *
+ring_read_ptr(struct ring *ring, size_t *n)
+{
+    size_t tail, end;
+
+    ASSUME(ring != NULL);
+    ASSUME(n != NULL);
+
+    tail = ring->tail;
+    *n = load(&ring->head, ring->flags) - tail;
+    end = (tail & (ring->capacity - 1)) + *n;
+
+    // Likewise, bytes at the start are read past the end
+    if (ring->flags & RING_COPY && end > ring->capacity) {
+        memcpy(ring->buf + ring->capacity, ring->buf, end - ring->capacity);
+    }
+
+    return ring->buf + (tail & (ring->capacity - 1));
+}
+
+void
+ring_consume(struct ring *ring, size_t n)
+{
+    ASSUME(ring != NULL);
+    ASSUME(n <= load(&ring->head, ring->flags) - ring->tail);
+
+    store(&ring->tail, ring->tail + n, ring->flags);
+}
+
+void
+ring_free(struct ring *ring)
+{
+    ASSUME(ring != NULL);
+
+    if (ring->flags & RING_COPY) {
+        jfree(ring->buf);
+    } else {
+        munmap(ring->buf, 2 * ring->capacity);
+        alloc_stats_unmap();
+    }
+
+    ring->buf = NULL;
+}
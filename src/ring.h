@@ -0,0 +1,74 @@
+#ifndef RING_H_
+#define RING_H_ 1
+
+#include "main.h"
+
+/* A ring buffer of bytes where the readable bytes, and the space writable
+ * after them, are each always contiguous in memory, so a streaming parser
+ * never has to handle a region that wraps around.
+ *
+ * Where memfd_create is available, the ring's memory is mapped twice, back to
+ * back, so a region running off the end of the first mapping carries on into
+ * the second, which is the same memory. Elsewhere, the ring falls back to a
+ * buffer twice the capacity, and copies the part of each region that wraps:
+ * bytes produced past the end are copied to the start, and bytes about to be
+ * read from the start are copied past the end.
+ *
+ * head and tail count the bytes ever produced and consumed. With RING_SPSC,
+ * one thread may produce while another consumes. head and tail each have a
+ * cache line to themselves, and so do buf, capacity and flags, which never
+ * change after ring_init, so that neither side's writes evict what the other
+ * side only reads. */
+struct ring {
+    char *buf;
+    size_t capacity;
+    unsigned flags;
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+};
+
+/* The flags. RING_SPSC makes the ring safe for a single producer thread and a
+ * single consumer thread. RING_COPY uses the copying fallback even where
+ * memfd_create is available; ring_init sets it when it has to fall back. */
+#define RING_SPSC 1u
+#define RING_COPY 2u
+
+/* All of the following functions take a struct ring * as their first
+ * argument. This pointer is always assumed not to be NULL. */
+
+/* Initializes the ring to hold at least capacity bytes, rounded up to a power
+ * of 2 that's at least a page. The memory is counted by alloc_stats_map, or
+ * allocated with jmalloc when falling back. Returns 0 on success, nonzero on
+ * failure. */
+int
+ring_init(struct ring *ring, size_t capacity, unsigned flags);
+
+/* Returns the number of bytes that can be read. */
+size_t
+ring_length(struct ring *ring);
+
+/* Returns a pointer to the contiguous space that can be written, and sets *n
+ * to its size. Only the producer may call this. */
+void *
+ring_write_ptr(struct ring *ring, size_t *n);
+
+/* Makes the first n bytes of the space returned by ring_write_ptr readable.
+ * Assumes n is no more than ring_write_ptr returned. */
+void
+ring_produce(struct ring *ring, size_t n);
+
+/* Returns a pointer to the contiguous bytes that can be read, and sets *n to
+ * their number. Only the consumer may call this. */
+void *
+ring_read_ptr(struct ring *ring, size_t *n);
+
+/* Frees the first n bytes returned by ring_read_ptr for writing. Assumes n is
+ * no more than ring_read_ptr returned. */
+void
+ring_consume(struct ring *ring, size_t n);
+
+/* Frees the memory used by ring. */
+void
+ring_free(struct ring *ring);
+
+#endif
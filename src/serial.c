@@ -0,0 +1,637 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "main.h"
+#include "serial.h"
+
+#include "alloc.h"
+#include "ptrvec.h"
+#include "vec.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Elements at least this big are gathered by serial_write_ptrs with writev
+// rather than copied into the buffer
+#define GATHER_MIN 1024
+
+// The number of iovecs serial_write_ptrs passes to each writev, which is well
+// under any IOV_MAX
+#define GATHER_IOVS 64
+
+// The most bytes the loaders allocate ahead of what they've actually read, so
+// that a corrupt length in a stream whose size can't be checked, like a pipe,
+// only costs a bounded allocation before the read fails
+#define LOAD_CHUNK ((size_t)1 << 20)
+
+#define FNV_OFFSET UINT64_C(0xCBF29CE484222325)
+#define FNV_PRIME UINT64_C(0x100000001B3)
+
+static inline unsigned
+host_order(void)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return SERIAL_BIG_ENDIAN;
+#else
+    return 0;
+#endif
+}
+
+static inline void
+put_u32(unsigned char *p, uint32_t x)
+{
+    for (size_t i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(x >> (8 * i));
+    }
+}
+
+static inline void
+put_u64(unsigned char *p, uint64_t x)
+{
+    for (size_t i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(x >> (8 * i));
+    }
+}
+
+static inline uint32_t
+get_u32(const unsigned char *p)
+{
+    uint32_t x = 0;
+
+    for (size_t i = 0; i < 4; ++i) {
+        x |= (uint32_t)p[i] << (8 * i);
+    }
+
+    return x;
+}
+
+static inline uint64_t
+get_u64(const unsigned char *p)
+{
+    uint64_t x = 0;
+
+    for (size_t i = 0; i < 8; ++i) {
+        x |= (uint64_t)p[i] << (8 * i);
+    }
+
+    return x;
+}
+
+// A 64 bit FNV-1a over little endian words of 8 bytes, then over the bytes
+// left at the end. Words can straddle calls, so the bytes of a partial word
+// are carried over to the next call.
+static void
+hash_update(struct serial *serial, const void *data, size_t bytes)
+{
+    const unsigned char *p = data;
+    uint64_t hash = serial->hash;
+    size_t take;
+
+    if (serial->ncarry > 0) {
+        take = sizeof(serial->carry) - serial->ncarry;
+        take = take < bytes ? take : bytes;
+        memcpy(serial->carry + serial->ncarry, p, take);
+        serial->ncarry += take;
+        p += take;
+        bytes -= take;
+
+        if (serial->ncarry < sizeof(serial->carry)) {
+            return;
+        }
+        hash = (hash ^ get_u64(serial->carry)) * FNV_PRIME;
+        serial->ncarry = 0;
+    }
+
+    for (; bytes >= 8; bytes -= 8, p += 8) {
+        hash = (hash ^ get_u64(p)) * FNV_PRIME;
+    }
+
+    memcpy(serial->carry, p, bytes);
+    serial->ncarry = bytes;
+    serial->hash = hash;
+}
+
+static uint64_t
+hash_final(const struct serial *serial)
+{
+    uint64_t hash = serial->hash;
+
+    for (size_t i = 0; i < serial->ncarry; ++i) {
+        hash = (hash ^ serial->carry[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// Writes all of the n iovecs at iov, retrying after partial writes
+static int
+write_iov(int fd, struct iovec *iov, int n)
+{
+    ssize_t done;
+    size_t left;
+
+    while (n > 0) {
+        done = writev(fd, iov, n);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ERR(done < 0)) {
+            return -1;
+        }
+
+        left = (size_t)done;
+        for (; n > 0 && left >= iov->iov_len; ++iov, --n) {
+            left -= iov->iov_len;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    return 0;
+}
+
+// Copies data into the buffer if it fits, otherwise writes both without
+// copying
+static int
+put(struct serial *serial, const void *data, size_t bytes)
+{
+    struct iovec iov[2];
+
+    if (bytes <= SERIAL_BUFFER_SIZE - serial->end) {
+        memcpy(serial->buf + serial->end, data, bytes);
+        serial->end += bytes;
+
+        return 0;
+    }
+
+    iov[0].iov_base = serial->buf;
+    iov[0].iov_len = serial->end;
+    // writev only reads through iov_base, so data is never written to
+    iov[1].iov_base = (void *)(uintptr_t)data;
+    iov[1].iov_len = bytes;
+    serial->end = 0;
+
+    return write_iov(serial->fd, iov, 2);
+}
+
+// Reads bytes into dst, first from the buffer and then with readv, which
+// refills the buffer with whatever follows
+static int
+get(struct serial *serial, void *dst, size_t bytes)
+{
+    struct iovec iov[2];
+    char *p = dst;
+    ssize_t done;
+    size_t take;
+
+    take = serial->end - serial->begin;
+    take = take < bytes ? take : bytes;
+    memcpy(p, serial->buf + serial->begin, take);
+    serial->begin += take;
+    p += take;
+    bytes -= take;
+
+    if (bytes == 0) {
+        return 0;
+    }
+
+    serial->begin = 0;
+    serial->end = 0;
+
+    while (bytes > 0) {
+        iov[0].iov_base = p;
+        iov[0].iov_len = bytes;
+        iov[1].iov_base = serial->buf;
+        iov[1].iov_len = SERIAL_BUFFER_SIZE;
+
+        done = readv(serial->fd, iov, 2);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ERR(done <= 0)) {
+            return -1;
+        }
+
+        if ((size_t)done < bytes) {
+            p += done;
+            bytes -= (size_t)done;
+        } else {
+            serial->end = (size_t)done - bytes;
+            bytes = 0;
+        }
+    }
+
+    return 0;
+}
+
+int
+serial_write_start(struct serial *serial, int fd, size_t size, size_t length,
+                   unsigned flags)
+{
+    unsigned char *head;
+
+    ASSUME(serial != NULL);
+    ASSUME(size > 0);
+    ASSUME((flags & ~SERIAL_CHECKSUM) == 0);
+
+    serial->buf = jmalloc(SERIAL_BUFFER_SIZE);
+    if (ERR(serial->buf == NULL)) {
+        return -1;
+    }
+
+    serial->fd = fd;
+    serial->size = size;
+    serial->length = length;
+    serial->left = length;
+    serial->flags = flags | host_order();
+    serial->hash = FNV_OFFSET;
+    serial->ncarry = 0;
+
+    head = (unsigned char *)serial->buf;
+    memcpy(head, SERIAL_MAGIC, sizeof(SERIAL_MAGIC));
+    put_u32(head + 8, SERIAL_VERSION);
+    put_u32(head + 12, serial->flags);
+    put_u64(head + 16, size);
+    put_u64(head + 24, length);
+
+    serial->begin = 0;
+    serial->end = SERIAL_HEADER_SIZE;
+
+    return 0;
+}
+
+int
+serial_write(struct serial *serial, const void *data, size_t count)
+{
+    size_t bytes;
+
+    ASSUME(serial != NULL);
+    ASSUME(data != NULL || count == 0);
+    ASSUME(count <= serial->left);
+
+    bytes = count * serial->size;
+    serial->left -= count;
+
+    if (serial->flags & SERIAL_CHECKSUM) {
+        hash_update(serial, data, bytes);
+    }
+
+    return put(serial, data, bytes);
+}
+
+int
+serial_write_ptrs(struct serial *serial, void *const *ptrs, size_t count)
+{
+    struct iovec iov[GATHER_IOVS];
+    int n;
+
+    ASSUME(serial != NULL);
+    ASSUME(ptrs != NULL || count == 0);
+    ASSUME(count <= serial->left);
+
+    if (serial->size < GATHER_MIN) {
+        for (size_t i = 0; i < count; ++i) {
+            if (ERR(serial_write(serial, ptrs[i], 1) != 0)) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    serial->left -= count;
+
+    for (size_t i = 0; i < count;) {
+        n = 0;
+
+        if (serial->end > 0) {
+            iov[n].iov_base = serial->buf;
+            iov[n].iov_len = serial->end;
+            serial->end = 0;
+            ++n;
+        }
+
+        for (; i < count && n < GATHER_IOVS; ++i, ++n) {
+            iov[n].iov_base = ptrs[i];
+            iov[n].iov_len = serial->size;
+
+            if (serial->flags & SERIAL_CHECKSUM) {
+                hash_update(serial, ptrs[i], serial->size);
+            }
+        }
+
+        if (ERR(write_iov(serial->fd, iov, n) != 0)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+serial_write_end(struct serial *serial)
+{
+    unsigned char trailer[8];
+    struct iovec iov[2];
+    int err = 0;
+
+    ASSUME(serial != NULL);
+
+    if (ERR(serial->left != 0)) {
+        err = -1;
+    } else {
+        put_u64(trailer, hash_final(serial));
+
+        iov[0].iov_base = serial->buf;
+        iov[0].iov_len = serial->end;
+        iov[1].iov_base = trailer;
+        iov[1].iov_len = serial->flags & SERIAL_CHECKSUM ? sizeof(trailer) : 0;
+
+        if (ERR(write_iov(serial->fd, iov, 2) != 0)) {
+            err = -1;
+        }
+    }
+
+    jfree(serial->buf);
+    serial->buf = NULL;
+
+    return err;
+}
+
+// Returns 0 if a stream of length elements of size bytes can fit in what's
+// left of fd, counting what's already buffered, or if fd isn't a regular file
+// and so can't be checked
+static int
+check_length(struct serial *serial, uint64_t length)
+{
+    struct stat st;
+    off_t pos;
+    uint64_t left;
+
+    if (fstat(serial->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    pos = lseek(serial->fd, 0, SEEK_CUR);
+    if (pos < 0 || pos > st.st_size) {
+        return 0;
+    }
+
+    left = (uint64_t)(st.st_size - pos) + (serial->end - serial->begin);
+
+    return length > left / serial->size ? -1 : 0;
+}
+
+int
+serial_read_start(struct serial *serial, int fd, size_t size)
+{
+    unsigned char head[SERIAL_HEADER_SIZE];
+    uint64_t length;
+
+    ASSUME(serial != NULL);
+    ASSUME(size > 0);
+
+    serial->buf = jmalloc(SERIAL_BUFFER_SIZE);
+    if (ERR(serial->buf == NULL)) {
+        return -1;
+    }
+
+    serial->fd = fd;
+    serial->size = size;
+    serial->begin = 0;
+    serial->end = 0;
+    serial->hash = FNV_OFFSET;
+    serial->ncarry = 0;
+
+    if (ERR(get(serial, head, sizeof(head)) != 0)) {
+        goto fail;
+    }
+
+    serial->flags = get_u32(head + 12);
+    length = get_u64(head + 24);
+
+    if (ERR(memcmp(head, SERIAL_MAGIC, sizeof(SERIAL_MAGIC)) != 0)
+        || ERR(get_u32(head + 8) != SERIAL_VERSION)
+        || ERR((serial->flags & ~(SERIAL_CHECKSUM | SERIAL_BIG_ENDIAN)) != 0)
+        || ERR(get_u64(head + 16) != size)
+        || ERR(length > SIZE_MAX / size)
+        || ERR(check_length(serial, length) != 0)) {
+
+        goto fail;
+    }
+
+    // The elements are opaque, so they can't be swapped into the host's order
+    if (ERR(size > 1
+            && (serial->flags & SERIAL_BIG_ENDIAN) != host_order())) {
+        goto fail;
+    }
+
+    serial->length = (size_t)length;
+    serial->left = (size_t)length;
+
+    return 0;
+
+fail:
+    jfree(serial->buf);
+    serial->buf = NULL;
+
+    return -1;
+}
+
+int
+serial_read(struct serial *serial, void *data, size_t count)
+{
+    size_t bytes;
+
+    ASSUME(serial != NULL);
+    ASSUME(data != NULL || count == 0);
+    ASSUME(count <= serial->left);
+
+    bytes = count * serial->size;
+    serial->left -= count;
+
+    if (ERR(get(serial, data, bytes) != 0)) {
+        return -1;
+    }
+
+    if (serial->flags & SERIAL_CHECKSUM) {
+        hash_update(serial, data, bytes);
+    }
+
+    return 0;
+}
+
+int
+serial_read_end(struct serial *serial)
+{
+    unsigned char trailer[8];
+    int err = 0;
+
+    ASSUME(serial != NULL);
+
+    if (ERR(serial->left != 0)) {
+        err = -1;
+    } else if (serial->flags & SERIAL_CHECKSUM) {
+        if (ERR(get(serial, trailer, sizeof(trailer)) != 0)
+            || ERR(get_u64(trailer) != hash_final(serial))) {
+
+            err = -1;
+        }
+    }
+
+    // Give back what was read ahead, which fails harmlessly on pipes
+    if (serial->end > serial->begin) {
+        lseek(serial->fd, -(off_t)(serial->end - serial->begin), SEEK_CUR);
+    }
+
+    jfree(serial->buf);
+    serial->buf = NULL;
+
+    return err;
+}
+
+int
+serial_save(int fd, const void *ptr, size_t n, size_t size, unsigned flags)
+{
+    struct serial serial;
+    int err;
+
+    ASSUME(ptr != NULL || n == 0);
+
+    if (ERR(serial_write_start(&serial, fd, size, n, flags) != 0)) {
+        return -1;
+    }
+
+    err = serial_write(&serial, ptr, n);
+
+    if (ERR(serial_write_end(&serial) != 0)) {
+        err = -1;
+    }
+
+    return err;
+}
+
+int
+serial_load(int fd, void *ptr, size_t *n, size_t size)
+{
+    struct serial serial;
+    size_t done, count, chunk, cap;
+    int err = 0;
+
+    ASSUME(ptr != NULL);
+    ASSUME(n != NULL);
+
+    if (ERR(serial_read_start(&serial, fd, size) != 0)) {
+        return -1;
+    }
+
+    if (ERR(serial.length > SIZE_MAX / size - *n)) {
+        serial_read_end(&serial);
+
+        return -1;
+    }
+
+    // Grow the array as elements are read rather than all at once, so a
+    // length that's bigger than the stream fails after at most LOAD_CHUNK
+    // bytes
+    chunk = LOAD_CHUNK / size > 0 ? LOAD_CHUNK / size : 1;
+    cap = *n;
+
+    for (done = 0; err == 0 && done < serial.length; done += count) {
+        count = serial.length - done < chunk ? serial.length - done : chunk;
+
+        if (*n + done + count > cap) {
+            err = vec_reserve_min(ptr, &cap, size, *n + done + count - cap);
+        }
+        if (LIKELY(err == 0)) {
+            err = serial_read(&serial, *(char **)ptr + (*n + done) * size,
+                              count);
+        }
+    }
+
+    if (ERR(serial_read_end(&serial) != 0)) {
+        err = -1;
+    }
+
+    if (err == 0) {
+        *n += serial.length;
+    }
+
+    return err;
+}
+
+int
+serial_save_ptrvec(int fd, struct ptrvec *ptrvec, size_t size,
+                   unsigned flags)
+{
+    struct serial serial;
+    int err;
+
+    ASSUME(ptrvec != NULL);
+
+    if (ERR(serial_write_start(&serial, fd, size, ptrvec->length, flags)
+            != 0)) {
+        return -1;
+    }
+
+    err = serial_write_ptrs(&serial, ptrvec->ptr, ptrvec->length);
+
+    if (ERR(serial_write_end(&serial) != 0)) {
+        err = -1;
+    }
+
+    return err;
+}
+
+int
+serial_load_ptrvec(int fd, struct ptrvec *ptrvec, size_t size)
+{
+    struct serial serial;
+    size_t length, done, count, chunk;
+    int err = 0;
+
+    ASSUME(ptrvec != NULL);
+
+    if (ERR(serial_read_start(&serial, fd, size) != 0)) {
+        return -1;
+    }
+
+    length = ptrvec->length;
+
+    if (ERR(serial.length > SIZE_MAX / sizeof(*ptrvec->ptr) - length)) {
+        serial_read_end(&serial);
+
+        return -1;
+    }
+
+    // Allocate the blocks as they're read, as in serial_load
+    chunk = LOAD_CHUNK / size > 0 ? LOAD_CHUNK / size : 1;
+
+    for (done = 0; err == 0 && done < serial.length; done += count) {
+        count = serial.length - done < chunk ? serial.length - done : chunk;
+
+        err = ptrvec_push_new(ptrvec, count, size);
+
+        for (size_t i = ptrvec->length - count;
+             err == 0 && i < ptrvec->length; ++i) {
+
+            err = serial_read(&serial, ptrvec->ptr[i], 1);
+        }
+    }
+
+    if (ERR(serial_read_end(&serial) != 0)) {
+        err = -1;
+    }
+
+    if (err != 0) {
+        jfree_batch(ptrvec->ptr + length, ptrvec->length - length);
+        ptrvec->length = length;
+    }
+
+    return err;
+}
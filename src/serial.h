@@ -0,0 +1,134 @@
+#ifndef SERIAL_H_
+#define SERIAL_H_ 1
+
+#include "main.h"
+
+#include <stdint.h>
+
+struct ptrvec;
+
+/* A stream of fixed size elements written to or read from a file descriptor,
+ * e.g. the contents of an array grown with the vec helpers. The stream is a
+ * header, the elements, and then an optional checksum:
+ *
+ *     magic    8 bytes, "JSERIAL\0"
+ *     version  4 bytes
+ *     flags    4 bytes
+ *     size     8 bytes, the size of each element
+ *     length   8 bytes, the number of elements
+ *     elements length * size bytes
+ *     checksum 8 bytes, if flags has SERIAL_CHECKSUM
+ *
+ * The header and checksum are always little endian. The elements are written
+ * as they are in memory, so they must not contain pointers, and their byte
+ * order is the writer's, which is recorded in flags.
+ *
+ * Both directions go through a SERIAL_BUFFER_SIZE buffer. Small writes are
+ * copied into it, but a write that doesn't fit is sent along with the buffer
+ * in one writev, without being copied. Likewise, reads go straight into the
+ * caller's memory with readv, and any bytes past what was asked for refill the
+ * buffer in the same call. */
+struct serial {
+    int fd;
+    char *buf;
+    size_t begin;
+    size_t end;
+    size_t size;
+    size_t length;
+    size_t left;
+    unsigned flags;
+    uint64_t hash;
+    unsigned char carry[8];
+    size_t ncarry;
+};
+
+#define SERIAL_MAGIC "JSERIAL"
+#define SERIAL_VERSION 1
+#define SERIAL_HEADER_SIZE 32
+#define SERIAL_BUFFER_SIZE ((size_t)1 << 16)
+
+/* The flags. SERIAL_CHECKSUM is given to serial_write_start to append an FNV-1a
+ * checksum of the elements; SERIAL_BIG_ENDIAN is set by serial_write_start on
+ * big endian hosts. */
+#define SERIAL_CHECKSUM 1u
+#define SERIAL_BIG_ENDIAN 2u
+
+/* All of the following functions take a struct serial * as their first
+ * argument. This pointer is always assumed not to be NULL.
+ *
+ * Each serial_*_start that succeeds must be matched with its serial_*_end,
+ * even if a call in between failed, to free the buffer. */
+
+/* Starts writing a stream of length elements of size bytes each to fd, with
+ * flags being 0 or SERIAL_CHECKSUM. Returns 0 on success, nonzero on
+ * failure. */
+int
+serial_write_start(struct serial *serial, int fd, size_t size, size_t length,
+                   unsigned flags);
+
+/* Writes the count elements at data. Assumes no more than the elements left in
+ * the stream are written. Returns 0 on success, nonzero on failure. */
+int
+serial_write(struct serial *serial, const void *data, size_t count);
+
+/* Writes the count elements pointed to by ptrs, e.g. the contents of a ptrvec.
+ * Large elements are gathered with writev rather than copied. Returns 0 on
+ * success, nonzero on failure. */
+int
+serial_write_ptrs(struct serial *serial, void *const *ptrs, size_t count);
+
+/* Writes the checksum if there is one, flushes the buffer and frees it.
+ * Returns 0 on success; returns nonzero if that fails or if fewer elements
+ * were written than the header says. */
+int
+serial_write_end(struct serial *serial);
+
+/* Starts reading a stream of elements of size bytes each from fd, and sets
+ * serial->length to the number of elements in it. Fails if the stream is
+ * corrupt, or was written with a different element size, or on a host with a
+ * different byte order when size > 1. If fd is a regular file, it also fails
+ * if the file is too short to hold the elements the header claims. Returns 0
+ * on success, nonzero on failure. */
+int
+serial_read_start(struct serial *serial, int fd, size_t size);
+
+/* Reads count elements into data. Assumes no more than the elements left in
+ * the stream are read. Returns 0 on success, nonzero on failure. */
+int
+serial_read(struct serial *serial, void *data, size_t count);
+
+/* Checks the checksum if there is one and frees the buffer. Any bytes read
+ * ahead of the stream's end are given back with lseek, if fd is seekable.
+ * Returns 0 on success; returns nonzero if the checksum doesn't match or not
+ * all the elements were read. */
+int
+serial_read_end(struct serial *serial);
+
+/* Writes the n elements of size bytes at ptr to fd as one stream. Returns 0
+ * on success, nonzero on failure. */
+int
+serial_save(int fd, const void *ptr, size_t n, size_t size, unsigned flags);
+
+/* Reads a stream of elements of size bytes from fd and appends them to *ptr,
+ * which is a pointer to an array of *n * size bytes, growing it with
+ * vec_reserve_min as the elements are read, so a corrupt header can't make it
+ * reserve much more than the stream holds. Adds the number of elements read to
+ * *n. Returns 0 on success; on failure, *n is unchanged and nonzero is
+ * returned. */
+int
+serial_load(int fd, void *ptr, size_t *n, size_t size);
+
+/* Writes the blocks of size bytes pointed to by ptrvec to fd as one stream.
+ * Returns 0 on success, nonzero on failure. */
+int
+serial_save_ptrvec(int fd, struct ptrvec *ptrvec, size_t size,
+                   unsigned flags);
+
+/* Reads a stream of elements of size bytes from fd into new blocks allocated
+ * with ptrvec_push_new, a bounded number at a time as they're read. Returns 0
+ * on success; on failure, nothing is appended
+ * and nonzero is returned. */
+int
+serial_load_ptrvec(int fd, struct ptrvec *ptrvec, size_t size);
+
+#endif
@@ -0,0 +1,200 @@
+#include "main.h"
+#include "slotmap.h"
+
+#include "alloc.h"
+#include "vec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define NO_SLOT UINT32_MAX
+
+int
+slotmap_init(struct slotmap *slotmap, size_t size)
+{
+    ASSUME(slotmap != NULL);
+    ASSUME(size > 0);
+
+    slotmap->data = NULL;
+    slotmap->owners = NULL;
+    slotmap->slots = NULL;
+    slotmap->size = size;
+    slotmap->length = 0;
+    slotmap->capacity = 0;
+    slotmap->n_slots = 0;
+    slotmap->cap_slots = 0;
+    slotmap->free_slot = NO_SLOT;
+
+    return 0;
+}
+
+static int
+reserve_one(struct slotmap *slotmap)
+{
+    size_t cap;
+
+    ASSUME(slotmap != NULL);
+
+    if (slotmap->length < slotmap->capacity) {
+        return 0;
+    }
+
+    // If owners can't grow, data is just left bigger than it needs to be
+    cap = slotmap->capacity;
+    if (ERR(vec_reserve_one_min(&slotmap->data, &cap, slotmap->size) != 0)
+        || ERR(vec_reserve(&slotmap->owners, slotmap->capacity,
+                           sizeof(*slotmap->owners), cap - slotmap->capacity)
+               != 0)) {
+
+        return -1;
+    }
+
+    slotmap->capacity = cap;
+
+    return 0;
+}
+
+static int
+take_slot(struct slotmap *slotmap, uint32_t *slot)
+{
+    ASSUME(slotmap != NULL);
+    ASSUME(slot != NULL);
+
+    if (slotmap->free_slot != NO_SLOT) {
+        *slot = slotmap->free_slot;
+        slotmap->free_slot = slotmap->slots[*slot].index;
+
+        return 0;
+    }
+
+    if (ERR(slotmap->n_slots >= NO_SLOT)) {
+        return -1;
+    }
+
+    if (slotmap->n_slots == slotmap->cap_slots
+        && ERR(vec_reserve_one_min(&slotmap->slots, &slotmap->cap_slots,
+                                   sizeof(*slotmap->slots)) != 0)) {
+
+        return -1;
+    }
+
+    *slot = (uint32_t)slotmap->n_slots++;
+    slotmap->slots[*slot].generation = 0;
+
+    return 0;
+}
+
+int
+slotmap_insert(struct slotmap *slotmap, const void *elem,
+               struct slotmap_handle *handle)
+{
+    uint32_t slot;
+
+    ASSUME(slotmap != NULL);
+    ASSUME(handle != NULL);
+
+    if (ERR(reserve_one(slotmap) != 0) || ERR(take_slot(slotmap, &slot) != 0)) {
+        return -1;
+    }
+
+    ASSERT((slotmap->slots[slot].generation & 1) == 0,
+           "a free slot should have an even generation");
+
+    if (elem != NULL) {
+        memcpy(slotmap->data + slotmap->length * slotmap->size, elem,
+               slotmap->size);
+    }
+
+    slotmap->owners[slotmap->length] = slot;
+    slotmap->slots[slot].index = (uint32_t)slotmap->length;
+    ++slotmap->slots[slot].generation;
+    ++slotmap->length;
+
+    handle->index = slot;
+    handle->generation = slotmap->slots[slot].generation;
+
+    return 0;
+}
+
+static inline int
+is_live(const struct slotmap *slotmap, struct slotmap_handle handle)
+{
+    // A live handle always has an odd generation, so this can't match a free
+    // slot
+    return handle.index < slotmap->n_slots
+        && slotmap->slots[handle.index].generation == handle.generation
+        && (handle.generation & 1) == 1;
+}
+
+void *
+slotmap_get(struct slotmap *slotmap, struct slotmap_handle handle)
+{
+    ASSUME(slotmap != NULL);
+
+    if (!is_live(slotmap, handle)) {
+        return NULL;
+    }
+
+    return slotmap->data + slotmap->slots[handle.index].index * slotmap->size;
+}
+
+int
+slotmap_erase(struct slotmap *slotmap, struct slotmap_handle handle)
+{
+    struct slotmap_slot *slot;
+    size_t last;
+
+    ASSUME(slotmap != NULL);
+
+    if (ERR(!is_live(slotmap, handle))) {
+        return -1;
+    }
+
+    slot = &slotmap->slots[handle.index];
+    last = --slotmap->length;
+
+    // Keep data dense by moving the last element into the hole
+    if (slot->index != last) {
+        memcpy(slotmap->data + slot->index * slotmap->size,
+               slotmap->data + last * slotmap->size, slotmap->size);
+        slotmap->owners[slot->index] = slotmap->owners[last];
+        slotmap->slots[slotmap->owners[last]].index = slot->index;
+    }
+
+    ++slot->generation;
+    slot->index = slotmap->free_slot;
+    slotmap->free_slot = handle.index;
+
+    return 0;
+}
+
+void *
+slotmap_at(struct slotmap *slotmap, size_t index)
+{
+    ASSUME(slotmap != NULL);
+    ASSUME(index < slotmap->length);
+
+    return slotmap->data + index * slotmap->size;
+}
+
+void
+slotmap_handle_at(struct slotmap *slotmap, size_t index,
+                  struct slotmap_handle *handle)
+{
+    ASSUME(slotmap != NULL);
+    ASSUME(index < slotmap->length);
+    ASSUME(handle != NULL);
+
+    handle->index = slotmap->owners[index];
+    handle->generation = slotmap->slots[handle->index].generation;
+}
+
+void
+slotmap_free(struct slotmap *slotmap)
+{
+    ASSUME(slotmap != NULL);
+
+    jfree(slotmap->data);
+    jfree(slotmap->owners);
+    jfree(slotmap->slots);
+}
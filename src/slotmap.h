@@ -0,0 +1,78 @@
+#ifndef SLOTMAP_H_
+#define SLOTMAP_H_ 1
+
+#include "main.h"
+
+#include <stdint.h>
+
+/* Identifies an element of a slotmap. A handle stays valid until its element
+ * is erased, no matter how other elements move. */
+struct slotmap_handle {
+    uint32_t index;
+    uint32_t generation;
+};
+
+struct slotmap_slot {
+    // The element's index in data while the slot is live, otherwise the next
+    // free slot
+    uint32_t index;
+    // Odd while the slot is live, even while it's free
+    uint32_t generation;
+};
+
+/* A container of fixed size elements with O(1) insertion, lookup, and erasure
+ * by handle. The live elements are kept contiguous in data, so iterating over
+ * them is as fast as iterating over an array; their order is unspecified. */
+struct slotmap {
+    char *data;
+    uint32_t *owners;
+    struct slotmap_slot *slots;
+    size_t size;
+    size_t length;
+    size_t capacity;
+    size_t n_slots;
+    size_t cap_slots;
+    uint32_t free_slot;
+};
+
+/* All of the following functions take a struct slotmap * as their first
+ * argument. This pointer is always assumed not to be NULL. */
+
+/* Initializes the slotmap to hold elements of size bytes each. Returns 0 on
+ * success, nonzero on failure. */
+int
+slotmap_init(struct slotmap *slotmap, size_t size);
+
+/* Adds a copy of the size bytes at elem to the slotmap, or an uninitialized
+ * element if elem is NULL, and stores its handle in *handle. Returns 0 on
+ * success, nonzero on failure. */
+int
+slotmap_insert(struct slotmap *slotmap, const void *elem,
+               struct slotmap_handle *handle);
+
+/* Returns a pointer to the element for handle, or NULL if handle is stale. The
+ * pointer is invalidated by any insertion or erasure. */
+void *
+slotmap_get(struct slotmap *slotmap, struct slotmap_handle handle);
+
+/* Erases the element for handle. Returns 0 on success, nonzero if handle is
+ * stale. */
+int
+slotmap_erase(struct slotmap *slotmap, struct slotmap_handle handle);
+
+/* Returns a pointer to the element at index in data. Assumes index <
+ * slotmap->length. */
+void *
+slotmap_at(struct slotmap *slotmap, size_t index);
+
+/* Stores the handle of the element at index in data in *handle. Assumes index
+ * < slotmap->length. */
+void
+slotmap_handle_at(struct slotmap *slotmap, size_t index,
+                  struct slotmap_handle *handle);
+
+/* Frees the memory used by the slotmap. */
+void
+slotmap_free(struct slotmap *slotmap);
+
+#endif
@@ -0,0 +1,303 @@
+#include "main.h"
+#include "snapvec.h"
+
+#include "alloc.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Makes a version holding the n pointers in ptr
+static struct snapvec_snap *
+new_snap(void **ptr, size_t n)
+{
+    struct snapvec_snap *snap;
+
+    snap = jmalloc(sizeof(*snap) + n * sizeof(*snap->ptr));
+    if (ERR(snap == NULL)) {
+        return NULL;
+    }
+
+    snap->length = n;
+    snap->retired = 0;
+    snap->next = NULL;
+    if (n > 0) {
+        memcpy(snap->ptr, ptr, n * sizeof(*snap->ptr));
+    }
+
+    return snap;
+}
+
+// Returns the lowest epoch announced by a reader with a version pinned, or
+// UINT64_MAX if there isn't one. Must be called with the lock held.
+static uint64_t
+min_epoch(struct snapvec *snapvec)
+{
+    uint64_t min = UINT64_MAX, epoch;
+
+    for (struct snapvec_reader *reader = snapvec->readers; reader != NULL;
+         reader = reader->next) {
+
+        epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < min) {
+            min = epoch;
+        }
+    }
+
+    return min;
+}
+
+// Must be called with the lock held
+static void
+reclaim(struct snapvec *snapvec)
+{
+    struct snapvec_snap *snap;
+    uint64_t min;
+
+    if (snapvec->retired == NULL) {
+        return;
+    }
+
+    min = min_epoch(snapvec);
+
+    for (struct snapvec_snap **p = &snapvec->retired; *p != NULL;) {
+        snap = *p;
+
+        if (snap->retired < min) {
+            *p = snap->next;
+            jfree(snap);
+        } else {
+            p = &snap->next;
+        }
+    }
+}
+
+// Replaces the current version with snap. Must be called with the lock held.
+static void
+publish(struct snapvec *snapvec, struct snapvec_snap *snap)
+{
+    struct snapvec_snap *old = snapvec->current;
+
+    __atomic_store_n(&snapvec->current, snap, __ATOMIC_SEQ_CST);
+
+    // A reader that announces this epoch or an earlier one may have pinned old,
+    // and a reader that sees the next one is sure to see snap
+    old->retired = snapvec->epoch;
+    old->next = snapvec->retired;
+    snapvec->retired = old;
+
+    __atomic_store_n(&snapvec->epoch, snapvec->epoch + 1, __ATOMIC_SEQ_CST);
+
+    reclaim(snapvec);
+}
+
+int
+snapvec_init(struct snapvec *snapvec)
+{
+    ASSUME(snapvec != NULL);
+
+    // Readers always get a version, even before anything is published
+    snapvec->current = new_snap(NULL, 0);
+    if (ERR(snapvec->current == NULL)) {
+        return -1;
+    }
+
+    if (ERR(pthread_mutex_init(&snapvec->lock, NULL) != 0)) {
+        jfree(snapvec->current);
+        return -1;
+    }
+
+    snapvec->epoch = 1;
+    snapvec->readers = NULL;
+    snapvec->retired = NULL;
+
+    return 0;
+}
+
+int
+snapvec_reader_add(struct snapvec *snapvec, struct snapvec_reader *reader)
+{
+    ASSUME(snapvec != NULL);
+    ASSUME(reader != NULL);
+
+    reader->epoch = 0;
+    reader->snapvec = snapvec;
+
+    pthread_mutex_lock(&snapvec->lock);
+    reader->next = snapvec->readers;
+    snapvec->readers = reader;
+    pthread_mutex_unlock(&snapvec->lock);
+
+    return 0;
+}
+
+void
+snapvec_reader_remove(struct snapvec_reader *reader)
+{
+    struct snapvec *snapvec;
+
+    ASSUME(reader != NULL);
+    ASSUME(reader->epoch == 0);
+
+    snapvec = reader->snapvec;
+
+    pthread_mutex_lock(&snapvec->lock);
+    for (struct snapvec_reader **p = &snapvec->readers; *p != NULL;
+         p = &(*p)->next) {
+
+        if (*p == reader) {
+            *p = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&snapvec->lock);
+}
+
+const struct snapvec_snap *
+snapvec_read_begin(struct snapvec_reader *reader)
+{
+    ASSUME(reader != NULL);
+    ASSUME(reader->epoch == 0);
+
+    // The announcement has to be visible before the version is loaded, which
+    // takes a full fence, so that a writer either sees it or the reader sees
+    // the writer's newer version
+    __atomic_store_n(&reader->epoch,
+                     __atomic_load_n(&reader->snapvec->epoch,
+                                     __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&reader->snapvec->current, __ATOMIC_SEQ_CST);
+}
+
+void
+snapvec_read_end(struct snapvec_reader *reader)
+{
+    ASSUME(reader != NULL);
+    ASSUME(reader->epoch != 0);
+
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+int
+snapvec_copy(struct snapvec *snapvec, struct ptrvec *ptrvec)
+{
+    struct snapvec_snap *snap;
+
+    ASSUME(snapvec != NULL);
+    ASSUME(ptrvec != NULL);
+
+    pthread_mutex_lock(&snapvec->lock);
+
+    snap = snapvec->current;
+
+    if (ERR(ptrvec_reserve(ptrvec, snap->length) != 0)) {
+        pthread_mutex_unlock(&snapvec->lock);
+        return -1;
+    }
+
+    if (snap->length > 0) {
+        memcpy(ptrvec->ptr, snap->ptr, snap->length * sizeof(*snap->ptr));
+    }
+    ptrvec->length = snap->length;
+
+    pthread_mutex_unlock(&snapvec->lock);
+
+    return 0;
+}
+
+int
+snapvec_publish(struct snapvec *snapvec, const struct ptrvec *ptrvec)
+{
+    struct snapvec_snap *snap;
+
+    ASSUME(snapvec != NULL);
+    ASSUME(ptrvec != NULL);
+
+    snap = new_snap(ptrvec->ptr, ptrvec->length);
+    if (ERR(snap == NULL)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapvec->lock);
+    publish(snapvec, snap);
+    pthread_mutex_unlock(&snapvec->lock);
+
+    return 0;
+}
+
+int
+snapvec_update(struct snapvec *snapvec,
+               int (*fn)(struct ptrvec *ptrvec, void *ctx), void *ctx)
+{
+    struct snapvec_snap *snap;
+    struct ptrvec ptrvec;
+
+    ASSUME(snapvec != NULL);
+    ASSUME(fn != NULL);
+
+    if (ERR(ptrvec_init(&ptrvec) != 0)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapvec->lock);
+
+    snap = snapvec->current;
+
+    if (ERR(ptrvec_reserve(&ptrvec, snap->length) != 0)) {
+        goto err;
+    }
+    if (snap->length > 0) {
+        memcpy(ptrvec.ptr, snap->ptr, snap->length * sizeof(*snap->ptr));
+    }
+    ptrvec.length = snap->length;
+
+    if (fn(&ptrvec, ctx) != 0) {
+        goto err;
+    }
+
+    snap = new_snap(ptrvec.ptr, ptrvec.length);
+    if (ERR(snap == NULL)) {
+        goto err;
+    }
+
+    publish(snapvec, snap);
+
+    pthread_mutex_unlock(&snapvec->lock);
+    ptrvec_free(&ptrvec);
+
+    return 0;
+
+err:
+    pthread_mutex_unlock(&snapvec->lock);
+    ptrvec_free(&ptrvec);
+
+    return -1;
+}
+
+void
+snapvec_reclaim(struct snapvec *snapvec)
+{
+    ASSUME(snapvec != NULL);
+
+    pthread_mutex_lock(&snapvec->lock);
+    reclaim(snapvec);
+    pthread_mutex_unlock(&snapvec->lock);
+}
+
+void
+snapvec_free(struct snapvec *snapvec)
+{
+    struct snapvec_snap *next;
+
+    ASSUME(snapvec != NULL);
+
+    for (struct snapvec_snap *snap = snapvec->retired; snap != NULL;
+         snap = next) {
+
+        next = snap->next;
+        jfree(snap);
+    }
+
+    jfree(snapvec->current);
+    pthread_mutex_destroy(&snapvec->lock);
+}
@@ -0,0 +1,113 @@
+#ifndef SNAPVEC_H_
+#define SNAPVEC_H_ 1
+
+#include "main.h"
+#include "ptrvec.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* One immutable version of a snapvec's pointers. retired and next are only
+ * used by writers, to keep the version until no reader can still see it. */
+struct snapvec_snap {
+    size_t length;
+    uint64_t retired;
+    struct snapvec_snap *next;
+    void *ptr[];
+};
+
+struct snapvec_reader;
+
+/* A vector of pointers for data that's read far more often than it's changed,
+ * like configuration lists shared by many threads. Readers pin the current
+ * version without taking a lock, and see it unchanged until they unpin it.
+ * Writers never change a version in place: they build a copy, publish it with
+ * one atomic store, and free the old version once every reader that could
+ * have pinned it is done with it.
+ *
+ * Old versions are reclaimed by epoch: epoch goes up with every publish, each
+ * reader announces the epoch it saw when it pins a version, and a version
+ * retired in epoch e is freed once no reader has announced an epoch of e or
+ * less. A reader that keeps a version pinned holds back the freeing of every
+ * version retired since, but never blocks writers.
+ *
+ * lock is only taken by writers, and to add or remove readers. current and
+ * epoch, which every reader loads, have a cache line to themselves, so that
+ * writers only disturb readers when they publish, and not when they take the
+ * lock or reclaim. */
+struct snapvec {
+    struct snapvec_snap *current;
+    uint64_t epoch;
+    pthread_mutex_t lock __attribute__((aligned(64)));
+    struct snapvec_reader *readers;
+    struct snapvec_snap *retired;
+};
+
+/* A reader of a snapvec, which must only be used by one thread at a time.
+ * epoch is 0 while nothing is pinned. Each reader has a cache line to itself,
+ * so pinning only ever writes to memory the reading thread owns. */
+struct snapvec_reader {
+    uint64_t epoch;
+    struct snapvec *snapvec;
+    struct snapvec_reader *next;
+} __attribute__((aligned(64)));
+
+/* All of the following functions take a struct snapvec * or a struct
+ * snapvec_reader * as their first argument. This pointer is always assumed not
+ * to be NULL.
+ *
+ * Note: the pointers contained in a snapvec are not managed by the snapvec. */
+
+/* Initializes the snapvec, empty. Returns 0 on success, nonzero on failure. */
+int
+snapvec_init(struct snapvec *snapvec);
+
+/* Adds reader to snapvec. Returns 0 on success, nonzero on failure. */
+int
+snapvec_reader_add(struct snapvec *snapvec, struct snapvec_reader *reader);
+
+/* Removes reader, which must not have a version pinned, from its snapvec. */
+void
+snapvec_reader_remove(struct snapvec_reader *reader);
+
+/* Pins the current version and returns it. It stays valid, and unchanged,
+ * until snapvec_read_end. Pins don't nest: each snapvec_read_begin must be
+ * followed by snapvec_read_end before the reader pins again. */
+const struct snapvec_snap *
+snapvec_read_begin(struct snapvec_reader *reader);
+
+/* Unpins the version returned by snapvec_read_begin. */
+void
+snapvec_read_end(struct snapvec_reader *reader);
+
+/* Copies the current version into ptrvec, which must be initialized, replacing
+ * its contents. Returns 0 on success, nonzero on failure. */
+int
+snapvec_copy(struct snapvec *snapvec, struct ptrvec *ptrvec);
+
+/* Publishes a copy of the pointers in ptrvec as the new version. Returns 0 on
+ * success, nonzero on failure, in which case the current version is left as it
+ * is. */
+int
+snapvec_publish(struct snapvec *snapvec, const struct ptrvec *ptrvec);
+
+/* Copies the current version into a ptrvec, calls fn on it, and publishes the
+ * result as the new version if fn returns 0. Writers are serialized, so no
+ * other change can get in between the copy and the publish. Returns 0 on
+ * success, or nonzero if fn or anything else fails, in which case the current
+ * version is left as it is. */
+int
+snapvec_update(struct snapvec *snapvec,
+               int (*fn)(struct ptrvec *ptrvec, void *ctx), void *ctx);
+
+/* Frees the retired versions no reader can still see. This is done by every
+ * publish, but can be called after readers are done to free the last of them
+ * sooner. */
+void
+snapvec_reclaim(struct snapvec *snapvec);
+
+/* Frees the memory used by the snapvec. No reader may still be using it. */
+void
+snapvec_free(struct snapvec *snapvec);
+
+#endif
@@ -0,0 +1,293 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "main.h"
+#include "trace.h"
+
+#ifdef TRACE
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// The shortest time trace_flush measures the tick rate over
+#define CALIBRATE_NS 10000000
+
+enum trace_phase {
+    TRACE_PHASE_SCOPE,
+    TRACE_PHASE_COUNTER
+};
+
+// arg is the duration in ticks for a scope, and the value for a counter
+struct trace_event {
+    const char *name;
+    uint64_t ticks;
+    int64_t arg;
+    enum trace_phase phase;
+};
+
+// Only the owning thread writes to events and head. head counts every event
+// ever recorded, so the events still in the ring are the last TRACE_EVENTS up
+// to head, and the ones not yet flushed start at flushed.
+struct trace_ring {
+    struct trace_ring *next;
+    size_t head;
+    size_t flushed;
+    unsigned tid;
+    int exited;
+    struct trace_event events[TRACE_EVENTS];
+};
+
+// Guards trace_rings, trace_tids and the epoch
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings = NULL;
+static unsigned trace_tids = 0;
+
+// The ticks and CLOCK_MONOTONIC time when the first ring was made, which
+// timestamps are measured from
+static uint64_t epoch_ticks;
+static uint64_t epoch_ns;
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_ring *trace_ring = NULL;
+static __thread int trace_thread_done = 0;
+
+uint64_t
+trace_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+trace_thread_exit(void *arg)
+{
+    struct trace_ring *ring = arg;
+
+    // Keep the ring until its events are flushed, but stop recording to it,
+    // since trace_free may free it from now on
+    __atomic_store_n(&ring->exited, 1, __ATOMIC_RELEASE);
+
+    trace_ring = NULL;
+    trace_thread_done = 1;
+}
+
+static void
+trace_key_init(void)
+{
+    pthread_key_create(&trace_key, &trace_thread_exit);
+}
+
+static struct trace_ring *
+new_ring(void)
+{
+    struct trace_ring *ring;
+
+    // Use the system malloc, since the allocator itself is traced
+    ring = malloc(sizeof(*ring));
+    if (ERR(ring == NULL)) {
+        return NULL;
+    }
+
+    ring->head = 0;
+    ring->flushed = 0;
+    ring->exited = 0;
+
+    pthread_once(&trace_key_once, &trace_key_init);
+    pthread_setspecific(trace_key, ring);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_tids == 0) {
+        epoch_ticks = trace_now();
+        epoch_ns = trace_clock();
+    }
+    ring->tid = ++trace_tids;
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_lock);
+
+    return ring;
+}
+
+static void
+record(const char *name, uint64_t ticks, int64_t arg, enum trace_phase phase)
+{
+    struct trace_ring *ring;
+    struct trace_event *event;
+    size_t head;
+
+    ring = trace_ring;
+    if (UNLIKELY(ring == NULL)) {
+        // Events from destructors that run after the ring's are dropped
+        if (trace_thread_done) {
+            return;
+        }
+
+        ring = trace_ring = new_ring();
+        if (ERR(ring == NULL)) {
+            return;
+        }
+    }
+
+    head = ring->head;
+    event = &ring->events[head & (TRACE_EVENTS - 1)];
+    event->name = name;
+    event->ticks = ticks;
+    event->arg = arg;
+    event->phase = phase;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_scope_end(struct trace_scope *scope)
+{
+    ASSUME(scope != NULL);
+
+    record(scope->name, scope->start, (int64_t)(trace_now() - scope->start),
+           TRACE_PHASE_SCOPE);
+}
+
+void
+trace_counter(const char *name, int64_t value)
+{
+    record(name, trace_now(), value, TRACE_PHASE_COUNTER);
+}
+
+// Writes str as a JSON string
+static void
+write_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+
+    for (; *str != '\0'; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', file);
+            fputc(*str, file);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(file, "\\u%04x", (unsigned)(unsigned char)*str);
+        } else {
+            fputc(*str, file);
+        }
+    }
+
+    fputc('"', file);
+}
+
+// Returns the microseconds per tick, measured since the epoch
+static double
+tick_us(void)
+{
+    uint64_t ticks, ns;
+
+    // Too short a time would make for a bad estimate
+    do {
+        ns = trace_clock();
+        ticks = trace_now();
+    } while (ns - epoch_ns < CALIBRATE_NS);
+
+    if (ticks == epoch_ticks) {
+        return 0.001;
+    }
+
+    return (double)(ns - epoch_ns) / (double)(ticks - epoch_ticks) / 1000;
+}
+
+int
+trace_flush(FILE *file)
+{
+    struct trace_event *event;
+    const char *sep = "";
+    double us;
+    long pid;
+
+    ASSUME(file != NULL);
+
+    pthread_mutex_lock(&trace_lock);
+
+    us = trace_rings == NULL ? 0 : tick_us();
+    pid = (long)getpid();
+
+    fputs("{\"traceEvents\":[", file);
+
+    for (struct trace_ring *ring = trace_rings; ring != NULL;
+         ring = ring->next) {
+
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        // Anything older has been overwritten
+        if (head - ring->flushed > TRACE_EVENTS) {
+            ring->flushed = head - TRACE_EVENTS;
+        }
+
+        for (; ring->flushed < head; ++ring->flushed) {
+            event = &ring->events[ring->flushed & (TRACE_EVENTS - 1)];
+
+            fputs(sep, file);
+            fputs("\n{\"name\":", file);
+            write_string(file, event->name);
+            fprintf(file, ",\"pid\":%ld,\"tid\":%u,\"ts\":%.3f,", pid,
+                    ring->tid,
+                    (double)(int64_t)(event->ticks - epoch_ticks) * us);
+
+            switch (event->phase) {
+            case TRACE_PHASE_SCOPE:
+                fprintf(file, "\"ph\":\"X\",\"dur\":%.3f}",
+                        (double)event->arg * us);
+                break;
+            case TRACE_PHASE_COUNTER:
+                fprintf(file, "\"ph\":\"C\",\"args\":{\"value\":%" PRId64 "}}",
+                        event->arg);
+                break;
+            default:
+                ASSUME_UNREACHABLE();
+            }
+
+            sep = ",";
+        }
+    }
+
+    fputs("\n],\"displayTimeUnit\":\"ns\"}\n", file);
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return ferror(file) || fflush(file) != 0 ? -1 : 0;
+}
+
+void
+trace_free(void)
+{
+    struct trace_ring *ring;
+
+    pthread_mutex_lock(&trace_lock);
+
+    for (struct trace_ring **p = &trace_rings; *p != NULL;) {
+        ring = *p;
+
+        if (ring == trace_ring
+            || __atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE)) {
+
+            *p = ring->next;
+            free(ring);
+        } else {
+            ring->flushed = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            p = &ring->next;
+        }
+    }
+
+    if (trace_ring != NULL) {
+        pthread_setspecific(trace_key, NULL);
+        trace_ring = NULL;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef TRACE_H_
+#define TRACE_H_ 1
+
+#include "main.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Lightweight timing instrumentation for hot paths. In a build with TRACE in
+ * DEFS, TRACE_SCOPE and TRACE_COUNTER record events into a ring buffer owned
+ * by the calling thread, without taking any locks, and trace_flush writes
+ * them out as a Chrome trace (load it in chrome://tracing or Perfetto).
+ * Without TRACE, they compile to nothing, and trace_flush writes nothing.
+ *
+ * Each thread keeps only its last TRACE_EVENTS events, so a long run should be
+ * flushed every so often to keep them all. */
+#define TRACE_EVENTS ((size_t)1 << 15)
+
+#define TRACE_CAT_(a,b) a##b
+#define TRACE_CAT(a,b) TRACE_CAT_(a,b)
+
+#ifdef TRACE
+
+/* The CLOCK_MONOTONIC time in nanoseconds. */
+uint64_t
+trace_clock(void);
+
+/* The time in ticks, from the TSC on x86, which is much cheaper to read, and
+ * from trace_clock elsewhere. trace_flush converts ticks to microseconds. */
+#if defined(__x86_64__) || defined(__i386__)
+
+static inline uint64_t
+trace_now(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+
+#else
+
+static inline uint64_t
+trace_now(void)
+{
+    return trace_clock();
+}
+
+#endif
+
+struct trace_scope {
+    const char *name;
+    uint64_t start;
+};
+
+/* Records a scope that started at scope->start and ends now. Called by the
+ * cleanup of TRACE_SCOPE. */
+void
+trace_scope_end(struct trace_scope *scope);
+
+/* Records that the counter name has value now. */
+void
+trace_counter(const char *name, int64_t value);
+
+/* Times the rest of the enclosing block, from here until it's left, however
+ * that happens. name should be a string literal, or at least outlive the next
+ * trace_flush. This is a declaration, so it has to go with the block's other
+ * declarations, and there can only be one on each line. */
+#define TRACE_SCOPE(name) \
+    struct trace_scope TRACE_CAT(trace_scope_, __LINE__) \
+        __attribute__((cleanup(trace_scope_end))) = {(name), trace_now()}
+
+/* Records value, converted to int64_t, as the current value of the counter
+ * name, which is shown as a graph over time. */
+#define TRACE_COUNTER(name,value) trace_counter((name), (int64_t)(value))
+
+/* Writes the events recorded by every thread since the last flush to file as
+ * Chrome trace JSON, and empties the buffers. Other threads should not be
+ * recording events while this is called. Returns 0 on success, nonzero on
+ * failure. */
+int
+trace_flush(FILE *file);
+
+/* Drops every buffered event, and frees the buffers of threads that have
+ * exited, and the calling thread's. */
+void
+trace_free(void);
+
+#else
+
+#define TRACE_SCOPE(name) struct TRACE_CAT(trace_scope_, __LINE__)
+#define TRACE_COUNTER(name,value) ((void)0)
+
+static inline int
+trace_flush(FILE *file)
+{
+    UNUSED(file);
+
+    return 0;
+}
+
+static inline void
+trace_free(void)
+{
+}
+
+#endif
+
+#endif
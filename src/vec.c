@@ -2,9 +2,73 @@
 #include "vec.h"
 
 #include "alloc.h"
+#include "trace.h"
+
+#include <stdint.h>
+
+// Rounds a capacity of cap elements of size bytes up, so that a buffer of at
+// least VEC_HUGE_THRESHOLD bytes fills a whole number of huge pages. This is
+// only done if ptr, the buffer being grown, starts on a huge page, and so is
+// likely to be grown in place. Any other buffer's last huge page straddles a
+// boundary and can never be backed by one, so padding it only wastes memory.
+static inline size_t
+round_cap(const void *ptr, size_t cap, size_t size)
+{
+    size_t bytes = cap * size;
+
+    if (bytes < VEC_HUGE_THRESHOLD || size == 0 || ptr == NULL
+        || ((uintptr_t)ptr & (ALLOC_HUGE_PAGE - 1)) != 0) {
+        return cap;
+    }
+
+    bytes = (bytes + ALLOC_HUGE_PAGE - 1) & ~(ALLOC_HUGE_PAGE - 1);
+
+    return bytes / size;
+}
+
+// Asks for huge pages for a buffer of at least VEC_HUGE_THRESHOLD bytes. This
+// is only a hint, so failure is ignored.
+static inline void
+advise_huge(void *ptr, size_t bytes)
+{
+    if (bytes >= VEC_HUGE_THRESHOLD) {
+        alloc_advise(ptr, bytes, ALLOC_ADVICE_HUGE);
+    }
+}
 
 int
 vec_reserve_one(void *ptr, size_t n, size_t size)
+{
+    return vec_reserve_one_a(NULL, ptr, n, size);
+}
+
+int
+vec_reserve_one_min(void *ptr, size_t *n, size_t size)
+{
+    return vec_reserve_one_min_a(NULL, ptr, n, size);
+}
+
+int
+vec_reserve(void *ptr, size_t n, size_t size, size_t extra)
+{
+    return vec_reserve_a(NULL, ptr, n, size, extra);
+}
+
+int
+vec_reserve_min(void *ptr, size_t *n, size_t size, size_t extra)
+{
+    return vec_reserve_min_a(NULL, ptr, n, size, extra);
+}
+
+int
+vec_shrink(void *ptr, size_t *n, size_t size, size_t m)
+{
+    return vec_shrink_a(NULL, ptr, n, size, m);
+}
+
+int
+vec_reserve_one_a(const struct allocator *allocator, void *ptr, size_t n,
+                  size_t size)
 {
     void *tmp;
     size_t bytes;
@@ -13,7 +77,7 @@ vec_reserve_one(void *ptr, size_t n, size_t size)
 
     bytes = (n + 1) * size;
 
-    tmp = jrealloc(*(void **)ptr, bytes);
+    tmp = jrealloc_a(allocator, *(void **)ptr, bytes);
     if (ERR(tmp == NULL)) {
         return -1;
     }
@@ -23,81 +87,110 @@ vec_reserve_one(void *ptr, size_t n, size_t size)
 }
 
 int
-vec_reserve_one_min(void *ptr, size_t *n, size_t size)
+vec_reserve_one_min_a(const struct allocator *allocator, void *ptr, size_t *n,
+                      size_t size)
 {
     void *tmp;
     size_t cap;
+    TRACE_SCOPE("vec grow");
 
     ASSUME(ptr != NULL);
     ASSUME(n != NULL);
 
-    cap = *n == 0 ? 1 : (*n * 2);
+    cap = round_cap(*(void **)ptr, *n == 0 ? 1 : (*n * 2), size);
 
-    tmp = jrealloc(*(void **)ptr, cap * size);
+    tmp = jrealloc_a(allocator, *(void **)ptr, cap * size);
     if (ERR(tmp == NULL)) {
         cap = (*n + 1);
 
-        tmp = jrealloc(*(void **)ptr, cap * size);
+        tmp = jrealloc_a(allocator, *(void **)ptr, cap * size);
         if (ERR(tmp == NULL)) {
             return -1;
         }
     }
     *(void **)ptr = tmp;
 
+    advise_huge(tmp, cap * size);
+    TRACE_COUNTER("vec grow bytes", cap * size);
+
     *n = cap;
 
     return 0;
 }
 
 int
-vec_reserve(void *ptr, size_t n, size_t size, size_t extra)
+vec_reserve_a(const struct allocator *allocator, void *ptr, size_t n,
+              size_t size, size_t extra)
 {
     void *tmp;
 
     ASSUME(ptr != NULL);
 
-    tmp = jrealloc(*(void **)ptr, (n + extra) * size);
+    tmp = jrealloc_a(allocator, *(void **)ptr, (n + extra) * size);
     if (ERR(tmp == NULL)) {
         return -1;
     }
     *(void **)ptr = tmp;
 
+    advise_huge(tmp, (n + extra) * size);
+
     return 0;
 }
 
 int
-vec_reserve_min(void *ptr, size_t *n, size_t size, size_t extra)
+vec_reserve_min_a(const struct allocator *allocator, void *ptr, size_t *n,
+                  size_t size, size_t extra)
 {
     void *tmp;
     size_t cap;
+    TRACE_SCOPE("vec grow");
 
     ASSUME(ptr != NULL);
     ASSUME(n != NULL);
 
-    cap = extra < *n ? *n * 2 : *n + extra;
+    cap = round_cap(*(void **)ptr, extra < *n ? *n * 2 : *n + extra, size);
 
-    tmp = jrealloc(*(void **)ptr, cap * size);
+    tmp = jrealloc_a(allocator, *(void **)ptr, cap * size);
     if (ERR(tmp == NULL)) {
         cap = *n + extra;
 
-        tmp = jrealloc(*(void **)ptr, cap * size);
+        tmp = jrealloc_a(allocator, *(void **)ptr, cap * size);
         if (ERR(tmp == NULL)) {
             return -1;
         }
     }
     *(void **)ptr = tmp;
 
+    advise_huge(tmp, cap * size);
+    TRACE_COUNTER("vec grow bytes", cap * size);
+
     *n = cap;
 
     return 0;
 }
 
 int
-vec_shrink(void *ptr, size_t *n, size_t size, size_t m)
+vec_shrink_a(const struct allocator *allocator, void *ptr, size_t *n,
+             size_t size, size_t m)
 {
     void *tmp;
 
-    tmp = jrealloc(*(void **)ptr, m * size);
+    ASSUME(ptr != NULL);
+    ASSUME(n != NULL);
+    ASSUME(m <= *n);
+
+    // Give a large tail's pages back in place, rather than having realloc copy
+    // the rest of the buffer somewhere smaller
+    if (m != 0 && (*n - m) * size >= VEC_HUGE_THRESHOLD
+        && alloc_advise((char *)*(void **)ptr + m * size, (*n - m) * size,
+                        ALLOC_ADVICE_RELEASE) == 0) {
+
+        *n = m;
+
+        return 0;
+    }
+
+    tmp = jrealloc_a(allocator, *(void **)ptr, m * size);
     if (ERR(tmp == NULL)) {
         return -1;
     }
@@ -3,6 +3,15 @@
 
 #include "main.h"
 
+struct allocator;
+
+/* Buffers of at least this many bytes are advised to be backed by huge pages
+ * (see alloc_advise), which saves TLB misses when they're scanned. Those that
+ * start on a huge page are also grown to a whole number of them. Shrinking one
+ * by at least this many bytes gives the pages after the end back to the system
+ * in place, instead of copying the buffer into a smaller one. */
+#define VEC_HUGE_THRESHOLD ((size_t)2 << 20)
+
 /* Reserves exactly size bytes after *ptr, which is a pointer to an array of
  * n * size bytes. Returns 0 on success, nonzero on failure. */
 int
@@ -27,8 +36,33 @@ vec_reserve_min(void *ptr, size_t *n, size_t size, size_t extra);
 
 /* Shrinks an overallocated array pointed to by *ptr, which is an array of *n *
  * size bytes. Leaves m * size bytes left in the array, in which the original
- * data is preserved. Sets *n to the total allocated bytes / size (i.e. m). */
+ * data is preserved. Sets *n to the total allocated bytes / size (i.e. m). The
+ * buffer may keep its address space if the tail's pages were released in
+ * place, but it must still be freed as usual. */
 int
 vec_shrink(void *ptr, size_t *n, size_t size, size_t m);
 
+/* The following functions are the same as the ones above, except that they
+ * allocate through allocator, or through jrealloc if allocator is NULL. */
+
+int
+vec_reserve_one_a(const struct allocator *allocator, void *ptr, size_t n,
+                  size_t size);
+
+int
+vec_reserve_one_min_a(const struct allocator *allocator, void *ptr, size_t *n,
+                      size_t size);
+
+int
+vec_reserve_a(const struct allocator *allocator, void *ptr, size_t n,
+              size_t size, size_t extra);
+
+int
+vec_reserve_min_a(const struct allocator *allocator, void *ptr, size_t *n,
+                  size_t size, size_t extra);
+
+int
+vec_shrink_a(const struct allocator *allocator, void *ptr, size_t *n,
+             size_t size, size_t m);
+
 #endif
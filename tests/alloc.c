@@ -1,9 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "../src/main.h"
 #include "../src/alloc.h"
 
 #include "test.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#if defined(NDEBUG) && defined(ALLOC_HARDEN)
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs fn in a child process, and returns whether the child was aborted
+static int
+aborts(void (*fn)(void))
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0) {
+        // Keep the child's corruption report out of the test output
+        freopen("/dev/null", "w", stderr);
+        fn();
+        _exit(0);
+    }
+
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFSIGNALED(status)
+        && WTERMSIG(status) == SIGABRT;
+}
+
+static void
+alloc_exit_ok(void)
+{
+    char *ptr = jcalloc(4, 4);
+
+    ptr = jrealloc(ptr, 100);
+    memset(ptr, 0, 100);
+    jfree(ptr);
+}
+
+static void
+overflow(void)
+{
+    char *ptr = jmalloc(16);
+
+    memset(ptr, 0, 17);
+    jfree(ptr);
+}
+
+static void
+underflow(void)
+{
+    char *ptr = jmalloc(16);
+
+    ptr[-1] = 0;
+    jfree(ptr);
+}
+
+static void
+double_free(void)
+{
+    char *ptr = jmalloc(16);
+
+    jfree(ptr);
+    jfree(ptr);
+}
+
+#endif
+
+#if defined(NDEBUG) && defined(ALLOC_TCACHE)
+
+#include <pthread.h>
+
+#define TCACHE_BLOCKS 256
+
+// Allocates and frees enough blocks to overflow the thread's cache into the
+// depot
+static void *
+churn(void *arg)
+{
+    void *ptrs[TCACHE_BLOCKS];
+
+    UNUSED(arg);
+
+    for (size_t i = 0; i < TCACHE_BLOCKS; ++i) {
+        ptrs[i] = jmalloc(24);
+    }
+    for (size_t i = 0; i < TCACHE_BLOCKS; ++i) {
+        jfree(ptrs[i]);
+    }
+
+    return NULL;
+}
+
+#endif
+
+#ifdef ALLOC_TRACE
+
+#include "../src/alloc_trace.h"
+
+#define TRACE_ROUNDS 100
+
+// Checks that the trace at path holds exactly the events of TRACE_ROUNDS
+// rounds of jmalloc(i), jrealloc(ptr, 2 * i) and jfree, in order
+static int
+check_trace(const char *path)
+{
+    struct alloc_trace_header header;
+    struct alloc_trace_event events[3 * TRACE_ROUNDS + 1], *event;
+    FILE *file;
+    size_t n;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    n = fread(&header, sizeof(header), 1, file) == 1
+        ? fread(events, sizeof(*events), 3 * TRACE_ROUNDS + 1, file) : 0;
+    if (fclose(file) != 0 || n != 3 * TRACE_ROUNDS
+        || memcmp(header.magic, ALLOC_TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != ALLOC_TRACE_VERSION
+        || header.event_size != sizeof(*events)) {
+
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        event = &events[i];
+
+        // Only one thread allocated, so the file is in sequence order
+        if (i > 0 && ALLOC_TRACE_SEQ(event) != ALLOC_TRACE_SEQ(event - 1) + 1) {
+            return -1;
+        }
+
+        switch (i % 3) {
+        case 0:
+            if (ALLOC_TRACE_OP(event) != ALLOC_TRACE_MALLOC
+                || event->size != i / 3 + 1 || event->old_ptr != 0) {
+                return -1;
+            }
+            break;
+        case 1:
+            if (ALLOC_TRACE_OP(event) != ALLOC_TRACE_REALLOC
+                || event->size != 2 * (i / 3 + 1)
+                || event->old_ptr != event[-1].ptr) {
+                return -1;
+            }
+            break;
+        case 2:
+            if (ALLOC_TRACE_OP(event) != ALLOC_TRACE_FREE || event->size != 0
+                || event->ptr != event[-1].ptr) {
+                return -1;
+            }
+            break;
+        default:
+            ASSUME_UNREACHABLE();
+        }
+    }
+
+    return 0;
+}
+
+#endif
 
 int
 main(void)
@@ -20,6 +185,7 @@ main(void)
     alloc_size(1);
     TEST_PASS();
 
+#ifdef XMALLOC
     TEST_CHECK("jxmalloc()");
     ptr = jxmalloc(1);
     TEST_PASS();
@@ -39,6 +205,7 @@ main(void)
     TEST_CHECK("jxfree()");
     jxfree(ptr);
     TEST_PASS();
+#endif
 
     TEST_CHECK("jmalloc()");
     ptr = jmalloc(1);
@@ -48,6 +215,25 @@ main(void)
     jfree(ptr);
     TEST_PASS();
 
+    TEST_CHECK("jmalloc_batch() and jfree_batch()");
+    {
+        void *ptrs[33];
+
+        TEST_ASSERT(jmalloc_batch(32, 24, ptrs) == 0);
+        ptrs[32] = NULL;
+
+        // Swap the halves, so the batch isn't already in address order
+        for (size_t i = 0; i < 16; ++i) {
+            ptr = ptrs[i];
+            ptrs[i] = ptrs[i + 16];
+            ptrs[i + 16] = ptr;
+        }
+
+        jfree_batch(ptrs, 33);
+        jfree_batch(ptrs, 0);
+    }
+    TEST_PASS();
+
     TEST_CHECK("jcalloc()");
     ptr = jcalloc(1, 1);
     TEST_PASS();
@@ -60,6 +246,220 @@ main(void)
     jfree(ptr);
     TEST_PASS();
 
+#ifdef ALLOC_TRACE
+    TEST_CHECK("alloc_trace_start() and alloc_trace_stop()");
+    TEST_ASSERT(alloc_trace_start("alloc_trace.bin") == 0);
+    for (size_t i = 1; i <= TRACE_ROUNDS; ++i) {
+        ptr = jmalloc(i);
+        ptr = jrealloc(ptr, 2 * i);
+        jfree(ptr);
+    }
+    TEST_ASSERT(alloc_trace_stop() == 0);
+    TEST_ASSERT(check_trace("alloc_trace.bin") == 0);
+    TEST_ASSERT(remove("alloc_trace.bin") == 0);
+    TEST_PASS();
+#endif
+
+#if defined(NDEBUG) && defined(ALLOC_HARDEN)
+    TEST_CHECK("heap cookies");
+    TEST_ASSERT(!aborts(&alloc_exit_ok));
+    TEST_ASSERT(aborts(&overflow));
+    TEST_ASSERT(aborts(&underflow));
+    TEST_ASSERT(aborts(&double_free));
+    alloc_quarantine(0);
+    ptr = jrealloc(NULL, 8);
+    ptr = jrealloc(ptr, 4096);
+    jfree(ptr);
+    alloc_quarantine(ALLOC_QUARANTINE);
+    TEST_PASS();
+#endif
+
+#if defined(NDEBUG) && defined(ALLOC_TCACHE)
+    TEST_CHECK("thread cache");
+    {
+        struct alloc_tcache_stats before, after;
+        pthread_t thread;
+        void *ptrs[TCACHE_BLOCKS];
+        char *bytes;
+
+        alloc_tcache_stats(&before);
+
+#ifndef ALLOC_HARDEN
+        // The same block comes straight back, unless it's in quarantine
+        ptr = jmalloc(100);
+        jfree(ptr);
+        TEST_ASSERT(jmalloc(100) == ptr);
+        jfree(ptr);
+#endif
+
+        // A cached block is zeroed by jcalloc, and kept by a small realloc
+        bytes = jmalloc(100);
+        memset(bytes, 0xFF, 100);
+        jfree(bytes);
+        bytes = jcalloc(10, 10);
+        for (size_t i = 0; i < 100; ++i) {
+            TEST_ASSERT(bytes[i] == 0);
+        }
+        TEST_ASSERT(jrealloc(bytes, 90) == bytes);
+        bytes = jrealloc(bytes, 10000);
+        TEST_ASSERT(bytes != NULL && bytes[0] == 0 && bytes[89] == 0);
+        jfree(bytes);
+
+        TEST_ASSERT(pthread_create(&thread, NULL, &churn, NULL) == 0);
+        TEST_ASSERT(pthread_join(thread, NULL) == 0);
+
+        // The other thread's blocks are taken from the depot
+        for (size_t i = 0; i < TCACHE_BLOCKS; ++i) {
+            ptrs[i] = jmalloc(24);
+            TEST_ASSERT(ptrs[i] != NULL);
+        }
+
+        alloc_tcache_stats(&after);
+        TEST_ASSERT(after.hits > before.hits);
+        TEST_ASSERT(after.refills > before.refills);
+        TEST_ASSERT(after.flushes > before.flushes);
+        TEST_ASSERT(after.misses > before.misses);
+
+        // A batch overflows the bin, which is only flushed once at the end
+        jfree_batch(ptrs, TCACHE_BLOCKS);
+        alloc_tcache_stats(&before);
+        TEST_ASSERT(before.flushes > after.flushes);
+        ptr = jmalloc(24);
+        alloc_tcache_stats(&after);
+        TEST_ASSERT(after.hits == before.hits + 1);
+        jfree(ptr);
+
+        alloc_tcache_flush();
+        alloc_tcache_trim();
+    }
+    TEST_PASS();
+#endif
+
+#ifndef NDEBUG
+    TEST_CHECK("alloc_snapshot() and alloc_diff()");
+    {
+        struct alloc_snapshot a, b, c;
+        void *ptrs[3];
+        char report[512];
+        size_t len;
+        FILE *stream;
+
+        ptr = jmalloc(7);
+        alloc_snapshot(&a);
+
+        for (size_t i = 0; i < 3; ++i) {
+            ptrs[i] = jmalloc(10);
+        }
+        jfree(ptr);
+        ptr = jmalloc(100);
+
+        alloc_snapshot(&b);
+        TEST_ASSERT(b.generation == a.generation + 4);
+        TEST_ASSERT(b.blocks == a.blocks + 3);
+        TEST_ASSERT(b.bytes == a.bytes + 3 * 10 + 100 - 7);
+
+        stream = tmpfile();
+        TEST_ASSERT(stream != NULL);
+        TEST_ASSERT(alloc_diff(&a, &b, stream) == 0);
+        rewind(stream);
+        len = fread(report, 1, sizeof(report) - 1, stream);
+        report[len] = '\0';
+        fclose(stream);
+
+        TEST_ASSERT(strstr(report, "Blocks: 4\n\tBytes: 130\n") != NULL);
+        TEST_ASSERT(strstr(report, ": 1 blocks, 100 bytes\n") != NULL);
+        TEST_ASSERT(strstr(report, ": 3 blocks, 30 bytes\n") != NULL);
+        TEST_ASSERT(strstr(report, ": 1 blocks, 100 bytes\n")
+                    < strstr(report, ": 3 blocks, 30 bytes\n"));
+
+        for (size_t i = 0; i < 3; ++i) {
+            jfree(ptrs[i]);
+        }
+        jfree(ptr);
+
+        alloc_snapshot(&c);
+        TEST_ASSERT(c.blocks == a.blocks - 1);
+
+        stream = tmpfile();
+        TEST_ASSERT(stream != NULL);
+        TEST_ASSERT(alloc_diff(&a, NULL, stream) == 0);
+        rewind(stream);
+        len = fread(report, 1, sizeof(report) - 1, stream);
+        report[len] = '\0';
+        fclose(stream);
+
+        TEST_ASSERT(strstr(report, "Blocks: 0\n") != NULL);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("alloc_check_range()");
+    {
+        char *bytes, *other, local;
+
+        bytes = jmalloc(16);
+        other = jmalloc(16);
+
+        TEST_ASSERT(alloc_check_range(bytes, 16) == 0);
+        TEST_ASSERT(alloc_check_range(bytes + 4, 8) == 0);
+        TEST_ASSERT(alloc_check_range(bytes + 16, 0) == 0);
+        TEST_ASSERT(alloc_check_range(other, 16) == 0);
+        TEST_ASSERT(alloc_check_range(bytes + 8, 9) != 0);
+        TEST_ASSERT(alloc_check_range(bytes - 1, 2) != 0);
+        TEST_ASSERT(alloc_check_range(&local, 1) != 0);
+
+        // The remembered block is forgotten once it's freed
+        TEST_ASSERT(alloc_check_range(bytes, 1) == 0);
+        jfree(bytes);
+        TEST_ASSERT(alloc_check_range(bytes, 1) != 0);
+        TEST_ASSERT(alloc_check_range(other, 1) == 0);
+        jfree(other);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("alloc_check_all() and alloc_check_step()");
+    {
+        char *bytes, saved;
+        size_t found;
+
+        bytes = jmalloc(8);
+        for (size_t i = 0; i < 4; ++i) {
+            TEST_ASSERT(alloc_check_step(1) == 0);
+        }
+        TEST_ASSERT(alloc_check_all() == 0);
+
+        // Corrupt the canary after the block, and put it back afterwards so
+        // the block can be freed cleanly
+        saved = bytes[8];
+        bytes[8] = (char)~saved;
+
+        TEST_ASSERT(alloc_check_all() == 1);
+
+        found = 0;
+        for (size_t i = 0; i < 64 && found == 0; ++i) {
+            found = alloc_check_step(1);
+        }
+        TEST_ASSERT(found == 1);
+
+        TEST_ASSERT(alloc_check_start(16, 1) == 0);
+        TEST_ASSERT(alloc_check_start(16, 1) != 0);
+        TEST_ASSERT(alloc_check_stop() == 1);
+
+        bytes[8] = saved;
+        TEST_ASSERT(alloc_check_start(16, 1) == 0);
+        TEST_ASSERT(alloc_check_stop() == 0);
+
+        jfree(bytes);
+    }
+    TEST_PASS();
+#endif
+
+    TEST_CHECK("alloc_find_allocator()");
+    TEST_ASSERT(alloc_find_allocator("system") == &alloc_system);
+    TEST_ASSERT(alloc_find_allocator("no such allocator") == NULL);
+    alloc_set_allocator(alloc_find_allocator("system"));
+    TEST_ASSERT(alloc_allocator == &alloc_system);
+    TEST_PASS();
+
     TEST_CHECK("alloc_free()");
     alloc_free();
     TEST_PASS();
@@ -0,0 +1,176 @@
+#include "../src/main.h"
+#include "../src/bitset.h"
+
+#include "../src/alloc.h"
+
+#include "test.h"
+
+#include <stdint.h>
+
+// Not a multiple of the word size, or of the 2 and 4 words done at a time
+#define N_BITS 1000
+
+static uint32_t seed = 1;
+
+static int
+random_bit(unsigned sparsity)
+{
+    seed = seed * 1103515245 + 12345;
+
+    return (seed >> 16) % sparsity == 0;
+}
+
+// Fills bitset and bits with the same random bits
+static int
+fill_random(struct bitset *bitset, char *bits, unsigned sparsity)
+{
+    if (bitset_init(bitset) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < N_BITS; ++i) {
+        bits[i] = (char)random_bit(sparsity);
+
+        if (bitset_push(bitset, bits[i]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Checks bitset against bits, including bitset_count, bitset_next, bitset_rank
+// and bitset_select
+static int
+check_bits(struct bitset *bitset, const char *bits)
+{
+    static size_t next[N_BITS + 1];
+    size_t count = 0;
+
+    if (bitset->length != N_BITS) {
+        return -1;
+    }
+
+    // next[i] is the index of the first bit set at or after i
+    next[N_BITS] = N_BITS;
+    for (size_t i = N_BITS; i > 0; --i) {
+        next[i - 1] = bits[i - 1] ? i - 1 : next[i];
+    }
+
+    if (bitset_next(bitset, 0) != next[0]) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < N_BITS; ++i) {
+        if (bitset_get(bitset, i) != bits[i]
+            || bitset_next(bitset, i + 1) != next[i + 1]) {
+
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < N_BITS; ++i) {
+        if (bitset_rank(bitset, i) != count) {
+            return -1;
+        }
+
+        if (bits[i]) {
+            if (bitset_select(bitset, count) != i) {
+                return -1;
+            }
+            ++count;
+        }
+    }
+
+    if (bitset_rank(bitset, N_BITS) != count
+        || bitset_count(bitset) != count
+        || bitset_select(bitset, count) != N_BITS) {
+
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(void)
+{
+    static char a_bits[N_BITS], b_bits[N_BITS];
+    struct bitset a, b;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    TEST_CHECK("bitset_push() and bitset_get()");
+    TEST_ASSERT(fill_random(&a, a_bits, 2) == 0);
+    TEST_ASSERT(check_bits(&a, a_bits) == 0);
+    TEST_PASS();
+
+    TEST_CHECK("sparse bitset");
+    TEST_ASSERT(fill_random(&b, b_bits, 300) == 0);
+    TEST_ASSERT(check_bits(&b, b_bits) == 0);
+    TEST_PASS();
+
+    TEST_CHECK("bitset_set() and bitset_reset()");
+    bitset_set(&b, 0);
+    bitset_set(&b, N_BITS - 1);
+    bitset_reset(&b, 500);
+    b_bits[0] = b_bits[N_BITS - 1] = 1;
+    b_bits[500] = 0;
+    TEST_ASSERT(check_bits(&b, b_bits) == 0);
+    TEST_PASS();
+
+    TEST_CHECK("bitset set operations");
+    bitset_and(&a, &b);
+    for (size_t i = 0; i < N_BITS; ++i) {
+        a_bits[i] = a_bits[i] & b_bits[i];
+    }
+    TEST_ASSERT(check_bits(&a, a_bits) == 0);
+
+    bitset_fill(&a, 1);
+    bitset_xor(&a, &b);
+    for (size_t i = 0; i < N_BITS; ++i) {
+        a_bits[i] = !b_bits[i];
+    }
+    TEST_ASSERT(check_bits(&a, a_bits) == 0);
+
+    bitset_or(&a, &b);
+    TEST_ASSERT(bitset_count(&a) == N_BITS);
+
+    bitset_andnot(&a, &b);
+    for (size_t i = 0; i < N_BITS; ++i) {
+        a_bits[i] = !b_bits[i];
+    }
+    TEST_ASSERT(check_bits(&a, a_bits) == 0);
+    TEST_PASS();
+
+    TEST_CHECK("bitset_resize()");
+    TEST_ASSERT(bitset_resize(&a, 70) == 0);
+    TEST_ASSERT(bitset_resize(&a, N_BITS) == 0);
+    for (size_t i = 70; i < N_BITS; ++i) {
+        a_bits[i] = 0;
+    }
+    TEST_ASSERT(check_bits(&a, a_bits) == 0);
+
+    bitset_fill(&a, 0);
+    TEST_ASSERT(bitset_next(&a, 0) == N_BITS);
+    TEST_ASSERT(bitset_select(&a, 0) == N_BITS);
+    TEST_PASS();
+
+    TEST_CHECK("bitset_rank() and bitset_select() after each change");
+    for (size_t i = 0; i < N_BITS; ++i) {
+        bitset_set(&a, N_BITS - 1 - i);
+        TEST_ASSERT(bitset_rank(&a, N_BITS) == i + 1);
+        TEST_ASSERT(bitset_rank(&a, N_BITS - 1 - i) == 0);
+        TEST_ASSERT(bitset_select(&a, 0) == N_BITS - 1 - i);
+    }
+    TEST_PASS();
+
+    bitset_free(&a);
+    bitset_free(&b);
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -0,0 +1,264 @@
+#include "../src/main.h"
+#include "../src/btree.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "test.h"
+
+#include <stdint.h>
+
+#define N_KEYS 5000
+
+static uintptr_t items[N_KEYS];
+
+// Checks the subtree at node, of height levels, holding keys in [lo, hi).
+// Returns the number of keys in it, or SIZE_MAX if anything is wrong.
+static size_t
+check_node(const struct btree_node *node, size_t height, int root,
+           uintptr_t lo, uintptr_t hi)
+{
+    size_t count = 0, n;
+
+    if (!root && node->length < BTREE_KEYS / 2) {
+        return SIZE_MAX;
+    }
+    if (node->length > BTREE_KEYS || node->leaf != (height == 1)) {
+        return SIZE_MAX;
+    }
+
+    for (size_t i = 0; i < node->length; ++i) {
+        if (node->keys[i] < lo || node->keys[i] >= hi
+            || (i > 0 && node->keys[i - 1] >= node->keys[i])) {
+
+            return SIZE_MAX;
+        }
+    }
+
+    if (node->leaf) {
+        return node->length;
+    }
+
+    for (size_t i = 0; i <= node->length; ++i) {
+        n = check_node(node->ptrs[i], height - 1, 0,
+                       i == 0 ? lo : node->keys[i - 1],
+                       i == node->length ? hi : node->keys[i]);
+        if (n == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+
+        count += n;
+    }
+
+    return count;
+}
+
+// Checks the structure of btree, and that iterating over it gives the keys
+// where expected isn't -1, in order, with their values
+static int
+check_btree(struct btree *btree, const int *expected, size_t n_keys)
+{
+    struct btree_iter iter;
+    uintptr_t key;
+    void *value;
+    size_t i = 0;
+
+    if (btree->root == NULL) {
+        if (btree->length != 0 || btree->height != 0) {
+            return -1;
+        }
+    } else if (check_node(btree->root, btree->height, 1, 0, UINTPTR_MAX)
+               != btree->length) {
+
+        return -1;
+    }
+
+    btree_seek(btree, 0, &iter);
+    while (btree_iter_next(&iter, &key, &value)) {
+        for (; i < n_keys && expected[i] == -1; ++i) {
+        }
+
+        if (i != key || value != items + expected[i]) {
+            return -1;
+        }
+        ++i;
+    }
+
+    for (; i < n_keys; ++i) {
+        if (expected[i] != -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Puts, overwrites and removes keys in a pseudorandom order, checking the
+// btree against an array of what it should hold
+static int
+check_random(struct btree *btree, size_t n_keys)
+{
+    static int expected[N_KEYS];
+    uint32_t x = 1;
+    size_t length = 0;
+    uint32_t key;
+    void **value;
+
+    for (size_t i = 0; i < n_keys; ++i) {
+        expected[i] = -1;
+    }
+
+    for (size_t i = 0; i < 8 * n_keys; ++i) {
+        x = x * 1103515245 + 12345;
+        key = (x >> 8) % (uint32_t)n_keys;
+
+        // Mostly insertions at first, then mostly removals
+        if ((x >> 4) % 8 < (i < 4 * n_keys ? 2u : 6u)) {
+            int removed = btree_remove(btree, key) == 0;
+
+            if (removed != (expected[key] != -1)) {
+                return -1;
+            }
+            length -= expected[key] != -1;
+            expected[key] = -1;
+        } else {
+            int v = (int)(i % n_keys);
+
+            length += expected[key] == -1;
+            expected[key] = v;
+            if (btree_put(btree, key, items + v) != 0) {
+                return -1;
+            }
+        }
+
+        if (i % 1000 == 0 && check_btree(btree, expected, n_keys) != 0) {
+            return -1;
+        }
+    }
+
+    if (btree->length != length) {
+        return -1;
+    }
+
+    for (key = 0; key < n_keys; ++key) {
+        value = btree_get(btree, key);
+
+        if (expected[key] == -1 ? value != NULL
+                                : value == NULL
+                                  || *value != items + expected[key]) {
+            return -1;
+        }
+    }
+
+    return check_btree(btree, expected, n_keys);
+}
+
+static uintptr_t
+item_key(const void *ptr)
+{
+    return *(const uintptr_t *)ptr;
+}
+
+int
+main(void)
+{
+    struct btree btree;
+    struct btree_iter iter;
+    struct ptrvec ptrvec;
+    uintptr_t key;
+    void *value;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    for (size_t i = 0; i < N_KEYS; ++i) {
+        items[i] = 3 * i + 1;
+    }
+
+    TEST_CHECK("btree_put() and btree_get()");
+    TEST_ASSERT(btree_init(&btree) == 0);
+    TEST_ASSERT(btree_get(&btree, 1) == NULL);
+    TEST_ASSERT(btree_remove(&btree, 1) != 0);
+    TEST_ASSERT(btree_put(&btree, 1, items) == 0);
+    TEST_ASSERT(*btree_get(&btree, 1) == items);
+    TEST_ASSERT(btree_put(&btree, 1, items + 1) == 0);
+    TEST_ASSERT(btree.length == 1);
+    TEST_ASSERT(*btree_get(&btree, 1) == items + 1);
+    TEST_ASSERT(btree_remove(&btree, 1) == 0);
+    TEST_ASSERT(btree.root == NULL);
+    TEST_PASS();
+
+    TEST_CHECK("btree with random puts and removes");
+    TEST_ASSERT(check_random(&btree, N_KEYS) == 0);
+    btree_clear(&btree);
+    TEST_ASSERT(check_random(&btree, 100) == 0);
+    btree_clear(&btree);
+    TEST_ASSERT(btree_get(&btree, 0) == NULL);
+    TEST_PASS();
+
+    TEST_CHECK("btree_load()");
+    TEST_ASSERT(ptrvec_init(&ptrvec) == 0);
+    for (size_t n = 0; n <= 300; n += 7) {
+        ptrvec.length = 0;
+        for (size_t i = 0; i < n; ++i) {
+            TEST_ASSERT(ptrvec_push(&ptrvec, items + i) == 0);
+        }
+
+        TEST_ASSERT(btree_load(&btree, &ptrvec, &item_key) == 0);
+        TEST_ASSERT(btree.length == n);
+        TEST_ASSERT(btree.root == NULL
+                    || check_node(btree.root, btree.height, 1, 0,
+                                  UINTPTR_MAX) == n);
+
+        for (size_t i = 0; i < n; ++i) {
+            TEST_ASSERT(*btree_get(&btree, items[i]) == items + i);
+        }
+
+        // The loaded tree has to take changes like any other
+        TEST_ASSERT(btree_put(&btree, 0, items) == 0);
+        TEST_ASSERT(n == 0 || btree_remove(&btree, items[n / 2]) == 0);
+        TEST_ASSERT(check_node(btree.root, btree.height, 1, 0, UINTPTR_MAX)
+                    == btree.length);
+        btree_clear(&btree);
+    }
+
+    // Out of order
+    TEST_ASSERT(ptrvec_push(&ptrvec, items) == 0);
+    TEST_ASSERT(btree_load(&btree, &ptrvec, &item_key) != 0);
+    TEST_ASSERT(btree.length == 0);
+
+    ptrvec.length = 0;
+    TEST_ASSERT(ptrvec_push(&ptrvec, items) == 0);
+    TEST_ASSERT(ptrvec_push(&ptrvec, items + 1) == 0);
+    TEST_ASSERT(btree_load(&btree, &ptrvec, NULL) == 0);
+    TEST_ASSERT(*btree_get(&btree, (uintptr_t)(items + 1)) == items + 1);
+    btree_clear(&btree);
+    ptrvec_free(&ptrvec);
+    TEST_PASS();
+
+    TEST_CHECK("btree_seek() over a range");
+    for (size_t i = 0; i < N_KEYS; ++i) {
+        TEST_ASSERT(btree_put(&btree, items[i], items + i) == 0);
+    }
+    {
+        size_t i = 1000;
+
+        // Between two keys, so the first key is the next one up
+        btree_seek(&btree, items[i] - 1, &iter);
+        while (btree_iter_next(&iter, &key, &value) && key < items[2000]) {
+            TEST_ASSERT(key == items[i] && value == items + i);
+            ++i;
+        }
+        TEST_ASSERT(i == 2000);
+
+        btree_seek(&btree, items[N_KEYS - 1] + 1, &iter);
+        TEST_ASSERT(!btree_iter_next(&iter, NULL, NULL));
+    }
+    btree_free(&btree);
+    TEST_PASS();
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
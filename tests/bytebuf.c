@@ -0,0 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/bytebuf.h"
+
+#include "../src/alloc.h"
+
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+main(void)
+{
+    struct bytebuf bytebuf;
+    char *flat;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    TEST_CHECK("bytebuf_append() and bytebuf_printf()");
+    TEST_ASSERT(bytebuf_init(&bytebuf) == 0);
+    TEST_ASSERT(bytebuf_append(&bytebuf, "abc", 3) == 0);
+    TEST_ASSERT(bytebuf_printf(&bytebuf, "%d-%s", 42, "x") == 0);
+    TEST_ASSERT(bytebuf.size == 7 && bytebuf.length == 1);
+
+    // Longer than the first attempt has room for
+    TEST_ASSERT(bytebuf_printf(&bytebuf, "%300d|", 1) == 0);
+    TEST_ASSERT(bytebuf.size == 308);
+
+    flat = jmalloc(bytebuf.size);
+    TEST_ASSERT(flat != NULL);
+    bytebuf_copy(&bytebuf, flat);
+    TEST_ASSERT(memcmp(flat, "abc42-x ", 8) == 0);
+    TEST_ASSERT(memcmp(flat + 306, "1|", 2) == 0);
+    jfree(flat);
+    TEST_PASS();
+
+    TEST_CHECK("bytebuf_reserve() and bytebuf_commit()");
+    {
+        char *dst = bytebuf_reserve(&bytebuf, 10);
+
+        TEST_ASSERT(dst != NULL);
+        memcpy(dst, "0123456789", 10);
+        bytebuf_commit(&bytebuf, 4);
+        TEST_ASSERT(bytebuf.size == 312);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("growing past BYTEBUF_CHUNK_SIZE without copying");
+    bytebuf_clear(&bytebuf);
+    for (size_t i = 0; i < 4 * BYTEBUF_CHUNK_SIZE / 8; ++i) {
+        TEST_ASSERT(bytebuf_append(&bytebuf, "01234567", 8) == 0);
+    }
+    TEST_ASSERT(bytebuf.size == 4 * BYTEBUF_CHUNK_SIZE);
+    TEST_ASSERT(bytebuf.length > 1);
+    for (size_t i = 0; i < bytebuf.length; ++i) {
+        TEST_ASSERT(bytebuf.iov[i].iov_len <= 2 * BYTEBUF_CHUNK_SIZE);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("bytebuf_append_ref()");
+    {
+        static char big[BYTEBUF_REF_MIN * 2];
+        size_t length;
+
+        memset(big, 'b', sizeof(big));
+        bytebuf_clear(&bytebuf);
+
+        TEST_ASSERT(bytebuf_append(&bytebuf, "<", 1) == 0);
+        TEST_ASSERT(bytebuf_append_ref(&bytebuf, big, sizeof(big)) == 0);
+        TEST_ASSERT(bytebuf.iov[bytebuf.length - 1].iov_base == big);
+        length = bytebuf.length;
+
+        // Small refs are copied, into a new tail after the ref
+        TEST_ASSERT(bytebuf_append_ref(&bytebuf, ">", 1) == 0);
+        TEST_ASSERT(bytebuf.length == length + 1);
+        TEST_ASSERT(bytebuf.iov[bytebuf.length - 1].iov_base != big);
+        TEST_ASSERT(bytebuf.size == sizeof(big) + 2);
+
+        flat = jmalloc(bytebuf.size);
+        TEST_ASSERT(flat != NULL);
+        bytebuf_copy(&bytebuf, flat);
+        TEST_ASSERT(flat[0] == '<' && flat[1] == 'b');
+        TEST_ASSERT(flat[sizeof(big)] == 'b' && flat[sizeof(big) + 1] == '>');
+        jfree(flat);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("bytebuf_write()");
+    {
+        char path[] = "/tmp/bytebuf-test-XXXXXX";
+        char head[4];
+        int fd = mkstemp(path);
+
+        TEST_ASSERT(fd >= 0);
+        unlink(path);
+
+        TEST_ASSERT(bytebuf_write(&bytebuf, fd) == 0);
+        TEST_ASSERT(bytebuf.size == 0 && bytebuf.length == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_END) == BYTEBUF_REF_MIN * 2 + 2);
+        TEST_ASSERT(pread(fd, head, sizeof(head), 0) == sizeof(head));
+        TEST_ASSERT(memcmp(head, "<bbb", 4) == 0);
+        close(fd);
+
+        // Nothing is lost when the write fails
+        TEST_ASSERT(bytebuf_append(&bytebuf, "abc", 3) == 0);
+        TEST_ASSERT(bytebuf_write(&bytebuf, -1) != 0);
+        TEST_ASSERT(bytebuf.size == 3);
+        TEST_ASSERT(bytebuf_append(&bytebuf, "d", 1) == 0);
+        TEST_ASSERT(bytebuf.size == 4);
+    }
+    TEST_PASS();
+
+    bytebuf_free(&bytebuf);
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
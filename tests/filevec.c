@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/filevec.h"
+
+#include "../src/alloc.h"
+
+#include "test.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int
+main(void)
+{
+    char path[] = "/tmp/filevec-test-XXXXXX";
+    struct filevec fv;
+    int fd;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    close(fd);
+
+    TEST_CHECK("filevec_push() on a new file");
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) == 0);
+    TEST_ASSERT(fv.length == 0);
+    for (int i = 0; i < 10000; ++i) {
+        TEST_ASSERT(filevec_push(&fv, &i) == 0);
+    }
+    TEST_ASSERT(fv.length == 10000 && fv.capacity >= 10000);
+    for (int i = 0; i < 10000; ++i) {
+        TEST_ASSERT(*(int *)filevec_at(&fv, (size_t)i) == i);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("filevec_sync() and filevec_verify()");
+    TEST_ASSERT(filevec_verify(&fv) != 0);
+    TEST_ASSERT(filevec_sync(&fv) == 0);
+    TEST_ASSERT(filevec_verify(&fv) == 0);
+    *(int *)filevec_at(&fv, 5000) = -1;
+    TEST_ASSERT(filevec_verify(&fv) != 0);
+    *(int *)filevec_at(&fv, 5000) = 5000;
+    TEST_ASSERT(filevec_verify(&fv) == 0);
+    TEST_ASSERT(filevec_close(&fv) == 0);
+    TEST_PASS();
+
+    TEST_CHECK("filevec_open() on an existing file");
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) == 0);
+    TEST_ASSERT(fv.length == 10000);
+    TEST_ASSERT(filevec_verify(&fv) == 0);
+    for (int i = 0; i < 10000; ++i) {
+        TEST_ASSERT(*(int *)filevec_at(&fv, (size_t)i) == i);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("filevec_resize() and filevec_shrink()");
+    TEST_ASSERT(filevec_resize(&fv, 100000) == 0);
+    TEST_ASSERT(fv.length == 100000 && fv.capacity >= 100000);
+    TEST_ASSERT(*(int *)filevec_at(&fv, 9999) == 9999);
+    TEST_ASSERT(*(int *)filevec_at(&fv, 99999) == 0);
+
+    TEST_ASSERT(filevec_resize(&fv, 20) == 0);
+    TEST_ASSERT(filevec_shrink(&fv) == 0);
+    TEST_ASSERT(fv.capacity == 20);
+    TEST_ASSERT(*(int *)filevec_at(&fv, 19) == 19);
+    TEST_ASSERT(filevec_close(&fv) == 0);
+
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) == 0);
+    TEST_ASSERT(fv.length == 20 && fv.capacity == 20);
+    TEST_ASSERT(filevec_verify(&fv) == 0);
+    TEST_ASSERT(filevec_close(&fv) == 0);
+    TEST_PASS();
+
+    TEST_CHECK("filevec_open() rejecting a mismatched file");
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(long long)) != 0);
+
+    fd = open(path, O_WRONLY);
+    TEST_ASSERT(fd >= 0);
+    TEST_ASSERT(write(fd, "XFILEVEC", 8) == 8);
+    close(fd);
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) != 0);
+
+    // A truncated file's length can't fit in it
+    TEST_ASSERT(truncate(path, 0) == 0);
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) == 0);
+    TEST_ASSERT(fv.length == 0);
+    TEST_ASSERT(filevec_push(&fv, &fd) == 0);
+    TEST_ASSERT(filevec_close(&fv) == 0);
+    TEST_ASSERT(truncate(path, FILEVEC_HEADER_SIZE) == 0);
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) != 0);
+
+    // A file that isn't a filevec is left alone, even if it starts with a 0
+    {
+        char buf[2 * FILEVEC_HEADER_SIZE];
+
+        memset(buf, 0, sizeof(buf));
+        buf[FILEVEC_HEADER_SIZE] = 1;
+        fd = open(path, O_RDWR | O_TRUNC);
+        TEST_ASSERT(fd >= 0);
+        TEST_ASSERT(write(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+        TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) != 0);
+        TEST_ASSERT(pread(fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf));
+        TEST_ASSERT(buf[0] == 0 && buf[FILEVEC_HEADER_SIZE] == 1);
+        close(fd);
+    }
+
+    // But a zeroed header alone is what a crash while creating one leaves
+    TEST_ASSERT(truncate(path, 0) == 0);
+    TEST_ASSERT(truncate(path, FILEVEC_HEADER_SIZE) == 0);
+    TEST_ASSERT(filevec_open(&fv, path, sizeof(int)) == 0);
+    TEST_ASSERT(fv.length == 0);
+    TEST_ASSERT(filevec_close(&fv) == 0);
+    TEST_PASS();
+
+    unlink(path);
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
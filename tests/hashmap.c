@@ -0,0 +1,212 @@
+#include "../src/main.h"
+#include "../src/hashmap.h"
+
+#include "../src/alloc.h"
+
+#include "test.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+
+#define N_KEYS 20000
+
+// Every key collides, so they all land in one cluster
+static uint64_t
+bad_hash(const void *key, size_t size)
+{
+    UNUSED(key);
+    UNUSED(size);
+
+    return 42;
+}
+
+static int
+equal_nocase(const void *a, const void *b, size_t size)
+{
+    const char *x = a, *y = b;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (tolower((unsigned char)x[i]) != tolower((unsigned char)y[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint64_t
+hash_nocase(const void *key, size_t size)
+{
+    char lower[8];
+
+    for (size_t i = 0; i < size && i < sizeof(lower); ++i) {
+        lower[i] = (char)tolower(((const unsigned char *)key)[i]);
+    }
+
+    return hashmap_hash_bytes(lower, size < sizeof(lower) ? size
+                                                          : sizeof(lower));
+}
+
+// Puts, overwrites and removes keys in a pseudorandom order, checking the
+// hashmap against an array of what it should hold
+static int
+check_random(struct hashmap *hashmap, size_t n_keys)
+{
+    static int expected[N_KEYS];
+    uint32_t x = 1;
+    size_t length = 0;
+    uint32_t key;
+    int *value;
+
+    for (size_t i = 0; i < n_keys; ++i) {
+        expected[i] = -1;
+    }
+
+    for (size_t i = 0; i < 8 * n_keys; ++i) {
+        x = x * 1103515245 + 12345;
+        key = (x >> 8) % (uint32_t)n_keys;
+
+        if ((x >> 4) % 3 == 0) {
+            int removed = hashmap_remove(hashmap, &key) == 0;
+
+            if (removed != (expected[key] != -1)) {
+                return -1;
+            }
+            length -= expected[key] != -1;
+            expected[key] = -1;
+        } else {
+            int v = (int)i;
+
+            length += expected[key] == -1;
+            expected[key] = v;
+            if (hashmap_put(hashmap, &key, &v) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    if (hashmap->length != length) {
+        return -1;
+    }
+
+    for (key = 0; key < n_keys; ++key) {
+        value = hashmap_get(hashmap, &key);
+
+        if (expected[key] == -1 ? value != NULL
+                                : value == NULL || *value != expected[key]) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int
+main(void)
+{
+    struct hashmap hashmap;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    TEST_CHECK("hashmap_put() and hashmap_get()");
+    {
+        uint64_t key = 7;
+        double value = 1.5;
+
+        TEST_ASSERT(hashmap_init(&hashmap, sizeof(key), sizeof(value), NULL,
+                                 NULL) == 0);
+        TEST_ASSERT(hashmap_get(&hashmap, &key) == NULL);
+        TEST_ASSERT(hashmap_remove(&hashmap, &key) != 0);
+
+        TEST_ASSERT(hashmap_put(&hashmap, &key, &value) == 0);
+        TEST_ASSERT(hashmap.length == 1);
+        TEST_ASSERT(*(double *)hashmap_get(&hashmap, &key) == 1.5);
+
+        value = 2.5;
+        TEST_ASSERT(hashmap_put(&hashmap, &key, &value) == 0);
+        TEST_ASSERT(hashmap.length == 1);
+        TEST_ASSERT(*(double *)hashmap_get(&hashmap, &key) == 2.5);
+
+        TEST_ASSERT(hashmap_remove(&hashmap, &key) == 0);
+        TEST_ASSERT(hashmap_get(&hashmap, &key) == NULL);
+        TEST_ASSERT(hashmap.length == 0);
+        hashmap_free(&hashmap);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("hashmap with random puts and removes");
+    TEST_ASSERT(hashmap_init(&hashmap, sizeof(uint32_t), sizeof(int), NULL,
+                             NULL) == 0);
+    TEST_ASSERT(check_random(&hashmap, N_KEYS) == 0);
+    TEST_PASS();
+
+    TEST_CHECK("hashmap_next()");
+    {
+        size_t count = 0;
+
+        for (size_t i = hashmap_next(&hashmap, 0); i < hashmap.capacity;
+             i = hashmap_next(&hashmap, i + 1)) {
+
+            uint32_t *key = hashmap_key_at(&hashmap, i);
+
+            TEST_ASSERT(hashmap_get(&hashmap, key)
+                        == hashmap_value_at(&hashmap, i));
+            ++count;
+        }
+        TEST_ASSERT(count == hashmap.length);
+
+        hashmap_clear(&hashmap);
+        TEST_ASSERT(hashmap_next(&hashmap, 0) == hashmap.capacity);
+        hashmap_free(&hashmap);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("hashmap with every hash colliding");
+    TEST_ASSERT(hashmap_init(&hashmap, sizeof(uint32_t), sizeof(int),
+                             &bad_hash, NULL) == 0);
+    TEST_ASSERT(check_random(&hashmap, 300) == 0);
+    hashmap_free(&hashmap);
+    TEST_PASS();
+
+    TEST_CHECK("hashmap with custom equality");
+    {
+        const char *a = "Key00001", *b = "kEY00001";
+        char value;
+
+        TEST_ASSERT(hashmap_init(&hashmap, 8, 1, &hash_nocase,
+                                 &equal_nocase) == 0);
+        TEST_ASSERT(hashmap_put(&hashmap, a, "a") == 0);
+        TEST_ASSERT(hashmap_put(&hashmap, b, "b") == 0);
+        TEST_ASSERT(hashmap.length == 1);
+        value = *(char *)hashmap_get(&hashmap, a);
+        TEST_ASSERT(value == 'b');
+        hashmap_free(&hashmap);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("hashmap_reserve()");
+    TEST_ASSERT(hashmap_init(&hashmap, 3, 0, NULL, NULL) == 0);
+    TEST_ASSERT(hashmap.stride == 3 && hashmap.value_offset == 3);
+    TEST_ASSERT(hashmap_reserve(&hashmap, 1000) == 0);
+    {
+        size_t capacity = hashmap.capacity;
+
+        for (unsigned i = 0; i < 1000; ++i) {
+            unsigned char key[3] = {(unsigned char)i, (unsigned char)(i >> 8),
+                                    0};
+
+            TEST_ASSERT(hashmap_put(&hashmap, key, NULL) == 0);
+        }
+        TEST_ASSERT(hashmap.capacity == capacity);
+        TEST_ASSERT(hashmap.length == 1000);
+    }
+    hashmap_free(&hashmap);
+    TEST_PASS();
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "../src/main.h"
+#include "../src/heap.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "test.h"
+
+#define N_ITEMS 100
+
+struct item {
+    int key;
+    size_t index;
+};
+
+static int
+item_cmp(const void *a, const void *b)
+{
+    const struct item *x = a, *y = b;
+
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+static void
+item_set_index(void *ptr, size_t index)
+{
+    ((struct item *)ptr)->index = index;
+}
+
+static int
+drains_in_order(struct heap *heap)
+{
+    int prev = -1;
+
+    while (heap->ptrvec.length > 0) {
+        struct item *item = heap_pop(heap);
+
+        if (item->key < prev) {
+            return 0;
+        }
+        prev = item->key;
+    }
+
+    return 1;
+}
+
+int
+main(void)
+{
+    static struct item items[N_ITEMS];
+    struct heap heap;
+
+    alloc_init();
+
+    for (size_t arity = 2; arity <= 4; arity *= 2) {
+        TEST_CHECK(arity == 2 ? "heap_push() and heap_pop(), arity 2"
+                   : "heap_push() and heap_pop(), arity 4");
+
+        TEST_ASSERT(heap_init(&heap, &item_cmp, &item_set_index, arity) == 0);
+
+        for (size_t i = 0; i < N_ITEMS; ++i) {
+            items[i].key = (int)((i * 37) % N_ITEMS);
+            TEST_ASSERT(heap_push(&heap, &items[i]) == 0);
+        }
+
+        TEST_ASSERT(((struct item *)heap_peek(&heap))->key == 0);
+        TEST_ASSERT(drains_in_order(&heap));
+
+        TEST_PASS();
+
+        TEST_CHECK("heap_update()");
+
+        for (size_t i = 0; i < N_ITEMS; ++i) {
+            TEST_ASSERT(heap_push(&heap, &items[i]) == 0);
+        }
+        for (size_t i = 0; i < N_ITEMS; ++i) {
+            TEST_ASSERT(heap.ptrvec.ptr[items[i].index] == &items[i]);
+        }
+
+        items[50].key = -1;
+        heap_update(&heap, items[50].index);
+        TEST_ASSERT(heap_peek(&heap) == &items[50]);
+
+        items[50].key = N_ITEMS;
+        heap_update(&heap, items[50].index);
+        TEST_ASSERT(heap_remove(&heap, items[7].index) == &items[7]);
+        TEST_ASSERT(heap.ptrvec.length == N_ITEMS - 1);
+        TEST_ASSERT(drains_in_order(&heap));
+
+        TEST_PASS();
+
+        TEST_CHECK("heap_heapify()");
+
+        for (size_t i = 0; i < N_ITEMS; ++i) {
+            items[i].key = (int)((i * 53) % N_ITEMS);
+            TEST_ASSERT(ptrvec_push(&heap.ptrvec, &items[i]) == 0);
+        }
+        heap_heapify(&heap);
+        for (size_t i = 0; i < N_ITEMS; ++i) {
+            TEST_ASSERT(heap.ptrvec.ptr[items[i].index] == &items[i]);
+        }
+        TEST_ASSERT(drains_in_order(&heap));
+
+        heap_free(&heap);
+
+        TEST_PASS();
+    }
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "../src/main.h"
+#include "../src/offvec.h"
+
+#include "../src/alloc.h"
+
+#include "test.h"
+
+#define N_ITEMS 37
+
+int
+main(void)
+{
+    static char region[N_ITEMS];
+    struct offvec offvec;
+
+    alloc_init();
+
+    TEST_CHECK("offvec_push() and offvec_get()");
+
+    TEST_ASSERT(offvec_init(&offvec, region) == 0);
+
+    for (size_t i = 0; i < N_ITEMS; ++i) {
+        TEST_ASSERT(offvec_push(&offvec, region + i) == 0);
+    }
+    TEST_ASSERT(offvec_push(&offvec, NULL) == 0);
+
+    for (size_t i = 0; i < N_ITEMS; ++i) {
+        TEST_ASSERT(offvec_get(&offvec, i) == region + i);
+    }
+    TEST_ASSERT(offvec_peek(&offvec) == NULL);
+
+    TEST_PASS();
+
+    TEST_CHECK("offvec_find()");
+
+    for (size_t i = 0; i < N_ITEMS; ++i) {
+        TEST_ASSERT(offvec_find(&offvec, region + i) == i);
+    }
+    TEST_ASSERT(offvec_find(&offvec, NULL) == N_ITEMS);
+    TEST_ASSERT(offvec_pop(&offvec) == NULL);
+    TEST_ASSERT(!offvec_contains(&offvec, NULL));
+
+    TEST_PASS();
+
+    TEST_CHECK("offvec_insert() and offvec_remove()");
+
+    TEST_ASSERT(offvec_insert(&offvec, region + 5, 0) == 0);
+    TEST_ASSERT(offvec_get(&offvec, 0) == region + 5);
+    TEST_ASSERT(offvec_get(&offvec, 1) == region);
+    offvec_remove(&offvec, 0);
+    TEST_ASSERT(offvec_get(&offvec, 5) == region + 5);
+
+    offvec_remove_fast(&offvec, 0);
+    TEST_ASSERT(offvec.length == N_ITEMS - 1);
+    TEST_ASSERT(offvec_get(&offvec, 0) == region + N_ITEMS - 1);
+    TEST_ASSERT(!offvec_contains(&offvec, region));
+
+    offvec_free(&offvec);
+
+    TEST_PASS();
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -5,10 +5,189 @@
 
 #include "test.h"
 
+#include <stdint.h>
+#include <string.h>
+
+#define PAR_LENGTH 20000
+
+// Enough pointers for a parallel delete to split them between two threads
+#define DELETE_LENGTH (2 * PTRVEC_PAR_MIN_CHUNK)
+
+// Pointers into items are used as distinct, ordered elements
+static char items[PAR_LENGTH + 1];
+
+static void
+count_one(void *ptr, void *ctx)
+{
+    UNUSED(ptr);
+
+    __atomic_fetch_add((size_t *)ctx, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+next_one(void *ptr, void *ctx)
+{
+    UNUSED(ctx);
+
+    return (char *)ptr + 1;
+}
+
+// Counts the pointers visited while they come in the order fill_cycle gave
+// them, and stops counting after one that's out of order
+static void
+count_in_order(void *ptr, void *ctx)
+{
+    size_t *count = ctx;
+
+    if (*count != SIZE_MAX) {
+        *count = ptr == items + *count % PAR_LENGTH ? *count + 1 : SIZE_MAX;
+    }
+}
+
+static void
+count_batch_in_order(void **ptrs, size_t n, void *ctx)
+{
+    for (size_t i = 0; i < n; ++i) {
+        count_in_order(ptrs[i], ctx);
+    }
+}
+
+// Keeps the largest run size it's called with
+static void
+max_batch(void **ptrs, size_t n, void *ctx)
+{
+    size_t *max = ctx;
+
+    UNUSED(ptrs);
+
+    *max = n > *max ? n : *max;
+}
+
+static int
+is_odd(void *ptr, void *ctx)
+{
+    UNUSED(ctx);
+
+    return (int)((char *)ptr - items) & 1;
+}
+
+static void *
+counting_malloc(void *ctx, size_t n)
+{
+    ++*(size_t *)ctx;
+
+    return alloc_system.malloc(NULL, n);
+}
+
+static void *
+counting_calloc(void *ctx, size_t n, size_t size)
+{
+    ++*(size_t *)ctx;
+
+    return alloc_system.calloc(NULL, n, size);
+}
+
+static void *
+counting_realloc(void *ctx, void *ptr, size_t n)
+{
+    ++*(size_t *)ctx;
+
+    return alloc_system.realloc(NULL, ptr, n);
+}
+
+static void
+counting_free(void *ctx, void *ptr)
+{
+    ++*(size_t *)ctx;
+
+    alloc_system.free(NULL, ptr);
+}
+
+static int
+fill(struct ptrvec *ptrvec, size_t n)
+{
+    if (ptrvec_resize(ptrvec, n) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        ptrvec->ptr[i] = items + i;
+    }
+
+    return 0;
+}
+
+// Fills ptrvec with n pointers cycling through items
+static int
+fill_cycle(struct ptrvec *ptrvec, size_t n)
+{
+    if (ptrvec_resize(ptrvec, n) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        ptrvec->ptr[i] = items + i % PAR_LENGTH;
+    }
+
+    return 0;
+}
+
+#ifndef NDEBUG
+static struct alloc_snapshot marked_heap;
+#endif
+
+#ifdef ALLOC_STATS
+static struct alloc_stats marked_stats;
+#endif
+
+// Remembers the live blocks and the number of frees, for all_freed
+static void
+mark_heap(void)
+{
+#ifndef NDEBUG
+    alloc_snapshot(&marked_heap);
+#endif
+#ifdef ALLOC_STATS
+    alloc_stats(&marked_stats);
+#endif
+}
+
+// Returns whether every block allocated since mark_heap has been freed, and at
+// least n blocks were freed. Only checked in builds that can tell.
+static int
+all_freed(size_t n)
+{
+#ifndef NDEBUG
+    struct alloc_snapshot now;
+#endif
+#ifdef ALLOC_STATS
+    struct alloc_stats stats;
+#endif
+
+#ifndef NDEBUG
+    alloc_snapshot(&now);
+    if (now.blocks != marked_heap.blocks || now.bytes != marked_heap.bytes) {
+        return 0;
+    }
+#endif
+#ifdef ALLOC_STATS
+    alloc_stats(&stats);
+    if (stats.frees - marked_stats.frees < n) {
+        return 0;
+    }
+#endif
+
+    UNUSED(n);
+
+    return 1;
+}
+
 int
 main(void)
 {
     struct ptrvec ptrvec;
+    size_t count;
+    char *base;
 
     alloc_init();
 
@@ -21,9 +200,183 @@ main(void)
 
     TEST_PASS();
 
+    TEST_CHECK("ptrvec_for_each_par()");
+
+    base = items;
+    TEST_ASSERT(fill(&ptrvec, PAR_LENGTH) == 0);
+
+    count = 0;
+    TEST_ASSERT(ptrvec_for_each_par(&ptrvec, &count_one, &count, 4) == 0);
+    TEST_ASSERT(count == PAR_LENGTH);
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_transform_par()");
+
+    TEST_ASSERT(ptrvec_transform_par(&ptrvec, &next_one, NULL, 4) == 0);
+    for (size_t i = 0; i < PAR_LENGTH; ++i) {
+        TEST_ASSERT(ptrvec.ptr[i] == base + i + 1);
+    }
+
+    ptrvec_free(&ptrvec);
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_for_each_prefetch()");
+
+    ptrvec_init(&ptrvec);
+    {
+        // Large enough for the distance to be tuned when it's 0
+        static const size_t lengths[] = {0, 3, PAR_LENGTH, 300000};
+        static const size_t distances[] = {0, 1, 5, 16, 200000};
+        size_t max;
+
+        for (size_t i = 0; i < sizeof(lengths) / sizeof(*lengths); ++i) {
+            TEST_ASSERT(fill_cycle(&ptrvec, lengths[i]) == 0);
+
+            for (size_t j = 0; j < sizeof(distances) / sizeof(*distances);
+                 ++j) {
+
+                count = 0;
+                ptrvec_for_each_prefetch(&ptrvec, distances[j],
+                                         &count_in_order, &count);
+                TEST_ASSERT(count == lengths[i]);
+
+                count = 0;
+                ptrvec_for_each_batch_prefetch(&ptrvec, distances[j],
+                                               &count_batch_in_order, &count);
+                TEST_ASSERT(count == lengths[i]);
+            }
+        }
+
+        // The distance was tuned to one of the candidates, and stays put
+        count = 0;
+        ptrvec_for_each_batch_prefetch(&ptrvec, 0, &max_batch, &count);
+        TEST_ASSERT(count >= 2 && count <= 64 && (count & (count - 1)) == 0);
+        max = count;
+        ptrvec_for_each_prefetch(&ptrvec, 0, &count_one, &count);
+        count = 0;
+        ptrvec_for_each_batch_prefetch(&ptrvec, 0, &max_batch, &count);
+        TEST_ASSERT(count == max);
+    }
+    ptrvec_free(&ptrvec);
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_remove_if()");
+
+    ptrvec_init(&ptrvec);
+    TEST_ASSERT(fill(&ptrvec, 10) == 0);
+    TEST_ASSERT(ptrvec_remove_if(&ptrvec, &is_odd, NULL) == 5);
+    TEST_ASSERT(ptrvec.length == 5);
+    for (size_t i = 0; i < ptrvec.length; ++i) {
+        TEST_ASSERT(ptrvec.ptr[i] == base + 2 * i);
+    }
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_remove_if_fast()");
+
+    TEST_ASSERT(fill(&ptrvec, 10) == 0);
+    TEST_ASSERT(ptrvec_remove_if_fast(&ptrvec, &is_odd, NULL) == 5);
+    TEST_ASSERT(ptrvec.length == 5);
+    for (size_t i = 0; i < ptrvec.length; ++i) {
+        TEST_ASSERT(!is_odd(ptrvec.ptr[i], NULL));
+    }
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_remove_indices()");
+
+    {
+        const size_t indices[] = {0, 3, 4, 9};
+        const size_t expected[] = {1, 2, 5, 6, 7, 8};
+
+        TEST_ASSERT(fill(&ptrvec, 10) == 0);
+        ptrvec_remove_indices(&ptrvec, indices, 4);
+        TEST_ASSERT(ptrvec.length == 6);
+        for (size_t i = 0; i < ptrvec.length; ++i) {
+            TEST_ASSERT(ptrvec.ptr[i] == base + expected[i]);
+        }
+
+        TEST_PASS();
+
+        TEST_CHECK("ptrvec_remove_indices_fast()");
+
+        TEST_ASSERT(fill(&ptrvec, 10) == 0);
+        ptrvec_remove_indices_fast(&ptrvec, indices, 4);
+        TEST_ASSERT(ptrvec.length == 6);
+        for (size_t i = 0; i < 6; ++i) {
+            TEST_ASSERT(ptrvec_contains(&ptrvec, base + expected[i]));
+        }
+    }
+
+    ptrvec_free(&ptrvec);
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_init_a()");
+
+    {
+        struct allocator counting = alloc_system;
+
+        count = 0;
+        counting.malloc = &counting_malloc;
+        counting.calloc = &counting_calloc;
+        counting.realloc = &counting_realloc;
+        counting.free = &counting_free;
+        counting.ctx = &count;
+
+        TEST_ASSERT(ptrvec_init_a(&ptrvec, &counting) == 0);
+        TEST_ASSERT(fill(&ptrvec, 100) == 0);
+        TEST_ASSERT(ptrvec_push(&ptrvec, NULL) == 0);
+        ptrvec_free(&ptrvec);
+
+        // One reserve from fill, one grow from the push, and the free
+        TEST_ASSERT(count == 3);
+    }
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_push_new() and ptrvec_delete()");
+
+    ptrvec_init(&ptrvec);
+    TEST_ASSERT(ptrvec_push(&ptrvec, NULL) == 0);
+    TEST_ASSERT(ptrvec_push_new(&ptrvec, 64, 8) == 0);
+    TEST_ASSERT(ptrvec.length == 65);
+    for (size_t i = 1; i < ptrvec.length; ++i) {
+        TEST_ASSERT(ptrvec.ptr[i] != NULL);
+        memset(ptrvec.ptr[i], (int)i, 8);
+    }
+    ptrvec_delete(&ptrvec);
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_delete_par()");
+
+    mark_heap();
+    ptrvec_init(&ptrvec);
+    TEST_ASSERT(ptrvec_push_new(&ptrvec, DELETE_LENGTH, 1) == 0);
+    TEST_ASSERT(ptrvec_delete_par(&ptrvec, 4) == 0);
+    TEST_ASSERT(all_freed(DELETE_LENGTH));
+
+    TEST_PASS();
+
+    TEST_CHECK("ptrvec_delete_async()");
+
+    mark_heap();
+    ptrvec_init(&ptrvec);
+    TEST_ASSERT(ptrvec_push_new(&ptrvec, DELETE_LENGTH, 1) == 0);
+    TEST_ASSERT(ptrvec_delete_async(&ptrvec, 4) == 0);
+    TEST_ASSERT(ptrvec.ptr == NULL && ptrvec.length == 0);
+    ptrvec_delete_wait();
+    TEST_ASSERT(all_freed(DELETE_LENGTH));
+
+    TEST_PASS();
+
     TEST_TODO(Implement ptrvec tests);
 
-    alloc_free();
+    TEST_ASSERT(alloc_free() == 0);
 
     return 0;
 }
@@ -0,0 +1,169 @@
+#include "../src/main.h"
+#include "../src/ring.h"
+
+#include "../src/alloc.h"
+
+#include "test.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Bytes passed through the ring by the SPSC test
+#define N_BYTES ((size_t)16 << 20)
+
+static void *
+produce(void *arg)
+{
+    struct ring *ring = arg;
+    size_t sent = 0, n;
+    unsigned char *dst;
+
+    while (sent < N_BYTES) {
+        dst = ring_write_ptr(ring, &n);
+        n = n < N_BYTES - sent ? n : N_BYTES - sent;
+
+        for (size_t i = 0; i < n; ++i) {
+            dst[i] = (unsigned char)((sent + i) % 251);
+        }
+        ring_produce(ring, n);
+        sent += n;
+    }
+
+    return NULL;
+}
+
+// Checks that the regions stay contiguous as they wrap around, in whichever
+// mode ring was initialized
+static int
+check_wrap(struct ring *ring)
+{
+    char *p;
+    size_t n;
+
+    p = ring_write_ptr(ring, &n);
+    if (n != ring->capacity) {
+        return -1;
+    }
+
+    // Move both ends to 100 bytes before the end
+    memset(p, 'x', ring->capacity - 100);
+    ring_produce(ring, ring->capacity - 100);
+    ring_read_ptr(ring, &n);
+    ring_consume(ring, n);
+
+    // A write that wraps is still contiguous, and so is the read of it
+    p = ring_write_ptr(ring, &n);
+    if (n != ring->capacity) {
+        return -1;
+    }
+    for (size_t i = 0; i < 300; ++i) {
+        p[i] = (char)i;
+    }
+    ring_produce(ring, 300);
+
+    if (ring_length(ring) != 300) {
+        return -1;
+    }
+
+    p = ring_read_ptr(ring, &n);
+    if (n != 300) {
+        return -1;
+    }
+    for (size_t i = 0; i < 300; ++i) {
+        if (p[i] != (char)i) {
+            return -1;
+        }
+    }
+    ring_consume(ring, 250);
+
+    // The space left wraps back around to the tail
+    ring_write_ptr(ring, &n);
+    if (n != ring->capacity - 50) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(void)
+{
+    struct ring ring;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    TEST_CHECK("ring_init()");
+    TEST_ASSERT(ring_init(&ring, 5000, 0) == 0);
+    TEST_ASSERT(ring.capacity >= 5000);
+    TEST_ASSERT((ring.capacity & (ring.capacity - 1)) == 0);
+    TEST_ASSERT(ring_length(&ring) == 0);
+    // The read-only fields, head and tail are on three separate cache lines
+    TEST_ASSERT((uintptr_t)&ring % 64 == 0);
+    TEST_ASSERT(offsetof(struct ring, head) >= 64);
+    TEST_ASSERT(offsetof(struct ring, tail) - offsetof(struct ring, head) >= 64);
+    TEST_PASS();
+
+    TEST_CHECK("contiguous regions (double mapped)");
+    TEST_ASSERT(check_wrap(&ring) == 0);
+    ring_free(&ring);
+    TEST_PASS();
+
+    TEST_CHECK("contiguous regions (RING_COPY)");
+    TEST_ASSERT(ring_init(&ring, 5000, RING_COPY) == 0);
+    TEST_ASSERT(check_wrap(&ring) == 0);
+    ring_free(&ring);
+    TEST_PASS();
+
+#ifdef ALLOC_STATS
+    TEST_CHECK("ring accounting");
+    {
+        struct alloc_stats before, after;
+
+        alloc_stats(&before);
+        TEST_ASSERT(ring_init(&ring, 1 << 16, 0) == 0);
+        alloc_stats(&after);
+        if (!(ring.flags & RING_COPY)) {
+            TEST_ASSERT(after.maps == before.maps + 1);
+            TEST_ASSERT(after.bytes - before.bytes == 1 << 16);
+        }
+        ring_free(&ring);
+        alloc_stats(&after);
+        TEST_ASSERT(after.maps - before.maps == after.unmaps - before.unmaps);
+    }
+    TEST_PASS();
+#endif
+
+    for (unsigned flags = RING_SPSC; flags <= (RING_SPSC | RING_COPY);
+         flags += RING_COPY) {
+
+        pthread_t thread;
+        size_t received = 0, n;
+        unsigned char *src;
+
+        TEST_CHECK(flags & RING_COPY ? "RING_SPSC (RING_COPY)" : "RING_SPSC");
+        TEST_ASSERT(ring_init(&ring, 1 << 16, flags) == 0);
+        TEST_ASSERT(pthread_create(&thread, NULL, &produce, &ring) == 0);
+
+        while (received < N_BYTES) {
+            src = ring_read_ptr(&ring, &n);
+            for (size_t i = 0; i < n; ++i) {
+                TEST_ASSERT(src[i] == (received + i) % 251);
+            }
+            ring_consume(&ring, n);
+            received += n;
+        }
+
+        pthread_join(thread, NULL);
+        TEST_ASSERT(ring_length(&ring) == 0);
+        ring_free(&ring);
+        TEST_PASS();
+    }
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/serial.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+#include "../src/vec.h"
+
+#include "test.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Enough to go past the buffer several times
+#define N_INTS ((size_t)1 << 16)
+
+#define BLOCK 4096
+
+// Overwrites the length in the header of the stream at the start of fd
+static int
+set_length(int fd, uint64_t length)
+{
+    unsigned char bytes[8];
+
+    for (size_t i = 0; i < 8; ++i) {
+        bytes[i] = (unsigned char)(length >> (8 * i));
+    }
+
+    return pwrite(fd, bytes, 8, 24) == 8 ? 0 : -1;
+}
+
+int
+main(void)
+{
+    char path[] = "/tmp/serial-test-XXXXXX";
+    int fd;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    fd = mkstemp(path);
+    TEST_ASSERT(fd >= 0);
+    unlink(path);
+
+    TEST_CHECK("serial_save() and serial_load()");
+    {
+        int *array = NULL, *loaded = NULL;
+        size_t n = 0, m = 1;
+
+        TEST_ASSERT(vec_reserve(&array, 0, sizeof(*array), N_INTS) == 0);
+        for (size_t i = 0; i < N_INTS; ++i) {
+            array[i] = (int)(i * 7);
+        }
+
+        // Two streams back to back, the second with a checksum
+        TEST_ASSERT(serial_save(fd, array, N_INTS, sizeof(*array), 0) == 0);
+        TEST_ASSERT(serial_save(fd, array, 3, sizeof(*array),
+                                SERIAL_CHECKSUM) == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+
+        TEST_ASSERT(serial_load(fd, &loaded, &n, sizeof(*loaded)) == 0);
+        TEST_ASSERT(n == N_INTS);
+        TEST_ASSERT(memcmp(array, loaded, N_INTS * sizeof(*array)) == 0);
+        jfree(loaded);
+
+        // Loading appends to what's already there
+        loaded = jmalloc(sizeof(*loaded));
+        TEST_ASSERT(loaded != NULL);
+        loaded[0] = -1;
+        TEST_ASSERT(serial_load(fd, &loaded, &m, sizeof(*loaded)) == 0);
+        TEST_ASSERT(m == 4);
+        TEST_ASSERT(loaded[0] == -1 && loaded[1] == 0 && loaded[3] == 14);
+
+        // There's nothing left
+        TEST_ASSERT(serial_load(fd, &loaded, &m, sizeof(*loaded)) != 0);
+        TEST_ASSERT(m == 4);
+        jfree(loaded);
+
+        jfree(array);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("serial_read() in pieces");
+    {
+        struct serial serial;
+        char bytes[1000];
+        char piece[7];
+
+        for (size_t i = 0; i < sizeof(bytes); ++i) {
+            bytes[i] = (char)i;
+        }
+
+        TEST_ASSERT(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_write_start(&serial, fd, 1, sizeof(bytes),
+                                       SERIAL_CHECKSUM) == 0);
+        for (size_t i = 0; i < sizeof(bytes); i += 100) {
+            TEST_ASSERT(serial_write(&serial, bytes + i, 100) == 0);
+        }
+        TEST_ASSERT(serial_write_end(&serial) == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+
+        TEST_ASSERT(serial_read_start(&serial, fd, 1) == 0);
+        TEST_ASSERT(serial.length == sizeof(bytes));
+        for (size_t i = 0; i + sizeof(piece) <= sizeof(bytes);
+             i += sizeof(piece)) {
+            TEST_ASSERT(serial_read(&serial, piece, sizeof(piece)) == 0);
+            TEST_ASSERT(memcmp(piece, bytes + i, sizeof(piece)) == 0);
+        }
+        TEST_ASSERT(serial_read(&serial, piece, serial.left) == 0);
+        TEST_ASSERT(serial_read_end(&serial) == 0);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("serial_read_end() catching corruption");
+    {
+        struct serial serial;
+        char bytes[1000];
+
+        TEST_ASSERT(pwrite(fd, "\xff", 1, SERIAL_HEADER_SIZE + 500) == 1);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_read_start(&serial, fd, 1) == 0);
+        TEST_ASSERT(serial_read(&serial, bytes, sizeof(bytes)) == 0);
+        TEST_ASSERT(serial_read_end(&serial) != 0);
+
+        // Stopping early can't be checked
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_read_start(&serial, fd, 1) == 0);
+        TEST_ASSERT(serial_read(&serial, bytes, 10) == 0);
+        TEST_ASSERT(serial_read_end(&serial) != 0);
+        TEST_PASS();
+
+        TEST_CHECK("serial_read_start() rejecting a mismatched stream");
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_read_start(&serial, fd, 2) != 0);
+
+        TEST_ASSERT(pwrite(fd, "X", 1, 0) == 1);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_read_start(&serial, fd, 1) != 0);
+
+        TEST_ASSERT(ftruncate(fd, SERIAL_HEADER_SIZE / 2) == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_read_start(&serial, fd, 1) != 0);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("serial_load() rejecting a corrupt length");
+    {
+        int array[3] = {1, 2, 3};
+        int *loaded = jmalloc(4 * sizeof(*loaded));
+        size_t m = 4;
+        struct ptrvec ptrvec;
+
+        TEST_ASSERT(loaded != NULL);
+        TEST_ASSERT(ptrvec_init(&ptrvec) == 0);
+        TEST_ASSERT(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_save(fd, array, 3, sizeof(*array), 0) == 0);
+
+        // Enough to overflow m + length
+        TEST_ASSERT(set_length(fd, SIZE_MAX / sizeof(*array) - 1) == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_load(fd, &loaded, &m, sizeof(*loaded)) != 0);
+        TEST_ASSERT(m == 4);
+
+        // Longer than the file
+        TEST_ASSERT(set_length(fd, 4) == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_load(fd, &loaded, &m, sizeof(*loaded)) != 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_load_ptrvec(fd, &ptrvec, sizeof(*array)) != 0);
+        TEST_ASSERT(m == 4 && ptrvec.length == 0);
+
+        TEST_ASSERT(set_length(fd, 3) == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_load(fd, &loaded, &m, sizeof(*loaded)) == 0);
+        TEST_ASSERT(m == 7 && loaded[6] == 3);
+
+        jfree(loaded);
+        ptrvec_free(&ptrvec);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("serial_save_ptrvec() and serial_load_ptrvec()");
+    for (size_t size = 24; size <= BLOCK; size += BLOCK - 24) {
+        struct ptrvec ptrvec, loaded;
+
+        TEST_ASSERT(ptrvec_init(&ptrvec) == 0);
+        TEST_ASSERT(ptrvec_init(&loaded) == 0);
+        TEST_ASSERT(ptrvec_push_new(&ptrvec, 200, size) == 0);
+        for (size_t i = 0; i < ptrvec.length; ++i) {
+            memset(ptrvec.ptr[i], (int)i, size);
+        }
+
+        TEST_ASSERT(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_save_ptrvec(fd, &ptrvec, size,
+                                       SERIAL_CHECKSUM) == 0);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_load_ptrvec(fd, &loaded, size) == 0);
+
+        TEST_ASSERT(loaded.length == ptrvec.length);
+        for (size_t i = 0; i < loaded.length; ++i) {
+            TEST_ASSERT(memcmp(loaded.ptr[i], ptrvec.ptr[i], size) == 0);
+        }
+
+        // A failed load appends nothing
+        TEST_ASSERT(pwrite(fd, "\xff", 1, SERIAL_HEADER_SIZE + 100) == 1);
+        TEST_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+        TEST_ASSERT(serial_load_ptrvec(fd, &loaded, size) != 0);
+        TEST_ASSERT(loaded.length == ptrvec.length);
+
+        ptrvec_delete(&ptrvec);
+        ptrvec_delete(&loaded);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("serial over a pipe");
+    {
+        struct serial serial;
+        int fds[2];
+        int x = 42, y = 0;
+
+        TEST_ASSERT(pipe(fds) == 0);
+        TEST_ASSERT(serial_save(fds[1], &x, 1, sizeof(x), SERIAL_CHECKSUM)
+                    == 0);
+        TEST_ASSERT(serial_read_start(&serial, fds[0], sizeof(y)) == 0);
+        TEST_ASSERT(serial_read(&serial, &y, 1) == 0);
+        TEST_ASSERT(serial_read_end(&serial) == 0);
+        TEST_ASSERT(y == 42);
+
+        // A pipe's length can't be checked up front, so a huge one has to
+        // fail when the stream runs out rather than when reserving
+        TEST_ASSERT(serial_save(fds[1], &x, 1, sizeof(x), 0) == 0);
+        close(fds[1]);
+        {
+            int *loaded = NULL;
+            size_t m = 0;
+            unsigned char head[SERIAL_HEADER_SIZE];
+
+            TEST_ASSERT(read(fds[0], head, sizeof(head)) == sizeof(head));
+            close(fds[0]);
+            TEST_ASSERT(pipe(fds) == 0);
+            head[24 + 5] = 1;
+            TEST_ASSERT(write(fds[1], head, sizeof(head)) == sizeof(head));
+            TEST_ASSERT(write(fds[1], &x, sizeof(x)) == sizeof(x));
+            close(fds[1]);
+            TEST_ASSERT(serial_load(fds[0], &loaded, &m, sizeof(x)) != 0);
+            TEST_ASSERT(m == 0);
+            jfree(loaded);
+        }
+        close(fds[0]);
+    }
+    TEST_PASS();
+
+    close(fd);
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
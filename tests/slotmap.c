@@ -0,0 +1,77 @@
+#include "../src/main.h"
+#include "../src/slotmap.h"
+
+#include "../src/alloc.h"
+
+#include "test.h"
+
+#define N_ITEMS 100
+
+int
+main(void)
+{
+    struct slotmap slotmap;
+    struct slotmap_handle handles[N_ITEMS], handle;
+    int sum;
+
+    alloc_init();
+
+    TEST_CHECK("slotmap_insert() and slotmap_get()");
+
+    TEST_ASSERT(slotmap_init(&slotmap, sizeof(int)) == 0);
+
+    for (int i = 0; i < N_ITEMS; ++i) {
+        TEST_ASSERT(slotmap_insert(&slotmap, &i, &handles[i]) == 0);
+    }
+    for (int i = 0; i < N_ITEMS; ++i) {
+        int *value = slotmap_get(&slotmap, handles[i]);
+
+        TEST_ASSERT(value != NULL && *value == i);
+    }
+
+    TEST_PASS();
+
+    TEST_CHECK("slotmap_erase()");
+
+    for (int i = 0; i < N_ITEMS; i += 2) {
+        TEST_ASSERT(slotmap_erase(&slotmap, handles[i]) == 0);
+    }
+    TEST_ASSERT(slotmap.length == N_ITEMS / 2);
+    TEST_ASSERT(slotmap_erase(&slotmap, handles[0]) != 0);
+
+    for (int i = 0; i < N_ITEMS; ++i) {
+        int *value = slotmap_get(&slotmap, handles[i]);
+
+        TEST_ASSERT(i % 2 == 0 ? value == NULL : *value == i);
+    }
+
+    TEST_PASS();
+
+    TEST_CHECK("stale handles after slot reuse");
+
+    TEST_ASSERT(slotmap_insert(&slotmap, NULL, &handle) == 0);
+    TEST_ASSERT(handle.index == handles[N_ITEMS - 2].index);
+    TEST_ASSERT(slotmap_get(&slotmap, handles[N_ITEMS - 2]) == NULL);
+    TEST_ASSERT(slotmap_get(&slotmap, handle) != NULL);
+    TEST_ASSERT(slotmap_erase(&slotmap, handle) == 0);
+
+    TEST_PASS();
+
+    TEST_CHECK("dense iteration");
+
+    sum = 0;
+    for (size_t i = 0; i < slotmap.length; ++i) {
+        slotmap_handle_at(&slotmap, i, &handle);
+        TEST_ASSERT(slotmap_get(&slotmap, handle) == slotmap_at(&slotmap, i));
+        sum += *(int *)slotmap_at(&slotmap, i);
+    }
+    TEST_ASSERT(sum == (N_ITEMS / 2) * (N_ITEMS / 2));
+
+    slotmap_free(&slotmap);
+
+    TEST_PASS();
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/snapvec.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#define N_VERSIONS 2000
+#define N_READERS 3
+
+static char items[N_VERSIONS + 1];
+
+// Every version published by the concurrent test holds length copies of
+// items + length, so a reader can tell if its version changed under it
+static int
+check_snap(const struct snapvec_snap *snap)
+{
+    for (size_t i = 0; i < snap->length; ++i) {
+        if (snap->ptr[i] != items + snap->length) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Appends one more pointer, and points them all at the next item
+static int
+grow(struct ptrvec *ptrvec, void *ctx)
+{
+    UNUSED(ctx);
+
+    if (ptrvec_push(ptrvec, NULL) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < ptrvec->length; ++i) {
+        ptrvec->ptr[i] = items + ptrvec->length;
+    }
+
+    return 0;
+}
+
+static int
+fail(struct ptrvec *ptrvec, void *ctx)
+{
+    UNUSED(ctx);
+
+    ptrvec->length = 0;
+
+    return -1;
+}
+
+struct reader_ctx {
+    struct snapvec *snapvec;
+    int done;
+    int err;
+};
+
+static void *
+read_versions(void *arg)
+{
+    struct reader_ctx *ctx = arg;
+    struct snapvec_reader reader;
+    const struct snapvec_snap *snap;
+    size_t last = 0;
+
+    snapvec_reader_add(ctx->snapvec, &reader);
+
+    while (!__atomic_load_n(&ctx->done, __ATOMIC_ACQUIRE)) {
+        snap = snapvec_read_begin(&reader);
+
+        // Versions only ever grow
+        if (snap->length < last || check_snap(snap) != 0) {
+            __atomic_store_n(&ctx->err, 1, __ATOMIC_RELAXED);
+        }
+        last = snap->length;
+
+        sched_yield();
+
+        if (check_snap(snap) != 0) {
+            __atomic_store_n(&ctx->err, 1, __ATOMIC_RELAXED);
+        }
+
+        snapvec_read_end(&reader);
+    }
+
+    snapvec_reader_remove(&reader);
+
+    return NULL;
+}
+
+int
+main(void)
+{
+    struct snapvec snapvec;
+    struct snapvec_reader reader;
+    const struct snapvec_snap *snap, *old;
+    struct ptrvec ptrvec;
+    struct reader_ctx ctx;
+    pthread_t threads[N_READERS];
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    TEST_CHECK("snapvec_publish() and snapvec_read_begin()");
+    TEST_ASSERT(snapvec_init(&snapvec) == 0);
+    TEST_ASSERT(snapvec_reader_add(&snapvec, &reader) == 0);
+    snap = snapvec_read_begin(&reader);
+    TEST_ASSERT(snap->length == 0);
+    snapvec_read_end(&reader);
+
+    TEST_ASSERT(ptrvec_init(&ptrvec) == 0);
+    TEST_ASSERT(ptrvec_push(&ptrvec, items) == 0);
+    TEST_ASSERT(ptrvec_push(&ptrvec, items + 1) == 0);
+    TEST_ASSERT(snapvec_publish(&snapvec, &ptrvec) == 0);
+
+    old = snapvec_read_begin(&reader);
+    TEST_ASSERT(old->length == 2);
+    TEST_ASSERT(old->ptr[0] == items && old->ptr[1] == items + 1);
+
+    // The pinned version stays as it was, and isn't freed
+    ptrvec.length = 0;
+    TEST_ASSERT(snapvec_publish(&snapvec, &ptrvec) == 0);
+    TEST_ASSERT(snapvec_update(&snapvec, &grow, NULL) == 0);
+    TEST_ASSERT(old->length == 2 && old->ptr[1] == items + 1);
+    TEST_ASSERT(snapvec.retired != NULL);
+    snapvec_read_end(&reader);
+
+    snap = snapvec_read_begin(&reader);
+    TEST_ASSERT(snap->length == 1 && snap->ptr[0] == items + 1);
+    snapvec_read_end(&reader);
+
+    snapvec_reclaim(&snapvec);
+    TEST_ASSERT(snapvec.retired == NULL);
+    TEST_PASS();
+
+    TEST_CHECK("snapvec_update() and snapvec_copy()");
+    TEST_ASSERT(snapvec_update(&snapvec, &fail, NULL) != 0);
+    TEST_ASSERT(snapvec_copy(&snapvec, &ptrvec) == 0);
+    TEST_ASSERT(ptrvec.length == 1 && ptrvec.ptr[0] == items + 1);
+    TEST_ASSERT(snapvec_update(&snapvec, &grow, NULL) == 0);
+    TEST_ASSERT(snapvec_copy(&snapvec, &ptrvec) == 0);
+    TEST_ASSERT(ptrvec.length == 2 && ptrvec.ptr[1] == items + 2);
+    snapvec_reader_remove(&reader);
+    snapvec_free(&snapvec);
+    TEST_PASS();
+
+    TEST_CHECK("snapvec with concurrent readers");
+    TEST_ASSERT(snapvec_init(&snapvec) == 0);
+    ctx.snapvec = &snapvec;
+    ctx.done = 0;
+    ctx.err = 0;
+    for (size_t i = 0; i < N_READERS; ++i) {
+        TEST_ASSERT(pthread_create(&threads[i], NULL, &read_versions, &ctx)
+                    == 0);
+    }
+
+    for (size_t i = 0; i < N_VERSIONS; ++i) {
+        TEST_ASSERT(snapvec_update(&snapvec, &grow, NULL) == 0);
+    }
+
+    __atomic_store_n(&ctx.done, 1, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < N_READERS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    TEST_ASSERT(ctx.err == 0);
+
+    snapvec_reclaim(&snapvec);
+    TEST_ASSERT(snapvec.retired == NULL);
+    TEST_ASSERT(snapvec_copy(&snapvec, &ptrvec) == 0);
+    TEST_ASSERT(ptrvec.length == N_VERSIONS);
+    snapvec_free(&snapvec);
+    ptrvec_free(&ptrvec);
+    TEST_PASS();
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include "../src/main.h"
+#include "../src/trace.h"
+
+#include "../src/alloc.h"
+#include "../src/ptrvec.h"
+
+#include "test.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static int
+traced(int depth)
+{
+    TRACE_SCOPE("traced \"scope\"");
+
+    TRACE_COUNTER("depth", depth);
+
+    return depth > 0 ? traced(depth - 1) + 1 : 0;
+}
+
+static void *
+traced_thread(void *arg)
+{
+    UNUSED(arg);
+
+    traced(2);
+
+    return NULL;
+}
+
+// Flushes the trace to a temporary file, and reads it back into buf
+static int
+flush(char *buf, size_t size)
+{
+    FILE *file;
+    size_t n;
+
+    file = tmpfile();
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (trace_flush(file) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    rewind(file);
+    n = fread(buf, 1, size - 1, file);
+    buf[n] = '\0';
+
+    return fclose(file) != 0 || n == size - 1 ? -1 : 0;
+}
+
+// Returns the number of times str appears in buf
+static size_t
+count(const char *buf, const char *str)
+{
+    size_t n = 0;
+
+    for (buf = strstr(buf, str); buf != NULL; buf = strstr(buf + 1, str)) {
+        ++n;
+    }
+
+    return n;
+}
+
+#ifdef TRACE
+
+// Returns whether each of the n strings in strs appears in buf after the one
+// before it
+static int
+in_order(const char *buf, const char *const *strs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        buf = strstr(buf, strs[i]);
+        if (buf == NULL) {
+            return 0;
+        }
+        ++buf;
+    }
+
+    return 1;
+}
+
+// Returns whether buf is a Chrome trace of n events, each with every field
+// trace_flush writes
+static int
+well_formed(const char *buf, size_t n)
+{
+    static const char end[] = "\n],\"displayTimeUnit\":\"ns\"}\n";
+    size_t length = strlen(buf);
+
+    return strncmp(buf, "{\"traceEvents\":[", 16) == 0
+        && length >= sizeof(end) - 1
+        && strcmp(buf + length - (sizeof(end) - 1), end) == 0
+        && count(buf, "\n{\"name\":") == n
+        && count(buf, ",\"pid\":") == n
+        && count(buf, ",\"tid\":") == n
+        && count(buf, ",\"ts\":") == n
+        && count(buf, ",\"ph\":") == n
+        && count(buf, "},\n{") == (n > 0 ? n - 1 : 0);
+}
+
+#endif
+
+int
+main(void)
+{
+    static char buf[1 << 23];
+    pthread_t thread;
+    struct ptrvec ptrvec;
+
+    (void)TEST_FAIL;
+
+    alloc_init();
+
+    TEST_CHECK("TRACE_SCOPE() and TRACE_COUNTER()");
+    // Drop anything traced while setting up
+    TEST_ASSERT(flush(buf, sizeof(buf)) == 0);
+    TEST_ASSERT(traced(3) == 3);
+    TEST_ASSERT(pthread_create(&thread, NULL, &traced_thread, NULL) == 0);
+    TEST_ASSERT(pthread_join(thread, NULL) == 0);
+    TEST_ASSERT(flush(buf, sizeof(buf)) == 0);
+#ifdef TRACE
+    TEST_ASSERT(well_formed(buf, 14));
+    TEST_ASSERT(count(buf, "\"name\":\"traced \\\"scope\\\"\"") == 7);
+    TEST_ASSERT(count(buf, "\"ph\":\"X\"") == 7);
+    TEST_ASSERT(count(buf, "\"name\":\"depth\"") == 7);
+    TEST_ASSERT(count(buf, "\"args\":{\"value\":0}") == 2);
+    TEST_ASSERT(count(buf, "\"tid\":1,") == 8);
+    TEST_ASSERT(count(buf, "\"tid\":2,") == 6);
+    TEST_ASSERT(count(buf, ",\"dur\":") == 7);
+    // Each thread's events are in the order they were recorded: the counters
+    // on the way down, then the scopes, innermost first, on the way back up
+    {
+        static const char *const order[] = {
+            "\"depth\",\"pid\"", "\"value\":3}", "\"value\":2}",
+            "\"value\":1}", "\"value\":0}", "\"ph\":\"X\"", "\"ph\":\"X\"",
+            "\"ph\":\"X\"", "\"ph\":\"X\""
+        };
+
+        TEST_ASSERT(in_order(buf, order, sizeof(order) / sizeof(*order)));
+    }
+#else
+    TEST_ASSERT(buf[0] == '\0');
+#endif
+
+    // Everything was flushed
+    TEST_ASSERT(flush(buf, sizeof(buf)) == 0);
+    TEST_ASSERT(count(buf, "\"ph\"") == 0);
+    TEST_PASS();
+
+    TEST_CHECK("trace of vec growth");
+    TEST_ASSERT(ptrvec_init(&ptrvec) == 0);
+    for (size_t i = 0; i < 1000; ++i) {
+        TEST_ASSERT(ptrvec_push(&ptrvec, buf) == 0);
+    }
+    ptrvec_free(&ptrvec);
+    TEST_ASSERT(flush(buf, sizeof(buf)) == 0);
+#ifdef TRACE
+    TEST_ASSERT(count(buf, "\"name\":\"vec grow\"") > 0);
+    TEST_ASSERT(count(buf, "\"name\":\"vec grow bytes\"")
+                == count(buf, "\"name\":\"vec grow\""));
+#endif
+    TEST_PASS();
+
+    TEST_CHECK("trace ring buffer overwriting");
+    for (size_t i = 0; i < TRACE_EVENTS + 100; ++i) {
+        TRACE_COUNTER("i", i);
+    }
+    TEST_ASSERT(flush(buf, sizeof(buf)) == 0);
+#ifdef TRACE
+    TEST_ASSERT(well_formed(buf, TRACE_EVENTS));
+    TEST_ASSERT(count(buf, "\"ph\":\"C\"") == TRACE_EVENTS);
+    TEST_ASSERT(count(buf, "\"args\":{\"value\":99}") == 0);
+    TEST_ASSERT(count(buf, "\"args\":{\"value\":100}") == 1);
+    // The oldest events left are flushed first
+    {
+        char first[32], last[32];
+        const char *const order[2] = {first, last};
+
+        snprintf(first, sizeof(first), "\"value\":%d}", 100);
+        snprintf(last, sizeof(last), "\"value\":%zu}", TRACE_EVENTS + 99);
+        TEST_ASSERT(in_order(buf, order, 2));
+    }
+#endif
+    TEST_PASS();
+
+    trace_free();
+
+    TEST_ASSERT(alloc_free() == 0);
+
+    return 0;
+}
@@ -1,3 +1,7 @@
+#define _POSIX_C_SOURCE 200809L
+// For mincore
+#define _DEFAULT_SOURCE
+
 #include "../src/main.h"
 #include "../src/vec.h"
 
@@ -5,14 +9,106 @@
 
 #include "test.h"
 
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Returns the number of whole pages in [ptr, ptr + bytes) that are resident,
+// or SIZE_MAX on failure
+static size_t
+resident_pages(void *ptr, size_t bytes)
+{
+    static unsigned char vec[2 * VEC_HUGE_THRESHOLD / 4096];
+    uintptr_t page, begin, end;
+    size_t n = 0;
+
+    page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    begin = ((uintptr_t)ptr + page - 1) & ~(page - 1);
+    end = ((uintptr_t)ptr + bytes) & ~(page - 1);
+    if (begin >= end) {
+        return 0;
+    }
+    if ((end - begin) / page > sizeof(vec)) {
+        return SIZE_MAX;
+    }
+
+    if (mincore((void *)begin, end - begin, vec) != 0) {
+        return SIZE_MAX;
+    }
+
+    for (size_t i = 0; i < (end - begin) / page; ++i) {
+        n += vec[i] & 1;
+    }
+
+    return n;
+}
+
 int
 main(void)
 {
-    (void)TEST_CHECK;
-    (void)TEST_PASS;
     (void)TEST_FAIL;
 
+    alloc_init();
+
+    TEST_CHECK("vec_reserve_min() with huge pages");
+    {
+        char *array = NULL, *old;
+        size_t cap = VEC_HUGE_THRESHOLD + 1;
+        int aligned;
+
+        TEST_ASSERT(vec_reserve(&array, 0, 1, cap) == 0);
+        aligned = (uintptr_t)array % ALLOC_HUGE_PAGE == 0;
+        TEST_ASSERT(vec_reserve_min(&array, &cap, 1, 1) == 0);
+
+        // Large buffers are only padded to a whole number of huge pages if
+        // they start on one
+        if (aligned) {
+            TEST_ASSERT(cap % ALLOC_HUGE_PAGE == 0);
+            TEST_ASSERT(cap >= 2 * VEC_HUGE_THRESHOLD + 2);
+        } else {
+            TEST_ASSERT(cap == 2 * VEC_HUGE_THRESHOLD + 2);
+        }
+
+        memset(array, 'x', cap);
+        TEST_PASS();
+
+        TEST_CHECK("vec_shrink() releasing pages in place");
+        old = array;
+        TEST_ASSERT(vec_shrink(&array, &cap, 1, 4096) == 0);
+        TEST_ASSERT(cap == 4096);
+        TEST_ASSERT(array == old);
+        for (size_t i = 0; i < cap; ++i) {
+            TEST_ASSERT(array[i] == 'x');
+        }
+        TEST_ASSERT(resident_pages(array + cap, 2 * VEC_HUGE_THRESHOLD - cap)
+                    == 0);
+
+        // Small shrinks still reallocate
+        TEST_ASSERT(vec_shrink(&array, &cap, 1, 16) == 0);
+        TEST_ASSERT(cap == 16 && array[15] == 'x');
+
+        jfree(array);
+    }
+    TEST_PASS();
+
+    TEST_CHECK("alloc_advise()");
+    {
+        char *buf = jmalloc(3 * ALLOC_HUGE_PAGE);
+
+        TEST_ASSERT(buf != NULL);
+        TEST_ASSERT(alloc_advise(buf, 3 * ALLOC_HUGE_PAGE,
+                                 ALLOC_ADVICE_HUGE) == 0);
+        TEST_ASSERT(alloc_advise(buf, 16, ALLOC_ADVICE_RELEASE) == 0);
+        TEST_ASSERT(alloc_advise(buf, 3 * ALLOC_HUGE_PAGE,
+                                 ALLOC_ADVICE_RELEASE) == 0);
+        jfree(buf);
+    }
+    TEST_PASS();
+
     TEST_TODO(Implement vec tests);
 
+    TEST_ASSERT(alloc_free() == 0);
+
     return 0;
 }
@@ -0,0 +1,342 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/main.h"
+#include "../src/alloc.h"
+
+#include "../src/alloc_trace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Replays an allocation trace written by an ALLOC_TRACE build against the
+ * allocator this tool was built with, and reports the time taken, the peak
+ * RSS, and the fragmentation. The allocator is chosen with -a NAME from the
+ * ones alloc_find_allocator knows; build with make tools BENCHFLAGS=-DJEMALLOC
+ * BENCHLIBS=-ljemalloc to be able to choose jemalloc. A custom allocator can be
+ * compared by setting it with alloc_set_allocator below instead.
+ *
+ * All of the bookkeeping is allocated and its pages touched before the replay
+ * starts, so that the only allocations made during the replay, and the only
+ * growth in RSS, are the traced ones. */
+
+// How often to sample the RSS, in events
+#define RSS_INTERVAL 1024
+
+// Bytes between the writes made to each newly allocated block, so that its
+// pages count towards the RSS like they would in the traced program
+#define TOUCH_STRIDE 4096
+
+struct block {
+    uint64_t traced;
+    void *ptr;
+    size_t size;
+};
+
+struct blocks {
+    struct block *slots;
+    size_t mask;
+};
+
+static int
+event_cmp(const void *a, const void *b)
+{
+    uint64_t x = ALLOC_TRACE_SEQ((const struct alloc_trace_event *)a);
+    uint64_t y = ALLOC_TRACE_SEQ((const struct alloc_trace_event *)b);
+
+    return (x > y) - (x < y);
+}
+
+static inline size_t
+block_hash(const struct blocks *blocks, uint64_t traced)
+{
+    // Fibonacci hashing; the low bits of pointers are mostly zero
+    return (size_t)((traced * UINT64_C(0x9E3779B97F4A7C15)) >> 32)
+        & blocks->mask;
+}
+
+static void
+block_put(struct blocks *blocks, uint64_t traced, void *ptr, size_t size)
+{
+    size_t i = block_hash(blocks, traced);
+
+    while (blocks->slots[i].traced != 0 && blocks->slots[i].traced != traced) {
+        i = (i + 1) & blocks->mask;
+    }
+
+    blocks->slots[i].traced = traced;
+    blocks->slots[i].ptr = ptr;
+    blocks->slots[i].size = size;
+}
+
+// Removes the block for traced and stores it in *block. Returns 0 if the block
+// was found, nonzero otherwise.
+static int
+block_take(struct blocks *blocks, uint64_t traced, struct block *block)
+{
+    size_t i = block_hash(blocks, traced);
+
+    while (blocks->slots[i].traced != traced) {
+        if (blocks->slots[i].traced == 0) {
+            return -1;
+        }
+        i = (i + 1) & blocks->mask;
+    }
+
+    *block = blocks->slots[i];
+
+    // Backward shift deletion, so that lookups never need tombstones
+    for (size_t j = (i + 1) & blocks->mask; blocks->slots[j].traced != 0;
+         j = (j + 1) & blocks->mask) {
+
+        size_t home = block_hash(blocks, blocks->slots[j].traced);
+
+        if (((j - home) & blocks->mask) >= ((j - i) & blocks->mask)) {
+            blocks->slots[i] = blocks->slots[j];
+            i = j;
+        }
+    }
+
+    blocks->slots[i].traced = 0;
+
+    return 0;
+}
+
+static size_t
+current_rss(void)
+{
+    FILE *statm;
+    unsigned long size, resident;
+    long page;
+
+    statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) {
+        return 0;
+    }
+
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(statm);
+
+    page = sysconf(_SC_PAGESIZE);
+
+    return (size_t)resident * (page > 0 ? (size_t)page : 4096);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+touch(void *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i += TOUCH_STRIDE) {
+        ((volatile char *)ptr)[i] = 0;
+    }
+}
+
+static int
+read_trace(const char *path, struct alloc_trace_event **events, size_t *n)
+{
+    FILE *file;
+    struct alloc_trace_header header;
+    long end;
+    size_t count;
+
+    file = fopen(path, "rb");
+    if (ERR(file == NULL)) {
+        perror(path);
+        return -1;
+    }
+
+    if (ERR(fread(&header, sizeof(header), 1, file) != 1)
+        || ERR(memcmp(header.magic, ALLOC_TRACE_MAGIC, sizeof(header.magic))
+               != 0)
+        || ERR(header.version != ALLOC_TRACE_VERSION)
+        || ERR(header.event_size != sizeof(**events))) {
+
+        fprintf(stderr, "%s: not a version %d allocation trace\n", path,
+                ALLOC_TRACE_VERSION);
+        fclose(file);
+        return -1;
+    }
+
+    if (ERR(fseek(file, 0, SEEK_END) != 0) || ERR((end = ftell(file)) < 0)
+        || ERR(fseek(file, (long)sizeof(header), SEEK_SET) != 0)) {
+
+        perror(path);
+        fclose(file);
+        return -1;
+    }
+
+    count = ((size_t)end - sizeof(header)) / sizeof(**events);
+
+    *events = malloc((count > 0 ? count : 1) * sizeof(**events));
+    if (ERR(*events == NULL)) {
+        fclose(file);
+        return -1;
+    }
+
+    *n = fread(*events, sizeof(**events), count, file);
+    fclose(file);
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct alloc_trace_event *events;
+    struct blocks blocks;
+    struct block block;
+    size_t n, cap, live, peak_live, base_rss, peak_rss, unmatched;
+    uint64_t start, elapsed;
+    double frag;
+    const char *name = "system", *path;
+
+    if (argc == 4 && strcmp(argv[1], "-a") == 0) {
+        name = argv[2];
+        path = argv[3];
+    } else if (argc == 2) {
+        path = argv[1];
+    } else {
+        fprintf(stderr, "Usage: %s [-a ALLOCATOR] TRACE\n", argv[0]);
+        return 2;
+    }
+
+    if (alloc_find_allocator(name) == NULL) {
+        fprintf(stderr, "%s: unknown allocator %s\n", argv[0], name);
+        return 2;
+    }
+
+    if (read_trace(path, &events, &n) != 0) {
+        return 1;
+    }
+
+    qsort(events, n, sizeof(*events), &event_cmp);
+
+    // At most n blocks are ever live, so the table never needs to grow
+    cap = 16;
+    while (cap < 2 * n) {
+        cap *= 2;
+    }
+    blocks.slots = calloc(cap, sizeof(*blocks.slots));
+    blocks.mask = cap - 1;
+    if (ERR(blocks.slots == NULL)) {
+        free(events);
+        return 1;
+    }
+
+    // Fault the whole table in now, rather than letting calloc's lazily
+    // zeroed pages show up in the replay's RSS and timings
+    touch(blocks.slots, cap * sizeof(*blocks.slots));
+
+    alloc_set_allocator(alloc_find_allocator(name));
+
+    live = peak_live = unmatched = 0;
+    base_rss = peak_rss = current_rss();
+
+    start = now_ns();
+
+    for (size_t i = 0; i < n; ++i) {
+        const struct alloc_trace_event *e = &events[i];
+        void *ptr;
+        size_t size = (size_t)e->size;
+
+        switch (ALLOC_TRACE_OP(e)) {
+        case ALLOC_TRACE_MALLOC:
+        case ALLOC_TRACE_CALLOC:
+            ptr = ALLOC_TRACE_OP(e) == ALLOC_TRACE_MALLOC ? jmalloc(size)
+                : jcalloc(size, 1);
+            if (ptr != NULL) {
+                touch(ptr, size);
+                block_put(&blocks, e->ptr, ptr, size);
+                live += size;
+            }
+            break;
+        case ALLOC_TRACE_REALLOC:
+            block.ptr = NULL;
+            block.size = 0;
+            if (e->old_ptr != 0
+                && block_take(&blocks, e->old_ptr, &block) != 0) {
+
+                ++unmatched;
+            }
+            ptr = jrealloc(block.ptr, size);
+            if (ptr != NULL) {
+                live -= block.size;
+                if (size > block.size) {
+                    touch((char *)ptr + block.size, size - block.size);
+                }
+                block_put(&blocks, e->ptr, ptr, size);
+                live += size;
+            }
+            break;
+        case ALLOC_TRACE_FREE:
+            if (block_take(&blocks, e->ptr, &block) != 0) {
+                ++unmatched;
+                break;
+            }
+            jfree(block.ptr);
+            live -= block.size;
+            break;
+        default:
+            ++unmatched;
+            break;
+        }
+
+        if (live > peak_live) {
+            peak_live = live;
+        }
+
+        if (i % RSS_INTERVAL == 0) {
+            size_t rss = current_rss();
+
+            if (rss > peak_rss) {
+                peak_rss = rss;
+            }
+        }
+    }
+
+    elapsed = now_ns() - start;
+
+    {
+        size_t rss = current_rss();
+
+        if (rss > peak_rss) {
+            peak_rss = rss;
+        }
+    }
+
+    peak_rss -= base_rss;
+    frag = peak_rss > peak_live ? 1 - (double)peak_live / (double)peak_rss : 0;
+
+    printf("Allocator:        %s\n", name);
+    printf("Events:           %zu (%zu unmatched)\n", n, unmatched);
+    printf("Time:             %.3f ms (%.1f ns/event)\n",
+           (double)elapsed / 1e6, n > 0 ? (double)elapsed / (double)n : 0.0);
+    printf("Peak live bytes:  %zu\n", peak_live);
+    printf("Peak RSS growth:  %zu\n", peak_rss);
+    printf("Fragmentation:    %.1f%%\n", frag * 100);
+
+    for (size_t i = 0; i <= blocks.mask; ++i) {
+        if (blocks.slots[i].traced != 0) {
+            jfree(blocks.slots[i].ptr);
+        }
+    }
+
+    free(blocks.slots);
+    free(events);
+
+    return 0;
+}